@@ -0,0 +1,83 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "common.h"
+
+
+size_t common_raise_files_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return 1024;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur;
+}
+
+
+uint64_t common_cpu_us(pid_t pid) {
+    char path[64];
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    // Skip the command, which may hold spaces, up to its closing paren.
+    int c;
+    while ((c = fgetc(file)) != EOF && c != ')') {
+    }
+    if (fscanf(file, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2)
+    {
+        utime = stime = 0;
+    }
+    fclose(file);
+    return (utime + stime) * UINT64_C(1000000) / sysconf(_SC_CLK_TCK);
+}
+
+
+void common_response_init(common_response_t* response) {
+    response->read = 0;
+    response->matched = 0;
+    response->switching = true;
+}
+
+
+common_status_t common_read_response(int fd, common_response_t* response) {
+    static const char END[] = "\r\n\r\n";
+    static const char STATUS[] = "HTTP/1.1 101";
+    char buf[512];
+
+    ssize_t len = recv(fd, buf, sizeof(buf), MSG_PEEK);
+    if (len <= 0) {
+        return len < 0 && errno == EAGAIN ? COMMON_AGAIN : COMMON_ERROR;
+    }
+
+    // Consume the response only, frames may follow it.
+    ssize_t take = 0;
+    while (take < len && response->matched < strlen(END)) {
+        char c = buf[take++];
+        if (response->read < strlen(STATUS)
+            && c != STATUS[response->read])
+        {
+            response->switching = false;
+        }
+        response->read++;
+        response->matched = c == END[response->matched]
+                          ? response->matched + 1
+                          : c == END[0] ? 1 : 0;
+    }
+    recv(fd, buf, take, 0);
+    if (response->matched < strlen(END)) {
+        return COMMON_AGAIN;
+    }
+    return response->switching ? COMMON_SUCCESS : COMMON_ERROR;
+}
@@ -0,0 +1,55 @@
+/*
+ * Helpers shared by the bench programs.
+ */
+#ifndef _common_h_
+#define _common_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+typedef enum common_status {
+    COMMON_ERROR = -1,
+    COMMON_SUCCESS = 0,
+    COMMON_AGAIN = 1,
+} common_status_t;
+
+
+/*
+ * Progress of the read of a handshake response.
+ */
+typedef struct common_response {
+    // Bytes of the response read, and of its end matched so far.
+    unsigned read;
+    unsigned matched;
+    // Whether the status read so far is the one of a successful upgrade.
+    bool switching;
+} common_response_t;
+
+
+/*
+ * Raise the open files limit to its maximum.
+ * Returns the new limit.
+ */
+size_t common_raise_files_limit(void);
+
+/*
+ * Returns the CPU time used by `pid` in microseconds, or 0 if unknown.
+ */
+uint64_t common_cpu_us(pid_t pid);
+
+void common_response_init(common_response_t* response);
+
+/*
+ * Read the handshake response available on `fd`, leaving the frames which
+ * may follow it in the socket.
+ * Returns COMMON_SUCCESS once the whole response is read and accepts the
+ * upgrade, COMMON_AGAIN if more of it is to come, and COMMON_ERROR if the
+ * connection failed or the upgrade is refused.
+ */
+common_status_t common_read_response(int fd, common_response_t* response);
+
+
+#endif
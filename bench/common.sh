@@ -0,0 +1,46 @@
+#
+# Harness sourced by the bench scripts: starts the bridged server and the
+# bridge in the background, stops them between runs and on exit, and runs
+# bench-load against the bridge.
+#
+# The sourcing script sets DURATION and BRIDGE_PORT. It adds the pids of
+# its other background processes to helper_pids, which stop kills first.
+
+BUILD=${BUILD:-build}
+
+server_pid=
+bridge_pid=
+helper_pids=
+
+stop() {
+    for pid in $helper_pids $bridge_pid $server_pid; do
+        kill $pid 2>/dev/null
+        wait $pid 2>/dev/null
+    done
+    helper_pids=
+    bridge_pid=
+    server_pid=
+}
+trap stop EXIT INT TERM
+
+# start_server <command...>
+start_server() {
+    "$@" &
+    server_pid=$!
+    sleep 0.2
+}
+
+# start_bridge <command...>: the bridge, or a program embedding it
+start_bridge() {
+    "$@" >/dev/null 2>&1 &
+    bridge_pid=$!
+    sleep 0.5
+}
+
+# load <label> <bench-load options...>
+load() {
+    label=$1
+    shift
+    $BUILD/bench-load -d $DURATION -p $bridge_pid -l "$label" "$@" \
+        127.0.0.1 $BRIDGE_PORT
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Run the echo scenarios against the bridge relaying to an echo server on a
+# Unix sequenced packet socket, then against example-echo, which answers in
+# process, then against example-rpc, which asks a TCP echo server from the
+# coroutines of its clients, and write one JSON line of results per run.
+#
+# Usage: bench/embed.sh [duration in seconds]
+#
+# Ports 9340 (bridge) and 9341 (TCP echo server) must be free.
+
+DURATION=${1:-5}
+BRIDGE_PORT=9340
+BACKEND_PORT=9341
+SOCKET=@wsbridge-bench-$$
+
+. "$(dirname "$0")/common.sh"
+
+# start <relay|embedded|coroutine>
+start() {
+    stop
+    case $1 in
+      relay)
+        start_server $BUILD/bench-load -u unixpacket:$SOCKET
+        start_bridge $BUILD/wsbridge --log-level=warning --workers=1 \
+            $BRIDGE_PORT unixpacket:$SOCKET
+        ;;
+      embedded)
+        start_bridge $BUILD/example-echo --log-level=warning --workers=1 \
+            $BRIDGE_PORT
+        ;;
+      coroutine)
+        start_server $BUILD/bench-load -b $BACKEND_PORT
+        start_bridge $BUILD/example-rpc --log-level=warning --workers=1 \
+            $BRIDGE_PORT 127.0.0.1 $BACKEND_PORT
+        ;;
+    esac
+}
+
+for mode in relay embedded coroutine; do
+    start $mode
+    load "$mode/pingpong/64" -c 1 -w 1 -s 64
+    load "$mode/echo/64" -c 32 -w 8 -s 64
+    load "$mode/echo/16384" -c 4 -w 4 -s 16384
+done
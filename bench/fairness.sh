@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Measure the latency of a ping-pong client sharing a worker with bulk
+# clients, alone, then with the bulk clients in the same class, then with
+# the ping-pong client in a weighted class, and write one JSON line of
+# results per run.
+#
+# Usage: bench/fairness.sh [duration in seconds]
+#
+# Ports 9350 (bridge) and 9351 (bridged server) must be free.
+
+DURATION=${1:-5}
+BRIDGE_PORT=9350
+SERVER_PORT=9351
+
+. "$(dirname "$0")/common.sh"
+
+# start <bridge options...>
+start() {
+    stop
+    start_server $BUILD/bench-load -b $SERVER_PORT
+    start_bridge $BUILD/wsbridge --log-level=warning --workers=1 "$@" \
+        $BRIDGE_PORT 127.0.0.1 $SERVER_PORT
+}
+
+# bulk: keep large echoes in flight on the bridge, unreported
+bulk() {
+    $BUILD/bench-load -d $((DURATION + 2)) -W 0 -P /bulk -c 8 -w 16 \
+        -s 65536 127.0.0.1 $BRIDGE_PORT >/dev/null &
+    helper_pids=$!
+    sleep 1
+}
+
+# pingpong <label>
+pingpong() {
+    load "$1" -P /live -c 1 -w 1 -s 64
+}
+
+start
+pingpong "alone"
+
+start
+bulk
+pingpong "shared"
+
+start --class=/live:16
+bulk
+pingpong "weighted"
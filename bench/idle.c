@@ -0,0 +1,404 @@
+/*
+ * Idle connections benchmark.
+ *
+ * Opens many WebSocket connections to a wsbridge instance, completes their
+ * handshake, and leaves them idle. The memory used per connection is then
+ * computed from the growth of the bridge resident set size, and from the
+ * growth of the TCP memory of the kernel.
+ *
+ * Connections to a loopback address are spread over several source
+ * addresses, so that their number is not limited by the ephemeral ports.
+ * The bench can also run the bridged server, which accepts connections and
+ * holds them without reading.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "common.h"
+
+
+// Connections opened to a single source address.
+#define BENCH_PER_SOURCE    20000
+
+// Events handled by a single wait.
+#define BENCH_EVENTS        256
+
+
+static const char REQUEST[] = "GET / HTTP/1.1\r\n"
+                              "Host: bench\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n"
+                              "\r\n";
+
+
+typedef enum conn_state {
+    CONN_FREE,
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+} conn_state_t;
+
+
+/*
+ * Connection being opened, indexed by its descriptor.
+ */
+typedef struct conn {
+    conn_state_t state;
+    common_response_t response;
+} conn_t;
+
+
+typedef struct bench {
+    struct sockaddr_in target;
+    bool loopback;
+    size_t count;
+    size_t window;
+    int epoll_fd;
+    conn_t* conns;
+    size_t conns_size;
+
+    size_t opened;
+    size_t in_flight;
+    size_t established;
+    size_t failed;
+} bench_t;
+
+
+static size_t backend_count_g = 0;
+
+
+static uint64_t _bench_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000) + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * Returns the resident set size of `pid` in KiB, or 0 if unknown.
+ */
+static size_t _bench_rss_kib(pid_t pid) {
+    char path[64];
+    char line[256];
+    size_t rss = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmRSS: %zu kB", &rss) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return rss;
+}
+
+
+/*
+ * Returns the pages of memory used by the TCP sockets of the host.
+ */
+static size_t _bench_tcp_pages(void) {
+    char line[256];
+    size_t pages = 0;
+
+    FILE* file = fopen("/proc/net/sockstat", "r");
+    if (!file) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char* mem = strstr(line, " mem ");
+        if (strncmp(line, "TCP:", 4) == 0 && mem) {
+            sscanf(mem, " mem %zu", &pages);
+            break;
+        }
+    }
+    fclose(file);
+    return pages;
+}
+
+
+static void* _bench_backend_thread(void* data) {
+    int sock = (int)(intptr_t)data;
+    for (;;) {
+        if (accept4(sock, NULL, NULL, SOCK_CLOEXEC) < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                fprintf(stderr, "backend: out of descriptors\n");
+                sleep(1);
+            }
+            continue;
+        }
+        __atomic_add_fetch(&backend_count_g, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+
+/*
+ * Listen on `port` and hold the connections accepted there.
+ */
+static bool _bench_start_backend(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    pthread_t thread;
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(sock, SOMAXCONN) < 0)
+    {
+        fprintf(stderr, "backend: unable to listen on %d\n", port);
+        return false;
+    }
+    if (pthread_create(&thread, NULL, &_bench_backend_thread,
+                       (void*)(intptr_t)sock) != 0)
+    {
+        fprintf(stderr, "backend: unable to start thread\n");
+        return false;
+    }
+    return true;
+}
+
+
+static void _bench_fail(bench_t* bench, int fd) {
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    bench->conns[fd].state = CONN_FREE;
+    bench->in_flight--;
+    bench->failed++;
+}
+
+
+/*
+ * Start opening the next connection.
+ */
+static void _bench_open(bench_t* bench) {
+    size_t index = bench->opened++;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || (size_t)fd >= bench->conns_size) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        bench->failed++;
+        return;
+    }
+
+    if (bench->loopback) {
+        // Let connect pick the port, unique for the destination only.
+        struct sockaddr_in source = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK
+                                     + 1 + index / BENCH_PER_SOURCE % 250),
+        };
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &(int){ 1 },
+                   sizeof(int));
+        bind(fd, (struct sockaddr*)&source, sizeof(source));
+    }
+
+    if (connect(fd, (struct sockaddr*)&bench->target, sizeof(bench->target))
+        < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        bench->failed++;
+        return;
+    }
+    struct epoll_event event = {
+        .events = EPOLLOUT,
+        .data.fd = fd,
+    };
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    bench->conns[fd] = (conn_t){ .state = CONN_CONNECTING };
+    bench->in_flight++;
+}
+
+
+/*
+ * Read the handshake response of `fd`, and leave the connection idle once
+ * it is complete.
+ */
+static void _bench_read(bench_t* bench, int fd) {
+    conn_t* conn = &bench->conns[fd];
+
+    common_status_t status = common_read_response(fd, &conn->response);
+    if (status == COMMON_AGAIN) {
+        return;
+    }
+    if (status == COMMON_ERROR) {
+        _bench_fail(bench, fd);
+        return;
+    }
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    conn->state = CONN_FREE;
+    bench->in_flight--;
+    bench->established++;
+}
+
+
+static void _bench_handle(bench_t* bench, int fd, uint32_t events) {
+    conn_t* conn = &bench->conns[fd];
+
+    if (conn->state == CONN_CONNECTING) {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error != 0
+            || send(fd, REQUEST, strlen(REQUEST), MSG_NOSIGNAL)
+               != strlen(REQUEST))
+        {
+            _bench_fail(bench, fd);
+            return;
+        }
+        conn->state = CONN_HANDSHAKE;
+        common_response_init(&conn->response);
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.fd = fd,
+        };
+        epoll_ctl(bench->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        return;
+    }
+    _bench_read(bench, fd);
+}
+
+
+static void _bench_usage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [options] <host> <port>\n"
+        "\n"
+        "options:\n"
+        "  -c COUNT    connections to open (default 10000)\n"
+        "  -p PID      pid of the bridge, whose memory is measured\n"
+        "  -b PORT     run a bridged server holding connections on PORT\n"
+        "  -w COUNT    connections opened concurrently (default 256)\n"
+        "  -s MS       time waited before measuring (default 1000)\n"
+        "  -H MS       time the connections are held after measuring\n"
+        "              (default 0)\n",
+        program);
+}
+
+
+int main(int argc, char** argv) {
+    bench_t bench = {
+        .count = 10000,
+        .window = 256,
+    };
+    pid_t pid = 0;
+    int backend_port = 0;
+    unsigned settle_ms = 1000;
+    unsigned hold_ms = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:p:b:w:s:H:")) != -1) {
+        switch (opt) {
+          case 'c': bench.count = strtoul(optarg, NULL, 10); break;
+          case 'p': pid = atoi(optarg); break;
+          case 'b': backend_port = atoi(optarg); break;
+          case 'w': bench.window = strtoul(optarg, NULL, 10); break;
+          case 's': settle_ms = strtoul(optarg, NULL, 10); break;
+          case 'H': hold_ms = strtoul(optarg, NULL, 10); break;
+          default:
+            _bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || bench.count == 0 || bench.window == 0) {
+        _bench_usage(argv[0]);
+        return 1;
+    }
+
+    struct hostent* host = gethostbyname(argv[optind]);
+    if (!host) {
+        fprintf(stderr, "unknown host %s\n", argv[optind]);
+        return 1;
+    }
+    bench.target = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(atoi(argv[optind + 1])),
+        .sin_addr = *(struct in_addr*)host->h_addr,
+    };
+    bench.loopback = (ntohl(bench.target.sin_addr.s_addr) >> 24) == 127;
+
+    bench.conns_size = common_raise_files_limit();
+    if (bench.conns_size < bench.count + 64) {
+        fprintf(stderr, "warning: %zu descriptors available for %zu "
+                        "connections\n", bench.conns_size, bench.count);
+    }
+    bench.conns = calloc(bench.conns_size, sizeof(conn_t));
+    bench.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!bench.conns || bench.epoll_fd < 0) {
+        fprintf(stderr, "unable to allocate the connections\n");
+        return 1;
+    }
+
+    if (backend_port > 0 && !_bench_start_backend(backend_port)) {
+        return 1;
+    }
+
+    size_t rss_before = pid ? _bench_rss_kib(pid) : 0;
+    size_t tcp_before = _bench_tcp_pages();
+    uint64_t started = _bench_now_ms();
+
+    while (bench.opened < bench.count || bench.in_flight > 0) {
+        while (bench.opened < bench.count && bench.in_flight < bench.window) {
+            _bench_open(&bench);
+        }
+        struct epoll_event events[BENCH_EVENTS];
+        int count = epoll_wait(bench.epoll_fd, events, BENCH_EVENTS, 1000);
+        for (int i = 0; i < count; i++) {
+            _bench_handle(&bench, events[i].data.fd, events[i].events);
+        }
+    }
+    double elapsed = (_bench_now_ms() - started) / 1e3;
+
+    usleep(settle_ms * 1000);
+    size_t rss_after = pid ? _bench_rss_kib(pid) : 0;
+    size_t tcp_after = _bench_tcp_pages();
+
+    printf("connections:          %zu established, %zu failed in %.2f s "
+           "(%.0f/s)\n",
+           bench.established, bench.failed, elapsed,
+           bench.established / (elapsed > 0 ? elapsed : 1e-3));
+    if (backend_port > 0) {
+        printf("bridged server:       %zu connections held\n",
+               __atomic_load_n(&backend_count_g, __ATOMIC_RELAXED));
+    }
+    if (pid && bench.established > 0) {
+        printf("bridge rss:           %zu KiB before, %zu KiB after\n",
+               rss_before, rss_after);
+        printf("memory per idle connection: %.0f bytes\n",
+               (rss_after > rss_before ? rss_after - rss_before : 0)
+               * 1024.0 / bench.established);
+    }
+    if (bench.established > 0) {
+        // Both ends of every connection are on this host when testing on
+        // the loopback.
+        printf("kernel TCP buffers:   %zu pages before, %zu after, "
+               "%.0f bytes per connection (all its sockets)\n",
+               tcp_before, tcp_after,
+               (tcp_after > tcp_before ? tcp_after - tcp_before : 0)
+               * (double)sysconf(_SC_PAGESIZE) / bench.established);
+    }
+
+    usleep(hold_ms * 1000);
+    return 0;
+}
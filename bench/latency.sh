@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Measure the latency of ping-pong clients on a worker left to the
+# scheduler, then pinned to the CPU of the first core, then also busy
+# polling, and write one JSON line of results per run.
+#
+# Usage: bench/latency.sh [duration in seconds] [busy poll in microseconds]
+#
+# Ports 9360 (bridge) and 9361 (bridged server) must be free. The bridge
+# busy polls its sockets too when it has CAP_NET_ADMIN.
+
+DURATION=${1:-5}
+BUSY_POLL=${2:-50}
+BRIDGE_PORT=9360
+SERVER_PORT=9361
+
+. "$(dirname "$0")/common.sh"
+
+# run <label> <bridge options...>
+run() {
+    label=$1
+    shift
+    stop
+    start_server $BUILD/bench-load -b $SERVER_PORT
+    start_bridge $BUILD/wsbridge --log-level=warning --workers=1 "$@" \
+        $BRIDGE_PORT 127.0.0.1 $SERVER_PORT
+    load "$label" -c 4 -w 1 -s 64
+}
+
+run "scheduled"
+run "pinned" --cpus=0
+run "busy-poll" --cpus=0 --busy-poll=$BUSY_POLL
@@ -0,0 +1,1317 @@
+/*
+ * Load benchmark.
+ *
+ * Opens WebSocket connections to a wsbridge instance from several threads,
+ * and sends binary messages of a fixed size over some of them: either as
+ * fast as a window of messages in flight per connection allows, or at a
+ * fixed rate per connection. Every message starts with its send time and
+ * its sender, so the latency of each copy received is measured whatever
+ * the bridge and its bridged server do with it: echo it, or broadcast it.
+ *
+ * The bench can also run the bridged server, either an echo server, or a
+ * broadcast server writing every message received to all its connections.
+ * Messages are cut in the byte stream by their size alone, so the bridge
+ * must use the raw or fixed codec in front of a broadcast server, and any
+ * codec but `line` in front of an echo server. The bridged server listens
+ * on a TCP port, or on a Unix socket: with `unixpacket:`, each message is
+ * sent back in its own packet.
+ *
+ * Results are written on the standard output as a single JSON line.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+
+
+// Connections opened to a single source address.
+#define BENCH_PER_SOURCE        20000
+
+// Connections of a thread being opened at once.
+#define BENCH_OPEN_WINDOW       256
+
+// Events handled by a single wait.
+#define BENCH_EVENTS            256
+
+// Bytes read at once.
+#define BENCH_RECV_SIZE         65536
+
+// Bytes of a frame kept between reads: a frame header, or a control frame.
+#define BENCH_PENDING_SIZE      160
+
+// Send time and sender index starting every message.
+#define BENCH_STAMP_SIZE        12
+
+// Bytes waiting to be sent past which a connection stops queueing messages.
+#define BENCH_MAX_BACKLOG       (1 << 20)
+
+// Bytes a bridged server connection may hold before being dropped.
+#define BACKEND_MAX_BACKLOG     (64 << 20)
+
+// Latency histogram, in nanoseconds: 16 buckets per power of two.
+#define BENCH_SUB_BUCKETS_BITS  4
+#define BENCH_SUB_BUCKETS       (1 << BENCH_SUB_BUCKETS_BITS)
+#define BENCH_BUCKETS           ((64 - BENCH_SUB_BUCKETS_BITS + 1) \
+                                 * BENCH_SUB_BUCKETS)
+
+
+static const char REQUEST[] = "GET %s HTTP/1.1\r\n"
+                              "Host: bench\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n"
+                              "\r\n";
+
+
+/*
+ * Bytes waiting to be sent, from `start` to `end`.
+ */
+typedef struct out {
+    char* data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+} out_t;
+
+
+typedef enum conn_state {
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_OPEN,
+    CONN_CLOSED,
+} conn_state_t;
+
+
+typedef struct conn {
+    int fd;
+    uint32_t index;
+    bool sender;
+    conn_state_t state;
+    uint32_t events;
+
+    common_response_t response;
+
+    out_t out;
+    char pending[BENCH_PENDING_SIZE];
+    size_t pending_size;
+    // Payload bytes left in the current data frame.
+    uint64_t frame_left;
+    // Bytes of the current message received, and its stamp.
+    size_t message_offset;
+    char stamp[BENCH_STAMP_SIZE];
+
+    uint64_t sent;
+    uint64_t in_flight;
+} conn_t;
+
+
+typedef struct bench bench_t;
+
+typedef struct bench_thread {
+    bench_t* bench;
+    pthread_t thread;
+    int epoll_fd;
+    conn_t* conns;
+    size_t conns_size;
+    uint64_t random;
+    char* buffer;
+
+    size_t opened;
+    size_t opening;
+    size_t established;
+    size_t failed;
+    size_t closed;
+
+    // Counted within the measured period only.
+    uint64_t sent;
+    uint64_t received;
+    uint64_t bytes;
+    uint64_t latency_max;
+    uint64_t latencies[BENCH_BUCKETS];
+} bench_thread_t;
+
+
+struct bench {
+    struct sockaddr_in target;
+    bool loopback;
+    size_t count;
+    size_t threads_count;
+    size_t senders;
+    size_t size;
+    double rate;
+    size_t window;
+    bool mask;
+    size_t header_size;
+    char* payload;
+    char request[512];
+    size_t request_size;
+
+    pthread_barrier_t barrier;
+    uint64_t start;
+    uint64_t measure_start;
+    uint64_t end;
+    bench_thread_t* threads;
+};
+
+
+typedef struct peer {
+    int fd;
+    uint32_t events;
+    out_t out;
+    char* message;
+    size_t message_size;
+    struct peer* next;
+} peer_t;
+
+
+typedef struct backend {
+    int port;
+    bool broadcast;
+    // Peers are SOCK_SEQPACKET ones: messages are sent one per packet, and
+    // blocking, since queued bytes would be sent as a single packet.
+    bool packets;
+    size_t size;
+    int epoll_fd;
+    int listen_fd;
+    peer_t* peers;
+} backend_t;
+
+
+static uint64_t _bench_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000000000) + now.tv_nsec;
+}
+
+
+static void _bench_sleep_until(uint64_t deadline) {
+    struct timespec when = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL)
+           == EINTR)
+    {
+    }
+}
+
+
+static uint64_t _bench_self_cpu_us(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * UINT64_C(1000000)
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+
+static unsigned _bench_bucket(uint64_t value) {
+    if (value < BENCH_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned exponent = 63 - __builtin_clzll(value);
+    unsigned shift = exponent - BENCH_SUB_BUCKETS_BITS;
+    return (shift + 1) * BENCH_SUB_BUCKETS
+         + ((value >> shift) & (BENCH_SUB_BUCKETS - 1));
+}
+
+
+/*
+ * Returns the largest value of `bucket`.
+ */
+static uint64_t _bench_bucket_max(unsigned bucket) {
+    if (bucket < BENCH_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = bucket / BENCH_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(BENCH_SUB_BUCKETS
+                                + bucket % BENCH_SUB_BUCKETS) << shift;
+    return lower + (UINT64_C(1) << shift) - 1;
+}
+
+
+/*
+ * Returns the `quantile` of the `count` values of `buckets`, in
+ * microseconds.
+ */
+static double _bench_quantile(const uint64_t* buckets, uint64_t count,
+                              double quantile)
+{
+    uint64_t rank = (uint64_t)(quantile * count);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BENCH_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            return _bench_bucket_max(i) / 1e3;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Returns `size` bytes of room at the end of `out`, or NULL on allocation
+ * failure.
+ */
+static char* _bench_out_reserve(out_t* out, size_t size) {
+    if (out->start == out->end) {
+        out->start = out->end = 0;
+    }
+    if (out->capacity - out->end >= size) {
+        return out->data + out->end;
+    }
+    if (out->start > 0) {
+        memmove(out->data, out->data + out->start, out->end - out->start);
+        out->end -= out->start;
+        out->start = 0;
+    }
+    if (out->capacity - out->end < size) {
+        size_t capacity = out->capacity ? out->capacity : 4096;
+        while (capacity - out->end < size) {
+            capacity *= 2;
+        }
+        char* data = realloc(out->data, capacity);
+        if (!data) {
+            return NULL;
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+    return out->data + out->end;
+}
+
+
+static bool _bench_out_append(out_t* out, const void* data, size_t size) {
+    char* room = _bench_out_reserve(out, size);
+    if (!room) {
+        return false;
+    }
+    memcpy(room, data, size);
+    out->end += size;
+    return true;
+}
+
+
+/*
+ * Send what `out` holds on `fd`.
+ * Returns false if the socket failed.
+ */
+static bool _bench_out_flush(out_t* out, int fd) {
+    while (out->start < out->end) {
+        ssize_t len = send(fd, out->data + out->start, out->end - out->start,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        out->start += len;
+    }
+    return true;
+}
+
+
+static void _backend_watch(backend_t* backend, peer_t* peer) {
+    uint32_t events = EPOLLIN
+                    | (peer->out.start < peer->out.end ? EPOLLOUT : 0);
+    if (events != peer->events) {
+        struct epoll_event event = {
+            .events = events,
+            .data.ptr = peer,
+        };
+        epoll_ctl(backend->epoll_fd, EPOLL_CTL_MOD, peer->fd, &event);
+        peer->events = events;
+    }
+}
+
+
+static void _backend_close(backend_t* backend, peer_t* peer) {
+    for (peer_t** it = &backend->peers; *it; it = &(*it)->next) {
+        if (*it == peer) {
+            *it = peer->next;
+            break;
+        }
+    }
+    close(peer->fd);
+    free(peer->out.data);
+    free(peer->message);
+    free(peer);
+}
+
+
+/*
+ * Queue `size` bytes to `peer` and try to send them.
+ * Returns false if the peer was dropped.
+ */
+static bool _backend_send(backend_t* backend, peer_t* peer, const char* data,
+                          size_t size)
+{
+    if (backend->packets) {
+        if (send(peer->fd, data, size, MSG_NOSIGNAL) != size) {
+            _backend_close(backend, peer);
+            return false;
+        }
+        return true;
+    }
+    if (peer->out.end - peer->out.start + size > BACKEND_MAX_BACKLOG
+        || !_bench_out_append(&peer->out, data, size)
+        || !_bench_out_flush(&peer->out, peer->fd))
+    {
+        _backend_close(backend, peer);
+        return false;
+    }
+    _backend_watch(backend, peer);
+    return true;
+}
+
+
+/*
+ * Send complete messages to every peer.
+ */
+static void _backend_broadcast(backend_t* backend, const char* data,
+                               size_t size)
+{
+    peer_t* next;
+    for (peer_t* peer = backend->peers; peer; peer = next) {
+        next = peer->next;
+        _backend_send(backend, peer, data, size);
+    }
+}
+
+
+/*
+ * Cut the bytes received from `peer` in messages, and broadcast them.
+ */
+static void _backend_relay(backend_t* backend, peer_t* peer, const char* data,
+                           size_t size)
+{
+    if (peer->message_size > 0) {
+        size_t take = backend->size - peer->message_size;
+        take = take < size ? take : size;
+        memcpy(peer->message + peer->message_size, data, take);
+        peer->message_size += take;
+        data += take;
+        size -= take;
+        if (peer->message_size < backend->size) {
+            return;
+        }
+        peer->message_size = 0;
+        _backend_broadcast(backend, peer->message, backend->size);
+    }
+    size_t complete = size - size % backend->size;
+    if (backend->packets) {
+        for (size_t offset = 0; offset < complete; offset += backend->size) {
+            _backend_broadcast(backend, data + offset, backend->size);
+        }
+    } else
+    if (complete > 0) {
+        _backend_broadcast(backend, data, complete);
+    }
+    // The peer may have been dropped by the broadcast itself.
+    for (peer_t* it = backend->peers; it; it = it->next) {
+        if (it == peer) {
+            memcpy(peer->message, data + complete, size - complete);
+            peer->message_size = size - complete;
+            break;
+        }
+    }
+}
+
+
+static void _backend_accept(backend_t* backend) {
+    int fd;
+    while ((fd = accept4(backend->listen_fd, NULL, NULL,
+                         (backend->packets ? 0 : SOCK_NONBLOCK)
+                         | SOCK_CLOEXEC)) >= 0)
+    {
+        peer_t* peer = calloc(1, sizeof(peer_t));
+        if (peer && backend->broadcast) {
+            peer->message = malloc(backend->size);
+        }
+        if (!peer || (backend->broadcast && !peer->message)) {
+            free(peer);
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+        peer->fd = fd;
+        peer->events = EPOLLIN;
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = peer,
+        };
+        epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        peer->next = backend->peers;
+        backend->peers = peer;
+    }
+    if (errno == EMFILE || errno == ENFILE) {
+        fprintf(stderr, "backend: out of descriptors\n");
+    }
+}
+
+
+static void _backend_handle(backend_t* backend, peer_t* peer,
+                            uint32_t events, char* buffer)
+{
+    if (events & EPOLLOUT) {
+        if (!_bench_out_flush(&peer->out, peer->fd)) {
+            _backend_close(backend, peer);
+            return;
+        }
+        _backend_watch(backend, peer);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    ssize_t len = recv(peer->fd, buffer, BENCH_RECV_SIZE, MSG_DONTWAIT);
+    if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            _backend_close(backend, peer);
+        }
+        return;
+    }
+    if (backend->broadcast) {
+        _backend_relay(backend, peer, buffer, len);
+    } else {
+        _backend_send(backend, peer, buffer, len);
+    }
+}
+
+
+static void* _bench_backend_thread(void* data) {
+    backend_t* backend = data;
+    struct epoll_event events[BENCH_EVENTS];
+    char* buffer = malloc(BENCH_RECV_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "backend: cannot allocate buffer\n");
+        return NULL;
+    }
+
+    for (;;) {
+        int count = epoll_wait(backend->epoll_fd, events, BENCH_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                _backend_accept(backend);
+            } else {
+                _backend_handle(backend, events[i].data.ptr,
+                                events[i].events, buffer);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Parse the Unix socket address `str` (`unix:PATH` or `unixpacket:PATH`,
+ * '@' starting an abstract name) in `addr` and `*size`, and set `*type` to
+ * its socket type.
+ * Returns false if it is not one.
+ */
+static bool _bench_parse_unix(const char* str, struct sockaddr_un* addr,
+                              socklen_t* size, int* type)
+{
+    const char* path;
+    if (strncmp(str, "unix:", 5) == 0) {
+        path = str + 5;
+        *type = SOCK_STREAM;
+    } else
+    if (strncmp(str, "unixpacket:", 11) == 0) {
+        path = str + 11;
+        *type = SOCK_SEQPACKET;
+    } else {
+        return false;
+    }
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+    memcpy(addr->sun_path, path, len);
+    *size = offsetof(struct sockaddr_un, sun_path) + len;
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+    } else {
+        (*size)++;
+        unlink(path);
+    }
+    return true;
+}
+
+
+/*
+ * Run `threads` threads serving the bridged server on `port`, each with its
+ * own listening socket, or a single thread on the Unix socket `unix_addr`
+ * when it is not NULL. Broadcasting uses a single thread.
+ */
+static bool _bench_start_backend(int port, const char* unix_addr,
+                                 bool broadcast, size_t size, size_t threads)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_size = sizeof(struct sockaddr_in);
+    int family = AF_INET;
+    int type = SOCK_STREAM;
+    *(struct sockaddr_in*)&addr = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (unix_addr) {
+        if (!_bench_parse_unix(unix_addr, (struct sockaddr_un*)&addr,
+                               &addr_size, &type))
+        {
+            fprintf(stderr, "backend: invalid address %s\n", unix_addr);
+            return false;
+        }
+        family = AF_UNIX;
+        threads = 1;
+    }
+
+    if (broadcast) {
+        threads = 1;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        backend_t* backend = calloc(1, sizeof(backend_t));
+        pthread_t thread;
+        if (!backend) {
+            fprintf(stderr, "backend: cannot allocate\n");
+            return false;
+        }
+        backend->port = port;
+        backend->broadcast = broadcast;
+        backend->packets = type == SOCK_SEQPACKET;
+        backend->size = size;
+        backend->listen_fd = socket(family, type | SOCK_NONBLOCK
+                                            | SOCK_CLOEXEC, 0);
+        backend->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (family == AF_INET) {
+            setsockopt(backend->listen_fd, SOL_SOCKET, SO_REUSEADDR,
+                       &(int){ 1 }, sizeof(int));
+            setsockopt(backend->listen_fd, SOL_SOCKET, SO_REUSEPORT,
+                       &(int){ 1 }, sizeof(int));
+        }
+        if (bind(backend->listen_fd, (struct sockaddr*)&addr, addr_size) < 0
+            || listen(backend->listen_fd, SOMAXCONN) < 0)
+        {
+            if (unix_addr) {
+                fprintf(stderr, "backend: unable to listen on %s\n",
+                        unix_addr);
+            } else {
+                fprintf(stderr, "backend: unable to listen on %d\n", port);
+            }
+            return false;
+        }
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = NULL,
+        };
+        epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, backend->listen_fd,
+                  &event);
+        if (pthread_create(&thread, NULL, &_bench_backend_thread, backend)
+            != 0)
+        {
+            fprintf(stderr, "backend: unable to start thread\n");
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    return true;
+}
+
+
+static void _bench_watch(bench_thread_t* thread, conn_t* conn) {
+    uint32_t events = conn->state == CONN_CONNECTING ? EPOLLOUT : EPOLLIN;
+    if (conn->out.start < conn->out.end) {
+        events |= EPOLLOUT;
+    }
+    if (events != conn->events) {
+        struct epoll_event event = {
+            .events = events,
+            .data.ptr = conn,
+        };
+        epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = events;
+    }
+}
+
+
+static void _bench_close(bench_thread_t* thread, conn_t* conn) {
+    if (conn->state == CONN_CONNECTING || conn->state == CONN_HANDSHAKE) {
+        thread->opening--;
+        thread->failed++;
+    } else if (conn->state == CONN_OPEN) {
+        thread->closed++;
+    }
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->state = CONN_CLOSED;
+}
+
+
+/*
+ * Start opening the next connection of `thread`.
+ */
+static void _bench_open(bench_thread_t* thread) {
+    bench_t* bench = thread->bench;
+    conn_t* conn = &thread->conns[thread->opened++];
+    conn->state = CONN_CLOSED;
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        thread->failed++;
+        return;
+    }
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+
+    if (bench->loopback) {
+        // Let connect pick the port, unique for the destination only.
+        struct sockaddr_in source = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK
+                                     + 1 + conn->index / BENCH_PER_SOURCE
+                                           % 250),
+        };
+        setsockopt(conn->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &(int){ 1 },
+                   sizeof(int));
+        bind(conn->fd, (struct sockaddr*)&source, sizeof(source));
+    }
+
+    if (connect(conn->fd, (struct sockaddr*)&bench->target,
+                sizeof(bench->target)) < 0 && errno != EINPROGRESS)
+    {
+        close(conn->fd);
+        thread->failed++;
+        return;
+    }
+    struct epoll_event event = {
+        .events = EPOLLOUT,
+        .data.ptr = conn,
+    };
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+    conn->state = CONN_CONNECTING;
+    conn->events = EPOLLOUT;
+    thread->opening++;
+}
+
+
+/*
+ * Read the handshake response of `conn`, leaving the frames which may
+ * follow it in the socket.
+ */
+static void _bench_read_response(bench_thread_t* thread, conn_t* conn) {
+    common_status_t status = common_read_response(conn->fd, &conn->response);
+    if (status == COMMON_AGAIN) {
+        return;
+    }
+    if (status == COMMON_ERROR) {
+        _bench_close(thread, conn);
+        return;
+    }
+    conn->state = CONN_OPEN;
+    thread->opening--;
+    thread->established++;
+    _bench_watch(thread, conn);
+}
+
+
+static uint32_t _bench_random(bench_thread_t* thread) {
+    // xorshift64
+    thread->random ^= thread->random << 13;
+    thread->random ^= thread->random >> 7;
+    thread->random ^= thread->random << 17;
+    return (uint32_t)thread->random;
+}
+
+
+/*
+ * Write a client frame header for `size` payload bytes masked with `mask`.
+ * Returns the header size.
+ */
+static size_t _bench_frame_header(char* out, uint8_t opcode, size_t size,
+                                  uint32_t mask)
+{
+    size_t offset = 2;
+    out[0] = 0x80 | opcode;
+    if (size < 126) {
+        out[1] = 0x80 | size;
+    } else if (size <= UINT16_MAX) {
+        out[1] = 0x80 | 126;
+        out[2] = size >> 8;
+        out[3] = size;
+        offset = 4;
+    } else {
+        out[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            out[2 + i] = (uint64_t)size >> (56 - i * 8);
+        }
+        offset = 10;
+    }
+    memcpy(out + offset, &mask, sizeof(mask));
+    return offset + sizeof(mask);
+}
+
+
+static void _bench_mask(char* payload, size_t size, uint32_t mask) {
+    uint64_t mask64 = ((uint64_t)mask << 32) | mask;
+    size_t i = 0;
+    for (; i + sizeof(mask64) <= size; i += sizeof(mask64)) {
+        uint64_t chunk;
+        memcpy(&chunk, payload + i, sizeof(chunk));
+        chunk ^= mask64;
+        memcpy(payload + i, &chunk, sizeof(chunk));
+    }
+    for (; i < size; i++) {
+        payload[i] ^= (char)(mask >> ((i % 4) * 8));
+    }
+}
+
+
+/*
+ * Queue a message stamped with `stamp` on `conn`.
+ * Returns false on allocation failure.
+ */
+static bool _bench_push(bench_thread_t* thread, conn_t* conn, uint64_t stamp)
+{
+    bench_t* bench = thread->bench;
+    char* frame = _bench_out_reserve(&conn->out,
+                                     bench->header_size + bench->size);
+    if (!frame) {
+        return false;
+    }
+    uint32_t mask = bench->mask ? _bench_random(thread) : 0;
+    size_t header = _bench_frame_header(frame, 0x2, bench->size, mask);
+    char* payload = frame + header;
+
+    memcpy(payload, &stamp, sizeof(stamp));
+    memcpy(payload + sizeof(stamp), &conn->index, sizeof(conn->index));
+    memcpy(payload + BENCH_STAMP_SIZE, bench->payload + BENCH_STAMP_SIZE,
+           bench->size - BENCH_STAMP_SIZE);
+    if (mask != 0) {
+        _bench_mask(payload, bench->size, mask);
+    }
+    conn->out.end += header + bench->size;
+    conn->sent++;
+    conn->in_flight++;
+    if (stamp >= bench->measure_start && stamp < bench->end) {
+        thread->sent++;
+    }
+    return true;
+}
+
+
+static void _bench_flush(bench_thread_t* thread, conn_t* conn) {
+    if (!_bench_out_flush(&conn->out, conn->fd)) {
+        _bench_close(thread, conn);
+        return;
+    }
+    _bench_watch(thread, conn);
+}
+
+
+/*
+ * Keep `window` messages in flight on `conn`.
+ */
+static void _bench_fill(bench_thread_t* thread, conn_t* conn, uint64_t now) {
+    bench_t* bench = thread->bench;
+    bool pushed = false;
+    while (conn->in_flight < bench->window) {
+        if (!_bench_push(thread, conn, now)) {
+            break;
+        }
+        pushed = true;
+    }
+    if (pushed) {
+        _bench_flush(thread, conn);
+    }
+}
+
+
+/*
+ * Queue the messages due on the senders of `thread`. Messages are stamped
+ * with the time they were due, so that a bridge falling behind shows in
+ * the latencies.
+ */
+static void _bench_schedule(bench_thread_t* thread, uint64_t now) {
+    bench_t* bench = thread->bench;
+    // Index of the last message due, the message `n` being due at
+    // `start + n / rate`.
+    uint64_t due = (uint64_t)((now - bench->start) / 1e9 * bench->rate);
+
+    for (size_t i = 0; i < thread->conns_size; i++) {
+        conn_t* conn = &thread->conns[i];
+        if (!conn->sender || conn->state != CONN_OPEN || conn->sent > due) {
+            continue;
+        }
+        while (conn->sent <= due
+               && conn->out.end - conn->out.start < BENCH_MAX_BACKLOG)
+        {
+            uint64_t stamp = bench->start + conn->sent * 1e9 / bench->rate;
+            if (!_bench_push(thread, conn, stamp)) {
+                break;
+            }
+        }
+        _bench_flush(thread, conn);
+    }
+}
+
+
+static void _bench_received(bench_thread_t* thread, conn_t* conn,
+                            uint64_t now)
+{
+    bench_t* bench = thread->bench;
+    uint64_t stamp;
+    uint32_t sender;
+    memcpy(&stamp, conn->stamp, sizeof(stamp));
+    memcpy(&sender, conn->stamp + sizeof(stamp), sizeof(sender));
+
+    if (sender == conn->index && conn->in_flight > 0) {
+        conn->in_flight--;
+    }
+    if (now < bench->measure_start || now >= bench->end) {
+        return;
+    }
+    uint64_t latency = now > stamp ? now - stamp : 0;
+    thread->received++;
+    thread->bytes += bench->size;
+    thread->latencies[_bench_bucket(latency)]++;
+    if (latency > thread->latency_max) {
+        thread->latency_max = latency;
+    }
+}
+
+
+/*
+ * Cut the payload bytes received on `conn` in messages.
+ */
+static void _bench_consume(bench_thread_t* thread, conn_t* conn,
+                           const char* data, size_t size, uint64_t now)
+{
+    size_t message_size = thread->bench->size;
+    while (size > 0) {
+        size_t take = message_size - conn->message_offset;
+        take = take < size ? take : size;
+        if (conn->message_offset < BENCH_STAMP_SIZE) {
+            size_t stamp = BENCH_STAMP_SIZE - conn->message_offset;
+            memcpy(conn->stamp + conn->message_offset, data,
+                   stamp < take ? stamp : take);
+        }
+        conn->message_offset += take;
+        data += take;
+        size -= take;
+        if (conn->message_offset == message_size) {
+            conn->message_offset = 0;
+            _bench_received(thread, conn, now);
+        }
+    }
+}
+
+
+/*
+ * Parse the server frames in `data`.
+ * Returns the bytes parsed, or -1 if the connection must be closed.
+ */
+static ssize_t _bench_parse(bench_thread_t* thread, conn_t* conn,
+                            const char* data, size_t size, uint64_t now)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        if (conn->frame_left > 0) {
+            size_t take = size - offset;
+            take = take < conn->frame_left ? take : conn->frame_left;
+            _bench_consume(thread, conn, data + offset, take, now);
+            conn->frame_left -= take;
+            offset += take;
+            continue;
+        }
+
+        const uint8_t* head = (const uint8_t*)data + offset;
+        size_t left = size - offset;
+        size_t header = 2;
+        if (left < header) {
+            break;
+        }
+        uint8_t opcode = head[0] & 0x0f;
+        uint64_t length = head[1] & 0x7f;
+        if (length == 126) {
+            header = 4;
+            if (left < header) {
+                break;
+            }
+            length = (uint64_t)head[2] << 8 | head[3];
+        } else if (length == 127) {
+            header = 10;
+            if (left < header) {
+                break;
+            }
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = length << 8 | head[2 + i];
+            }
+        }
+
+        if (opcode < 0x8) {
+            conn->frame_left = length;
+            offset += header;
+            continue;
+        }
+        // Control frames are handled whole.
+        if (left < header + length) {
+            break;
+        }
+        if (opcode == 0x8) {
+            return -1;
+        }
+        if (opcode == 0x9) {
+            char* pong = _bench_out_reserve(&conn->out, 14 + length);
+            if (!pong) {
+                return -1;
+            }
+            size_t pong_header = _bench_frame_header(pong, 0xa, length, 0);
+            memcpy(pong + pong_header, head + header, length);
+            conn->out.end += pong_header + length;
+        }
+        offset += header + length;
+    }
+    return offset;
+}
+
+
+static void _bench_read(bench_thread_t* thread, conn_t* conn, uint64_t now) {
+    char* buffer = thread->buffer;
+    memcpy(buffer, conn->pending, conn->pending_size);
+    ssize_t len = recv(conn->fd, buffer + conn->pending_size,
+                       BENCH_RECV_SIZE - conn->pending_size, 0);
+    if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            _bench_close(thread, conn);
+        }
+        return;
+    }
+    size_t size = conn->pending_size + len;
+    ssize_t parsed = _bench_parse(thread, conn, buffer, size, now);
+    if (parsed < 0 || size - parsed > BENCH_PENDING_SIZE) {
+        _bench_close(thread, conn);
+        return;
+    }
+    conn->pending_size = size - parsed;
+    memcpy(conn->pending, buffer + parsed, conn->pending_size);
+
+    if (conn->sender && thread->bench->rate == 0) {
+        _bench_fill(thread, conn, now);
+    }
+    if (conn->state == CONN_OPEN) {
+        _bench_flush(thread, conn);
+    }
+}
+
+
+static void _bench_handle(bench_thread_t* thread, conn_t* conn,
+                          uint32_t events, uint64_t now)
+{
+    if (conn->state == CONN_CONNECTING) {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error != 0
+            || send(conn->fd, thread->bench->request,
+                    thread->bench->request_size, MSG_NOSIGNAL)
+               != thread->bench->request_size)
+        {
+            _bench_close(thread, conn);
+            return;
+        }
+        conn->state = CONN_HANDSHAKE;
+        common_response_init(&conn->response);
+        _bench_watch(thread, conn);
+        return;
+    }
+    if (conn->state == CONN_HANDSHAKE) {
+        _bench_read_response(thread, conn);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        _bench_flush(thread, conn);
+    }
+    if (conn->state == CONN_OPEN && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    {
+        _bench_read(thread, conn, now);
+    }
+}
+
+
+static void _bench_wait(bench_thread_t* thread, int timeout) {
+    struct epoll_event events[BENCH_EVENTS];
+    int count = epoll_wait(thread->epoll_fd, events, BENCH_EVENTS, timeout);
+    uint64_t now = _bench_now_ns();
+    for (int i = 0; i < count; i++) {
+        _bench_handle(thread, events[i].data.ptr, events[i].events, now);
+    }
+}
+
+
+static void* _bench_thread(void* data) {
+    bench_thread_t* thread = data;
+    bench_t* bench = thread->bench;
+
+    while (thread->opened < thread->conns_size || thread->opening > 0) {
+        while (thread->opened < thread->conns_size
+               && thread->opening < BENCH_OPEN_WINDOW)
+        {
+            _bench_open(thread);
+        }
+        _bench_wait(thread, 1000);
+    }
+
+    // Wait for every thread, while the main one sets the start time.
+    pthread_barrier_wait(&bench->barrier);
+    pthread_barrier_wait(&bench->barrier);
+
+    if (bench->rate == 0) {
+        uint64_t now = _bench_now_ns();
+        for (size_t i = 0; i < thread->conns_size; i++) {
+            conn_t* conn = &thread->conns[i];
+            if (conn->sender && conn->state == CONN_OPEN) {
+                _bench_fill(thread, conn, now);
+            }
+        }
+    }
+
+    uint64_t now;
+    while ((now = _bench_now_ns()) < bench->end) {
+        if (bench->rate > 0) {
+            _bench_schedule(thread, now);
+        }
+        uint64_t left_ms = (bench->end - now) / 1000000 + 1;
+        int timeout = bench->rate > 0 ? 1 : 100;
+        _bench_wait(thread, left_ms < timeout ? left_ms : timeout);
+    }
+    return NULL;
+}
+
+
+static void _bench_usage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [options] <host> <port>\n"
+        "       %s -b PORT|-u ADDR [options]\n"
+        "\n"
+        "options:\n"
+        "  -c COUNT    connections to open (default 100)\n"
+        "  -t COUNT    threads running the connections (default 1)\n"
+        "  -S COUNT    connections sending messages (default all)\n"
+        "  -s SIZE     message size, at least 12 bytes (default 64)\n"
+        "  -r RATE     messages per second and sender, or 0 to keep a\n"
+        "              window in flight (default 0)\n"
+        "  -w COUNT    messages in flight per sender when not rated\n"
+        "              (default 1)\n"
+        "  -m MASK     random or zero masking keys (default random)\n"
+        "  -d SECONDS  measured duration (default 5)\n"
+        "  -W SECONDS  warm-up, not measured (default 1)\n"
+        "  -p PID      pid of the bridge, whose CPU time is measured\n"
+        "  -l LABEL    label of the results\n"
+        "  -P PATH     path requested by the connections (default /)\n"
+        "  -b PORT     run a bridged server on PORT, alone without <host>\n"
+        "  -u ADDR     run it on a Unix socket instead, unix:PATH or\n"
+        "              unixpacket:PATH ('@' for the abstract namespace)\n"
+        "  -B MODE     echo or broadcast bridged server (default echo)\n"
+        "  -T COUNT    threads of the echo bridged server (default 1)\n",
+        program, program);
+}
+
+
+int main(int argc, char** argv) {
+    bench_t bench = {
+        .count = 100,
+        .threads_count = 1,
+        .senders = SIZE_MAX,
+        .size = 64,
+        .window = 1,
+        .mask = true,
+    };
+    double duration = 5;
+    double warmup = 1;
+    pid_t pid = 0;
+    const char* label = "";
+    const char* path = "/";
+    int backend_port = 0;
+    const char* backend_unix = NULL;
+    bool backend_broadcast = false;
+    size_t backend_threads = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:S:s:r:w:m:d:W:p:l:P:b:u:B:T:"))
+           != -1)
+    {
+        switch (opt) {
+          case 'c': bench.count = strtoul(optarg, NULL, 10); break;
+          case 't': bench.threads_count = strtoul(optarg, NULL, 10); break;
+          case 'S': bench.senders = strtoul(optarg, NULL, 10); break;
+          case 's': bench.size = strtoul(optarg, NULL, 10); break;
+          case 'r': bench.rate = strtod(optarg, NULL); break;
+          case 'w': bench.window = strtoul(optarg, NULL, 10); break;
+          case 'm': bench.mask = strcmp(optarg, "zero") != 0; break;
+          case 'd': duration = strtod(optarg, NULL); break;
+          case 'W': warmup = strtod(optarg, NULL); break;
+          case 'p': pid = atoi(optarg); break;
+          case 'l': label = optarg; break;
+          case 'P': path = optarg; break;
+          case 'b': backend_port = atoi(optarg); break;
+          case 'u': backend_unix = optarg; break;
+          case 'B': backend_broadcast = strcmp(optarg, "broadcast") == 0;
+                    break;
+          case 'T': backend_threads = strtoul(optarg, NULL, 10); break;
+          default:
+            _bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    bool backend = backend_port > 0 || backend_unix;
+    bool backend_only = argc == optind && backend;
+    if ((argc - optind != 2 && !backend_only) || bench.count == 0
+        || bench.threads_count == 0 || bench.size < BENCH_STAMP_SIZE
+        || bench.window == 0 || backend_threads == 0 || duration <= 0
+        || strlen(path) > 256)
+    {
+        _bench_usage(argv[0]);
+        return 1;
+    }
+    bench.request_size = snprintf(bench.request, sizeof(bench.request),
+                                  REQUEST, path);
+
+    size_t files = common_raise_files_limit();
+    if (backend
+        && !_bench_start_backend(backend_port, backend_unix,
+                                 backend_broadcast, bench.size,
+                                 backend_threads))
+    {
+        return 1;
+    }
+    if (backend_only) {
+        for (;;) {
+            pause();
+        }
+    }
+
+    struct hostent* host = gethostbyname(argv[optind]);
+    if (!host) {
+        fprintf(stderr, "unknown host %s\n", argv[optind]);
+        return 1;
+    }
+    bench.target = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(atoi(argv[optind + 1])),
+        .sin_addr = *(struct in_addr*)host->h_addr,
+    };
+    bench.loopback = (ntohl(bench.target.sin_addr.s_addr) >> 24) == 127;
+    if (files < bench.count + 64) {
+        fprintf(stderr, "warning: %zu descriptors available for %zu "
+                        "connections\n", files, bench.count);
+    }
+    if (bench.senders > bench.count) {
+        bench.senders = bench.count;
+    }
+    char header[14];
+    bench.header_size = _bench_frame_header(header, 0x2, bench.size, 0);
+    bench.payload = malloc(bench.size);
+    bench.threads = calloc(bench.threads_count, sizeof(bench_thread_t));
+    if (!bench.payload || !bench.threads) {
+        fprintf(stderr, "unable to allocate the connections\n");
+        return 1;
+    }
+    memset(bench.payload, 'x', bench.size);
+    pthread_barrier_init(&bench.barrier, NULL, bench.threads_count + 1);
+
+    // Connections and senders are dealt to the threads in turn.
+    for (size_t i = 0; i < bench.threads_count; i++) {
+        bench_thread_t* thread = &bench.threads[i];
+        thread->bench = &bench;
+        thread->random = 0x9e3779b97f4a7c15ull * (i + 1);
+        thread->conns_size = bench.count / bench.threads_count
+                           + (i < bench.count % bench.threads_count);
+        thread->conns = calloc(thread->conns_size, sizeof(conn_t));
+        thread->buffer = malloc(BENCH_RECV_SIZE);
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (!thread->conns || !thread->buffer || thread->epoll_fd < 0) {
+            fprintf(stderr, "unable to allocate the connections\n");
+            return 1;
+        }
+        for (size_t j = 0; j < thread->conns_size; j++) {
+            thread->conns[j].index = i + j * bench.threads_count;
+            thread->conns[j].sender = thread->conns[j].index < bench.senders;
+        }
+        if (pthread_create(&thread->thread, NULL, &_bench_thread, thread)
+            != 0)
+        {
+            fprintf(stderr, "unable to start thread\n");
+            return 1;
+        }
+    }
+
+    pthread_barrier_wait(&bench.barrier);
+    bench.start = _bench_now_ns();
+    bench.measure_start = bench.start + (uint64_t)(warmup * 1e9);
+    bench.end = bench.measure_start + (uint64_t)(duration * 1e9);
+    pthread_barrier_wait(&bench.barrier);
+
+    _bench_sleep_until(bench.measure_start);
+    uint64_t bridge_cpu = pid ? common_cpu_us(pid) : 0;
+    uint64_t self_cpu = _bench_self_cpu_us();
+    _bench_sleep_until(bench.end);
+    bridge_cpu = pid ? common_cpu_us(pid) - bridge_cpu : 0;
+    self_cpu = _bench_self_cpu_us() - self_cpu;
+
+    bench_thread_t total = { 0 };
+    for (size_t i = 0; i < bench.threads_count; i++) {
+        bench_thread_t* thread = &bench.threads[i];
+        pthread_join(thread->thread, NULL);
+        total.established += thread->established;
+        total.failed += thread->failed;
+        total.closed += thread->closed;
+        total.sent += thread->sent;
+        total.received += thread->received;
+        total.bytes += thread->bytes;
+        if (thread->latency_max > total.latency_max) {
+            total.latency_max = thread->latency_max;
+        }
+        for (unsigned j = 0; j < BENCH_BUCKETS; j++) {
+            total.latencies[j] += thread->latencies[j];
+        }
+    }
+
+    double received = total.received ? total.received : 1;
+    printf("{\"label\":\"%s\",\"connections\":%zu,\"failed\":%zu,"
+           "\"closed\":%zu,\"threads\":%zu,\"senders\":%zu,\"size\":%zu,"
+           "\"rate\":%g,\"window\":%zu,\"mask\":\"%s\",\"duration_s\":%g,"
+           "\"sent\":%" PRIu64 ",\"received\":%" PRIu64 ","
+           "\"fanout\":%.2f,\"msgs_per_s\":%.0f,\"mb_per_s\":%.2f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+           "\"max_us\":%.1f,\"bench_cpu_us_per_msg\":%.3f,"
+           "\"bridge_cpu_us_per_msg\":%.3f}\n",
+           label, total.established, total.failed, total.closed,
+           bench.threads_count, bench.senders, bench.size, bench.rate,
+           bench.window, bench.mask ? "random" : "zero", duration,
+           total.sent, total.received,
+           total.sent ? total.received / (double)total.sent : 0,
+           total.received / duration, total.bytes / duration / 1e6,
+           _bench_quantile(total.latencies, total.received, 0.5),
+           _bench_quantile(total.latencies, total.received, 0.99),
+           _bench_quantile(total.latencies, total.received, 0.999),
+           total.latency_max / 1e3, self_cpu / received,
+           pid ? bridge_cpu / received : 0);
+    return 0;
+}
@@ -0,0 +1,510 @@
+/*
+ * Microbenchmarks of the codec kernels.
+ *
+ * Runs the frame header encoding, message encoding, frame parsing and
+ * unmasking, handshake, SHA-1, base64 and UTF-8 routines of the bridge over
+ * in-memory buffers, without any socket, and the coroutine switches. Each
+ * case is calibrated to run for a given time, then timed over several runs,
+ * whose median is kept.
+ *
+ * When perf_event_open(2) is allowed, the cycles, instructions, cache
+ * misses and branch misses of the user code are counted too. Results are
+ * written as one JSON line per case.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <b64/b64.h>
+#include <sha1/sha1.h>
+
+#include "config.h"
+#include "coro.h"
+#include "pmd.h"
+#include "utf8.h"
+#include "ws.h"
+
+
+// Timed runs of each case.
+#define MICRO_RUNS          7
+
+// Hardware counters read, the first one leading the group.
+#define MICRO_COUNTERS      4
+
+
+static const uint64_t COUNTERS[MICRO_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+
+static const char REQUEST[] =
+    "GET /chat HTTP/1.1\r\n"
+    "Host: server.example.com\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Origin: http://example.com\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate; "
+    "client_max_window_bits\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+
+typedef struct micro_case micro_case_t;
+
+struct micro_case {
+    const char* name;
+    // Bytes processed by an operation, 0 if not meaningful.
+    size_t size;
+    void (*setup)(micro_case_t*);
+    void (*run)(micro_case_t*, uint64_t iterations);
+
+    char* buf;
+    size_t buf_size;
+    char* out;
+    pmd_context_t pmd;
+    coro_t* coro;
+};
+
+
+static pmd_pool_t pmd_pool_g;
+static config_deflate_t deflate_g;
+
+
+/*
+ * Keep the compiler from removing the computation of `data`.
+ */
+static inline void _micro_use(const void* data) {
+    __asm__ volatile("" : : "r"(data) : "memory");
+}
+
+
+static uint64_t _micro_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000000000) + now.tv_nsec;
+}
+
+
+/*
+ * Fill `size` bytes of `buf` with printable text.
+ */
+static void _micro_fill_text(char* buf, size_t size) {
+    static const char TEXT[] = "{\"sym\": \"ABC\", \"price\": 123.45, "
+                               "\"qty\": 100, \"side\": \"buy\"} ";
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = TEXT[i % (sizeof(TEXT) - 1)];
+    }
+}
+
+
+static void _micro_setup_text(micro_case_t* c) {
+    c->buf_size = c->size;
+    c->buf = malloc(c->buf_size + 1);
+    _micro_fill_text(c->buf, c->buf_size);
+    c->buf[c->buf_size] = '\0';
+    c->out = malloc(c->size * 2 + 64);
+}
+
+
+/*
+ * A masked client frame of `size` payload bytes.
+ */
+static void _micro_setup_frame(micro_case_t* c) {
+    char head[WS_FRAME_HEAD_MAX];
+    size_t head_size = ws_encode_frame_head(head, true, 0,
+                                            WS_OP_BINARY_FRAME, c->size);
+    uint32_t mask = 0x5a17c3e1;
+
+    head[1] |= 0x80;
+    c->buf_size = head_size + sizeof(mask) + c->size;
+    c->buf = malloc(c->buf_size);
+    memcpy(c->buf, head, head_size);
+    memcpy(c->buf + head_size, &mask, sizeof(mask));
+    _micro_fill_text(c->buf + head_size + sizeof(mask), c->size);
+}
+
+
+static void _micro_setup_deflate(micro_case_t* c) {
+    pmd_params_t params = {
+        .enabled = true,
+        .server_no_context_takeover = deflate_g.server_no_context_takeover,
+        .server_max_window_bits = deflate_g.server_max_window_bits,
+        .client_max_window_bits = deflate_g.client_max_window_bits,
+    };
+    _micro_setup_text(c);
+    pmd_init(&c->pmd, &pmd_pool_g, &params);
+}
+
+
+static void _micro_frame_head(micro_case_t* c, uint64_t iterations) {
+    char head[WS_FRAME_HEAD_MAX];
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t size = ws_encode_frame_head(head, true, 0, WS_OP_TEXT_FRAME,
+                                           c->size);
+        _micro_use(head + size);
+    }
+}
+
+
+static void _micro_encode_message(micro_case_t* c, uint64_t iterations) {
+    pmd_context_t* pmd = c->pmd.pool ? &c->pmd : NULL;
+    char head[WS_FRAME_HEAD_MAX];
+    size_t head_size;
+    const char* payload;
+    size_t payload_size;
+    for (uint64_t i = 0; i < iterations; i++) {
+        ws_encode_message(pmd, WS_OP_TEXT_FRAME, c->buf, c->size, head,
+                          &head_size, &payload, &payload_size);
+        _micro_use(payload);
+    }
+}
+
+
+/*
+ * Parse the frame over and over: unmasking it in place twice restores it.
+ */
+static void _micro_parse_frame(micro_case_t* c, uint64_t iterations) {
+    ws_frame_t frame;
+    size_t frame_size;
+    for (uint64_t i = 0; i < iterations; i++) {
+        ws_parse_frame(c->buf, c->buf_size, SIZE_MAX, &frame, &frame_size);
+        _micro_use(frame.payload);
+    }
+}
+
+
+static void _micro_unmask(micro_case_t* c, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        ws_unmask(c->buf, c->size, 0x5a17c3e1);
+        _micro_use(c->buf);
+    }
+}
+
+
+static void _micro_accept_key(micro_case_t* c, uint64_t iterations) {
+    char key[64];
+    for (uint64_t i = 0; i < iterations; i++) {
+        ws_compute_accept_key("dGhlIHNhbXBsZSBub25jZQ==", key);
+        _micro_use(key);
+    }
+}
+
+
+static void _micro_handshake(micro_case_t* c, uint64_t iterations) {
+    char response[1024];
+    size_t response_size;
+    pmd_params_t params;
+    for (uint64_t i = 0; i < iterations; i++) {
+        ws_handshake_response(REQUEST, &deflate_g, &params, NULL, response,
+                              sizeof(response), &response_size);
+        _micro_use(response);
+    }
+}
+
+
+static void _micro_sha1(micro_case_t* c, uint64_t iterations) {
+    unsigned char digest[20];
+    SHA1_CTX sha;
+    for (uint64_t i = 0; i < iterations; i++) {
+        SHA1Init(&sha);
+        SHA1Update(&sha, (unsigned char*)c->buf, c->size);
+        SHA1Final(digest, &sha);
+        _micro_use(digest);
+    }
+}
+
+
+static void _micro_b64_encode(micro_case_t* c, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        b64_encode((unsigned char*)c->buf, c->size, c->out);
+        _micro_use(c->out);
+    }
+}
+
+
+static void _micro_setup_b64_decode(micro_case_t* c) {
+    _micro_setup_text(c);
+    b64_encode((unsigned char*)c->buf, c->size, c->out);
+}
+
+
+static void _micro_b64_decode(micro_case_t* c, uint64_t iterations) {
+    size_t size = strlen(c->out);
+    for (uint64_t i = 0; i < iterations; i++) {
+        unsigned char* decoded = b64_decode(c->out, size);
+        _micro_use(decoded);
+        free(decoded);
+    }
+}
+
+
+static void _micro_utf8(micro_case_t* c, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        bool valid = utf8_validate(c->buf, c->size);
+        _micro_use(&valid);
+    }
+}
+
+
+static void _micro_yield_forever(void* data) {
+    while (true) {
+        coro_yield();
+    }
+}
+
+
+static void _micro_setup_coro(micro_case_t* c) {
+    c->coro = coro_create(NULL, CORO_STACK_SIZE, &_micro_yield_forever, NULL,
+                          NULL);
+    if (!c->coro) {
+        exit(1);
+    }
+}
+
+
+static void _micro_coro_switch(micro_case_t* c, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        coro_resume(c->coro);
+    }
+}
+
+
+static void _micro_return(void* data) {
+}
+
+
+static void _micro_coro_create(micro_case_t* c, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        coro_t* coro = coro_create(NULL, CORO_STACK_SIZE, &_micro_return,
+                                   NULL, NULL);
+        coro_resume(coro);
+        coro_destroy(coro);
+    }
+}
+
+
+static micro_case_t cases_g[] = {
+    { "frame_head/16", 16, NULL, &_micro_frame_head },
+    { "frame_head/1024", 1024, NULL, &_micro_frame_head },
+    { "frame_head/65536", 65536, NULL, &_micro_frame_head },
+    { "encode_message/64", 64, &_micro_setup_text, &_micro_encode_message },
+    { "encode_message/deflate/4096", 4096, &_micro_setup_deflate,
+      &_micro_encode_message },
+    { "parse_frame/16", 16, &_micro_setup_frame, &_micro_parse_frame },
+    { "parse_frame/1024", 1024, &_micro_setup_frame, &_micro_parse_frame },
+    { "parse_frame/65536", 65536, &_micro_setup_frame, &_micro_parse_frame },
+    { "unmask/16", 16, &_micro_setup_text, &_micro_unmask },
+    { "unmask/1024", 1024, &_micro_setup_text, &_micro_unmask },
+    { "unmask/65536", 65536, &_micro_setup_text, &_micro_unmask },
+    { "accept_key", 0, NULL, &_micro_accept_key },
+    { "handshake_response", 0, NULL, &_micro_handshake },
+    { "sha1/60", 60, &_micro_setup_text, &_micro_sha1 },
+    { "sha1/4096", 4096, &_micro_setup_text, &_micro_sha1 },
+    { "b64_encode/20", 20, &_micro_setup_text, &_micro_b64_encode },
+    { "b64_encode/4096", 4096, &_micro_setup_text, &_micro_b64_encode },
+    { "b64_decode/20", 20, &_micro_setup_b64_decode, &_micro_b64_decode },
+    { "b64_decode/4096", 4096, &_micro_setup_b64_decode, &_micro_b64_decode },
+    { "utf8_validate/64", 64, &_micro_setup_text, &_micro_utf8 },
+    { "utf8_validate/65536", 65536, &_micro_setup_text, &_micro_utf8 },
+    { "coro_switch", 0, &_micro_setup_coro, &_micro_coro_switch },
+    { "coro_create", 0, NULL, &_micro_coro_create },
+};
+
+
+/*
+ * Open the hardware counters of the calling thread, in a group led by the
+ * cycles counter.
+ * Returns false if they are not available.
+ */
+static bool _micro_open_counters(int* fds) {
+    for (int i = 0; i < MICRO_COUNTERS; i++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(attr),
+            .config = COUNTERS[i],
+            .disabled = i == 0,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_GROUP,
+        };
+        fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+                         i == 0 ? -1 : fds[0], 0);
+        if (fds[i] < 0) {
+            for (int j = 0; j < i; j++) {
+                close(fds[j]);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Run `iterations` operations of `c`, counting them when `fds` is not NULL.
+ * Returns the time taken in nanoseconds.
+ */
+static uint64_t _micro_time(micro_case_t* c, uint64_t iterations,
+                            const int* fds, uint64_t* counts)
+{
+    struct {
+        uint64_t nr;
+        uint64_t values[MICRO_COUNTERS];
+    } group;
+
+    if (fds) {
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    uint64_t started = _micro_now_ns();
+    c->run(c, iterations);
+    uint64_t elapsed = _micro_now_ns() - started;
+    if (fds) {
+        ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if (read(fds[0], &group, sizeof(group)) == sizeof(group)) {
+            memcpy(counts, group.values, sizeof(group.values));
+        }
+    }
+    return elapsed;
+}
+
+
+static int _micro_compare(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static void _micro_bench(micro_case_t* c, uint64_t target_ns, const int* fds)
+{
+    double ns[MICRO_RUNS];
+    uint64_t counts[MICRO_RUNS][MICRO_COUNTERS] = {{ 0 }};
+    double median_counts[MICRO_COUNTERS] = { 0 };
+
+    if (c->setup) {
+        c->setup(c);
+    }
+
+    // Double the iterations until a run takes a tenth of the target.
+    uint64_t iterations = 1;
+    while (_micro_time(c, iterations, NULL, NULL) < target_ns / 10) {
+        iterations *= 2;
+    }
+    iterations *= 10;
+
+    for (int i = 0; i < MICRO_RUNS; i++) {
+        ns[i] = (double)_micro_time(c, iterations, fds, counts[i])
+              / iterations;
+    }
+    // The counters of the median run by time.
+    double sorted[MICRO_RUNS];
+    memcpy(sorted, ns, sizeof(ns));
+    qsort(sorted, MICRO_RUNS, sizeof(double), &_micro_compare);
+    double median = sorted[MICRO_RUNS / 2];
+    for (int i = 0; i < MICRO_RUNS; i++) {
+        if (ns[i] == median) {
+            for (int j = 0; j < MICRO_COUNTERS; j++) {
+                median_counts[j] = (double)counts[i][j] / iterations;
+            }
+            break;
+        }
+    }
+
+    printf("{\"name\":\"%s\",\"bytes\":%zu,\"iterations\":%" PRIu64 ","
+           "\"ns_per_op\":%.2f,\"ns_per_op_min\":%.2f,"
+           "\"bytes_per_ns\":%.3f",
+           c->name, c->size, iterations, median, sorted[0],
+           c->size ? c->size / median : 0);
+    if (fds) {
+        double cycles = median_counts[0];
+        printf(",\"cycles_per_op\":%.1f,\"bytes_per_cycle\":%.3f,"
+               "\"instructions_per_op\":%.1f,\"ipc\":%.2f,"
+               "\"cache_misses_per_op\":%.4f,"
+               "\"branch_misses_per_op\":%.4f",
+               cycles, c->size && cycles ? c->size / cycles : 0,
+               median_counts[1], cycles ? median_counts[1] / cycles : 0,
+               median_counts[2], median_counts[3]);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+
+static void _micro_usage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [options] [filter]\n"
+        "\n"
+        "Runs the cases whose name contains `filter`, or all of them.\n"
+        "\n"
+        "options:\n"
+        "  -t MS       time of each run (default 100)\n"
+        "  -l          list the cases\n",
+        program);
+}
+
+
+int main(int argc, char** argv) {
+    uint64_t target_ms = 100;
+    size_t cases = sizeof(cases_g) / sizeof(cases_g[0]);
+    int fds[MICRO_COUNTERS];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:l")) != -1) {
+        switch (opt) {
+          case 't': target_ms = strtoul(optarg, NULL, 10); break;
+          case 'l':
+            for (size_t i = 0; i < cases; i++) {
+                printf("%s\n", cases_g[i].name);
+            }
+            return 0;
+          default:
+            _micro_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind > 1 || target_ms == 0) {
+        _micro_usage(argv[0]);
+        return 1;
+    }
+    const char* filter = optind < argc ? argv[optind] : "";
+
+    bool counters = _micro_open_counters(fds);
+    if (!counters) {
+        fprintf(stderr, "hardware counters unavailable (%s), timing only\n",
+                strerror(errno));
+    }
+
+    deflate_g = (config_deflate_t){
+        .enabled = true,
+        .server_max_window_bits = 15,
+        .client_max_window_bits = 15,
+        .mem_level = 8,
+        .level = 6,
+        .threshold = 0,
+    };
+    pmd_pool_init(&pmd_pool_g, &deflate_g);
+
+    for (size_t i = 0; i < cases; i++) {
+        if (strstr(cases_g[i].name, filter)) {
+            _micro_bench(&cases_g[i], target_ms * 1000000,
+                         counters ? fds : NULL);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,802 @@
+/*
+ * Capture replay.
+ *
+ * Plays a capture recorded by `wsbridge --capture` back through a running
+ * bridge. Each captured connection is opened again as a WebSocket client,
+ * which sends the captured client messages, while a stand-in bridged
+ * server sends the captured server messages on the matching connection,
+ * encoded again with the codec of the capture. Records are played at their
+ * captured time, divided by the speed factor, or as fast as possible.
+ *
+ * Connections of the stand-in server are matched with the replayed clients
+ * in the order the bridge opens them, which is the order the clients
+ * sent their handshake. In broadcast mode, the first connection gets
+ * the messages of the shared one.
+ *
+ * Results are written on the standard output as a single JSON line.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "capture.h"
+#include "common.h"
+
+
+// Events handled by a single wait.
+#define REPLAY_EVENTS           256
+
+// Bytes read at once.
+#define REPLAY_RECV_SIZE        65536
+
+// Bytes of a frame kept between reads: a frame header, or a control frame.
+#define REPLAY_PENDING_SIZE     160
+
+
+static const char REQUEST[] = "GET / HTTP/1.1\r\n"
+                              "Host: replay\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n"
+                              "\r\n";
+
+
+/*
+ * Bytes waiting to be sent, from `start` to `end`.
+ */
+typedef struct out {
+    char* data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+} out_t;
+
+
+typedef enum conn_state {
+    CONN_NONE,
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_OPEN,
+    CONN_CLOSED,
+} conn_state_t;
+
+
+typedef struct conn conn_t;
+
+/*
+ * One of the two sockets of a connection, as watched by epoll.
+ */
+typedef struct side {
+    conn_t* conn;
+    bool server;
+    int fd;
+    uint32_t events;
+    out_t out;
+} side_t;
+
+
+struct conn {
+    conn_state_t state;
+    side_t ws;
+    side_t server;
+
+    common_response_t response;
+
+    char pending[REPLAY_PENDING_SIZE];
+    size_t pending_size;
+    uint64_t frame_left;
+
+    // Next connection waiting for its bridged server connection.
+    conn_t* next_waiting;
+};
+
+
+typedef struct replay {
+    struct sockaddr_in target;
+    const capture_header_t* header;
+    const capture_record_t** records;
+    size_t records_size;
+    conn_t* conns;
+    size_t conns_size;
+    double speed;
+    uint32_t only;
+    int epoll_fd;
+    int listen_fd;
+    char* buffer;
+    uint64_t random;
+
+    // Connections waiting for the bridge to connect the stand-in server.
+    conn_t* waiting_head;
+    conn_t* waiting_tail;
+
+    size_t opened;
+    size_t failed;
+    uint64_t client_messages;
+    uint64_t client_bytes;
+    uint64_t server_messages;
+    uint64_t server_bytes;
+    uint64_t ws_bytes;
+    uint64_t late_max;
+} replay_t;
+
+
+static uint64_t _replay_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000000000) + now.tv_nsec;
+}
+
+
+/*
+ * Returns `size` bytes of room at the end of `out`, or NULL on allocation
+ * failure.
+ */
+static char* _replay_out_reserve(out_t* out, size_t size) {
+    if (out->start == out->end) {
+        out->start = out->end = 0;
+    }
+    if (out->capacity - out->end >= size) {
+        return out->data + out->end;
+    }
+    if (out->start > 0) {
+        memmove(out->data, out->data + out->start, out->end - out->start);
+        out->end -= out->start;
+        out->start = 0;
+    }
+    if (out->capacity - out->end < size) {
+        size_t capacity = out->capacity ? out->capacity : 4096;
+        while (capacity - out->end < size) {
+            capacity *= 2;
+        }
+        char* data = realloc(out->data, capacity);
+        if (!data) {
+            return NULL;
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+    return out->data + out->end;
+}
+
+
+static void _replay_watch(replay_t* replay, side_t* side) {
+    uint32_t events = side->conn && side->conn->state == CONN_CONNECTING
+                      && !side->server ? EPOLLOUT : EPOLLIN;
+    if (side->out.start < side->out.end) {
+        events |= EPOLLOUT;
+    }
+    if (events != side->events) {
+        struct epoll_event event = {
+            .events = events,
+            .data.ptr = side,
+        };
+        epoll_ctl(replay->epoll_fd, EPOLL_CTL_MOD, side->fd, &event);
+        side->events = events;
+    }
+}
+
+
+static void _replay_close_side(replay_t* replay, side_t* side) {
+    if (side->fd >= 0) {
+        epoll_ctl(replay->epoll_fd, EPOLL_CTL_DEL, side->fd, NULL);
+        close(side->fd);
+        side->fd = -1;
+    }
+    side->out.start = side->out.end = 0;
+}
+
+
+/*
+ * Send what `side` holds, unless its connection is not ready for it.
+ */
+static void _replay_flush(replay_t* replay, side_t* side) {
+    if (side->fd < 0 || (!side->server && side->conn->state != CONN_OPEN)) {
+        return;
+    }
+    while (side->out.start < side->out.end) {
+        ssize_t len = send(side->fd, side->out.data + side->out.start,
+                           side->out.end - side->out.start,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                _replay_close_side(replay, side);
+                return;
+            }
+            break;
+        }
+        side->out.start += len;
+    }
+    _replay_watch(replay, side);
+}
+
+
+static uint32_t _replay_random(replay_t* replay) {
+    // xorshift64
+    replay->random ^= replay->random << 13;
+    replay->random ^= replay->random >> 7;
+    replay->random ^= replay->random << 17;
+    return (uint32_t)replay->random;
+}
+
+
+/*
+ * Write a masked client frame header for `size` payload bytes.
+ * Returns the header size.
+ */
+static size_t _replay_frame_header(char* out, uint8_t opcode, size_t size,
+                                   uint32_t mask)
+{
+    size_t offset = 2;
+    out[0] = 0x80 | opcode;
+    if (size < 126) {
+        out[1] = 0x80 | size;
+    } else if (size <= UINT16_MAX) {
+        out[1] = 0x80 | 126;
+        out[2] = size >> 8;
+        out[3] = size;
+        offset = 4;
+    } else {
+        out[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            out[2 + i] = (uint64_t)size >> (56 - i * 8);
+        }
+        offset = 10;
+    }
+    memcpy(out + offset, &mask, sizeof(mask));
+    return offset + sizeof(mask);
+}
+
+
+static bool _replay_send_client(replay_t* replay, conn_t* conn,
+                                uint8_t opcode, const char* payload,
+                                size_t size)
+{
+    char* frame = _replay_out_reserve(&conn->ws.out, 14 + size);
+    if (!frame) {
+        return false;
+    }
+    uint32_t mask = _replay_random(replay);
+    size_t header = _replay_frame_header(frame, opcode, size, mask);
+    for (size_t i = 0; i < size; i++) {
+        frame[header + i] = payload[i] ^ (char)(mask >> ((i % 4) * 8));
+    }
+    conn->ws.out.end += header + size;
+    _replay_flush(replay, &conn->ws);
+    return true;
+}
+
+
+/*
+ * Queue a server message, delimited following the capture codec.
+ */
+static bool _replay_send_server(replay_t* replay, conn_t* conn,
+                                const char* payload, size_t size)
+{
+    uint32_t codec = replay->header->codec;
+    size_t prefix = codec == CONFIG_CODEC_U16 ? 2
+                  : codec == CONFIG_CODEC_U32 ? 4 : 0;
+    size_t suffix = codec == CONFIG_CODEC_LINE ? 1 : 0;
+    char* out = _replay_out_reserve(&conn->server.out, prefix + size + suffix);
+    if (!out) {
+        return false;
+    }
+    for (size_t i = 0; i < prefix; i++) {
+        out[i] = (uint64_t)size >> ((prefix - 1 - i) * 8);
+    }
+    memcpy(out + prefix, payload, size);
+    if (suffix) {
+        out[prefix + size] = '\n';
+    }
+    conn->server.out.end += prefix + size + suffix;
+    _replay_flush(replay, &conn->server);
+    return true;
+}
+
+
+static void _replay_open(replay_t* replay, conn_t* conn) {
+    conn->ws.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+    if (conn->ws.fd < 0) {
+        replay->failed++;
+        return;
+    }
+    setsockopt(conn->ws.fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 },
+               sizeof(int));
+    if (connect(conn->ws.fd, (struct sockaddr*)&replay->target,
+                sizeof(replay->target)) < 0 && errno != EINPROGRESS)
+    {
+        close(conn->ws.fd);
+        conn->ws.fd = -1;
+        replay->failed++;
+        return;
+    }
+    struct epoll_event event = {
+        .events = EPOLLOUT,
+        .data.ptr = &conn->ws,
+    };
+    epoll_ctl(replay->epoll_fd, EPOLL_CTL_ADD, conn->ws.fd, &event);
+    conn->ws.events = EPOLLOUT;
+    conn->state = CONN_CONNECTING;
+    replay->opened++;
+}
+
+
+static void _replay_play(replay_t* replay, const capture_record_t* record) {
+    conn_t* conn = &replay->conns[record->connection];
+    const char* payload = (const char*)(record + 1);
+
+    switch (record->kind) {
+      case CAPTURE_OPEN:
+        _replay_open(replay, conn);
+        break;
+
+      case CAPTURE_CLOSE:
+        _replay_close_side(replay, &conn->ws);
+        conn->state = CONN_CLOSED;
+        break;
+
+      case CAPTURE_CLIENT:
+        if (conn->state != CONN_CLOSED && conn->ws.fd >= 0) {
+            _replay_send_client(replay, conn, record->opcode, payload,
+                                record->size);
+            replay->client_messages++;
+            replay->client_bytes += record->size;
+        }
+        break;
+
+      case CAPTURE_SERVER:
+        _replay_send_server(replay, conn, payload, record->size);
+        replay->server_messages++;
+        replay->server_bytes += record->size;
+        break;
+    }
+}
+
+
+/*
+ * Give the bridged server connection `fd` to the oldest connection waiting
+ * for one.
+ */
+static void _replay_accept(replay_t* replay) {
+    int fd;
+    while ((fd = accept4(replay->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        conn_t* conn = NULL;
+        if (replay->header->broadcast) {
+            if (replay->conns[CAPTURE_BROADCAST].server.fd < 0) {
+                conn = &replay->conns[CAPTURE_BROADCAST];
+            }
+        } else if (replay->waiting_head) {
+            conn = replay->waiting_head;
+            replay->waiting_head = conn->next_waiting;
+            if (!replay->waiting_head) {
+                replay->waiting_tail = NULL;
+            }
+        }
+        if (!conn) {
+            fprintf(stderr, "unexpected bridged server connection\n");
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+        conn->server.fd = fd;
+        conn->server.events = EPOLLIN;
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = &conn->server,
+        };
+        epoll_ctl(replay->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        _replay_flush(replay, &conn->server);
+    }
+}
+
+
+/*
+ * Read the handshake response of `conn`, leaving the frames which may
+ * follow it in the socket.
+ */
+static void _replay_read_response(replay_t* replay, conn_t* conn) {
+    common_status_t status =
+        common_read_response(conn->ws.fd, &conn->response);
+    if (status == COMMON_AGAIN) {
+        return;
+    }
+    if (status == COMMON_ERROR) {
+        _replay_close_side(replay, &conn->ws);
+        replay->failed++;
+        return;
+    }
+
+    conn->state = CONN_OPEN;
+    _replay_flush(replay, &conn->ws);
+}
+
+
+/*
+ * Parse the frames received by a client, answering its pings.
+ * Returns the bytes parsed.
+ */
+static size_t _replay_parse(replay_t* replay, conn_t* conn, const char* data,
+                            size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        if (conn->frame_left > 0) {
+            size_t take = size - offset;
+            take = take < conn->frame_left ? take : conn->frame_left;
+            conn->frame_left -= take;
+            offset += take;
+            continue;
+        }
+
+        const uint8_t* head = (const uint8_t*)data + offset;
+        size_t left = size - offset;
+        size_t header = 2;
+        if (left < header) {
+            break;
+        }
+        uint8_t opcode = head[0] & 0x0f;
+        uint64_t length = head[1] & 0x7f;
+        if (length == 126) {
+            header = 4;
+            if (left < header) {
+                break;
+            }
+            length = (uint64_t)head[2] << 8 | head[3];
+        } else if (length == 127) {
+            header = 10;
+            if (left < header) {
+                break;
+            }
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = length << 8 | head[2 + i];
+            }
+        }
+
+        if (opcode < 0x8) {
+            conn->frame_left = length;
+            offset += header;
+            continue;
+        }
+        if (left < header + length) {
+            break;
+        }
+        if (opcode == 0x9) {
+            _replay_send_client(replay, conn, 0xa,
+                                (const char*)head + header, length);
+        }
+        offset += header + length;
+    }
+    return offset;
+}
+
+
+static void _replay_read_ws(replay_t* replay, conn_t* conn) {
+    char* buffer = replay->buffer;
+    memcpy(buffer, conn->pending, conn->pending_size);
+    ssize_t len = recv(conn->ws.fd, buffer + conn->pending_size,
+                       REPLAY_RECV_SIZE - conn->pending_size, 0);
+    if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            _replay_close_side(replay, &conn->ws);
+        }
+        return;
+    }
+    replay->ws_bytes += len;
+    size_t size = conn->pending_size + len;
+    size_t parsed = _replay_parse(replay, conn, buffer, size);
+    if (size - parsed > REPLAY_PENDING_SIZE) {
+        _replay_close_side(replay, &conn->ws);
+        return;
+    }
+    conn->pending_size = size - parsed;
+    memcpy(conn->pending, buffer + parsed, conn->pending_size);
+}
+
+
+static void _replay_handle(replay_t* replay, side_t* side, uint32_t events) {
+    conn_t* conn = side->conn;
+
+    if (side->server) {
+        if (events & EPOLLOUT) {
+            _replay_flush(replay, side);
+        }
+        if (side->fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            // What the bridge relays from the clients is only drained.
+            ssize_t len = recv(side->fd, replay->buffer, REPLAY_RECV_SIZE, 0);
+            if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+                _replay_close_side(replay, side);
+            }
+        }
+        return;
+    }
+
+    switch (conn->state) {
+      case CONN_CONNECTING: {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        getsockopt(side->fd, SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error != 0
+            || send(side->fd, REQUEST, strlen(REQUEST), MSG_NOSIGNAL)
+               != strlen(REQUEST))
+        {
+            _replay_close_side(replay, side);
+            replay->failed++;
+            return;
+        }
+        conn->state = CONN_HANDSHAKE;
+        common_response_init(&conn->response);
+        // The bridge connects its server as it answers the handshake.
+        if (!replay->header->broadcast) {
+            if (replay->waiting_tail) {
+                replay->waiting_tail->next_waiting = conn;
+            } else {
+                replay->waiting_head = conn;
+            }
+            replay->waiting_tail = conn;
+        }
+        _replay_watch(replay, side);
+        break;
+      }
+
+      case CONN_HANDSHAKE:
+        _replay_read_response(replay, conn);
+        break;
+
+      default:
+        if (events & EPOLLOUT) {
+            _replay_flush(replay, side);
+        }
+        if (side->fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            _replay_read_ws(replay, conn);
+        }
+        break;
+    }
+}
+
+
+static int _replay_compare(const void* a, const void* b) {
+    const capture_record_t* x = *(const capture_record_t**)a;
+    const capture_record_t* y = *(const capture_record_t**)b;
+    if (x->time_ns != y->time_ns) {
+        return x->time_ns < y->time_ns ? -1 : 1;
+    }
+    // Records of the same time keep their order in the file.
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Map the capture at `path` and index its records by time.
+ */
+static bool _replay_load(replay_t* replay, const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0
+        || (size_t)st.st_size < sizeof(capture_header_t))
+    {
+        fprintf(stderr, "cannot read %s\n", path);
+        return false;
+    }
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "cannot map %s\n", path);
+        return false;
+    }
+    const capture_header_t* header = (const capture_header_t*)base;
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        return false;
+    }
+    replay->header = header;
+
+    size_t end = header->used < (uint64_t)st.st_size ? header->used
+                                                     : st.st_size;
+    size_t capacity = 0;
+    uint32_t max_connection = 0;
+    size_t offset = sizeof(capture_header_t);
+    while (offset + sizeof(capture_record_t) <= end) {
+        const capture_record_t* record = (const void*)(base + offset);
+        size_t size = (sizeof(capture_record_t) + record->size + 7)
+                    & ~(size_t)7;
+        // Records reserved but never written end the capture.
+        if (record->ready != CAPTURE_READY || offset + size > end) {
+            break;
+        }
+        offset += size;
+        if (replay->only && record->connection != replay->only
+            && record->connection != CAPTURE_BROADCAST)
+        {
+            continue;
+        }
+        if (replay->records_size == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            replay->records = realloc(replay->records,
+                                      capacity * sizeof(*replay->records));
+            if (!replay->records) {
+                fprintf(stderr, "cannot allocate the records\n");
+                return false;
+            }
+        }
+        replay->records[replay->records_size++] = record;
+        if (record->connection > max_connection) {
+            max_connection = record->connection;
+        }
+    }
+    qsort(replay->records, replay->records_size, sizeof(*replay->records),
+          &_replay_compare);
+
+    replay->conns_size = max_connection + 1;
+    replay->conns = calloc(replay->conns_size, sizeof(conn_t));
+    if (!replay->conns) {
+        fprintf(stderr, "cannot allocate the connections\n");
+        return false;
+    }
+    for (size_t i = 0; i < replay->conns_size; i++) {
+        conn_t* conn = &replay->conns[i];
+        conn->ws = (side_t){ .conn = conn, .fd = -1 };
+        conn->server = (side_t){ .conn = conn, .server = true, .fd = -1 };
+    }
+    return true;
+}
+
+
+static bool _replay_listen(replay_t* replay, int port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    replay->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK
+                                        | SOCK_CLOEXEC, 0);
+    setsockopt(replay->listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 },
+               sizeof(int));
+    if (bind(replay->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(replay->listen_fd, SOMAXCONN) < 0)
+    {
+        fprintf(stderr, "unable to listen on %d\n", port);
+        return false;
+    }
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    epoll_ctl(replay->epoll_fd, EPOLL_CTL_ADD, replay->listen_fd, &event);
+    return true;
+}
+
+
+static void _replay_wait(replay_t* replay, int timeout) {
+    struct epoll_event events[REPLAY_EVENTS];
+    int count = epoll_wait(replay->epoll_fd, events, REPLAY_EVENTS, timeout);
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.ptr == NULL) {
+            _replay_accept(replay);
+        } else {
+            _replay_handle(replay, events[i].data.ptr, events[i].events);
+        }
+    }
+}
+
+
+static void _replay_usage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [options] <capture> <host> <port>\n"
+        "\n"
+        "options:\n"
+        "  -b PORT     port of the stand-in bridged server (default 9001)\n"
+        "  -x SPEED    speed factor, 0 as fast as possible (default 1)\n"
+        "  -c ID       replay this captured connection only\n"
+        "  -w SECONDS  time waited after the last record (default 1)\n",
+        program);
+}
+
+
+int main(int argc, char** argv) {
+    replay_t replay = {
+        .speed = 1,
+        .random = 0x9e3779b97f4a7c15ull,
+    };
+    int server_port = 9001;
+    double wait = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:x:c:w:")) != -1) {
+        switch (opt) {
+          case 'b': server_port = atoi(optarg); break;
+          case 'x': replay.speed = strtod(optarg, NULL); break;
+          case 'c': replay.only = strtoul(optarg, NULL, 10); break;
+          case 'w': wait = strtod(optarg, NULL); break;
+          default:
+            _replay_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 3 || replay.speed < 0) {
+        _replay_usage(argv[0]);
+        return 1;
+    }
+
+    struct hostent* host = gethostbyname(argv[optind + 1]);
+    if (!host) {
+        fprintf(stderr, "unknown host %s\n", argv[optind + 1]);
+        return 1;
+    }
+    replay.target = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(atoi(argv[optind + 2])),
+        .sin_addr = *(struct in_addr*)host->h_addr,
+    };
+    replay.buffer = malloc(REPLAY_RECV_SIZE);
+    replay.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!replay.buffer || replay.epoll_fd < 0
+        || !_replay_load(&replay, argv[optind])
+        || !_replay_listen(&replay, server_port))
+    {
+        return 1;
+    }
+
+    uint64_t started = _replay_now_ns();
+    uint64_t end = 0;
+    size_t next = 0;
+    for (;;) {
+        uint64_t now = _replay_now_ns() - started;
+        while (next < replay.records_size) {
+            const capture_record_t* record = replay.records[next];
+            uint64_t due = replay.speed > 0
+                         ? (uint64_t)(record->time_ns / replay.speed) : 0;
+            if (due > now) {
+                break;
+            }
+            if (now - due > replay.late_max) {
+                replay.late_max = now - due;
+            }
+            _replay_play(&replay, record);
+            next++;
+        }
+
+        int timeout = 100;
+        if (next < replay.records_size) {
+            uint64_t due = replay.records[next]->time_ns / replay.speed;
+            timeout = (due - now + 999999) / 1000000;
+        } else if (end == 0) {
+            end = now + (uint64_t)(wait * 1e9);
+        } else if (now >= end) {
+            break;
+        }
+        _replay_wait(&replay, timeout < 100 ? timeout : 100);
+    }
+    double elapsed = (_replay_now_ns() - started) / 1e9 - wait;
+
+    printf("{\"records\":%zu,\"connections\":%zu,\"failed\":%zu,"
+           "\"client_messages\":%" PRIu64 ",\"client_bytes\":%" PRIu64 ","
+           "\"server_messages\":%" PRIu64 ",\"server_bytes\":%" PRIu64 ","
+           "\"ws_bytes_received\":%" PRIu64 ",\"duration_s\":%.3f,"
+           "\"speed\":%g,\"late_max_us\":%.1f}\n",
+           replay.records_size, replay.opened, replay.failed,
+           replay.client_messages, replay.client_bytes,
+           replay.server_messages, replay.server_bytes, replay.ws_bytes,
+           elapsed, replay.speed, replay.late_max / 1e3);
+    return 0;
+}
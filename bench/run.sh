@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Run the load scenarios on the loopback against each threading mode of the
+# bridge, and write one JSON line of results per run.
+#
+# Usage: bench/run.sh [duration in seconds]
+#
+# Ports 9300 (bridge) and 9301 (bridged server) must be free.
+
+DURATION=${1:-5}
+WORKERS=$(nproc)
+BRIDGE_PORT=9300
+SERVER_PORT=9301
+
+. "$(dirname "$0")/common.sh"
+
+# start <server mode> <bridge options...>
+start() {
+    stop
+    mode=$1
+    shift
+    start_server $BUILD/bench-load -b $SERVER_PORT -B $mode -s $size
+    start_bridge $BUILD/wsbridge --log-level=warning "$@" \
+        $BRIDGE_PORT 127.0.0.1 $SERVER_PORT
+}
+
+for threading in threads workers; do
+    if [ $threading = workers ]; then
+        options="--workers=$WORKERS"
+    else
+        options=
+    fi
+
+    for size in 64 4096; do
+        start echo $options
+        load "$threading/echo/$size/closed" -s $size -c 32 -w 8
+        load "$threading/echo/$size/rate" -s $size -c 32 -r 1000
+    done
+
+    size=64
+    start echo $options --broadcast
+    load "$threading/fanout/$size" -s $size -c 32 -S 1 -r 1000
+done
+
+# Many connections only run in workers.
+size=64
+start echo --workers=$WORKERS
+load "workers/echo/$size/many" -s $size -c 5000 -t 2 -S 500 -r 100
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Run the echo scenarios with the bridged server on a Unix sequenced packet
+# socket, then on shared memory rings, and write one JSON line of results
+# per run. Both keep the message boundaries, so every message is relayed as
+# a frame of its own. The shared memory server is bench-shm-echo.
+#
+# Usage: bench/shm.sh [duration in seconds]
+#
+# Port 9330 (bridge) must be free.
+
+DURATION=${1:-5}
+BRIDGE_PORT=9330
+SOCKET=@wsbridge-bench-$$
+
+. "$(dirname "$0")/common.sh"
+
+# start <transport>
+start() {
+    stop
+    case $1 in
+      unixpacket)
+        start_server $BUILD/bench-load -u unixpacket:$SOCKET
+        upstream=unixpacket:$SOCKET
+        ;;
+      shm)
+        start_server $BUILD/bench-shm-echo $SOCKET
+        upstream=shm:$SOCKET
+        ;;
+    esac
+    start_bridge $BUILD/wsbridge --log-level=warning --workers=1 \
+        $BRIDGE_PORT $upstream
+}
+
+for transport in unixpacket shm; do
+    start $transport
+    load "$transport/pingpong/64" -c 1 -w 1 -s 64
+    load "$transport/echo/64" -c 32 -w 8 -s 64
+    load "$transport/echo/16384" -c 4 -w 4 -s 16384
+done
@@ -0,0 +1,187 @@
+/*
+ * Shared memory echo server.
+ *
+ * A bridged server built on `lib/wsbshm.h`, sending every message of the
+ * bridge back on the same connection. All the connections run in a single
+ * epoll loop, which watches the eventfd and the socket of each. Run the
+ * bridge with `shm:PATH` as its bridged server, then load it with
+ * bench-load, as `bench/shm.sh` does.
+ *
+ * Usage: bench-shm-echo PATH
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "wsbshm.h"
+
+
+// Events handled by a single wait.
+#define ECHO_EVENTS     64
+
+
+struct echo_conn;
+
+
+// An epoll registration: the listener, when `conn` is NULL, or the eventfd
+// or the socket of a connection.
+typedef struct echo_watch {
+    struct echo_conn* conn;
+    bool hangup;
+} echo_watch_t;
+
+
+typedef struct echo_conn {
+    wsbshm_conn_t shm;
+    echo_watch_t wake;
+    echo_watch_t hangup;
+
+    // Last message received, which is pending while the bridge ring has no
+    // room for it.
+    char* buf;
+    size_t size;
+    bool pending;
+
+    // Closed connections are freed after the events of a wait, which may
+    // still refer to them.
+    bool closed;
+    struct echo_conn* next_closed;
+} echo_conn_t;
+
+
+/*
+ * Close the connection, which is freed by `echo_free`. The eventfds are
+ * shared with the bridge, so closing them wouldn't remove them from epoll.
+ */
+static void echo_close(int epoll_fd, echo_conn_t* conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->shm.wake_fd, NULL);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->shm.sock, NULL);
+    wsbshm_close(&conn->shm);
+    conn->closed = true;
+}
+
+
+static void echo_free(echo_conn_t* conn) {
+    free(conn->buf);
+    free(conn);
+}
+
+
+/*
+ * Send the pending message back, then echo the messages received until
+ * there are none, or until the bridge ring is full.
+ * Returns -1 if the connection failed.
+ */
+static int echo_run(echo_conn_t* conn) {
+    eventfd_t count;
+    eventfd_read(conn->shm.wake_fd, &count);
+
+    for (;;) {
+        if (conn->pending) {
+            if (wsbshm_send(&conn->shm, conn->buf, conn->size) < 0) {
+                return errno == EAGAIN ? 0 : -1;
+            }
+            conn->pending = false;
+        }
+        ssize_t len = wsbshm_recv(&conn->shm, conn->buf,
+                                  wsbshm_max_message(&conn->shm));
+        if (len < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        conn->size = len;
+        conn->pending = true;
+    }
+}
+
+
+static void echo_accept(int epoll_fd, int listener) {
+    echo_conn_t* conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        return;
+    }
+    if (wsbshm_accept(listener, &conn->shm) < 0) {
+        perror("accept");
+        free(conn);
+        return;
+    }
+    conn->buf = malloc(wsbshm_max_message(&conn->shm));
+    conn->wake = (echo_watch_t){ conn, false };
+    conn->hangup = (echo_watch_t){ conn, true };
+    struct epoll_event wake = { .events = EPOLLIN, .data.ptr = &conn->wake };
+    struct epoll_event hangup = {
+        .events = EPOLLIN,
+        .data.ptr = &conn->hangup,
+    };
+    if (!conn->buf
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->shm.wake_fd, &wake) < 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->shm.sock, &hangup) < 0)
+    {
+        perror("connection");
+        echo_close(epoll_fd, conn);
+        echo_free(conn);
+        return;
+    }
+    // The bridge may have written before the eventfd was watched.
+    if (echo_run(conn) < 0) {
+        echo_close(epoll_fd, conn);
+        echo_free(conn);
+    }
+}
+
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s PATH\n", argv[0]);
+        return 1;
+    }
+
+    int listener = wsbshm_listen(argv[1]);
+    if (listener < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    echo_watch_t listen_watch = { NULL, false };
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = &listen_watch,
+    };
+    if (epoll_fd < 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event) < 0)
+    {
+        perror("epoll");
+        return 1;
+    }
+
+    for (;;) {
+        struct epoll_event events[ECHO_EVENTS];
+        int count = epoll_wait(epoll_fd, events, ECHO_EVENTS, -1);
+        echo_conn_t* closed = NULL;
+        for (int i = 0; i < count; i++) {
+            echo_watch_t* watch = events[i].data.ptr;
+            echo_conn_t* conn = watch->conn;
+            if (!conn) {
+                echo_accept(epoll_fd, listener);
+                continue;
+            }
+            if (conn->closed) {
+                continue;
+            }
+            if (watch->hangup || echo_run(conn) < 0) {
+                echo_close(epoll_fd, conn);
+                conn->next_closed = closed;
+                closed = conn;
+            }
+        }
+        while (closed) {
+            echo_conn_t* next = closed->next_closed;
+            echo_free(closed);
+            closed = next;
+        }
+    }
+}
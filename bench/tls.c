@@ -0,0 +1,412 @@
+/*
+ * TLS benchmark.
+ *
+ * Measures a wsbridge instance accepting TLS connections, in one of two
+ * modes, each connection running in its own thread with blocking sockets:
+ *
+ *  - handshake: connections are opened and closed in a loop, each doing a
+ *    TLS handshake and a WebSocket upgrade, optionally resuming the TLS
+ *    session of the previous one;
+ *  - relay: long lived connections send binary messages to an echo
+ *    bridged server, keeping a window of messages in flight, and count the
+ *    bytes echoed.
+ *
+ * Comparing a bridge run with and without `--no-ktls` shows what kernel TLS
+ * saves. The CPU time of the bridge (`-p`) is reported per handshake or per
+ * megabyte relayed.
+ *
+ * Results are written on the standard output as a single JSON line.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "common.h"
+
+
+static const char REQUEST[] = "GET / HTTP/1.1\r\n"
+                              "Host: bench\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n"
+                              "\r\n";
+
+
+typedef struct bench {
+    struct sockaddr_in target;
+    SSL_CTX* ctx;
+    bool relay;
+    bool resume;
+    size_t size;
+    size_t window;
+    uint64_t deadline;
+    // Frame sent by every relay connection, unmasked by a zero key.
+    char* frame;
+    size_t frame_size;
+} bench_t;
+
+
+typedef struct bench_thread {
+    bench_t* bench;
+    pthread_t thread;
+    uint64_t handshakes;
+    uint64_t resumed;
+    uint64_t failed;
+    uint64_t bytes;
+} bench_thread_t;
+
+
+static uint64_t _bench_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000000000) + now.tv_nsec;
+}
+
+
+static bool _bench_write(SSL* ssl, const char* data, size_t size) {
+    while (size > 0) {
+        int len = SSL_write(ssl, data, size);
+        if (len <= 0) {
+            return false;
+        }
+        data += len;
+        size -= len;
+    }
+    return true;
+}
+
+
+/*
+ * Connect a TLS session, resuming `session` if not NULL, and upgrade it to
+ * a WebSocket.
+ * Returns the session, or NULL on failure.
+ */
+static SSL* _bench_connect(bench_t* bench, SSL_SESSION* session) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&bench->target,
+                          sizeof(bench->target)) < 0)
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+
+    SSL* ssl = SSL_new(bench->ctx);
+    if (!ssl) {
+        close(fd);
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+    if (session) {
+        SSL_set_session(ssl, session);
+    }
+    if (SSL_connect(ssl) != 1
+        || !_bench_write(ssl, REQUEST, strlen(REQUEST)))
+    {
+        goto error;
+    }
+
+    // The response ends the upgrade, and brings the TLS 1.3 tickets along.
+    static const char END[] = "\r\n\r\n";
+    size_t matched = 0;
+    while (matched < strlen(END)) {
+        char c;
+        if (SSL_read(ssl, &c, 1) != 1) {
+            goto error;
+        }
+        matched = c == END[matched] ? matched + 1 : c == END[0] ? 1 : 0;
+    }
+    return ssl;
+
+  error:
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+}
+
+
+static void _bench_disconnect(SSL* ssl) {
+    int fd = SSL_get_fd(ssl);
+    // A session freed without a close_notify can't be resumed.
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+}
+
+
+static void _bench_handshakes(bench_thread_t* thread) {
+    bench_t* bench = thread->bench;
+    SSL_SESSION* session = NULL;
+
+    while (_bench_now_ns() < bench->deadline) {
+        SSL* ssl = _bench_connect(bench, session);
+        if (!ssl) {
+            thread->failed++;
+            continue;
+        }
+        thread->handshakes++;
+        if (SSL_session_reused(ssl)) {
+            thread->resumed++;
+        }
+        if (bench->resume) {
+            SSL_SESSION_free(session);
+            session = SSL_get1_session(ssl);
+        }
+        _bench_disconnect(ssl);
+    }
+    SSL_SESSION_free(session);
+}
+
+
+/*
+ * Count the payload bytes of the frames in `data`, `left` holding the
+ * bytes of the current frame still to come and `head` the bytes of a frame
+ * header split between reads.
+ */
+static uint64_t _bench_payload(const unsigned char* data, size_t size,
+                               uint64_t* left, unsigned char* head,
+                               size_t* head_size)
+{
+    uint64_t payload = 0;
+    for (size_t i = 0; i < size;) {
+        if (*left > 0) {
+            size_t take = size - i < *left ? size - i : *left;
+            payload += take;
+            *left -= take;
+            i += take;
+            continue;
+        }
+        head[(*head_size)++] = data[i++];
+        size_t need = 2;
+        if (*head_size >= 2) {
+            unsigned length = head[1] & 0x7f;
+            need = length == 126 ? 4 : length == 127 ? 10 : 2;
+        }
+        if (*head_size < need) {
+            continue;
+        }
+        uint64_t length = head[1] & 0x7f;
+        if (need > 2) {
+            length = 0;
+            for (size_t j = 2; j < need; j++) {
+                length = length << 8 | head[j];
+            }
+        }
+        *left = length;
+        *head_size = 0;
+    }
+    return payload;
+}
+
+
+static void _bench_relay(bench_thread_t* thread) {
+    bench_t* bench = thread->bench;
+    SSL* ssl = _bench_connect(bench, NULL);
+    if (!ssl) {
+        thread->failed++;
+        return;
+    }
+    thread->handshakes++;
+
+    char* buffer = malloc(65536);
+    uint64_t in_flight = 0;
+    uint64_t left = 0;
+    unsigned char head[10];
+    size_t head_size = 0;
+    while (buffer && _bench_now_ns() < bench->deadline) {
+        while (in_flight < bench->window * bench->size) {
+            if (!_bench_write(ssl, bench->frame, bench->frame_size)) {
+                goto end;
+            }
+            in_flight += bench->size;
+        }
+        int len = SSL_read(ssl, buffer, 65536);
+        if (len <= 0) {
+            break;
+        }
+        uint64_t payload = _bench_payload((unsigned char*)buffer, len, &left,
+                                          head, &head_size);
+        thread->bytes += payload;
+        in_flight -= payload < in_flight ? payload : in_flight;
+    }
+
+  end:
+    free(buffer);
+    _bench_disconnect(ssl);
+}
+
+
+static void* _bench_thread(void* data) {
+    bench_thread_t* thread = data;
+    if (thread->bench->relay) {
+        _bench_relay(thread);
+    } else {
+        _bench_handshakes(thread);
+    }
+    return NULL;
+}
+
+
+static void _bench_usage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [options] <host> <port>\n"
+        "\n"
+        "options:\n"
+        "  -m MODE     handshake or relay (default relay)\n"
+        "  -c COUNT    connections running at once (default 1)\n"
+        "  -R          resume the TLS sessions when handshaking\n"
+        "  -s SIZE     message size when relaying (default 16384)\n"
+        "  -w COUNT    messages in flight per connection (default 4)\n"
+        "  -d SECONDS  measured duration (default 5)\n"
+        "  -p PID      pid of the bridge, whose CPU time is measured\n"
+        "  -l LABEL    label of the results\n",
+        program);
+}
+
+
+int main(int argc, char** argv) {
+    bench_t bench = {
+        .relay = true,
+        .size = 16384,
+        .window = 4,
+    };
+    size_t count = 1;
+    double duration = 5;
+    pid_t pid = 0;
+    const char* label = "";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:c:Rs:w:d:p:l:")) != -1) {
+        switch (opt) {
+          case 'm': bench.relay = strcmp(optarg, "handshake") != 0; break;
+          case 'c': count = strtoul(optarg, NULL, 10); break;
+          case 'R': bench.resume = true; break;
+          case 's': bench.size = strtoul(optarg, NULL, 10); break;
+          case 'w': bench.window = strtoul(optarg, NULL, 10); break;
+          case 'd': duration = strtod(optarg, NULL); break;
+          case 'p': pid = atoi(optarg); break;
+          case 'l': label = optarg; break;
+          default:
+            _bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || count == 0 || bench.size == 0
+        || bench.window == 0 || duration <= 0)
+    {
+        _bench_usage(argv[0]);
+        return 1;
+    }
+
+    struct hostent* host = gethostbyname(argv[optind]);
+    if (!host) {
+        fprintf(stderr, "unknown host %s\n", argv[optind]);
+        return 1;
+    }
+    bench.target = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(atoi(argv[optind + 1])),
+        .sin_addr = *(struct in_addr*)host->h_addr,
+    };
+
+    bench.ctx = SSL_CTX_new(TLS_client_method());
+    if (!bench.ctx) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    // The bench measures the bridge, not certificates.
+    SSL_CTX_set_verify(bench.ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(bench.ctx, SSL_SESS_CACHE_CLIENT);
+
+    // A zero masking key leaves the payload as is.
+    bench.frame = calloc(1, bench.size + 14);
+    if (!bench.frame) {
+        return 1;
+    }
+    bench.frame[0] = 0x82;
+    size_t offset = 2;
+    if (bench.size < 126) {
+        bench.frame[1] = 0x80 | bench.size;
+    } else if (bench.size <= UINT16_MAX) {
+        bench.frame[1] = 0x80 | 126;
+        bench.frame[2] = bench.size >> 8;
+        bench.frame[3] = bench.size;
+        offset = 4;
+    } else {
+        bench.frame[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            bench.frame[2 + i] = (uint64_t)bench.size >> (56 - i * 8);
+        }
+        offset = 10;
+    }
+    bench.frame_size = offset + 4 + bench.size;
+
+    bench_thread_t* threads = calloc(count, sizeof(bench_thread_t));
+    if (!threads) {
+        return 1;
+    }
+    uint64_t cpu_started = pid ? common_cpu_us(pid) : 0;
+    uint64_t started = _bench_now_ns();
+    bench.deadline = started + (uint64_t)(duration * 1e9);
+    for (size_t i = 0; i < count; i++) {
+        threads[i].bench = &bench;
+        if (pthread_create(&threads[i].thread, NULL, &_bench_thread,
+                           &threads[i]) != 0)
+        {
+            fprintf(stderr, "cannot start thread\n");
+            return 1;
+        }
+    }
+
+    bench_thread_t total = {0};
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(threads[i].thread, NULL);
+        total.handshakes += threads[i].handshakes;
+        total.resumed += threads[i].resumed;
+        total.failed += threads[i].failed;
+        total.bytes += threads[i].bytes;
+    }
+    double elapsed = (_bench_now_ns() - started) / 1e9;
+    double cpu_us = pid ? (double)(common_cpu_us(pid) - cpu_started) : 0;
+
+    if (bench.relay) {
+        double mb = total.bytes / 1e6;
+        printf("{\"label\":\"%s\",\"mode\":\"relay\",\"connections\":%zu,"
+               "\"failed\":%" PRIu64 ",\"size\":%zu,\"window\":%zu,"
+               "\"duration_s\":%.3f,\"mb_per_s\":%.2f,"
+               "\"bridge_cpu_us_per_mb\":%.1f}\n",
+               label, count, total.failed, bench.size, bench.window, elapsed,
+               mb / elapsed, mb > 0 ? cpu_us / mb : 0);
+    } else {
+        printf("{\"label\":\"%s\",\"mode\":\"handshake\",\"connections\":%zu,"
+               "\"failed\":%" PRIu64 ",\"resume\":%s,\"handshakes\":%" PRIu64
+               ",\"resumed\":%" PRIu64 ",\"duration_s\":%.3f,"
+               "\"handshakes_per_s\":%.1f,"
+               "\"bridge_cpu_us_per_handshake\":%.1f}\n",
+               label, count, total.failed, bench.resume ? "true" : "false",
+               total.handshakes, total.resumed, elapsed,
+               total.handshakes / elapsed,
+               total.handshakes ? cpu_us / total.handshakes : 0);
+    }
+    SSL_CTX_free(bench.ctx);
+    return 0;
+}
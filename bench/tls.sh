@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Run the TLS scenarios on the loopback, with kernel TLS and with the user
+# space relay, and write one JSON line of results per run.
+#
+# Usage: bench/tls.sh [duration in seconds]
+#
+# Ports 9310 (bridge) and 9311 (bridged server) must be free, and the
+# openssl command is used to make a self-signed certificate.
+
+DURATION=${1:-5}
+BRIDGE_PORT=9310
+SERVER_PORT=9311
+
+. "$(dirname "$0")/common.sh"
+
+dir=$(mktemp -d)
+
+cleanup() {
+    stop
+    rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null || exit 1
+
+# start <bridge options...>
+start() {
+    stop
+    start_server $BUILD/bench-load -b $SERVER_PORT -B echo
+    start_bridge $BUILD/wsbridge --log-level=warning \
+        --tls-cert="$dir/cert.pem" --tls-key="$dir/key.pem" "$@" \
+        $BRIDGE_PORT 127.0.0.1 $SERVER_PORT
+}
+
+# run <label> <bench-tls options...>
+run() {
+    label=$1
+    shift
+    $BUILD/bench-tls -d $DURATION -p $bridge_pid -l "$label" "$@" \
+        127.0.0.1 $BRIDGE_PORT
+}
+
+for offload in ktls user; do
+    if [ $offload = user ]; then
+        options=--no-ktls
+    else
+        options=
+    fi
+
+    start $options
+    run "$offload/handshake/full" -m handshake -c 4
+    run "$offload/handshake/resumed" -m handshake -c 4 -R
+    run "$offload/relay/16384" -m relay -c 4 -s 16384
+    run "$offload/relay/1024" -m relay -c 4 -s 1024 -w 16
+done
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Run the echo scenarios with the bridged server on loopback TCP, on a Unix
+# stream socket and on a Unix sequenced packet socket, and write one JSON
+# line of results per run. Stream servers use the u32 codec, so that every
+# message is relayed as a frame of its own, as packets are.
+#
+# Usage: bench/unix.sh [duration in seconds]
+#
+# Ports 9320 (bridge) and 9321 (bridged server) must be free.
+
+DURATION=${1:-5}
+BRIDGE_PORT=9320
+SERVER_PORT=9321
+SOCKET=@wsbridge-bench-$$
+
+. "$(dirname "$0")/common.sh"
+
+# start <transport>
+start() {
+    stop
+    case $1 in
+      tcp)
+        start_server $BUILD/bench-load -b $SERVER_PORT
+        upstream="127.0.0.1 $SERVER_PORT"
+        codec=--upstream-codec=u32
+        ;;
+      unix)
+        start_server $BUILD/bench-load -u unix:$SOCKET
+        upstream=unix:$SOCKET
+        codec=--upstream-codec=u32
+        ;;
+      unixpacket)
+        start_server $BUILD/bench-load -u unixpacket:$SOCKET
+        upstream=unixpacket:$SOCKET
+        codec=
+        ;;
+    esac
+    start_bridge $BUILD/wsbridge --log-level=warning --workers=1 $codec \
+        $BRIDGE_PORT $upstream
+}
+
+for transport in tcp unix unixpacket; do
+    start $transport
+    load "$transport/pingpong/64" -c 1 -w 1 -s 64
+    load "$transport/echo/64" -c 32 -w 8 -s 64
+    load "$transport/echo/16384" -c 4 -w 4 -s 16384
+done
@@ -0,0 +1,103 @@
+/*
+ * In-process echo server.
+ *
+ * Embeds the bridge with `libwsbridge.a`, and sends every message of the
+ * web socket clients back to them from a handler, without a bridged
+ * server. The bridge options apply, as `--workers` or `--tls-cert`.
+ *
+ * Usage: example-echo [OPTIONS] PORT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+#include "client.h"
+#include "config.h"
+#include "handler.h"
+#include "logger.h"
+#include "server.h"
+
+
+static config_t config_g;
+static server_t server_g;
+
+// Clients currently open, updated by the threads running them.
+static size_t open_clients_g = 0;
+
+
+static handler_status_t on_open(client_t* client, void* data) {
+    size_t* open_clients = data;
+    size_t count = __atomic_add_fetch(open_clients, 1, __ATOMIC_RELAXED);
+    LOG_INFO("echo: client %p opened, %zu open", client, count);
+    return HANDLER_SUCCESS;
+}
+
+
+static handler_status_t on_message(client_t* client, ws_opcode_t opcode,
+                                   const char* msg, size_t size, void* data)
+{
+    // A failed send closes the client by itself.
+    client_send(client, opcode, msg, size);
+    return HANDLER_SUCCESS;
+}
+
+
+static void on_close(client_t* client, ws_close_status_t status,
+                     void* data)
+{
+    size_t* open_clients = data;
+    size_t count = __atomic_sub_fetch(open_clients, 1, __ATOMIC_RELAXED);
+    LOG_INFO("echo: client %p closed (%d), %zu open", client, status,
+             count);
+}
+
+
+static const handler_t echo_handler_g = {
+    .on_open = &on_open,
+    .on_message = &on_message,
+    .on_close = &on_close,
+    .data = &open_clients_g,
+};
+
+
+static void sigint_handler(int signum) {
+    server_stop(&server_g);
+    exit(0);
+}
+
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [OPTIONS] PORT\n", argv[0]);
+        return 1;
+    }
+
+    // Options are parsed as the bridge ones, with a placeholder for the
+    // bridged server the handler replaces.
+    char* args[argc + 2];
+    for (int i = 0; i < argc; i++) {
+        args[i] = argv[i];
+    }
+    args[argc] = "unix:-";
+    args[argc + 1] = NULL;
+    config_init(&config_g);
+    if (config_parse(&config_g, argc + 1, args) != CONFIG_SUCCESS) {
+        config_usage(stderr, argv[0]);
+        return 1;
+    }
+    if (logger_start(&config_g.log) != LOGGER_SUCCESS) {
+        return 1;
+    }
+    atexit(&logger_stop);
+
+    if (server_start(&server_g, &config_g, &echo_handler_g)
+        != SERVER_SUCCESS)
+    {
+        return 1;
+    }
+    signal(SIGINT, &sigint_handler);
+    server_run(&server_g);
+    server_stop(&server_g);
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * In-process server asking a backend.
+ *
+ * Embeds the bridge with `libwsbridge.a`, and answers every message of the
+ * web socket clients with what a TCP backend answers to it, in straight
+ * line code: a client connects the backend when it opens, then sends it
+ * each message and waits for as many bytes back, on its coroutine. A
+ * worker runs the other clients while one waits. The bridge options
+ * apply, as `--workers`.
+ *
+ * Usage: example-rpc [OPTIONS] PORT HOST BACKEND_PORT
+ *
+ * where the backend answers each byte, as the echo server of bench-load.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "config.h"
+#include "coro.h"
+#include "handler.h"
+#include "logger.h"
+#include "net.h"
+#include "server.h"
+
+
+static config_t config_g;
+static server_t server_g;
+
+static socket_address_t backend_g;
+
+
+static handler_status_t on_open(client_t* client, void* data) {
+    socket_t sock = coro_connect(&backend_g);
+    if (sock == SOCKET_ERROR) {
+        LOG_ERROR("rpc: client %p cannot connect the backend", client);
+        return HANDLER_ERROR;
+    }
+    client->handler_data = (void*)(intptr_t)sock;
+    return HANDLER_SUCCESS;
+}
+
+
+static handler_status_t on_message(client_t* client, ws_opcode_t opcode,
+                                   const char* msg, size_t size, void* data)
+{
+    socket_t sock = (intptr_t)client->handler_data;
+    handler_status_t status = HANDLER_ERROR;
+    char* answer = malloc(size + 1);
+
+    if (!answer || coro_send(sock, msg, size) < 0) {
+        goto end;
+    }
+    for (size_t received = 0; received < size;) {
+        ssize_t count = coro_recv(sock, answer + received, size - received);
+        if (count <= 0) {
+            LOG_ERROR("rpc: client %p lost the backend", client);
+            goto end;
+        }
+        received += count;
+    }
+    // A failed send closes the client by itself.
+    client_send(client, opcode, answer, size);
+    status = HANDLER_SUCCESS;
+
+  end:
+    free(answer);
+    return status;
+}
+
+
+static void on_close(client_t* client, ws_close_status_t status,
+                     void* data)
+{
+    close((intptr_t)client->handler_data);
+}
+
+
+static const handler_t rpc_handler_g = {
+    .on_open = &on_open,
+    .on_message = &on_message,
+    .on_close = &on_close,
+    .data = NULL,
+    .stack_size = CORO_STACK_SIZE,
+};
+
+
+static void sigint_handler(int signum) {
+    server_stop(&server_g);
+    exit(0);
+}
+
+
+int main(int argc, char** argv) {
+    // The backend is parsed as the bridged server, which the handler
+    // replaces.
+    config_init(&config_g);
+    if (config_parse(&config_g, argc, argv) != CONFIG_SUCCESS
+        || !config_g.bridged_host)
+    {
+        fprintf(stderr, "usage: %s [OPTIONS] PORT HOST BACKEND_PORT\n",
+                argv[0]);
+        return 1;
+    }
+    if (logger_start(&config_g.log) != LOGGER_SUCCESS) {
+        return 1;
+    }
+    atexit(&logger_stop);
+    if (socket_resolve(config_g.bridged_host, config_g.bridged_port,
+                       &backend_g)
+        != NET_SUCCESS)
+    {
+        return 1;
+    }
+
+    if (server_start(&server_g, &config_g, &rpc_handler_g)
+        != SERVER_SUCCESS)
+    {
+        return 1;
+    }
+    signal(SIGINT, &sigint_handler);
+    server_run(&server_g);
+    server_stop(&server_g);
+
+    return 0;
+}
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "shmring.h"
+#include "wsbshm.h"
+
+
+int wsbshm_listen(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(addr.sun_path, path, len);
+    socklen_t addr_size = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+        addr_size--;
+    } else {
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (bind(sock, (struct sockaddr*)&addr, addr_size) < 0
+        || listen(sock, SOMAXCONN) < 0)
+    {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    return sock;
+}
+
+
+/*
+ * Close every descriptor carried by the control messages of `hdr`.
+ */
+static void _wsbshm_close_fds(struct msghdr* hdr) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+         cmsg = CMSG_NXTHDR(hdr, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+            close(fd);
+        }
+    }
+}
+
+
+/*
+ * Returns 0 if the peer of `sock` runs as our effective user or as root,
+ * or -1 with errno set.
+ */
+static int _wsbshm_check_peer(int sock) {
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0) {
+        return -1;
+    }
+    if (cred.uid != geteuid() && cred.uid != 0) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Receive the header and the descriptors sent by the bridge on `conn`
+ * socket: the mapping, then the eventfds of the server and of the bridge.
+ * The peer is not trusted: anything else is closed and rejected.
+ */
+static int _wsbshm_recv_fds(wsbshm_conn_t* conn, shmring_header_t* header,
+                            int* map_fd)
+{
+    int fds[3];
+    // Room for more descriptors than expected, to see and close them.
+    char control[CMSG_SPACE(sizeof(fds) * 2)];
+    struct iovec iov = { header, sizeof(*header) };
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t len = recvmsg(conn->sock, &hdr, MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        return -1;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))
+        || CMSG_NXTHDR(&hdr, cmsg) || (hdr.msg_flags & MSG_CTRUNC)
+        || len != sizeof(*header)
+        || header->magic != SHMRING_MAGIC
+        || header->version != SHMRING_VERSION
+        || !shmring_size_valid(header->size))
+    {
+        _wsbshm_close_fds(&hdr);
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *map_fd = fds[0];
+    conn->wake_fd = fds[1];
+    conn->peer_fd = fds[2];
+    return 0;
+}
+
+
+int wsbshm_accept(int listener, wsbshm_conn_t* conn) {
+    shmring_header_t header;
+    int map_fd = -1;
+    int error;
+
+    *conn = (wsbshm_conn_t){ .wake_fd = -1, .peer_fd = -1 };
+    conn->sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (conn->sock < 0) {
+        return -1;
+    }
+    // The bridge sends its rings right after connecting.
+    if (_wsbshm_check_peer(conn->sock) < 0
+        || _wsbshm_recv_fds(conn, &header, &map_fd) < 0)
+    {
+        goto error;
+    }
+
+    struct stat st;
+    size_t map_size = shmring_map_size(header.size);
+    if (fstat(map_fd, &st) < 0 || (size_t)st.st_size < map_size) {
+        errno = EPROTO;
+        goto error;
+    }
+    conn->base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      map_fd, 0);
+    if (conn->base == MAP_FAILED) {
+        conn->base = NULL;
+        goto error;
+    }
+    close(map_fd);
+    conn->size = header.size;
+    conn->in = shmring_get(conn->base, conn->size, SHMRING_BRIDGE);
+    conn->out = shmring_get(conn->base, conn->size, SHMRING_SERVER);
+    return 0;
+
+  error:
+    error = errno;
+    if (map_fd >= 0) {
+        close(map_fd);
+    }
+    wsbshm_close(conn);
+    errno = error;
+    return -1;
+}
+
+
+size_t wsbshm_max_message(const wsbshm_conn_t* conn) {
+    return shmring_max_message(conn->size);
+}
+
+
+ssize_t wsbshm_next(wsbshm_conn_t* conn) {
+    ssize_t len = shmring_next(conn->in, conn->size);
+    if (len == SHMRING_EMPTY) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len == SHMRING_INVALID) {
+        errno = EPROTO;
+        return -1;
+    }
+    return len;
+}
+
+
+ssize_t wsbshm_recv(wsbshm_conn_t* conn, void* buf, size_t size) {
+    ssize_t len = wsbshm_next(conn);
+    if (len < 0) {
+        return -1;
+    }
+    if ((size_t)len > size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    shmring_read(conn->in, conn->size, buf, len, conn->peer_fd);
+    return len;
+}
+
+
+int wsbshm_send(wsbshm_conn_t* conn, const void* buf, size_t size) {
+    struct iovec iov = { (void*)buf, size };
+    if (size > wsbshm_max_message(conn)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (!shmring_write(conn->out, conn->size, &iov, 1, size, conn->peer_fd))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+
+int wsbshm_wait(wsbshm_conn_t* conn, int timeout_ms) {
+    struct pollfd fds[2] = {
+        { .fd = conn->wake_fd, .events = POLLIN },
+        { .fd = conn->sock, .events = POLLIN },
+    };
+    if (poll(fds, 2, timeout_ms) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (fds[1].revents) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (fds[0].revents) {
+        eventfd_t count;
+        eventfd_read(conn->wake_fd, &count);
+    }
+    return 0;
+}
+
+
+void wsbshm_close(wsbshm_conn_t* conn) {
+    if (conn->base) {
+        munmap(conn->base, shmring_map_size(conn->size));
+    }
+    if (conn->wake_fd >= 0) {
+        close(conn->wake_fd);
+    }
+    if (conn->peer_fd >= 0) {
+        close(conn->peer_fd);
+    }
+    if (conn->sock >= 0) {
+        close(conn->sock);
+    }
+    *conn = (wsbshm_conn_t){ .sock = -1, .wake_fd = -1, .peer_fd = -1 };
+}
@@ -0,0 +1,121 @@
+/*
+ * Server side of the wsbridge shared memory connections.
+ *
+ * A server co-located with the bridge accepts its connections on a Unix
+ * packet socket, given to the bridge as `shm:PATH`, then exchanges
+ * messages with it through shared memory rings: see `src/shmring.h`.
+ *
+ *     int listener = wsbshm_listen("/run/echo.sock");
+ *     wsbshm_conn_t conn;
+ *     wsbshm_accept(listener, &conn);
+ *     char buf[4096];
+ *     for (;;) {
+ *         ssize_t len = wsbshm_recv(&conn, buf, sizeof(buf));
+ *         if (len >= 0) {
+ *             while (wsbshm_send(&conn, buf, len) < 0 && errno == EAGAIN) {
+ *                 wsbshm_wait(&conn, -1);
+ *             }
+ *         } else
+ *         if (errno != EAGAIN || wsbshm_wait(&conn, -1) < 0) {
+ *             break;
+ *         }
+ *     }
+ *     wsbshm_close(&conn);
+ *
+ * Event loops poll `wake_fd` for reading instead of calling `wsbshm_wait`,
+ * and `sock` to learn that the bridge closed the connection. Functions of
+ * a connection must be called by a single thread at a time.
+ */
+#ifndef _wsbshm_h_
+#define _wsbshm_h_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+typedef struct wsbshm_conn {
+    // Socket the connection was accepted on, readable once the bridge
+    // closed it.
+    int sock;
+
+    // eventfd written by the bridge when it wrote a message, or made room
+    // for one, after a call failed with EAGAIN.
+    int wake_fd;
+
+    // eventfd waking the bridge up.
+    int peer_fd;
+
+    // Mapping of the rings, their bytes of data, and the rings read and
+    // written by the server.
+    void* base;
+    size_t size;
+    void* in;
+    void* out;
+} wsbshm_conn_t;
+
+
+/*
+ * Listen for the bridge connections on the Unix packet socket `path`,
+ * in the abstract namespace if it starts with '@'. A previous socket file
+ * is replaced.
+ * Returns the listening socket, or -1 with errno set.
+ */
+int wsbshm_listen(const char* path);
+
+
+/*
+ * Accept a connection of the bridge on `listener` into `conn`, which
+ * blocks unless `listener` is non-blocking.
+ * Only bridges running as our effective user or as root are accepted.
+ * Returns 0, or -1 with errno set: EACCES if the peer runs as another
+ * user, EPROTO if it didn't send valid rings.
+ */
+int wsbshm_accept(int listener, wsbshm_conn_t* conn);
+
+
+/*
+ * Returns the largest message the rings of `conn` hold.
+ */
+size_t wsbshm_max_message(const wsbshm_conn_t* conn);
+
+
+/*
+ * Receive the next message of the bridge in the `size` bytes of `buf`.
+ * Returns its size, or -1 with errno set: EAGAIN if there is none yet,
+ * EMSGSIZE if it is larger than `size`, leaving it in the ring, and EPROTO
+ * if the ring is corrupted.
+ */
+ssize_t wsbshm_recv(wsbshm_conn_t* conn, void* buf, size_t size);
+
+
+/*
+ * Returns the size of the next message of the bridge, or -1 with errno set
+ * as `wsbshm_recv`.
+ */
+ssize_t wsbshm_next(wsbshm_conn_t* conn);
+
+
+/*
+ * Send the message of `size` bytes of `buf` to the bridge.
+ * Returns 0, or -1 with errno set: EAGAIN if the ring has no room for it
+ * yet, EMSGSIZE if it is larger than `wsbshm_max_message`.
+ */
+int wsbshm_send(wsbshm_conn_t* conn, const void* buf, size_t size);
+
+
+/*
+ * Wait up to `timeout_ms` milliseconds, or forever if negative, for the
+ * bridge to wake the connection up after a call failed with EAGAIN.
+ * Returns 0 when woken up or on timeout, or -1 with errno set: EPIPE if
+ * the bridge closed the connection.
+ */
+int wsbshm_wait(wsbshm_conn_t* conn, int timeout_ms);
+
+
+/*
+ * Close the connection, and unmap its rings.
+ */
+void wsbshm_close(wsbshm_conn_t* conn);
+
+
+#endif
@@ -0,0 +1,231 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+#include "logger.h"
+
+
+static const char ADMISSION_OVERLOADED_ANSWER[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char ADMISSION_LIMITED_ANSWER[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+
+static uint64_t _admission_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ull + now.tv_nsec / 1000000;
+}
+
+
+admission_status_t admission_init(admission_t* admission,
+                                  const config_admission_t* config,
+                                  size_t max_clients)
+{
+    *admission = (admission_t){
+        .config = config,
+        .max_clients = config->max_clients,
+        .buckets = NULL,
+        .overloaded = false,
+        .probed = 0,
+    };
+    if (max_clients > 0
+        && (admission->max_clients == 0
+            || admission->max_clients > max_clients))
+    {
+        admission->max_clients = max_clients;
+    }
+    if (config->rate > 0) {
+        admission->buckets = calloc(ADMISSION_BUCKETS,
+                                    sizeof(admission_bucket_t));
+        if (!admission->buckets) {
+            LOG_ERROR("cannot allocate the rate limit buckets");
+            return ADMISSION_ERROR;
+        }
+    }
+    return ADMISSION_SUCCESS;
+}
+
+
+void admission_destroy(admission_t* admission) {
+    free(admission->buckets);
+    admission->buckets = NULL;
+}
+
+
+/*
+ * Returns the first load signal over its limit, or NULL if there is none.
+ * The bridged server failures are not, when a client may probe it: then
+ * `probe` is set.
+ */
+static const char* _admission_signal(admission_t* admission,
+                                     const admission_load_t* load,
+                                     uint64_t now, bool* probe)
+{
+    const config_admission_t* config = admission->config;
+
+    *probe = false;
+    if (admission->max_clients > 0 && load->clients >= admission->max_clients)
+    {
+        return "clients";
+    }
+    if (config->max_queued > 0 && load->queued >= config->max_queued) {
+        return "queued bytes";
+    }
+    if (config->max_loop_lag > 0
+        && load->lag >= (uint64_t)config->max_loop_lag)
+    {
+        return "worker loop lag";
+    }
+    if (config->max_upstream_failures > 0
+        && load->upstream_failures >= config->max_upstream_failures)
+    {
+        if (now - admission->probed < ADMISSION_PROBE_INTERVAL) {
+            return "bridged server failures";
+        }
+        *probe = true;
+    }
+    return NULL;
+}
+
+
+/*
+ * Check `load` against the limits, logging when the bridge gets overloaded
+ * or recovers.
+ * Returns the signal over its limit, or NULL.
+ */
+static const char* _admission_update(admission_t* admission,
+                                     const admission_load_t* load,
+                                     uint64_t now, bool* probe)
+{
+    const char* signal = _admission_signal(admission, load, now, probe);
+
+    // A bridged server which just started failing is probed after a while.
+    if (*probe && !admission->overloaded) {
+        admission->probed = now;
+        *probe = false;
+        signal = "bridged server failures";
+    }
+    bool overloaded = signal || *probe;
+
+    if (overloaded && !admission->overloaded) {
+        LOG_WARNING("overloaded by the %s: %zu clients, %zu bytes queued, "
+                    "%" PRIu64 " ms of loop lag, %d bridged server "
+                    "failures", signal, load->clients, load->queued, load->lag,
+                    load->upstream_failures);
+    } else
+    if (!overloaded && admission->overloaded) {
+        LOG_INFO("load back under the limits, admitting clients");
+    }
+    admission->overloaded = overloaded;
+    return signal;
+}
+
+
+bool admission_paused(admission_t* admission, const admission_load_t* load) {
+    bool probe;
+    if (!admission->config->pause) {
+        return false;
+    }
+    return _admission_update(admission, load, _admission_now(), &probe)
+           != NULL;
+}
+
+
+/*
+ * Take a token of the bucket of `addr`, in network order.
+ * Returns false if it has none left.
+ */
+static bool _admission_take(admission_t* admission, uint32_t addr,
+                            uint64_t now)
+{
+    const config_admission_t* config = admission->config;
+    uint64_t full = (uint64_t)config->burst * 1000;
+    uint32_t hash = addr * 2654435761u;
+    size_t index = hash ^ (hash >> 16);
+    admission_bucket_t* bucket = NULL;
+    admission_bucket_t* oldest = NULL;
+
+    for (size_t i = 0; i < ADMISSION_PROBES; i++) {
+        admission_bucket_t* probed =
+            &admission->buckets[(index + i) & (ADMISSION_BUCKETS - 1)];
+        if (probed->addr == addr) {
+            bucket = probed;
+            break;
+        }
+        if (!oldest || probed->time < oldest->time) {
+            oldest = probed;
+        }
+    }
+    if (!bucket) {
+        bucket = oldest;
+        bucket->addr = addr;
+        bucket->tokens = full;
+        bucket->time = now;
+    }
+
+    // Tokens are added at `rate` thousandths per millisecond.
+    uint64_t tokens = bucket->tokens + (now - bucket->time) * config->rate;
+    if (tokens > full) {
+        tokens = full;
+    }
+    bucket->time = now;
+    if (tokens < 1000) {
+        bucket->tokens = tokens;
+        return false;
+    }
+    bucket->tokens = tokens - 1000;
+    return true;
+}
+
+
+admission_verdict_t admission_check(admission_t* admission,
+                                    const admission_load_t* load,
+                                    const struct sockaddr* addr)
+{
+    uint64_t now = _admission_now();
+    bool probe;
+
+    if (_admission_update(admission, load, now, &probe)) {
+        return ADMISSION_OVERLOADED;
+    }
+    // Unix socket clients have no address to limit.
+    if (admission->buckets && addr->sa_family == AF_INET) {
+        const struct sockaddr_in* addr_in = (const struct sockaddr_in*)addr;
+        if (!_admission_take(admission, addr_in->sin_addr.s_addr, now)) {
+            return ADMISSION_LIMITED;
+        }
+    }
+    if (probe) {
+        LOG_INFO("admitting a client to probe the bridged server");
+        admission->probed = now;
+    }
+    return ADMISSION_ADMIT;
+}
+
+
+void admission_reject(socket_t sock, admission_verdict_t verdict, bool tls) {
+    const char* answer = verdict == ADMISSION_LIMITED
+                       ? ADMISSION_LIMITED_ANSWER
+                       : ADMISSION_OVERLOADED_ANSWER;
+
+    // The answer fits in the empty send buffer of a new connection.
+    if (!tls) {
+        send(sock, answer, strlen(answer), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    // Unread handshake bytes would reset the connection, dropping the
+    // answer.
+    socket_gently_close(sock);
+}
@@ -0,0 +1,130 @@
+/*
+ * Admission control of the new clients, checked by the listening thread
+ * when it accepts them, before their handshake.
+ *
+ * The bridge is overloaded while one of its load signals is over its
+ * limit: the clients it runs, the bytes waiting in their output queues,
+ * the lag of the worker loops behind their timers, or the failures in a
+ * row to connect the bridged server. While overloaded, new clients are
+ * answered with a 503 and closed, which only costs an accept and a write,
+ * or are not accepted anymore, waiting in the listen backlog. While the
+ * bridged server fails, a client is still admitted every second to probe
+ * it.
+ *
+ * Each source address may also be limited to a rate of new clients by a
+ * token bucket, its clients beyond being answered with a 429. Buckets are
+ * kept in a fixed table, probed linearly from the address hash. An address
+ * without a bucket takes the least recently used of the probed ones over,
+ * which refilled the most, so that the table never grows. The table is
+ * only used by the listening thread, and needs no lock.
+ */
+#ifndef _admission_h_
+#define _admission_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "net.h"
+
+
+// Buckets of the rate limits, a power of two, and buckets probed for an
+// address.
+#define ADMISSION_BUCKETS   4096
+#define ADMISSION_PROBES    8
+
+// Milliseconds between two clients admitted to probe a failing bridged
+// server.
+#define ADMISSION_PROBE_INTERVAL    1000
+
+
+typedef enum admission_status {
+    ADMISSION_ERROR = -1,
+    ADMISSION_SUCCESS = 0,
+} admission_status_t;
+
+
+typedef enum admission_verdict {
+    ADMISSION_ADMIT,
+    // The bridge is overloaded, the client is answered with a 503.
+    ADMISSION_OVERLOADED,
+    // The source address opened too many clients, answered with a 429.
+    ADMISSION_LIMITED,
+} admission_verdict_t;
+
+
+/*
+ * Load signals of the bridge, gathered by the server.
+ */
+typedef struct admission_load {
+    size_t clients;
+    size_t queued;
+    // Largest lag of a worker loop, in milliseconds.
+    uint64_t lag;
+    int upstream_failures;
+} admission_load_t;
+
+
+typedef struct admission_bucket {
+    // IPv4 address in network order, 0 if the bucket was never used.
+    uint32_t addr;
+    // Thousandths of tokens left at `time`, in monotonic milliseconds.
+    uint32_t tokens;
+    uint64_t time;
+} admission_bucket_t;
+
+
+typedef struct admission {
+    const config_admission_t* config;
+    // Clients the server may run, the configured limit or its own.
+    size_t max_clients;
+
+    // Rate limit buckets, NULL without a rate limit.
+    admission_bucket_t* buckets;
+
+    // Whether the bridge was overloaded at the last check, to log the
+    // changes, and when a client last probed the bridged server.
+    bool overloaded;
+    uint64_t probed;
+} admission_t;
+
+
+/*
+ * Initialize the admission control of `config`, for a server running up
+ * to `max_clients` clients, or any number if 0.
+ * Returns `ADMISSION_ERROR` on allocation failure.
+ */
+admission_status_t admission_init(admission_t* admission,
+                                  const config_admission_t* config,
+                                  size_t max_clients);
+
+
+void admission_destroy(admission_t* admission);
+
+
+/*
+ * Returns whether the server should stop accepting clients under `load`.
+ * Always false unless the overload policy is to pause.
+ */
+bool admission_paused(admission_t* admission, const admission_load_t* load);
+
+
+/*
+ * Decide whether the client accepted from `addr` is admitted under `load`,
+ * taking a token of its address bucket if so.
+ */
+admission_verdict_t admission_check(admission_t* admission,
+                                    const admission_load_t* load,
+                                    const struct sockaddr* addr);
+
+
+/*
+ * Answer the client of `sock` which was not admitted, without blocking,
+ * then close it. TLS clients are closed without an answer.
+ */
+void admission_reject(socket_t sock, admission_verdict_t verdict, bool tls);
+
+
+#endif
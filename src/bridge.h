@@ -0,0 +1,49 @@
+/*
+ * State shared by all the clients of the bridge.
+ */
+#ifndef _bridge_h_
+#define _bridge_h_
+
+#include <stdbool.h>
+
+#include "config.h"
+#include "handler.h"
+#include "net.h"
+#include "pmd.h"
+#include "resume.h"
+
+
+struct broadcast;
+
+
+typedef struct bridge {
+    const config_t* config;
+
+    // Address of the bridged server, resolved once for all the clients.
+    socket_address_t server_addr;
+
+    // Whether the bridged server is reached through shared memory rings,
+    // `server_addr` being the socket they are set up on.
+    bool shm;
+
+    // Deflate streams borrowed by the connections.
+    pmd_pool_t pmd_pool;
+
+    // Shared upstream connection, NULL unless in broadcast mode.
+    struct broadcast* broadcast;
+
+    // In-process handler of the clients, or NULL to relay them to the
+    // bridged server.
+    const handler_t* handler;
+
+    // Sessions of the clients which may resume, NULL if resuming is
+    // disabled.
+    resume_t* resume;
+
+    // Bridged server connections which failed in a row, updated by all the
+    // threads.
+    int upstream_failures;
+} bridge_t;
+
+
+#endif
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "broadcast.h"
+#include "buffer.h"
+#include "capture.h"
+#include "codec.h"
+#include "frame.h"
+#include "logger.h"
+#include "metrics.h"
+#include "probe.h"
+#include "ws.h"
+
+
+// Bytes read from the bridged server at once.
+#define BROADCAST_RECV_SIZE     4096
+
+// Messages decoded at once.
+#define BROADCAST_RELAY_BATCH   64
+
+
+static uint64_t _broadcast_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+
+static void _broadcast_connect(broadcast_t* broadcast) {
+    uint64_t started = metrics_enabled_g ? _broadcast_now_us() : 0;
+    socket_t sock = socket_create_client(&broadcast->bridge->server_addr);
+    if (sock != SOCKET_ERROR && socket_set_no_delay(sock) != NET_SUCCESS) {
+        LOG_ERROR("broadcast: unable to disable Nagle");
+    }
+    if (sock != SOCKET_ERROR) {
+        metrics_add(METRICS_UPSTREAM_CONNECTS, 1);
+        if (started != 0) {
+            metrics_record(METRICS_UPSTREAM_CONNECT_TIME,
+                           _broadcast_now_us() - started);
+        }
+    } else {
+        metrics_add(METRICS_UPSTREAM_CONNECT_FAILURES, 1);
+    }
+
+    pthread_mutex_lock(&broadcast->lock);
+    broadcast->server_sock = sock;
+    pthread_mutex_unlock(&broadcast->lock);
+}
+
+
+static void _broadcast_disconnect(broadcast_t* broadcast) {
+    pthread_mutex_lock(&broadcast->lock);
+    if (broadcast->server_sock != SOCKET_ERROR) {
+        socket_close(broadcast->server_sock);
+        broadcast->server_sock = SOCKET_ERROR;
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+}
+
+
+/*
+ * Returns true if `client` can decode the frames of the shared compressor.
+ */
+static bool _broadcast_accepts_compressed(broadcast_t* broadcast,
+                                          client_t* client)
+{
+    return client->pmd.params.enabled
+        && client->pmd.params.server_no_context_takeover
+        && client->pmd.params.server_max_window_bits
+           >= broadcast->pmd.params.server_max_window_bits;
+}
+
+
+/*
+ * Queue the message `msg`, received at `received` (monotonic microseconds,
+ * or 0 if not measured), on every subscriber.
+ */
+static void _broadcast_dispatch(broadcast_t* broadcast, ws_opcode_t opcode,
+                                const char* msg, size_t size,
+                                uint64_t received)
+{
+    frame_t* plain = frame_new(0, opcode, msg, size);
+    frame_t* compressed = NULL;
+    if (!plain) {
+        LOG_ERROR("broadcast: cannot allocate frame");
+        return;
+    }
+    PROBE(server_message, 0, opcode, size, PROBE_NOW(server_message));
+
+    // Deflate outside of the lock, only if some subscriber wants it. One
+    // subscribing meanwhile gets the plain frame.
+    if (__atomic_load_n(&broadcast->compressed_count, __ATOMIC_RELAXED) > 0) {
+        const char* payload;
+        size_t payload_size;
+        if (pmd_compress(&broadcast->pmd, msg, size, &payload, &payload_size)
+            == PMD_SUCCESS)
+        {
+            compressed = frame_new(WS_RSV1, opcode, payload, payload_size);
+        }
+    }
+
+    pthread_mutex_lock(&broadcast->lock);
+    for (size_t i = 0; i < broadcast->subscribers_count; i++) {
+        client_t* client = broadcast->subscribers[i];
+        frame_t* frame = plain;
+
+        // Dropped, until its thread closes it.
+        if (__atomic_load_n(&client->dropped, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (compressed && _broadcast_accepts_compressed(broadcast, client)) {
+            frame = compressed;
+        }
+
+        // Set before the frame is queued, so that the client finds it.
+        if (received != 0) {
+            uint64_t none = 0;
+            __atomic_compare_exchange_n(&client->relay_started, &none,
+                                        received, false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED);
+        }
+        if (frame_queue_push(&client->out, frame) != FRAME_SUCCESS) {
+            LOG_WARNING("broadcast: client %p is too slow, dropping", client);
+            metrics_add(METRICS_SLOW_CLIENTS, 1);
+            PROBE(queue_full, (uintptr_t)client,
+                  frame_queue_bytes(&client->out), PROBE_NOW(queue_full));
+            // The client belongs to another thread, which closes it.
+            __atomic_store_n(&client->dropped, true, __ATOMIC_RELEASE);
+        } else {
+            metrics_add(METRICS_WS_FRAMES_OUT, 1);
+        }
+        client_wake(client);
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    frame_unref(plain);
+    if (compressed) {
+        frame_unref(compressed);
+    }
+}
+
+
+/*
+ * Dispatch the complete messages waiting in `in`, the last of them received
+ * at `received`.
+ * Returns false if the server sent an invalid message.
+ */
+static bool _broadcast_relay(broadcast_t* broadcast, buffer_t* in,
+                             uint64_t received)
+{
+    const config_t* config = broadcast->bridge->config;
+    bool stream = config->upstream_codec.type == CONFIG_CODEC_RAW
+               && broadcast->bridge->server_addr.type != SOCK_SEQPACKET;
+    codec_message_t messages[BROADCAST_RELAY_BATCH];
+    size_t count;
+    size_t consumed;
+
+    do {
+        if (codec_decode(&config->upstream_codec, buffer_content(in),
+                         buffer_size(in), config->max_message_size,
+                         messages, BROADCAST_RELAY_BATCH, &count, &consumed)
+            != CODEC_SUCCESS)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            size_t size;
+            ws_opcode_t opcode = ws_relay_opcode(config->upstream_opcode,
+                                                 messages[i].data,
+                                                 messages[i].size, stream,
+                                                 &size);
+            // Keep the beginning of a split character for the next read.
+            consumed -= messages[i].size - size;
+            if (size > 0 && capture_enabled_g) {
+                capture_write(CAPTURE_BROADCAST, CAPTURE_SERVER, opcode,
+                              messages[i].data, size);
+            }
+            if (size > 0) {
+                _broadcast_dispatch(broadcast, opcode, messages[i].data, size,
+                                    received);
+            }
+        }
+        buffer_consume(in, consumed);
+    } while (count == BROADCAST_RELAY_BATCH);
+
+    return true;
+}
+
+
+static void* _broadcast_thread(broadcast_t* broadcast) {
+    // Packets are read whole, one per read.
+    bool packets = broadcast->bridge->server_addr.type == SOCK_SEQPACKET;
+    size_t size = packets ? broadcast->bridge->config->recv_buffer_max
+                          : BROADCAST_RECV_SIZE;
+    buffer_t in;
+    ssize_t recv_len;
+
+    buffer_init(&in);
+    while (broadcast->alive) {
+        if (broadcast->server_sock == SOCKET_ERROR) {
+            sleep(1);
+            _broadcast_connect(broadcast);
+            continue;
+        }
+
+        if (!buffer_reserve(&in, size)) {
+            LOG_ERROR("broadcast: cannot allocate buffer");
+            sleep(1);
+            continue;
+        }
+
+        recv_len = recv(broadcast->server_sock, buffer_tail(&in),
+                        buffer_room(&in), packets ? MSG_TRUNC : 0);
+        if (recv_len <= 0) {
+            if (broadcast->alive) {
+                LOG_WARNING("broadcast: lost the bridged server, reconnecting");
+            }
+            _broadcast_disconnect(broadcast);
+            buffer_consume(&in, buffer_size(&in));
+            continue;
+        }
+        if (recv_len > buffer_room(&in)) {
+            LOG_ERROR("broadcast: server packet of %zd bytes exceeds %zu "
+                      "bytes, reconnecting", recv_len, buffer_room(&in));
+            _broadcast_disconnect(broadcast);
+            buffer_consume(&in, buffer_size(&in));
+            continue;
+        }
+        buffer_commit(&in, recv_len);
+        metrics_add(METRICS_UPSTREAM_BYTES_IN, recv_len);
+
+        uint64_t received = metrics_enabled_g ? _broadcast_now_us() : 0;
+        if (!_broadcast_relay(broadcast, &in, received)) {
+            LOG_ERROR("broadcast: invalid server message, reconnecting");
+            _broadcast_disconnect(broadcast);
+            buffer_consume(&in, buffer_size(&in));
+        }
+    }
+    buffer_free(&in);
+
+    return NULL;
+}
+
+
+broadcast_status_t broadcast_start(broadcast_t* broadcast, bridge_t* bridge) {
+    const config_deflate_t* deflate = &bridge->config->deflate;
+    pmd_params_t pmd_params = {
+        .enabled = true,
+        .server_no_context_takeover = true,
+        .client_no_context_takeover = true,
+        .server_max_window_bits = deflate->server_max_window_bits,
+        .client_max_window_bits = deflate->client_max_window_bits,
+    };
+
+    *broadcast = (broadcast_t){
+        .bridge = bridge,
+        .alive = true,
+        .server_sock = SOCKET_ERROR,
+    };
+    pthread_mutex_init(&broadcast->lock, NULL);
+    pmd_init(&broadcast->pmd, &bridge->pmd_pool, &pmd_params);
+
+    _broadcast_connect(broadcast);
+    if (broadcast->server_sock == SOCKET_ERROR) {
+        LOG_ERROR("broadcast: unable to connect the bridged server");
+        return BROADCAST_ERROR;
+    }
+
+    if (pthread_create(&broadcast->thread, NULL,
+                       (void* (*)(void*))&_broadcast_thread,
+                       broadcast) != 0)
+    {
+        LOG_ERROR("broadcast: unable to start thread");
+        _broadcast_disconnect(broadcast);
+        return BROADCAST_ERROR;
+    }
+
+    return BROADCAST_SUCCESS;
+}
+
+
+void broadcast_stop(broadcast_t* broadcast) {
+    broadcast->alive = false;
+
+    // Wake the thread up from its blocking recv.
+    pthread_mutex_lock(&broadcast->lock);
+    if (broadcast->server_sock != SOCKET_ERROR) {
+        shutdown(broadcast->server_sock, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    pthread_join(broadcast->thread, NULL);
+    _broadcast_disconnect(broadcast);
+    pmd_release(&broadcast->pmd);
+    free(broadcast->subscribers);
+    pthread_mutex_destroy(&broadcast->lock);
+}
+
+
+broadcast_status_t broadcast_subscribe(broadcast_t* broadcast,
+                                       client_t* client)
+{
+    broadcast_status_t status = BROADCAST_SUCCESS;
+
+    pthread_mutex_lock(&broadcast->lock);
+    if (broadcast->subscribers_count == broadcast->subscribers_capacity) {
+        size_t capacity = broadcast->subscribers_capacity
+                        ? broadcast->subscribers_capacity * 2
+                        : 16;
+        client_t** subscribers = realloc(broadcast->subscribers,
+                                         capacity * sizeof(client_t*));
+        if (!subscribers) {
+            status = BROADCAST_ERROR;
+            goto end;
+        }
+        broadcast->subscribers = subscribers;
+        broadcast->subscribers_capacity = capacity;
+    }
+    client->subscriber_index = broadcast->subscribers_count;
+    broadcast->subscribers[broadcast->subscribers_count++] = client;
+    if (_broadcast_accepts_compressed(broadcast, client)) {
+        __atomic_add_fetch(&broadcast->compressed_count, 1, __ATOMIC_RELAXED);
+    }
+
+  end:
+    pthread_mutex_unlock(&broadcast->lock);
+    return status;
+}
+
+
+void broadcast_unsubscribe(broadcast_t* broadcast, client_t* client) {
+    size_t index = client->subscriber_index;
+
+    pthread_mutex_lock(&broadcast->lock);
+    // The client may not have subscribed.
+    if (index < broadcast->subscribers_count
+        && broadcast->subscribers[index] == client)
+    {
+        client_t* last = broadcast->subscribers[--broadcast->subscribers_count];
+        broadcast->subscribers[index] = last;
+        last->subscriber_index = index;
+        if (_broadcast_accepts_compressed(broadcast, client)) {
+            __atomic_sub_fetch(&broadcast->compressed_count, 1,
+                               __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+}
+
+
+broadcast_status_t broadcast_send(broadcast_t* broadcast, const char* msg,
+                                  size_t size)
+{
+    broadcast_status_t status = BROADCAST_SUCCESS;
+
+    pthread_mutex_lock(&broadcast->lock);
+    if (broadcast->server_sock == SOCKET_ERROR
+        || codec_send(&broadcast->bridge->config->upstream_codec,
+                      broadcast->server_sock, msg, size, NULL)
+           != CODEC_SUCCESS)
+    {
+        status = BROADCAST_ERROR;
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    return status;
+}
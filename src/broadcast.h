@@ -0,0 +1,84 @@
+/*
+ * Broadcast mode: a single connection to the bridged server is shared by all
+ * the clients.
+ *
+ * Each message received from the server is framed once, and deflated once
+ * without context takeover, and the resulting frames are queued on every
+ * subscriber. Subscribers which negotiated permessage-deflate get the
+ * compressed frame, the others get the plain one.
+ */
+#ifndef _broadcast_h_
+#define _broadcast_h_
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "bridge.h"
+#include "client.h"
+#include "net.h"
+#include "pmd.h"
+
+
+typedef enum broadcast_status {
+    BROADCAST_ERROR = -1,
+    BROADCAST_SUCCESS = 0,
+} broadcast_status_t;
+
+
+typedef struct broadcast {
+    bridge_t* bridge;
+    bool alive;
+    pthread_t thread;
+
+    // Protects `server_sock` writes and the subscribers list.
+    pthread_mutex_t lock;
+    socket_t server_sock;
+    client_t** subscribers;
+    size_t subscribers_count;
+    size_t subscribers_capacity;
+
+    // Subscribers taking the compressed frames, written under `lock` and
+    // read without it.
+    size_t compressed_count;
+
+    // Compressor shared by all the subscribers, never keeping context, only
+    // used by the broadcast thread.
+    pmd_context_t pmd;
+} broadcast_t;
+
+
+/*
+ * Connect to the bridged server and start relaying its messages to the
+ * subscribers.
+ */
+broadcast_status_t broadcast_start(broadcast_t* broadcast, bridge_t* bridge);
+
+
+/*
+ * Stop the broadcast thread and close the server connection.
+ */
+void broadcast_stop(broadcast_t* broadcast);
+
+
+/*
+ * Start delivering server messages to `client`.
+ */
+broadcast_status_t broadcast_subscribe(broadcast_t* broadcast,
+                                       client_t* client);
+
+
+/*
+ * Stop delivering server messages to `client`. Once this returns, no more
+ * frames are queued on the client.
+ */
+void broadcast_unsubscribe(broadcast_t* broadcast, client_t* client);
+
+
+/*
+ * Send a client message to the bridged server.
+ */
+broadcast_status_t broadcast_send(broadcast_t* broadcast, const char* msg,
+                                  size_t size);
+
+
+#endif
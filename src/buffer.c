@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+
+// Free chunks kept by a thread, more are given back to malloc.
+#define BUFFER_POOL_MAX     256
+
+
+/*
+ * Free chunks of a thread, linked through their first bytes.
+ */
+typedef struct buffer_pool {
+    void* chunks;
+    size_t count;
+} buffer_pool_t;
+
+
+static pthread_key_t buffer_pool_key_g;
+static pthread_once_t buffer_pool_once_g = PTHREAD_ONCE_INIT;
+
+
+static void _buffer_pool_destroy(void* data) {
+    buffer_pool_t* pool = data;
+    while (pool->chunks) {
+        void* chunk = pool->chunks;
+        pool->chunks = *(void**)chunk;
+        free(chunk);
+    }
+    free(pool);
+}
+
+
+static void _buffer_pool_create_key(void) {
+    pthread_key_create(&buffer_pool_key_g, &_buffer_pool_destroy);
+}
+
+
+/*
+ * Returns the pool of the calling thread, or NULL if it cannot be created.
+ */
+static buffer_pool_t* _buffer_pool(void) {
+    pthread_once(&buffer_pool_once_g, &_buffer_pool_create_key);
+    buffer_pool_t* pool = pthread_getspecific(buffer_pool_key_g);
+    if (!pool) {
+        pool = calloc(1, sizeof(buffer_pool_t));
+        if (pool && pthread_setspecific(buffer_pool_key_g, pool) != 0) {
+            free(pool);
+            pool = NULL;
+        }
+    }
+    return pool;
+}
+
+
+static char* _buffer_pool_take(void) {
+    buffer_pool_t* pool = _buffer_pool();
+    if (!pool || !pool->chunks) {
+        return malloc(BUFFER_CHUNK_SIZE);
+    }
+    void* chunk = pool->chunks;
+    pool->chunks = *(void**)chunk;
+    pool->count--;
+    return chunk;
+}
+
+
+static void _buffer_pool_give(char* chunk) {
+    buffer_pool_t* pool = _buffer_pool();
+    if (!pool || pool->count == BUFFER_POOL_MAX) {
+        free(chunk);
+        return;
+    }
+    *(void**)chunk = pool->chunks;
+    pool->chunks = chunk;
+    pool->count++;
+}
+
+
+void buffer_init(buffer_t* buffer) {
+    *buffer = (buffer_t){
+        .data = NULL,
+        .start = 0,
+        .end = 0,
+        .capacity = 0,
+    };
+}
+
+
+void buffer_free(buffer_t* buffer) {
+    if (buffer->capacity == BUFFER_CHUNK_SIZE) {
+        _buffer_pool_give(buffer->data);
+    } else {
+        free(buffer->data);
+    }
+    buffer_init(buffer);
+}
+
+
+bool buffer_reserve(buffer_t* buffer, size_t size) {
+    if (buffer_room(buffer) >= size) {
+        return true;
+    }
+
+    // Reuse the consumed space first.
+    size_t content_size = buffer_size(buffer);
+    if (buffer->start > 0) {
+        memmove(buffer->data, buffer_content(buffer), content_size);
+        buffer->start = 0;
+        buffer->end = content_size;
+        if (buffer_room(buffer) >= size) {
+            return true;
+        }
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : BUFFER_CHUNK_SIZE;
+    while (capacity - content_size < size) {
+        capacity *= 2;
+    }
+    // Chunks are allocated by malloc, so they may grow with realloc.
+    char* data = capacity == BUFFER_CHUNK_SIZE
+               ? _buffer_pool_take()
+               : realloc(buffer->data, capacity);
+    if (!data) {
+        return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+
+void buffer_release(buffer_t* buffer) {
+    if (buffer_size(buffer) == 0 && buffer->data) {
+        buffer_free(buffer);
+    }
+}
+
+
+void buffer_commit(buffer_t* buffer, size_t size) {
+    buffer->end += size;
+}
+
+
+void buffer_consume(buffer_t* buffer, size_t size) {
+    buffer->start += size;
+    if (buffer->start == buffer->end) {
+        // Empty: restart from the beginning of the memory.
+        buffer->start = 0;
+        buffer->end = 0;
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * Growable byte buffers, filled at their end and consumed from their start.
+ *
+ * Buffers hold no memory while they are empty and released. Their first
+ * `BUFFER_CHUNK_SIZE` bytes come from a pool of chunks owned by the calling
+ * thread, so that connections only hold memory while data is in flight
+ * without calling malloc each time they receive some.
+ */
+#ifndef _buffer_h_
+#define _buffer_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Size of the pooled chunks, which are the smallest buffer memory.
+#define BUFFER_CHUNK_SIZE   4096
+
+
+typedef struct buffer {
+    char* data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+} buffer_t;
+
+
+/*
+ * Initialize an empty buffer. No memory is allocated until data is written.
+ */
+void buffer_init(buffer_t* buffer);
+
+
+/*
+ * Free the buffer memory, or give it back to the pool.
+ */
+void buffer_free(buffer_t* buffer);
+
+
+/*
+ * Make room for at least `size` bytes after the buffer content, moving the
+ * content at the beginning of the memory or growing it.
+ * Returns false on allocation failure.
+ */
+bool buffer_reserve(buffer_t* buffer, size_t size);
+
+
+/*
+ * Give back the memory of the buffer if it is empty.
+ */
+void buffer_release(buffer_t* buffer);
+
+
+/*
+ * Returns the bytes waiting in the buffer.
+ */
+static inline char* buffer_content(const buffer_t* buffer) {
+    return buffer->data + buffer->start;
+}
+
+
+/*
+ * Returns the number of bytes waiting in the buffer.
+ */
+static inline size_t buffer_size(const buffer_t* buffer) {
+    return buffer->end - buffer->start;
+}
+
+
+/*
+ * Returns where new bytes must be written, and how many may be.
+ */
+static inline char* buffer_tail(const buffer_t* buffer) {
+    return buffer->data + buffer->end;
+}
+
+static inline size_t buffer_room(const buffer_t* buffer) {
+    return buffer->capacity - buffer->end;
+}
+
+
+/*
+ * Account `size` bytes written at the buffer tail.
+ */
+void buffer_commit(buffer_t* buffer, size_t size);
+
+
+/*
+ * Drop `size` bytes from the beginning of the buffer content.
+ */
+void buffer_consume(buffer_t* buffer, size_t size);
+
+
+#endif
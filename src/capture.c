@@ -0,0 +1,155 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+#include "logger.h"
+
+
+typedef struct capture {
+    int fd;
+    capture_header_t* header;
+    char* base;
+    size_t size;
+    int sample;
+    uint64_t started;
+    uint32_t connections;
+    bool full;
+} capture_t;
+
+
+bool capture_enabled_g = false;
+static capture_t capture_g = { .fd = -1 };
+
+
+static uint64_t _capture_now_ns(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+capture_status_t capture_start(const config_t* config) {
+    const config_capture_t* capture = &config->capture;
+    size_t size = capture->size;
+
+    if (size < sizeof(capture_header_t) + sizeof(capture_record_t)) {
+        LOG_ERROR("capture: %zu bytes is too small", size);
+        return CAPTURE_ERROR;
+    }
+    int fd = open(capture->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0) {
+        LOG_ERROR("capture: cannot open %s", capture->path);
+        return CAPTURE_ERROR;
+    }
+    if (posix_fallocate(fd, 0, size) != 0) {
+        LOG_ERROR("capture: cannot allocate %zu bytes", size);
+        goto error;
+    }
+    // Faulting the pages in now keeps page faults out of the relay path.
+    char* base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("capture: cannot map %s", capture->path);
+        goto error;
+    }
+
+    capture_g = (capture_t){
+        .fd = fd,
+        .header = (capture_header_t*)base,
+        .base = base,
+        .size = size,
+        .sample = capture->sample,
+        .started = _capture_now_ns(CLOCK_MONOTONIC),
+    };
+    *capture_g.header = (capture_header_t){
+        .size = size,
+        .used = sizeof(capture_header_t),
+        .started_ns = _capture_now_ns(CLOCK_REALTIME),
+        .codec = config->upstream_codec.type,
+        .record_size = config->upstream_codec.record_size,
+        .broadcast = config->broadcast,
+    };
+    memcpy(capture_g.header->magic, CAPTURE_MAGIC,
+           sizeof(capture_g.header->magic));
+    capture_enabled_g = true;
+    LOG_INFO("capture: recording in %s", capture->path);
+    return CAPTURE_SUCCESS;
+
+  error:
+    close(fd);
+    return CAPTURE_ERROR;
+}
+
+
+void capture_stop(void) {
+    if (!capture_enabled_g) {
+        return;
+    }
+    capture_enabled_g = false;
+
+    // Other threads may still be writing their last records, so the file
+    // stays mapped until the process exits.
+    if (msync(capture_g.base, capture_g.size, MS_ASYNC) < 0) {
+        LOG_ERROR("capture: cannot flush the file");
+    }
+    if (capture_g.header->dropped > 0) {
+        LOG_WARNING("capture: %llu records dropped by a full file",
+                    (unsigned long long)capture_g.header->dropped);
+    }
+}
+
+
+uint32_t capture_open(void) {
+    if (!capture_enabled_g) {
+        return 0;
+    }
+    uint32_t index = __atomic_fetch_add(&capture_g.connections, 1,
+                                        __ATOMIC_RELAXED);
+    if (index % capture_g.sample != 0) {
+        return 0;
+    }
+    uint32_t connection = index / capture_g.sample + 1;
+    capture_write(connection, CAPTURE_OPEN, 0, NULL, 0);
+    return connection;
+}
+
+
+void capture_write(uint32_t connection, capture_kind_t kind, uint8_t opcode,
+                   const char* payload, size_t size)
+{
+    if (!capture_enabled_g || capture_g.full) {
+        return;
+    }
+    size_t record_size = (sizeof(capture_record_t) + size + 7) & ~(size_t)7;
+    uint64_t offset = record_size <= capture_g.size
+                    ? __atomic_fetch_add(&capture_g.header->used, record_size,
+                                         __ATOMIC_RELAXED)
+                    : capture_g.size;
+    if (offset + record_size > capture_g.size) {
+        __atomic_add_fetch(&capture_g.header->dropped, 1, __ATOMIC_RELAXED);
+        if (!capture_g.full) {
+            capture_g.full = true;
+            LOG_WARNING("capture: file full, capture stopped");
+        }
+        return;
+    }
+
+    capture_record_t* record = (capture_record_t*)(capture_g.base + offset);
+    *record = (capture_record_t){
+        .size = size,
+        .time_ns = _capture_now_ns(CLOCK_MONOTONIC) - capture_g.started,
+        .connection = connection,
+        .kind = kind,
+        .opcode = opcode,
+    };
+    if (size > 0) {
+        memcpy(record + 1, payload, size);
+    }
+    __atomic_store_n(&record->ready, CAPTURE_READY, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,118 @@
+/*
+ * Traffic capture.
+ *
+ * The messages relayed on the captured connections are appended to a
+ * memory-mapped file, in both directions, with their time and opcode, along
+ * with the opening and closing of the connections. Threads reserve their
+ * records with an atomic add and write them in place, without locks nor
+ * system calls. A record is marked ready once written, so that the records
+ * of a capture interrupted by a crash can still be read.
+ *
+ * The file is allocated at its full size. It starts with a
+ * `capture_header_t`, followed by the records, each a `capture_record_t`
+ * followed by its payload and aligned on 8 bytes.
+ * `bench/replay.c` plays a capture back through a bridge.
+ */
+#ifndef _capture_h_
+#define _capture_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+#define CAPTURE_MAGIC           "WSBCAP01"
+
+// Value of the `ready` field of written records.
+#define CAPTURE_READY           0x52454459
+
+// Connection of the records of the shared bridged server connection, in
+// broadcast mode.
+#define CAPTURE_BROADCAST       0
+
+
+typedef enum capture_status {
+    CAPTURE_ERROR = -1,
+    CAPTURE_SUCCESS = 0,
+} capture_status_t;
+
+
+typedef enum capture_kind {
+    // A client connected, or was closed.
+    CAPTURE_OPEN,
+    CAPTURE_CLOSE,
+    // A message relayed from the client to the bridged server.
+    CAPTURE_CLIENT,
+    // A message relayed from the bridged server to the client.
+    CAPTURE_SERVER,
+} capture_kind_t;
+
+
+typedef struct capture_header {
+    char magic[8];
+    // Bytes of the file, and of the header and records reserved so far.
+    // `used` may exceed `size` once the file is full.
+    uint64_t size;
+    uint64_t used;
+    // CLOCK_REALTIME of the start of the capture, in nanoseconds.
+    uint64_t started_ns;
+    // Records which did not fit in the file.
+    uint64_t dropped;
+    // Bridged server message delimitation, so that the replay can encode
+    // the server messages again.
+    uint32_t codec;
+    uint32_t record_size;
+    uint32_t broadcast;
+    uint32_t reserved;
+} capture_header_t;
+
+
+typedef struct capture_record {
+    uint32_t ready;
+    // Bytes of the payload following the record.
+    uint32_t size;
+    // Monotonic time since the start of the capture, in nanoseconds.
+    uint64_t time_ns;
+    uint32_t connection;
+    uint8_t kind;
+    uint8_t opcode;
+    uint16_t reserved;
+} capture_record_t;
+
+
+extern bool capture_enabled_g;
+
+
+/*
+ * Map the capture file following `config` and start capturing.
+ * Returns `CAPTURE_ERROR` on failure, `CAPTURE_SUCCESS` otherwise.
+ */
+capture_status_t capture_start(const config_t* config);
+
+
+/*
+ * Stop capturing and schedule the write of the capture file. The file keeps
+ * its full size, `used` telling where its records end.
+ */
+void capture_stop(void);
+
+
+/*
+ * Record the opening of a connection, if it is sampled.
+ * Returns the identifier of the captured connection, or 0 if it is not
+ * captured.
+ */
+uint32_t capture_open(void);
+
+
+/*
+ * Append a record of `kind` on `connection`, with the `size` bytes of
+ * `payload`.
+ */
+void capture_write(uint32_t connection, capture_kind_t kind, uint8_t opcode,
+                   const char* payload, size_t size);
+
+
+#endif
@@ -1,38 +1,120 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
+#include "broadcast.h"
+#include "capture.h"
 #include "client.h"
+#include "codec.h"
+#include "coro.h"
+#include "logger.h"
+#include "metrics.h"
+#include "probe.h"
+#include "utf8.h"
+#include "worker.h"
 #include "ws.h"
 
 
-void client_init(client_t* client, socket_t sock, const char* bridged_host,
-                 int bridged_port)
-{
+// Smallest read from the bridged server.
+#define CLIENT_RECV_MIN     4096
+
+// Consecutive reads using less than a quarter of their buffer before it is
+// halved.
+#define CLIENT_RECV_SHRINK_COUNT    8
+
+// Milliseconds waited for an event before checking the client is alive.
+#define CLIENT_POLL_TIMEOUT     1000
+
+// Largest client handshake request, so that it fits a pooled buffer with
+// its terminating NUL.
+#define CLIENT_HANDSHAKE_MAX    (BUFFER_CHUNK_SIZE - 1)
+
+// Messages relayed to the client by a single write.
+#define CLIENT_RELAY_BATCH  64
+
+// Stack of the client threads, which need much less than the default.
+#define CLIENT_STACK_SIZE   (256 * 1024)
+
+// Milliseconds between two attempts to take a claimed session over.
+#define CLIENT_RESUME_RETRY     10
+
+
+static void _client_on_deadline(wheel_timer_t* timer, void* data);
+static void _client_on_ping(wheel_timer_t* timer, void* data);
+static void _client_on_push(wheel_timer_t* timer, void* data);
+static void _client_on_resume(wheel_timer_t* timer, void* data);
+static void _client_on_callback_wake(void* data);
+
+
+// Whether a socket could not be busy polled yet, which is only logged once.
+static bool busy_poll_failed_g = false;
+
+
+void client_init(client_t* client, socket_t sock, bridge_t* bridge) {
     *client = (client_t){
         .server_sock = SOCKET_ERROR,
         .ws_sock = sock,
         .alive = false,
         .thread = 0,
-        .bridged_host = bridged_host,
-        .bridged_port = bridged_port
+        .worker = NULL,
+        .ws_watch = { .fd = SOCKET_ERROR },
+        .server_watch = { .fd = SOCKET_ERROR },
+        .wake_watch = { .fd = SOCKET_ERROR },
+        .shm_watch = { .fd = SOCKET_ERROR },
+        .bridge = bridge,
+        .state = CLIENT_HANDSHAKE,
+        .close_status = WS_CLOSE_NORMAL,
+        .close_sent = false,
+        .message_opcode = WS_OP_CONTINUATION_FRAME,
+        .recv_size = CLIENT_RECV_MIN,
+        .wake_fd = SOCKET_ERROR,
+        .session = NULL,
+        .ws_lost = false,
+        .coro = NULL,
+        .callback_pending = false,
     };
+    if (client->recv_size > bridge->config->recv_buffer_max) {
+        client->recv_size = bridge->config->recv_buffer_max;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &client->stats.started);
+    wheel_timer_init(&client->deadline, &_client_on_deadline, client);
+    wheel_timer_init(&client->ping_timer, &_client_on_ping, client);
+    wheel_timer_init(&client->push_timer, &_client_on_push, client);
+    wheel_timer_init(&client->resume_timer, &_client_on_resume, client);
+    buffer_init(&client->ws_in);
+    buffer_init(&client->ws_message);
+    buffer_init(&client->server_in);
+    buffer_init(&client->server_out);
+    shm_init(&client->shm);
+    frame_queue_init(&client->out, bridge->config->max_queue_size);
+    client->out.more = bridge->config->coalesce.latency_us > 0;
 }
 
 
 client_status_t client_start(client_t* client) {
-    if (pthread_create(&client->thread, NULL,
-                       (void* (*)(void*))&client_thread,
-                       client) < 0)
-    {
-        fprintf(stderr, "client %p: unable to start thread\n", client);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLIENT_STACK_SIZE);
+
+    // The thread may reach its main loop before pthread_create returns.
+    client->alive = true;
+    int ret = pthread_create(&client->thread, &attr,
+                             (void* (*)(void*))&client_thread, client);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        LOG_ERROR("client %p: unable to start thread", client);
         client_send_500(client);
         client_close(client);
         return CLIENT_ERROR;
     }
-    client->alive = true;
     return CLIENT_SUCCESS;
 }
 
@@ -51,143 +133,2018 @@ void client_send_500(client_t* client) {
 }
 
 
-static client_status_t _client_handle_ws(client_t* client) {
-    char* ws_msg = NULL;
-    size_t ws_msg_size = 0;
-    ws_opcode_t ws_opc = 0;
-
-    ws_status_t ws_recv_status = ws_read_message(client->ws_sock, &ws_opc,
-                                                 &ws_msg, &ws_msg_size);
-    if (ws_recv_status == WS_ERROR) {
-        fprintf(stderr, "client %p: cannot read client message\n", client);
-        goto error_end;
+/*
+ * Have the worker running the client update it after its events. A client
+ * thread updates its client after each wakeup anyway.
+ */
+static void _client_touch(client_t* client) {
+    if (client->worker) {
+        worker_touch(client->worker, client);
+    }
+}
+
+
+/*
+ * Returns the compression context of the client, or NULL if the extension
+ * was not negotiated.
+ */
+static pmd_context_t* _client_pmd(client_t* client) {
+    return client->pmd.params.enabled ? &client->pmd : NULL;
+}
+
+
+/*
+ * Queue the control `frame` before the data frames, dropping its reference.
+ */
+static client_status_t _client_queue_control(client_t* client,
+                                             frame_t* frame)
+{
+    if (!frame) {
+        LOG_ERROR("client %p: cannot allocate control frame", client);
+        return CLIENT_ERROR;
+    }
+    frame_status_t status = frame_queue_push_control(&client->out, frame);
+    frame_unref(frame);
+    if (status != FRAME_SUCCESS) {
+        LOG_ERROR("client %p: cannot queue control frame", client);
+        return CLIENT_ERROR;
+    }
+    metrics_add(METRICS_WS_FRAMES_OUT, 1);
+    return CLIENT_SUCCESS;
+}
+
+
+static client_status_t _client_send_control(client_t* client, ws_opcode_t op,
+                                            const char* payload, size_t size)
+{
+    return _client_queue_control(client, frame_new(0, op, payload, size));
+}
+
+
+/*
+ * Queue a close frame carrying the client close status.
+ */
+static client_status_t _client_send_close(client_t* client) {
+    client->close_sent = true;
+    return _client_queue_control(client,
+                                 frame_new_close(client->close_status));
+}
+
+
+/*
+ * Send the client message `msg` to the bridged server. What it can't take
+ * yet is kept in `server_out`, until the server socket is writable or the
+ * server made room in the shared memory ring.
+ */
+static client_status_t _client_send_server(client_t* client, const char* msg,
+                                           size_t size)
+{
+    const config_codec_t* codec = &client->bridge->config->upstream_codec;
+
+    if (client->bridge->shm) {
+        char head[CODEC_HEAD_MAX];
+        struct iovec iov[CODEC_IOV_MAX];
+        size_t count = codec_encode(codec, msg, size, head, iov);
+        if (count == 0
+            || shm_send(&client->shm, iov, count, &client->server_out)
+               != SHM_SUCCESS)
+        {
+            LOG_ERROR("client %p: cannot relay web socket message to "
+                      "server", client);
+            return CLIENT_ERROR;
+        }
+        return CLIENT_SUCCESS;
+    }
+
+    if (codec_send(codec, client->server_sock, msg, size,
+                   &client->server_out)
+        != CODEC_SUCCESS)
+    {
+        LOG_ERROR("client %p: cannot relay web socket message to "
+                  "server", client);
+        return CLIENT_ERROR;
+    }
+    if (buffer_size(&client->server_out) > 0
+        && loop_modify(client->loop, &client->server_watch,
+                       EPOLLIN | EPOLLOUT)
+           != LOOP_SUCCESS)
+    {
+        LOG_ERROR("client %p: unable to watch server socket", client);
+        return CLIENT_ERROR;
+    }
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Run the handler callbacks given to the client, on its coroutine. Ends
+ * with `on_close`.
+ */
+static void _client_run_callbacks(void* data) {
+    client_t* client = data;
+    const handler_t* handler = client->bridge->handler;
+
+    while (client->callback != CLIENT_CALLBACK_CLOSE) {
+        if (client->callback == CLIENT_CALLBACK_OPEN) {
+            client->callback_status = handler->on_open
+                                    ? handler->on_open(client, handler->data)
+                                    : HANDLER_SUCCESS;
+        } else {
+            client->callback_status = handler->on_message(
+                client, client->callback_opcode,
+                buffer_content(&client->server_out),
+                buffer_size(&client->server_out), handler->data
+            );
+        }
+        client->callback_pending = false;
+        coro_yield();
+    }
+    if (handler->on_close) {
+        handler->on_close(client, client->close_status, handler->data);
+    }
+    client->callback_status = HANDLER_SUCCESS;
+    client->callback_pending = false;
+}
+
+
+/*
+ * Take the result of the callback which returned.
+ * Returns `CLIENT_ERROR` if the handler failed, closing the client.
+ */
+static client_status_t _client_callback_done(client_t* client) {
+    if (client->callback == CLIENT_CALLBACK_MESSAGE) {
+        buffer_free(&client->server_out);
+    }
+    if (client->callback_status == HANDLER_SUCCESS) {
+        return CLIENT_SUCCESS;
+    }
+    if (client->callback == CLIENT_CALLBACK_OPEN) {
+        LOG_ERROR("client %p: rejected by the handler", client);
+        client->handler_open = false;
+    } else {
+        client->close_status = WS_CLOSE_INTERNAL_ERROR;
+    }
+    return CLIENT_ERROR;
+}
+
+
+/*
+ * Run `callback` on the client coroutine, creating it first, until it
+ * returns or waits.
+ * Returns `CLIENT_ERROR` if it failed, or if the coroutine cannot be
+ * created.
+ */
+static client_status_t _client_call(client_t* client,
+                                    client_callback_t callback)
+{
+    if (!client->coro) {
+        client->coro = coro_create(client->loop,
+                                   client->bridge->handler->stack_size,
+                                   &_client_run_callbacks,
+                                   &_client_on_callback_wake, client);
+        if (!client->coro) {
+            client->callback_status = HANDLER_ERROR;
+            return _client_callback_done(client);
+        }
+    }
+    client->callback = callback;
+    client->callback_pending = true;
+    coro_resume(client->coro);
+    return client->callback_pending
+         ? CLIENT_SUCCESS
+         : _client_callback_done(client);
+}
+
+
+/*
+ * Hand the client message `msg` to the in-process handler. On a coroutine,
+ * the message is kept until the callback returns, the next ones waiting
+ * for it.
+ */
+static client_status_t _client_handle_message(client_t* client,
+                                              ws_opcode_t opcode,
+                                              const char* msg, size_t size)
+{
+    const handler_t* handler = client->bridge->handler;
+
+    if (handler->stack_size == 0) {
+        if (handler->on_message(client, opcode, msg, size, handler->data)
+            != HANDLER_SUCCESS)
+        {
+            client->close_status = WS_CLOSE_INTERNAL_ERROR;
+            return CLIENT_ERROR;
+        }
+        return CLIENT_SUCCESS;
+    }
+    if (!buffer_reserve(&client->server_out, size)) {
+        LOG_ERROR("client %p: cannot allocate handler message", client);
+        client->close_status = WS_CLOSE_INTERNAL_ERROR;
+        return CLIENT_ERROR;
+    }
+    memcpy(buffer_tail(&client->server_out), msg, size);
+    buffer_commit(&client->server_out, size);
+    client->callback_opcode = opcode;
+    return _client_call(client, CLIENT_CALLBACK_MESSAGE);
+}
+
+
+/*
+ * Relay the client message `msg` to the bridged server, or hand it to the
+ * in-process handler. Text is validated unless `checked`.
+ */
+static client_status_t _client_relay_ws(client_t* client, ws_opcode_t opcode,
+                                        bool compressed, bool checked,
+                                        char* msg, size_t size)
+{
+    const config_t* config = client->bridge->config;
+    client_status_t status = CLIENT_SUCCESS;
+    char* inflated = NULL;
+
+    // Data following our close frame is discarded.
+    if (client->state == CLIENT_CLOSING) {
+        return CLIENT_SUCCESS;
+    }
+
+    if (compressed) {
+        if (pmd_decompress(&client->pmd, msg, size, config->max_message_size,
+                           &inflated, &size)
+            != PMD_SUCCESS)
+        {
+            LOG_ERROR("client %p: cannot inflate message", client);
+            client->close_status = WS_CLOSE_INVALID_DATA;
+            return CLIENT_ERROR;
+        }
+        msg = inflated;
+    }
+
+    LOG_PAYLOAD(msg, size, "client %p: WS (%x)", client, opcode);
+    if (client->capture_id) {
+        capture_write(client->capture_id, CAPTURE_CLIENT, opcode, msg, size);
+    }
+    PROBE(ws_message, (uintptr_t)client, opcode, size,
+          PROBE_NOW(ws_message));
+    client->stats.ws_messages++;
+    client->stats.ws_bytes += size;
+    client->last_activity = loop_now(client->loop);
+
+    if (opcode == WS_OP_TEXT_FRAME && !checked && !utf8_validate(msg, size))
+    {
+        LOG_ERROR("client %p: invalid UTF-8 text message", client);
+        client->close_status = WS_CLOSE_INVALID_DATA;
+        status = CLIENT_ERROR;
+    } else
+    if (client->bridge->handler) {
+        status = _client_handle_message(client, opcode, msg, size);
+    } else
+    if (client->bridge->broadcast) {
+        if (broadcast_send(client->bridge->broadcast, msg, size)
+            != BROADCAST_SUCCESS)
+        {
+            LOG_ERROR("client %p: cannot relay web socket message "
+                      "to broadcast server", client);
+        }
+    } else
+    if (_client_send_server(client, msg, size) != CLIENT_SUCCESS) {
+        status = CLIENT_ERROR;
+    }
+
+    free(inflated);
+    return status;
+}
+
+
+/*
+ * Handle the close frame of the client. Its status code is echoed in the
+ * answer, unless it is invalid.
+ */
+static void _client_handle_close(client_t* client, const ws_frame_t* frame) {
+    client->alive = false;
+
+    // Our own close frame was answered.
+    if (client->state == CLIENT_CLOSING) {
+        return;
+    }
+
+    client->close_status = WS_CLOSE_NORMAL;
+    if (frame->size == 1) {
+        client->close_status = WS_CLOSE_PROTOCOL_ERROR;
     } else
-    if (ws_recv_status == WS_NOTHING) {
-        goto end;
+    if (frame->size >= 2) {
+        unsigned status = (uint8_t)frame->payload[0] << 8
+                        | (uint8_t)frame->payload[1];
+        if (!ws_close_status_valid(status)) {
+            client->close_status = WS_CLOSE_PROTOCOL_ERROR;
+        } else
+        if (!utf8_validate(frame->payload + 2, frame->size - 2)) {
+            client->close_status = WS_CLOSE_INVALID_DATA;
+        } else {
+            client->close_status = status;
+        }
+    }
+}
+
+
+static client_status_t _client_handle_frame(client_t* client,
+                                            ws_frame_t* frame)
+{
+    const config_t* config = client->bridge->config;
+    buffer_t* message = &client->ws_message;
+
+    // RSV1 marks compressed messages, on their first frame only.
+    bool compressed = frame->rsv & WS_RSV1;
+    if ((frame->rsv & ~WS_RSV1)
+        || (compressed && (!_client_pmd(client)
+                           || frame->opcode == WS_OP_CONTINUATION_FRAME
+                           || frame->opcode >= WS_OP_CLOSE)))
+    {
+        LOG_ERROR("client %p: unexpected reserved bits %x", client, frame->rsv);
+        client->close_status = WS_CLOSE_PROTOCOL_ERROR;
+        return CLIENT_ERROR;
     }
 
-    printf("client %p: WS (%x) %s\n", client, ws_opc, ws_msg);
-    switch (ws_opc) {
+    switch (frame->opcode) {
       case WS_OP_CLOSE:
-        client->alive = false;
-        break;
+        _client_handle_close(client, frame);
+        return CLIENT_SUCCESS;
 
       case WS_OP_PING:
-        if (ws_send_message(client->ws_sock, WS_OP_PONG, NULL, 0)
-            != WS_SUCCESS)
-        {
-            fprintf(stderr, "client %p: cannot send pong\n", client);
-            goto error_free;
+        return _client_send_control(client, WS_OP_PONG, frame->payload,
+                                    frame->size);
+
+      case WS_OP_PONG:
+        client->pong_pending = false;
+        if (config->timeouts.ping_interval > 0) {
+            loop_arm(client->loop, &client->ping_timer,
+                     config->timeouts.ping_interval);
         }
-        break;
+        return CLIENT_SUCCESS;
 
       case WS_OP_TEXT_FRAME:
       case WS_OP_BINARY_FRAME:
-        if (send(client->server_sock, ws_msg, ws_msg_size, 0) != ws_msg_size)
-        {
-            fprintf(stderr, "client %p: cannot relay web socket message to "
-                            "server\n", client);
-            goto error_free;
+        if (client->message_opcode != WS_OP_CONTINUATION_FRAME) {
+            LOG_ERROR("client %p: message interrupting another", client);
+            client->close_status = WS_CLOSE_PROTOCOL_ERROR;
+            return CLIENT_ERROR;
+        }
+        if (frame->fin) {
+            return _client_relay_ws(client, frame->opcode, compressed, false,
+                                    frame->payload, frame->size);
+        }
+        client->message_opcode = frame->opcode;
+        client->message_compressed = compressed;
+        utf8_init(&client->message_utf8);
+        break;
+
+      case WS_OP_CONTINUATION_FRAME:
+        if (client->message_opcode == WS_OP_CONTINUATION_FRAME) {
+            LOG_ERROR("client %p: unexpected continuation frame", client);
+            client->close_status = WS_CLOSE_PROTOCOL_ERROR;
+            return CLIENT_ERROR;
         }
+        break;
 
       default:
-        break;
+        LOG_ERROR("client %p: unsupported opcode %x", client, frame->opcode);
+        client->close_status = WS_CLOSE_PROTOCOL_ERROR;
+        return CLIENT_ERROR;
     }
 
-  end:
-    if (ws_msg) {
-        free(ws_msg);
+    // Uncompressed text fails on its first invalid fragment, compressed
+    // text once inflated.
+    bool text = client->message_opcode == WS_OP_TEXT_FRAME
+             && !client->message_compressed;
+    if (text
+        && (!utf8_update(&client->message_utf8, frame->payload, frame->size)
+            || (frame->fin && !utf8_finish(&client->message_utf8))))
+    {
+        LOG_ERROR("client %p: invalid UTF-8 text message", client);
+        client->close_status = WS_CLOSE_INVALID_DATA;
+        return CLIENT_ERROR;
     }
-    return CLIENT_SUCCESS;
 
-  error_free:
-    if (ws_msg) {
-        free(ws_msg);
+    // Gather the fragments of the message.
+    if (buffer_size(message) + frame->size > config->max_message_size) {
+        LOG_ERROR("client %p: fragmented message too large", client);
+        client->close_status = WS_CLOSE_TOO_BIG;
+        return CLIENT_ERROR;
     }
-  error_end:
-    return CLIENT_ERROR;
+    if (!buffer_reserve(message, frame->size)) {
+        LOG_ERROR("client %p: cannot allocate message", client);
+        return CLIENT_ERROR;
+    }
+    memcpy(buffer_tail(message), frame->payload, frame->size);
+    buffer_commit(message, frame->size);
+    if (!frame->fin) {
+        return CLIENT_SUCCESS;
+    }
+
+    client_status_t status = _client_relay_ws(client, client->message_opcode,
+                                              client->message_compressed,
+                                              text, buffer_content(message),
+                                              buffer_size(message));
+    client->message_opcode = WS_OP_CONTINUATION_FRAME;
+    buffer_free(message);
+    return status;
+}
+
+
+/*
+ * Handle the complete frames received from the client, until a message
+ * waits for the bridged server or a handler callback to take it.
+ */
+static client_status_t _client_handle_frames(client_t* client) {
+    buffer_t* in = &client->ws_in;
+
+    while (client->alive && buffer_size(&client->server_out) == 0
+           && !client->callback_pending)
+    {
+        ws_frame_t frame;
+        size_t frame_size;
+        ws_status_t status = ws_parse_frame(
+            buffer_content(in), buffer_size(in),
+            client->bridge->config->max_message_size, &frame, &frame_size
+        );
+        if (status == WS_NOTHING) {
+            break;
+        } else
+        if (status != WS_SUCCESS) {
+            LOG_ERROR("client %p: invalid frame", client);
+            client->close_status = status == WS_TOO_LARGE
+                                 ? WS_CLOSE_TOO_BIG
+                                 : WS_CLOSE_PROTOCOL_ERROR;
+            return CLIENT_ERROR;
+        }
+
+        metrics_add(METRICS_WS_FRAMES_IN, 1);
+        if (_client_handle_frame(client, &frame) != CLIENT_SUCCESS) {
+            return CLIENT_ERROR;
+        }
+        buffer_consume(in, frame_size);
+    }
+
+    // Hold no memory between frames.
+    buffer_release(in);
+
+    return CLIENT_SUCCESS;
 }
 
 
-static client_status_t _client_handle_server(client_t* client) {
-    char buf[4096];
-    int recv_len;
+/*
+ * Read what the client sent, and handle the complete frames.
+ */
+static client_status_t _client_handle_ws(client_t* client) {
+    buffer_t* in = &client->ws_in;
 
-    recv_len = recv(client->server_sock, buf, sizeof(buf) - 1, 0);
+    if (!buffer_reserve(in, CLIENT_RECV_MIN)) {
+        LOG_ERROR("client %p: cannot allocate client buffer", client);
+        return CLIENT_ERROR;
+    }
+    ssize_t recv_len = recv(client->ws_sock, buffer_tail(in), buffer_room(in),
+                            0);
     if (recv_len < 0) {
-        return CLIENT_SUCCESS;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return CLIENT_SUCCESS;
+        }
+        LOG_ERROR("client %p: cannot read client message", client);
+        client->ws_lost = true;
+        return CLIENT_ERROR;
     } else
     if (recv_len == 0) {
-        fprintf(stderr, "client %p: invalid server message\n", client);
+        LOG_INFO("client %p: connection closed by the client", client);
+        client->ws_lost = true;
         return CLIENT_ERROR;
     }
-    buf[recv_len] = '\0';
-    printf("client %p: SERVER %d %s\n", client, recv_len, buf);
+    buffer_commit(in, recv_len);
+    metrics_add(METRICS_WS_BYTES_IN, recv_len);
 
-    if (ws_send_message(client->ws_sock, WS_OP_TEXT_FRAME, buf, recv_len + 1)
-        != WS_SUCCESS)
-    {
-        fprintf(stderr, "cannot relay server message to web socket\n");
-        return CLIENT_ERROR;
+    return _client_handle_frames(client);
+}
+
+
+/*
+ * Write the `frames` encoded in `iov` to the client, or queue them behind
+ * the frames it didn't read yet. A client too slow to keep up is dropped.
+ */
+static client_status_t _client_write(client_t* client,
+                                     const struct iovec* iov,
+                                     size_t count, size_t frames)
+{
+    client_status_t status = CLIENT_SUCCESS;
+    size_t written = client->out.bytes_written;
+
+    frame_status_t frame_status = frame_queue_write(&client->out,
+                                                    client->ws_sock,
+                                                    iov, count);
+    if (frame_status == FRAME_FULL) {
+        LOG_WARNING("client %p: too slow, dropping", client);
+        metrics_add(METRICS_SLOW_CLIENTS, 1);
+        PROBE(queue_full, (uintptr_t)client, frame_queue_bytes(&client->out),
+              PROBE_NOW(queue_full));
+        client->close_status = WS_CLOSE_POLICY;
+        status = CLIENT_ERROR;
+    } else
+    if (frame_status != FRAME_SUCCESS) {
+        LOG_ERROR("cannot relay server message to web socket");
+        client->ws_lost = true;
+        status = CLIENT_ERROR;
     }
+    metrics_add(METRICS_WS_FRAMES_OUT, frames);
+    if (PROBE_ENABLED(frame_sent)) {
+        PROBE(frame_sent, (uintptr_t)client, frames,
+              client->out.bytes_written - written,
+              frame_queue_bytes(&client->out), probe_now_ns());
+    }
+    return status;
+}
+
+
+/*
+ * Relay the complete messages waiting in the server input buffer. Messages
+ * decoded together are written with a single call.
+ */
+static client_status_t _client_relay_server(client_t* client) {
+    const config_t* config = client->bridge->config;
+    buffer_t* in = &client->server_in;
+    bool stream = config->upstream_codec.type == CONFIG_CODEC_RAW
+               && client->bridge->server_addr.type != SOCK_SEQPACKET;
+
+    codec_message_t messages[CLIENT_RELAY_BATCH];
+    size_t count;
+    size_t consumed;
+    do {
+        if (codec_decode(&config->upstream_codec, buffer_content(in),
+                         buffer_size(in), config->max_message_size,
+                         messages, CLIENT_RELAY_BATCH, &count, &consumed)
+            != CODEC_SUCCESS)
+        {
+            LOG_ERROR("client %p: invalid server message", client);
+            client->close_status = WS_CLOSE_INTERNAL_ERROR;
+            return CLIENT_ERROR;
+        }
+
+        char heads[CLIENT_RELAY_BATCH][WS_FRAME_HEAD_MAX];
+        frame_t* compressed[CLIENT_RELAY_BATCH];
+        size_t compressed_count = 0;
+        struct iovec iov[CLIENT_RELAY_BATCH * 2];
+        size_t iov_count = 0;
+        size_t frames = 0;
+        client_status_t status = CLIENT_SUCCESS;
+
+        for (size_t i = 0; i < count; i++) {
+            size_t size;
+            ws_opcode_t opcode = ws_relay_opcode(config->upstream_opcode,
+                                                 messages[i].data,
+                                                 messages[i].size, stream,
+                                                 &size);
+            // Leave the beginning of a split character in the buffer.
+            consumed -= messages[i].size - size;
+            if (size == 0) {
+                continue;
+            }
+            client->stats.server_messages++;
+            client->last_activity = loop_now(client->loop);
+            frames++;
+            if (client->capture_id) {
+                capture_write(client->capture_id, CAPTURE_SERVER, opcode,
+                              messages[i].data, size);
+            }
+            PROBE(server_message, (uintptr_t)client, opcode, size,
+                  PROBE_NOW(server_message));
+            if (client->session
+                && !resume_record(client->bridge->resume, client->session,
+                                  opcode, messages[i].data, size))
+            {
+                LOG_ERROR("client %p: cannot keep message to resume",
+                          client);
+                status = CLIENT_ERROR;
+                break;
+            }
+
+            const char* payload;
+            size_t payload_size;
+            pmd_status_t pmd_status = PMD_SKIPPED;
+            if (_client_pmd(client)) {
+                pmd_status = pmd_compress(&client->pmd, messages[i].data,
+                                          size, &payload, &payload_size);
+            }
+
+            if (pmd_status == PMD_SUCCESS) {
+                // The compressor output is overwritten by the next message.
+                frame_t* frame = frame_new(WS_RSV1, opcode, payload,
+                                           payload_size);
+                if (!frame) {
+                    status = CLIENT_ERROR;
+                    break;
+                }
+                compressed[compressed_count++] = frame;
+                iov[iov_count++] = (struct iovec){ frame->data, frame->size };
+            } else
+            if (pmd_status == PMD_SKIPPED) {
+                size_t head_size = ws_encode_frame_head(heads[i], true, 0,
+                                                        opcode, size);
+                iov[iov_count++] = (struct iovec){ heads[i], head_size };
+                iov[iov_count++] = (struct iovec){ (void*)messages[i].data,
+                                                   size };
+            } else {
+                LOG_ERROR("client %p: unable to compress message", client);
+                status = CLIENT_ERROR;
+                break;
+            }
+        }
+
+        if (status == CLIENT_SUCCESS && iov_count > 0) {
+            status = _client_write(client, iov, iov_count, frames);
+        }
+
+        for (size_t i = 0; i < compressed_count; i++) {
+            frame_unref(compressed[i]);
+        }
+        if (status != CLIENT_SUCCESS) {
+            return status;
+        }
+
+        buffer_consume(in, consumed);
+    } while (count == CLIENT_RELAY_BATCH);
 
     return CLIENT_SUCCESS;
 }
 
 
-void* client_thread(client_t* client) {
-    if (ws_do_handshake(client->ws_sock) != WS_SUCCESS) {
-        fprintf(stderr, "rejecting client %p\n", client);
-        client_send_401(client);
-        goto end;
+static uint64_t _client_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+
+/*
+ * Account for the server data received at `received` (monotonic
+ * microseconds, or 0 if there is none), and for the data waiting since
+ * `relay_started`: their relay latency is recorded once the web socket
+ * queue is empty, otherwise the oldest waits in `relay_started`.
+ */
+static void _client_relayed(client_t* client, uint64_t received) {
+    if (!frame_queue_empty(&client->out)) {
+        uint64_t none = 0;
+        if (received != 0) {
+            __atomic_compare_exchange_n(&client->relay_started, &none,
+                                        received, false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED);
+        }
+        return;
     }
 
-    // Connect to the server
-    client->server_sock = socket_create_client_tcp(client->bridged_host,
-                                                   client->bridged_port);
-    if (client->server_sock == SOCKET_ERROR) {
-        fprintf(stderr, "client %p: unable to connect the bridged server\n",
-                client);
-        goto end;
+    uint64_t now = _client_now_us();
+    uint64_t started = __atomic_exchange_n(&client->relay_started, 0,
+                                           __ATOMIC_RELAXED);
+    if (started != 0) {
+        metrics_record(METRICS_RELAY_LATENCY, now - started);
+        metrics_record(METRICS_CLASS_LATENCY + client->sched_class,
+                       now - started);
+    }
+    if (received != 0) {
+        metrics_record(METRICS_RELAY_LATENCY, now - received);
+        metrics_record(METRICS_CLASS_LATENCY + client->sched_class,
+                       now - received);
     }
+}
 
-    // Set sockets in non-bocking mode for main loop
-    if (socket_set_non_blocking(client->ws_sock) == NET_ERROR) {
-        fprintf(stderr, "client %p: unable to set non-blocking web socket\n",
-                client);
-        goto end;
+
+/*
+ * Adapt the size of the next server read to the `len` bytes just read: a
+ * full read doubles it, and it is halved after several reads using less
+ * than a quarter of it, so that a burst doesn't shrink it right away.
+ */
+static void _client_adapt_recv_size(client_t* client, size_t len) {
+    size_t max = client->bridge->config->recv_buffer_max;
+    size_t min = CLIENT_RECV_MIN < max ? CLIENT_RECV_MIN : max;
+
+    if (len == client->recv_size) {
+        client->recv_size = client->recv_size * 2 < max
+                          ? client->recv_size * 2
+                          : max;
+        client->recv_small_count = 0;
+    } else
+    if (len < client->recv_size / 4) {
+        if (++client->recv_small_count == CLIENT_RECV_SHRINK_COUNT) {
+            client->recv_size = client->recv_size / 2 > min
+                              ? client->recv_size / 2
+                              : min;
+            client->recv_small_count = 0;
+        }
+    } else {
+        client->recv_small_count = 0;
     }
-    if (socket_set_non_blocking(client->server_sock) == NET_ERROR) {
-        fprintf(stderr, "client %p: unable to set non-blocking server socket\n",
-                client);
-        goto end;
+}
+
+
+/*
+ * Read the server socket until it is drained, `budget` bytes were read or
+ * the `deadline` passed (monotonic microseconds, 0 for none), relaying
+ * messages as they are complete. When reads are coalesced, what was read
+ * is relayed at once instead. The bytes read are counted in `used`, and
+ * `more` is set if the socket may not be drained.
+ *
+ * Packets of a SOCK_SEQPACKET server are read whole, one per read, into
+ * `recv_buffer_max` bytes, so that each is relayed as a message. Messages
+ * of a shared memory server are read the same way, into their own size.
+ */
+static client_status_t _client_handle_server(client_t* client, size_t budget,
+                                             uint64_t deadline, size_t* used,
+                                             bool* more)
+{
+    const config_t* config = client->bridge->config;
+    buffer_t* in = &client->server_in;
+    bool shm = client->bridge->shm;
+    bool packets = shm || client->bridge->server_addr.type == SOCK_SEQPACKET;
+    bool coalesce = config->coalesce_reads && !packets
+                 && config->upstream_codec.type == CONFIG_CODEC_RAW;
+    size_t total = 0;
+    bool closed = false;
+    bool drained = false;
+    uint64_t received = 0;
+
+    if (coalesce && budget > config->max_message_size) {
+        budget = config->max_message_size;
     }
 
+    while (total < budget) {
+        size_t size = client->recv_size < budget - total
+                    ? client->recv_size
+                    : budget - total;
+        if (shm) {
+            ssize_t next = shm_next(&client->shm);
+            if (next == SHMRING_EMPTY) {
+                drained = true;
+                break;
+            }
+            if (next == SHMRING_INVALID || next > config->max_message_size) {
+                LOG_ERROR("client %p: invalid server message in shared "
+                          "memory", client);
+                client->close_status = WS_CLOSE_INTERNAL_ERROR;
+                return CLIENT_ERROR;
+            }
+            size = next;
+        } else
+        if (packets) {
+            size = config->recv_buffer_max;
+        }
+        if (!buffer_reserve(in, size)) {
+            LOG_ERROR("client %p: cannot allocate server buffer", client);
+            return CLIENT_ERROR;
+        }
 
-    while (client->alive) {
-        if (_client_handle_ws(client) == CLIENT_ERROR) {
-            goto end;
+        ssize_t recv_len;
+        if (shm) {
+            // Empty messages are read too, the connection closing is told
+            // by its socket.
+            shm_read(&client->shm, buffer_tail(in), size);
+            recv_len = size;
+        } else {
+            // With MSG_TRUNC, the size of a packet is returned even if it
+            // didn't fit.
+            recv_len = recv(client->server_sock, buffer_tail(in), size,
+                            packets ? MSG_TRUNC : 0);
+            if (recv_len < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK
+                    || errno == EINTR)
+                {
+                    drained = true;
+                    break;
+                }
+                LOG_ERROR("client %p: cannot read server message", client);
+                return CLIENT_ERROR;
+            } else
+            if (recv_len == 0) {
+                closed = true;
+                break;
+            } else
+            if (recv_len > size) {
+                LOG_ERROR("client %p: server packet of %zd bytes exceeds "
+                          "%zu bytes", client, recv_len, size);
+                client->close_status = WS_CLOSE_INTERNAL_ERROR;
+                return CLIENT_ERROR;
+            }
+        }
+        LOG_PAYLOAD(buffer_tail(in), recv_len, "client %p: SERVER %zd",
+                    client, recv_len);
+        buffer_commit(in, recv_len);
+        client->stats.server_reads++;
+        client->stats.server_bytes += recv_len;
+        total += recv_len;
+        *used = total;
+        if (!packets) {
+            _client_adapt_recv_size(client, recv_len);
+        }
+        metrics_add(METRICS_UPSTREAM_BYTES_IN, recv_len);
+        if (metrics_enabled_g && received == 0) {
+            received = client->ready_since ? client->ready_since
+                                           : _client_now_us();
         }
-        if (_client_handle_server(client) == CLIENT_ERROR) {
-            goto end;
+
+        if (!coalesce && _client_relay_server(client) != CLIENT_SUCCESS) {
+            return CLIENT_ERROR;
         }
 
-        usleep(1000);
+        // A short read drained the socket, don't wait for EAGAIN to tell.
+        if (!packets && recv_len < size) {
+            drained = true;
+            break;
+        }
+        if (deadline != 0 && _client_now_us() >= deadline) {
+            break;
+        }
     }
+    *more = !drained;
 
-  end:
-    client_close(client);
-    return NULL;
+    if (coalesce && total > 0
+        && _client_relay_server(client) != CLIENT_SUCCESS)
+    {
+        return CLIENT_ERROR;
+    }
+    if (received != 0) {
+        _client_relayed(client, received);
+    }
+
+    // The server won't wake the client up for the messages left in the
+    // ring, once the other connections had their turn.
+    if (shm && !drained) {
+        shm_rearm(&client->shm);
+    }
+
+    if (closed) {
+        LOG_INFO("client %p: the bridged server closed the connection",
+                 client);
+        return CLIENT_ERROR;
+    }
 
+    // Hold no memory once the data is relayed.
+    buffer_release(in);
+    pmd_release_buffer(&client->pmd);
+
+    return CLIENT_SUCCESS;
 }
 
 
-void client_close(client_t* client) {
-    printf("client %p disconnected\n", client);
-    ws_send_message(client->ws_sock, WS_OP_CLOSE, NULL, 0);
+/*
+ * Push the frames held in the web socket when the oldest one waited for the
+ * route latency budget, or when they fill a batch.
+ */
+static client_status_t _client_push(client_t* client) {
+    const config_coalesce_t* coalesce = &client->bridge->config->coalesce;
+    size_t held = client->out.bytes_written - client->pushed_bytes;
+    if (!client->out.more || held == 0) {
+        return CLIENT_SUCCESS;
+    }
+
+    uint64_t now = _client_now_us();
+    if (client->push_deadline == 0) {
+        client->push_deadline = now + coalesce->latency_us;
+    }
+    if (held < coalesce->max_batch && now < client->push_deadline) {
+        return CLIENT_SUCCESS;
+    }
+
+    if (socket_push(client->ws_sock) != NET_SUCCESS) {
+        LOG_ERROR("client %p: cannot push web socket", client);
+        return CLIENT_ERROR;
+    }
+    client->pushed_bytes = client->out.bytes_written;
+    client->push_deadline = 0;
+    client->stats.pushes++;
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Returns how many microseconds the client may wait for events.
+ */
+static int64_t _client_wait_us(client_t* client) {
+    if (client->push_deadline == 0) {
+        return CLIENT_POLL_TIMEOUT * 1000;
+    }
+    uint64_t now = _client_now_us();
+    return client->push_deadline > now ? client->push_deadline - now : 0;
+}
+
+
+/*
+ * Send a close frame with `status` and wait for the client answer, until
+ * the close timeout.
+ */
+static void _client_start_close(client_t* client, ws_close_status_t status) {
+    const config_timeouts_t* timeouts = &client->bridge->config->timeouts;
+
+    client->close_status = status;
+    if (_client_send_close(client) != CLIENT_SUCCESS || timeouts->close == 0) {
+        client->alive = false;
+    }
+    client->state = CLIENT_CLOSING;
+
+    // Nothing is relayed anymore, and the client answer must not wait
+    // behind a message for the server.
+    if (client->server_sock != SOCKET_ERROR) {
+        loop_remove(client->loop, &client->server_watch);
+        loop_remove(client->loop, &client->shm_watch);
+    }
+    buffer_consume(&client->server_out, buffer_size(&client->server_out));
+    buffer_release(&client->server_out);
+    loop_disarm(client->loop, &client->ping_timer);
+    loop_arm(client->loop, &client->deadline, timeouts->close);
+}
+
+
+/*
+ * Send the message `msg` of `size` bytes to the client, in a frame of
+ * `opcode`, compressed if the client negotiated it.
+ */
+static client_status_t _client_send_message(client_t* client,
+                                            ws_opcode_t opcode,
+                                            const char* msg, size_t size)
+{
+    char head[WS_FRAME_HEAD_MAX];
+    struct iovec iov[2];
+    size_t iov_count = 0;
+    frame_t* frame = NULL;
+
+    const char* payload;
+    size_t payload_size;
+    pmd_status_t pmd_status = PMD_SKIPPED;
+    if (_client_pmd(client)) {
+        pmd_status = pmd_compress(&client->pmd, msg, size, &payload,
+                                  &payload_size);
+    }
+    if (pmd_status == PMD_SUCCESS) {
+        frame = frame_new(WS_RSV1, opcode, payload, payload_size);
+        if (!frame) {
+            goto error;
+        }
+        iov[iov_count++] = (struct iovec){ frame->data, frame->size };
+    } else
+    if (pmd_status == PMD_SKIPPED) {
+        size_t head_size = ws_encode_frame_head(head, true, 0, opcode, size);
+        iov[iov_count++] = (struct iovec){ head, head_size };
+        iov[iov_count++] = (struct iovec){ (void*)msg, size };
+    } else {
+        LOG_ERROR("client %p: unable to compress message", client);
+        goto error;
+    }
+
+    client->stats.server_messages++;
+    client->last_activity = loop_now(client->loop);
+    if (client->capture_id) {
+        capture_write(client->capture_id, CAPTURE_SERVER, opcode, msg, size);
+    }
+    client_status_t status = _client_write(client, iov, iov_count, 1);
+    if (frame) {
+        frame_unref(frame);
+    }
+    return status;
+
+  error:
+    client->close_status = WS_CLOSE_INTERNAL_ERROR;
+    return CLIENT_ERROR;
+}
+
+
+client_status_t client_send(client_t* client, ws_opcode_t opcode,
+                            const char* msg, size_t size)
+{
+    if (!client->handler_open || !client->alive
+        || client->state != CLIENT_OPEN)
+    {
+        return CLIENT_ERROR;
+    }
+    if (_client_send_message(client, opcode, msg, size) != CLIENT_SUCCESS) {
+        client->alive = false;
+        return CLIENT_ERROR;
+    }
+    return CLIENT_SUCCESS;
+}
+
+
+void client_shutdown(client_t* client, ws_close_status_t status) {
+    if (client->state == CLIENT_OPEN) {
+        _client_start_close(client, status);
+    }
+}
+
+
+/*
+ * Check the idle deadline against the last message relayed, closing the
+ * client if it is really idle.
+ */
+static void _client_check_idle(client_t* client) {
+    uint64_t timeout = client->bridge->config->timeouts.idle;
+    uint64_t idle = loop_now(client->loop) - client->last_activity;
+
+    if (idle < timeout) {
+        loop_arm(client->loop, &client->deadline, timeout - idle);
+        return;
+    }
+    LOG_INFO("client %p: idle timeout", client);
+    _client_start_close(client, WS_CLOSE_GOING_AWAY);
+}
+
+
+/*
+ * Count a bridged server connection, which succeeded or not, and the
+ * failures in a row the listening thread checks to admit new clients.
+ */
+static void _client_connected(client_t* client, bool success) {
+    if (!success) {
+        __atomic_add_fetch(&client->bridge->upstream_failures, 1,
+                           __ATOMIC_RELAXED);
+        metrics_add(METRICS_UPSTREAM_CONNECT_FAILURES, 1);
+        PROBE(upstream_connect, (uintptr_t)client, 0,
+              PROBE_NOW(upstream_connect));
+        return;
+    }
+    if (__atomic_load_n(&client->bridge->upstream_failures, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&client->bridge->upstream_failures, 0,
+                         __ATOMIC_RELAXED);
+    }
+    metrics_add(METRICS_UPSTREAM_CONNECTS, 1);
+    PROBE(upstream_connect, (uintptr_t)client, 1,
+          PROBE_NOW(upstream_connect));
+    metrics_record(METRICS_UPSTREAM_CONNECT_TIME,
+                   _client_now_us() - client->connect_started);
+}
+
+
+static void _client_on_deadline(wheel_timer_t* timer, void* data) {
+    client_t* client = data;
+    switch (client->state) {
+      case CLIENT_HANDSHAKE:
+        LOG_WARNING("client %p: handshake timeout", client);
+        client->alive = false;
+        break;
+
+      case CLIENT_CONNECTING:
+        LOG_WARNING("client %p: bridged server connection timeout", client);
+        _client_connected(client, false);
+        client->close_status = WS_CLOSE_INTERNAL_ERROR;
+        client->alive = false;
+        break;
+
+      case CLIENT_OPEN:
+        _client_check_idle(client);
+        break;
+
+      case CLIENT_CLOSING:
+        LOG_WARNING("client %p: close handshake timeout", client);
+        client->alive = false;
+        break;
+    }
+    _client_touch(client);
+}
+
+
+static void _client_on_ping(wheel_timer_t* timer, void* data) {
+    client_t* client = data;
+    _client_touch(client);
+
+    if (client->pong_pending) {
+        LOG_WARNING("client %p: missed pong", client);
+        client->close_status = WS_CLOSE_GOING_AWAY;
+        client->ws_lost = true;
+        client->alive = false;
+        return;
+    }
+
+    if (_client_send_control(client, WS_OP_PING, NULL, 0)
+        != CLIENT_SUCCESS)
+    {
+        client->alive = false;
+        return;
+    }
+    client->pong_pending = true;
+    loop_arm(client->loop, timer, client->bridge->config->timeouts.pong);
+}
+
+
+static void _client_on_push(wheel_timer_t* timer, void* data) {
+    _client_touch(data);
+}
+
+
+/*
+ * Have the reads on `sock` busy polled, if asked.
+ */
+static void _client_busy_poll(client_t* client, socket_t sock) {
+    int busy_poll = client->bridge->config->busy_poll;
+    if (busy_poll > 0 && socket_set_busy_poll(sock, busy_poll) == NET_ERROR
+        && !__atomic_exchange_n(&busy_poll_failed_g, true, __ATOMIC_RELAXED))
+    {
+        LOG_WARNING("client %p: unable to busy poll its sockets, which "
+                    "needs CAP_NET_ADMIN", client);
+    }
+}
+
+
+static void _client_on_ws(void* data, uint32_t events);
+static void _client_on_server(void* data, uint32_t events);
+static void _client_on_wake(void* data, uint32_t events);
+static void _client_on_shm(void* data, uint32_t events);
+static void _client_on_shm_closed(void* data, uint32_t events);
+
+
+/*
+ * Start relaying messages, and the keepalive timers.
+ */
+static void _client_start_bridge(client_t* client) {
+    const config_timeouts_t* timeouts = &client->bridge->config->timeouts;
+
+    client->state = CLIENT_OPEN;
+    loop_disarm(client->loop, &client->deadline);
+    client->last_activity = loop_now(client->loop);
+    if (timeouts->idle > 0) {
+        loop_arm(client->loop, &client->deadline, timeouts->idle);
+    }
+    if (timeouts->ping_interval > 0) {
+        loop_arm(client->loop, &client->ping_timer, timeouts->ping_interval);
+    }
+}
+
+
+/*
+ * Subscribe the client to the broadcast. Its worker, or its own eventfd
+ * without one, is woken up when the broadcast thread queues frames.
+ */
+static client_status_t _client_subscribe(client_t* client) {
+    if (!client->worker) {
+        client->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (client->wake_fd < 0) {
+            LOG_ERROR("client %p: unable to create wake up event", client);
+            client->wake_fd = SOCKET_ERROR;
+            return CLIENT_ERROR;
+        }
+        if (loop_add(client->loop, &client->wake_watch, client->wake_fd,
+                     EPOLLIN, &_client_on_wake, client)
+            != LOOP_SUCCESS)
+        {
+            LOG_ERROR("client %p: unable to watch wake up event", client);
+            return CLIENT_ERROR;
+        }
+    }
+    if (broadcast_subscribe(client->bridge->broadcast, client)
+        != BROADCAST_SUCCESS)
+    {
+        LOG_ERROR("client %p: unable to subscribe", client);
+        return CLIENT_ERROR;
+    }
+    _client_start_bridge(client);
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Connect the client to a shared memory bridged server. Unix sockets
+ * connect at once, so the rings are set up right away.
+ */
+static client_status_t _client_connect_shm(client_t* client) {
+    client->server_sock = shm_connect(&client->shm,
+                                      &client->bridge->server_addr,
+                                      client->bridge->config->shm_ring_size);
+    if (client->server_sock == SOCKET_ERROR) {
+        LOG_ERROR("client %p: unable to connect the bridged server", client);
+        _client_connected(client, false);
+        return CLIENT_ERROR;
+    }
+    if (loop_add(client->loop, &client->server_watch, client->server_sock,
+                 EPOLLIN, &_client_on_shm_closed, client)
+           != LOOP_SUCCESS
+        || loop_add(client->loop, &client->shm_watch, client->shm.wake_fd,
+                    EPOLLIN, &_client_on_shm, client)
+           != LOOP_SUCCESS)
+    {
+        LOG_ERROR("client %p: unable to watch server connection", client);
+        return CLIENT_ERROR;
+    }
+    _client_connected(client, true);
+    _client_start_bridge(client);
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Open the client to the in-process handler.
+ */
+static client_status_t _client_open_handler(client_t* client) {
+    const handler_t* handler = client->bridge->handler;
+
+    _client_start_bridge(client);
+    client->handler_open = true;
+    if (handler->stack_size > 0) {
+        return _client_call(client, CLIENT_CALLBACK_OPEN);
+    }
+    if (handler->on_open
+        && handler->on_open(client, handler->data) != HANDLER_SUCCESS)
+    {
+        LOG_ERROR("client %p: rejected by the handler", client);
+        client->handler_open = false;
+        return CLIENT_ERROR;
+    }
+    return CLIENT_SUCCESS;
+}
+
+
+static bool _client_replay(void* data, ws_opcode_t opcode, const char* msg,
+                           size_t size)
+{
+    return _client_send_message(data, opcode, msg, size) == CLIENT_SUCCESS;
+}
+
+
+/*
+ * Take the session claimed by the client over, once its previous
+ * connection detached it, then send it the messages it missed. Until then,
+ * the client waits in the connecting state.
+ */
+static client_status_t _client_resume(client_t* client) {
+    resume_t* resume = client->bridge->resume;
+
+    resume_status_t status = resume_take(resume, client->resume_token,
+                                         client, client->ws_sock,
+                                         &client->session,
+                                         &client->server_sock,
+                                         &client->server_in,
+                                         &client->server_out);
+    if (status == RESUME_BUSY) {
+        client->state = CLIENT_CONNECTING;
+        loop_arm(client->loop, &client->resume_timer, CLIENT_RESUME_RETRY);
+        return CLIENT_SUCCESS;
+    }
+    if (status != RESUME_SUCCESS) {
+        LOG_WARNING("client %p: session %.8s lost while resuming", client,
+                    client->resume_token);
+        return CLIENT_ERROR;
+    }
+
+    resume_session_t* session = client->session;
+    if (client->resume_count < session->first
+        || client->resume_count > session->sent)
+    {
+        LOG_WARNING("client %p: the messages missed in session %.8s are "
+                    "not kept anymore", client, session->token);
+        return CLIENT_ERROR;
+    }
+    uint32_t events = buffer_size(&client->server_out) > 0
+                    ? EPOLLIN | EPOLLOUT
+                    : EPOLLIN;
+    if (loop_add(client->loop, &client->server_watch, client->server_sock,
+                 events, &_client_on_server, client)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("client %p: unable to watch server socket", client);
+        return CLIENT_ERROR;
+    }
+    LOG_INFO("client %p: resumed session %.8s, %" PRIu64 " messages "
+             "missed", client, session->token,
+             session->sent - client->resume_count);
+    metrics_add(METRICS_SESSIONS_RESUMED, 1);
+    _client_start_bridge(client);
+    if (!resume_replay(session, client->resume_count, &_client_replay,
+                       client))
+    {
+        return CLIENT_ERROR;
+    }
+    return CLIENT_SUCCESS;
+}
+
+
+static void _client_on_resume(wheel_timer_t* timer, void* data) {
+    client_t* client = data;
+    _client_touch(client);
+
+    if (client->alive && _client_resume(client) != CLIENT_SUCCESS) {
+        client->state = CLIENT_OPEN;
+        client->close_status = WS_CLOSE_INTERNAL_ERROR;
+        client->alive = false;
+    }
+}
+
+
+/*
+ * Start connecting the client to the bridged server, subscribe it to the
+ * broadcast, or open it to the in-process handler. The server connection
+ * is done without blocking the loop: the client frames are left in the web
+ * socket until it completes.
+ */
+static client_status_t _client_connect(client_t* client) {
+    if (client->bridge->broadcast) {
+        return _client_subscribe(client);
+    }
+    if (client->bridge->handler) {
+        return _client_open_handler(client);
+    }
+    if (client->resume_token[0] != '\0') {
+        return _client_resume(client);
+    }
+
+    client->connect_started = _client_now_us();
+    if (client->bridge->shm) {
+        return _client_connect_shm(client);
+    }
+    client->server_sock = socket_connect(&client->bridge->server_addr);
+    if (client->server_sock == SOCKET_ERROR) {
+        LOG_ERROR("client %p: unable to connect the bridged server", client);
+        _client_connected(client, false);
+        return CLIENT_ERROR;
+    }
+    if (socket_set_no_delay(client->server_sock) == NET_ERROR) {
+        LOG_ERROR("client %p: unable to disable Nagle on server "
+                  "socket", client);
+    }
+    _client_busy_poll(client, client->server_sock);
+    if (loop_add(client->loop, &client->server_watch, client->server_sock,
+                 EPOLLOUT, &_client_on_server, client)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("client %p: unable to watch server socket", client);
+        return CLIENT_ERROR;
+    }
+    client->state = CLIENT_CONNECTING;
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Claim the session named in the resume header of the handshake `request`,
+ * or open a new one, and write the header giving its token to the client
+ * in the `size` bytes of `header`.
+ */
+static client_status_t _client_open_session(client_t* client,
+                                            const char* request,
+                                            char* header, size_t size)
+{
+    resume_t* resume = client->bridge->resume;
+    char value[128];
+    const char* token;
+
+    if (ws_client_handshake_get_header(request, RESUME_HEADER, value,
+                                       sizeof(value))
+           == WS_SUCCESS
+        && resume_parse(value, client->resume_token, &client->resume_count)
+        && resume_claim(resume, client->resume_token, client->resume_count,
+                        client)
+           == RESUME_SUCCESS)
+    {
+        token = client->resume_token;
+    } else {
+        client->resume_token[0] = '\0';
+        client->session = resume_open(resume, client->ws_sock);
+        if (!client->session) {
+            LOG_ERROR("client %p: unable to open its session", client);
+            return CLIENT_ERROR;
+        }
+        token = client->session->token;
+    }
+    snprintf(header, size, RESUME_HEADER ": %s\r\n", token);
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Returns the scheduling class of the clients of the handshake `request`,
+ * the first one whose prefix starts its path.
+ */
+static unsigned _client_class(const config_t* config, const char* request) {
+    const char* path = strchr(request, ' ');
+    if (!path) {
+        return 0;
+    }
+    path++;
+    size_t size = strcspn(path, " \r\n");
+    for (size_t i = 0; i < config->class_count; i++) {
+        const config_class_t* class = &config->classes[i];
+        if (class->prefix_size <= size
+            && memcmp(path, class->prefix, class->prefix_size) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Answer the client handshake, then connect the bridged server.
+ */
+static client_status_t _client_open(client_t* client, const char* request) {
+    pmd_params_t pmd_params;
+    char header[64] = "";
+
+    if (client->bridge->resume
+        && _client_open_session(client, request, header, sizeof(header))
+           != CLIENT_SUCCESS)
+    {
+        client_send_500(client);
+        return CLIENT_ERROR;
+    }
+    if (ws_do_handshake(client->ws_sock, request,
+                        &client->bridge->config->deflate, &pmd_params,
+                        header)
+        != WS_SUCCESS)
+    {
+        LOG_ERROR("rejecting client %p", client);
+        PROBE(handshake_end, (uintptr_t)client, 0, PROBE_NOW(handshake_end));
+        client_send_401(client);
+        return CLIENT_ERROR;
+    }
+    metrics_add(METRICS_HANDSHAKES, 1);
+    PROBE(handshake_end, (uintptr_t)client, 1, PROBE_NOW(handshake_end));
+    client->sched_class = _client_class(client->bridge->config, request);
+    pmd_init(&client->pmd, &client->bridge->pmd_pool, &pmd_params);
+
+    if (_client_connect(client) != CLIENT_SUCCESS) {
+        // The handshake was answered, the client expects a close frame.
+        client->state = CLIENT_OPEN;
+        client->close_status = WS_CLOSE_INTERNAL_ERROR;
+        return CLIENT_ERROR;
+    }
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Read the client handshake request. Only the bytes of the request are
+ * consumed from the socket, the frames following it are left there.
+ */
+static client_status_t _client_read_handshake(client_t* client) {
+    static const char END[] = "\r\n\r\n";
+    buffer_t* in = &client->ws_in;
+    size_t size = buffer_size(in);
+
+    if (size == CLIENT_HANDSHAKE_MAX) {
+        LOG_ERROR("client %p: handshake too large", client);
+        return CLIENT_ERROR;
+    }
+    // Keep a byte for the terminating NUL.
+    if (!buffer_reserve(in, CLIENT_HANDSHAKE_MAX - size + 1)) {
+        LOG_ERROR("client %p: cannot allocate handshake", client);
+        return CLIENT_ERROR;
+    }
+
+    ssize_t peeked = recv(client->ws_sock, buffer_tail(in),
+                          CLIENT_HANDSHAKE_MAX - size, MSG_PEEK);
+    if (peeked < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return CLIENT_SUCCESS;
+        }
+        LOG_ERROR("client %p: unable to receive handshake", client);
+        return CLIENT_ERROR;
+    } else
+    if (peeked == 0) {
+        LOG_INFO("client %p: closed during handshake", client);
+        return CLIENT_ERROR;
+    }
+
+    // The end of the request may start in the bytes already read.
+    size_t from = size > strlen(END) - 1 ? size - (strlen(END) - 1) : 0;
+    const char* end = memmem(buffer_content(in) + from, size + peeked - from,
+                             END, strlen(END));
+    size_t take = end
+                ? end + strlen(END) - buffer_content(in) - size
+                : (size_t)peeked;
+    if (recv(client->ws_sock, buffer_tail(in), take, 0) != take) {
+        LOG_ERROR("client %p: unable to receive handshake", client);
+        return CLIENT_ERROR;
+    }
+    buffer_commit(in, take);
+    if (!end) {
+        return CLIENT_SUCCESS;
+    }
+
+    *buffer_tail(in) = '\0';
+    client_status_t status = _client_open(client, buffer_content(in));
+    buffer_free(in);
+    return status;
+}
+
+
+static void _client_on_ws(void* data, uint32_t events) {
+    client_t* client = data;
+    client_status_t status = CLIENT_SUCCESS;
+
+    if (!client->alive) {
+        return;
+    }
+    _client_touch(client);
+
+    switch (client->state) {
+      case CLIENT_HANDSHAKE:
+        status = _client_read_handshake(client);
+        break;
+
+      case CLIENT_CONNECTING:
+      case CLIENT_OPEN:
+      case CLIENT_CLOSING:
+        // The client frames wait in the socket while the bridged server
+        // connects or a handler callback waits, only its loss matters.
+        if (client->state == CLIENT_CONNECTING || client->callback_pending) {
+            if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                LOG_INFO("client %p: connection closed by the client",
+                         client);
+                status = CLIENT_ERROR;
+            }
+            break;
+        }
+        status = _client_handle_ws(client);
+        break;
+    }
+    if (status != CLIENT_SUCCESS) {
+        client->alive = false;
+    }
+}
+
+
+/*
+ * Write the pending bytes of a client message to the bridged server, then
+ * handle the client frames which waited for it.
+ */
+static client_status_t _client_flush_server(client_t* client) {
+    if (client->bridge->shm) {
+        shm_flush(&client->shm, &client->server_out);
+        return buffer_size(&client->server_out) > 0
+             ? CLIENT_SUCCESS
+             : _client_handle_frames(client);
+    }
+
+    if (codec_flush(client->server_sock, &client->server_out)
+        != CODEC_SUCCESS)
+    {
+        LOG_ERROR("client %p: cannot relay web socket message to server",
+                  client);
+        return CLIENT_ERROR;
+    }
+    if (buffer_size(&client->server_out) > 0) {
+        return CLIENT_SUCCESS;
+    }
+    if (loop_modify(client->loop, &client->server_watch, EPOLLIN)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("client %p: unable to watch server socket", client);
+        return CLIENT_ERROR;
+    }
+    return _client_handle_frames(client);
+}
+
+
+/*
+ * Resume the client coroutine once what its callback waits for happened,
+ * then handle the client frames which waited for the callback to return.
+ */
+static void _client_on_callback_wake(void* data) {
+    client_t* client = data;
+
+    coro_resume(client->coro);
+    // The callback may have sent frames, even if it waits again.
+    _client_touch(client);
+    if (client->callback_pending || !client->alive) {
+        return;
+    }
+    if (_client_callback_done(client) != CLIENT_SUCCESS
+        || _client_handle_frames(client) != CLIENT_SUCCESS)
+    {
+        client->alive = false;
+    }
+}
+
+
+/*
+ * Relay the data of the bridged server, or have the worker running the
+ * client do it on its turn.
+ */
+static void _client_server_ready(client_t* client) {
+    if (client->worker) {
+        if (metrics_enabled_g && client->ready_since == 0) {
+            client->ready_since = _client_now_us();
+        }
+        worker_schedule(client->worker, client);
+        return;
+    }
+
+    size_t used = 0;
+    bool more;
+    if (_client_handle_server(client, client->bridge->config->read_budget,
+                              0, &used, &more)
+        != CLIENT_SUCCESS)
+    {
+        client->alive = false;
+    }
+}
+
+
+static void _client_on_server(void* data, uint32_t events) {
+    client_t* client = data;
+
+    if (!client->alive) {
+        return;
+    }
+    _client_touch(client);
+
+    if (client->state == CLIENT_CONNECTING) {
+        if (socket_connect_result(client->server_sock) != NET_SUCCESS
+            || loop_modify(client->loop, &client->server_watch, EPOLLIN)
+               != LOOP_SUCCESS)
+        {
+            LOG_ERROR("client %p: unable to connect the bridged "
+                      "server", client);
+            _client_connected(client, false);
+            client->close_status = WS_CLOSE_INTERNAL_ERROR;
+            client->alive = false;
+            return;
+        }
+        _client_connected(client, true);
+        _client_start_bridge(client);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && _client_flush_server(client) != CLIENT_SUCCESS)
+    {
+        client->alive = false;
+        return;
+    }
+    if ((events & ~EPOLLOUT) && client->alive) {
+        _client_server_ready(client);
+    }
+}
+
+
+static void _client_on_wake(void* data, uint32_t events) {
+    client_t* client = data;
+    eventfd_t count;
+    eventfd_read(client->wake_fd, &count);
+}
+
+
+/*
+ * The shared memory server wrote messages, or made room for the pending
+ * one.
+ */
+static void _client_on_shm(void* data, uint32_t events) {
+    client_t* client = data;
+
+    if (!client->alive) {
+        return;
+    }
+    _client_touch(client);
+
+    // Anything the server does from now on writes the eventfd again.
+    shm_clear(&client->shm);
+    if (buffer_size(&client->server_out) > 0
+        && _client_flush_server(client) != CLIENT_SUCCESS)
+    {
+        client->alive = false;
+        return;
+    }
+    if (client->alive) {
+        _client_server_ready(client);
+    }
+}
+
+
+/*
+ * The shared memory server closed its socket, after the messages it wrote.
+ */
+static void _client_on_shm_closed(void* data, uint32_t events) {
+    client_t* client = data;
+
+    if (!client->alive) {
+        return;
+    }
+    _client_touch(client);
+    size_t used = 0;
+    bool more;
+    if (_client_handle_server(client, client->bridge->config->read_budget, 0,
+                              &used, &more)
+        == CLIENT_SUCCESS)
+    {
+        LOG_INFO("client %p: the bridged server closed the connection",
+                 client);
+    }
+    client->alive = false;
+}
+
+
+client_status_t client_setup(client_t* client, loop_t* loop) {
+    const config_timeouts_t* timeouts = &client->bridge->config->timeouts;
+
+    client->loop = loop;
+    client->capture_id = capture_open();
+    metrics_add(METRICS_CONNECTIONS_OPENED, 1);
+    PROBE(handshake_start, (uintptr_t)client, PROBE_NOW(handshake_start));
+
+    // Writes are grouped by the coalescing policy, not by Nagle.
+    if (socket_set_no_delay(client->ws_sock) == NET_ERROR) {
+        LOG_ERROR("client %p: unable to disable Nagle on web socket", client);
+    }
+    _client_busy_poll(client, client->ws_sock);
+
+    // Set sockets in non-bocking mode for main loop
+    if (socket_set_non_blocking(client->ws_sock) == NET_ERROR) {
+        LOG_ERROR("client %p: unable to set non-blocking web socket", client);
+        return CLIENT_ERROR;
+    }
+    if (loop_add(loop, &client->ws_watch, client->ws_sock, EPOLLIN,
+                 &_client_on_ws, client)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("client %p: unable to watch web socket", client);
+        return CLIENT_ERROR;
+    }
+    if (timeouts->handshake > 0) {
+        loop_arm(loop, &client->deadline, timeouts->handshake);
+    }
+    return CLIENT_SUCCESS;
+}
+
+
+/*
+ * Publish the bytes waiting in the output queue of the client, summed by
+ * the listening thread to admit new clients.
+ */
+static void _client_publish_queued(client_t* client, size_t queued) {
+    if (queued == client->queued) {
+        return;
+    }
+    if (client->worker) {
+        worker_count_queued(client->worker, queued - client->queued);
+    }
+    __atomic_store_n(&client->queued, queued, __ATOMIC_RELAXED);
+}
+
+
+void client_update(client_t* client) {
+    if (!client->alive) {
+        return;
+    }
+    if (__atomic_load_n(&client->dropped, __ATOMIC_ACQUIRE)) {
+        client->alive = false;
+        return;
+    }
+
+    size_t written = client->out.bytes_written;
+    if (frame_queue_flush(&client->out, client->ws_sock) != FRAME_SUCCESS) {
+        LOG_ERROR("client %p: cannot write queued frames", client);
+        client->ws_lost = true;
+        client->alive = false;
+        return;
+    }
+    if (PROBE_ENABLED(frame_sent) && client->out.bytes_written != written) {
+        PROBE(frame_sent, (uintptr_t)client, 0,
+              client->out.bytes_written - written,
+              frame_queue_bytes(&client->out), probe_now_ns());
+    }
+
+    _client_publish_queued(client, frame_queue_bytes(&client->out));
+    if (metrics_enabled_g) {
+        metrics_record(METRICS_QUEUE_DEPTH, frame_queue_bytes(&client->out));
+        _client_relayed(client, 0);
+    }
+
+    // The client frames are not read until they can be relayed. Only the
+    // loss of a client waiting for a handler callback is watched.
+    uint32_t events = client->state == CLIENT_CONNECTING
+                      || buffer_size(&client->server_out) > 0
+                    ? 0
+                    : EPOLLIN;
+    if (client->callback_pending) {
+        events = EPOLLRDHUP;
+    }
+    if (!frame_queue_empty(&client->out)) {
+        events |= EPOLLOUT;
+    }
+    if (loop_modify(client->loop, &client->ws_watch, events) != LOOP_SUCCESS
+        || _client_push(client) != CLIENT_SUCCESS)
+    {
+        client->alive = false;
+        return;
+    }
+
+    // A client thread waits for the push deadline itself, with a better
+    // resolution than the wheel.
+    if (client->worker && client->push_deadline != 0
+        && !wheel_timer_armed(&client->push_timer))
+    {
+        uint64_t now = _client_now_us();
+        uint64_t wait_us = client->push_deadline > now
+                         ? client->push_deadline - now
+                         : 0;
+        loop_arm(client->loop, &client->push_timer, (wait_us + 999) / 1000);
+    }
+}
+
+
+size_t client_serve(client_t* client, size_t budget, int turn_time,
+                    bool* more)
+{
+    size_t used = 0;
+
+    *more = false;
+    if (!client->alive || client->state != CLIENT_OPEN) {
+        return 0;
+    }
+    uint64_t deadline = turn_time > 0 ? _client_now_us() + turn_time : 0;
+    if (_client_handle_server(client, budget, deadline, &used, more)
+        != CLIENT_SUCCESS)
+    {
+        client->alive = false;
+        *more = false;
+    }
+    // Data left waits from now on.
+    client->ready_since = *more && metrics_enabled_g ? _client_now_us() : 0;
+    return used;
+}
+
+
+int client_weight(client_t* client) {
+    const config_t* config = client->bridge->config;
+    return client->sched_class > 0
+         ? config->classes[client->sched_class - 1].weight
+         : 1;
+}
+
+
+void* client_thread(client_t* client) {
+    loop_t loop;
+
+    if (loop_init(&loop) != LOOP_SUCCESS) {
+        LOG_ERROR("client %p: unable to create its loop", client);
+        client_send_500(client);
+        client_close(client);
+        return NULL;
+    }
+
+    if (client_setup(client, &loop) == CLIENT_SUCCESS) {
+        while (client->alive) {
+            if (loop_run_once(&loop, _client_wait_us(client))
+                != LOOP_SUCCESS)
+            {
+                break;
+            }
+            client->stats.wakeups++;
+            if (__atomic_load_n(&client->going_away, __ATOMIC_ACQUIRE)) {
+                client_shutdown(client, WS_CLOSE_GOING_AWAY);
+            }
+            client_update(client);
+        }
+    }
+
+    client_close(client);
+    client->loop = NULL;
+    loop_destroy(&loop);
+    return NULL;
+}
+
+
+void client_wake(client_t* client) {
+    if (client->worker) {
+        worker_wake(client->worker, client);
+        return;
+    }
+    // Failing means the counter is saturated, so the thread is awake anyway.
+    eventfd_write(client->wake_fd, 1);
+}
+
+
+size_t client_resident_bytes(client_t* client) {
+    return sizeof(client_t)
+         + client->ws_in.capacity
+         + client->ws_message.capacity
+         + client->server_in.capacity
+         + (client->shm.base ? shmring_map_size(client->shm.size) : 0)
+         + frame_queue_resident_bytes(&client->out)
+         + pmd_resident_bytes(&client->pmd)
+         + (client->session ? client->session->replay.capacity : 0);
+}
+
+
+static void _client_print_stats(client_t* client) {
+    const client_stats_t* stats = &client->stats;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - stats->started.tv_sec)
+                   + (now.tv_nsec - stats->started.tv_nsec) / 1e9;
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+
+    LOG_INFO("client %p: %.3f s, %zu wakeups, %zu pushes", client, elapsed,
+             stats->wakeups, stats->pushes);
+    LOG_INFO("client %p: server: %zu bytes in %zu reads, %zu messages, "
+             "%.2f MB/s", client, stats->server_bytes, stats->server_reads,
+             stats->server_messages, stats->server_bytes / elapsed / 1e6);
+    LOG_INFO("client %p: web socket: %zu bytes in %zu writes, %.2f MB/s "
+             "out, %zu bytes in %zu messages in", client,
+             client->out.bytes_written, client->out.writes,
+             client->out.bytes_written / elapsed / 1e6,
+             stats->ws_bytes, stats->ws_messages);
+}
+
+
+/*
+ * End the callback waiting on the client coroutine, if any, then run
+ * `on_close` on it, and drop it.
+ */
+static void _client_close_coro(client_t* client) {
+    bool pending = client->callback_pending;
+
+    coro_cancel(client->coro);
+    if (pending && !client->callback_pending) {
+        _client_callback_done(client);
+    }
+    // A callback which did not return holds its stack until it is dropped.
+    if (client->handler_open && !client->callback_pending) {
+        _client_call(client, CLIENT_CALLBACK_CLOSE);
+    }
+    client->handler_open = false;
+    coro_destroy(client->coro);
+    client->coro = NULL;
+}
+
+
+void client_close(client_t* client) {
+    LOG_INFO("client %p disconnected", client);
+    if (client->bridge->broadcast) {
+        broadcast_unsubscribe(client->bridge->broadcast, client);
+    }
+    if (client->loop) {
+        metrics_add(METRICS_CONNECTIONS_CLOSED, 1);
+        if (client->state == CLIENT_HANDSHAKE) {
+            metrics_add(METRICS_HANDSHAKE_FAILURES, 1);
+        }
+        if (client->capture_id) {
+            capture_write(client->capture_id, CAPTURE_CLOSE, 0, NULL, 0);
+        }
+        PROBE(close, (uintptr_t)client, client->close_status,
+              PROBE_NOW(close));
+
+        // The loop may outlive the client when it is shared.
+        loop_remove(client->loop, &client->ws_watch);
+        loop_remove(client->loop, &client->server_watch);
+        loop_remove(client->loop, &client->wake_watch);
+        loop_remove(client->loop, &client->shm_watch);
+        loop_disarm(client->loop, &client->deadline);
+        loop_disarm(client->loop, &client->ping_timer);
+        loop_disarm(client->loop, &client->push_timer);
+        loop_disarm(client->loop, &client->resume_timer);
+    }
+    _client_publish_queued(client, 0);
+    if (client->wake_fd != SOCKET_ERROR) {
+        close(client->wake_fd);
+        client->wake_fd = SOCKET_ERROR;
+    }
+    if (client->coro) {
+        _client_close_coro(client);
+    } else
+    if (client->handler_open) {
+        const handler_t* handler = client->bridge->handler;
+        client->handler_open = false;
+        if (handler->on_close) {
+            handler->on_close(client, client->close_status, handler->data);
+        }
+    }
+
+    // The bridged server connection of an open client which was lost is
+    // kept for it to resume. Its messages are sent again then.
+    bool detach = client->session && client->ws_lost
+               && client->state == CLIENT_OPEN
+               && client->server_sock != SOCKET_ERROR;
+    if (detach) {
+        LOG_INFO("client %p: session %.8s detached", client,
+                 client->session->token);
+        metrics_add(METRICS_SESSIONS_DETACHED, 1);
+        resume_detach(client->bridge->resume, client->session,
+                      client->server_sock, &client->server_in,
+                      &client->server_out);
+        client->server_sock = SOCKET_ERROR;
+    } else
+    if (client->session) {
+        resume_close(client->bridge->resume, client->session);
+    }
+    client->session = NULL;
+
+    if (client->state != CLIENT_HANDSHAKE && !detach) {
+        // Last chance to write the close frame and what precedes it.
+        if (!client->close_sent) {
+            _client_send_close(client);
+        }
+        frame_queue_flush(&client->out, client->ws_sock);
+    }
     socket_gently_close(client->ws_sock);
     if (client->server_sock != SOCKET_ERROR) {
         socket_gently_close(client->server_sock);
     }
+    shm_close(&client->shm);
+    pmd_release(&client->pmd);
+    _client_print_stats(client);
+    frame_queue_destroy(&client->out);
+    buffer_free(&client->ws_in);
+    buffer_free(&client->ws_message);
+    buffer_free(&client->server_in);
+    buffer_free(&client->server_out);
     client->alive = false;
 }
@@ -16,9 +16,21 @@
 #define _client_h_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
 
+#include "bridge.h"
+#include "buffer.h"
+#include "frame.h"
+#include "loop.h"
 #include "net.h"
+#include "pmd.h"
+#include "resume.h"
+#include "shm.h"
+#include "utf8.h"
+#include "ws.h"
 
 
 typedef enum client_status {
@@ -27,26 +39,220 @@ typedef enum client_status {
 } client_status_t;
 
 
+typedef enum client_state {
+    // Waiting for the client handshake.
+    CLIENT_HANDSHAKE,
+    // Handshake answered, waiting for the bridged server connection.
+    CLIENT_CONNECTING,
+    CLIENT_OPEN,
+    // A close frame was sent, waiting for the client one.
+    CLIENT_CLOSING,
+} client_state_t;
+
+
+/*
+ * Traffic counters of a client, written on stdout when it disconnects.
+ * Bytes written to the web socket are counted by the output queue.
+ */
+typedef struct client_stats {
+    struct timespec started;
+    size_t wakeups;
+    size_t pushes;
+    size_t ws_messages;
+    size_t ws_bytes;
+    size_t server_reads;
+    size_t server_bytes;
+    size_t server_messages;
+} client_stats_t;
+
+
+/*
+ * Handler callback given to the coroutine of a client.
+ */
+typedef enum client_callback {
+    CLIENT_CALLBACK_OPEN,
+    CLIENT_CALLBACK_MESSAGE,
+    CLIENT_CALLBACK_CLOSE,
+} client_callback_t;
+
+
+struct coro;
+struct worker;
+
+
 /*
  * This structure contains all data needed to handle a client during its
- * life.
+ * life. Its buffers only hold memory while data is in flight.
  */
 typedef struct client {
     bool alive;
+    bool close_sent;
+    bool pong_pending;
+    bool message_compressed;
+    client_state_t state;
     socket_t ws_sock;
     socket_t server_sock;
+
+    // Thread running the client, unless it is run by a worker.
     pthread_t thread;
+    struct worker* worker;
+
+    // Clients of the same worker, and the next one it must update. A client
+    // is `dirty` while it waits to be updated, and `wake_pending` while it
+    // waits in the worker woken list.
+    struct client* next;
+    struct client* prev;
+    struct client* next_dirty;
+    bool dirty;
+    bool wake_pending;
+
+    // Position of the client in the worker ready list, while its bridged
+    // server data waits for its turn, and the bytes it may read beyond its
+    // quantum on the next one.
+    struct client* next_ready;
+    struct client* prev_ready;
+    bool ready;
+    int64_t deficit;
+
+    // When the bridged server data waiting was found ready (monotonic
+    // microseconds, 0 if none is or it is not measured).
+    uint64_t ready_since;
+
+    // Scheduling class, from the request path: 0 for the default one, `n`
+    // for the n-th configured one.
+    unsigned sched_class;
+
+    // Bytes waiting in the output queue at the last update, read by the
+    // listening thread to admit new clients.
+    size_t queued;
+
+    // Position of the client in the broadcast subscribers.
+    size_t subscriber_index;
+
+    // Loop running the client, and its watches on the client descriptors.
+    loop_t* loop;
+    loop_watch_t ws_watch;
+    loop_watch_t server_watch;
+    loop_watch_t wake_watch;
+    loop_watch_t shm_watch;
+
+    // Deadline of the current state: handshake and bridged server
+    // connection, idle timeout while open, then close handshake.
+    // The idle deadline is checked against the loop time of the last
+    // message relayed in either direction when it expires, rather than
+    // re-armed on each message.
+    wheel_timer_t deadline;
+    uint64_t last_activity;
+
+    // Sends pings, or detects the missing pong when one is pending.
+    wheel_timer_t ping_timer;
+
+    // Expires when held frames are due, when run by a worker.
+    wheel_timer_t push_timer;
+
+    // Retries taking the claimed session over, until the previous
+    // connection of the client detached it.
+    wheel_timer_t resume_timer;
+
+    bridge_t* bridge;
+
+    // permessage-deflate state, streams are borrowed from the bridge pool.
+    pmd_context_t pmd;
+
+    // Frames waiting to be written on `ws_sock`.
+    frame_queue_t out;
+
+    // Status sent in the close frame when the client is closed.
+    ws_close_status_t close_status;
+
+    // Opcode of the first frame of the message being received, whose
+    // fragments are in `ws_message`, and whether it is compressed. No
+    // message is being received while it is WS_OP_CONTINUATION_FRAME.
+    ws_opcode_t message_opcode;
+
+    // Validation of the fragments of an uncompressed text message, as they
+    // arrive.
+    utf8_state_t message_utf8;
+
+    // Bytes received from the client: its handshake, then its frames.
+    buffer_t ws_in;
+    buffer_t ws_message;
+
+    // Bytes received from the server and not relayed yet.
+    buffer_t server_in;
+
+    // Bytes of a client message that the bridged server couldn't take yet.
+    // The following frames are left in `ws_in` until it is written.
+    buffer_t server_out;
+
+    // Rings of a shared memory server connection, whose socket is then
+    // only watched for its closing.
+    shm_t shm;
+
+    // Size of the next server read, adapted to the server throughput, and
+    // the number of consecutive reads which used little of it.
+    size_t recv_size;
+    unsigned recv_small_count;
+
+    // eventfd waking the client thread up when another thread queued
+    // frames, or SOCKET_ERROR if only the client thread writes them.
+    int wake_fd;
+
+    // Bytes written to the web socket when it was last pushed, and when the
+    // bytes written since are due (monotonic microseconds, 0 if none are).
+    size_t pushed_bytes;
+    uint64_t push_deadline;
+
+    // When the bridged server connection was started, and when the oldest
+    // server data not written to the web socket yet was received (monotonic
+    // microseconds, 0 if none is waiting). The latter is also set by the
+    // broadcast thread.
+    uint64_t connect_started;
+    uint64_t relay_started;
 
-    const char* bridged_host;
-    int bridged_port;
+    // Identifier of the client in the traffic capture, 0 if not captured.
+    uint32_t capture_id;
+
+    // Data of the in-process handler for the client, and whether the
+    // handler opened it and must be told when it is closed.
+    void* handler_data;
+    bool handler_open;
+
+    // Coroutine running the callbacks of a handler with a stack, or NULL
+    // until the first one, the callback it was last given with its result,
+    // and whether it did not return yet. The message given to it is kept in
+    // `server_out` meanwhile.
+    struct coro* coro;
+    client_callback_t callback;
+    ws_opcode_t callback_opcode;
+    handler_status_t callback_status;
+    bool callback_pending;
+
+    // Set by the server handing its sockets over: a client running in its
+    // own thread is closed with a going away status once open.
+    bool going_away;
+
+    // Set by the broadcast thread when the client is too slow to take its
+    // frames: its own thread or worker then closes it.
+    bool dropped;
+
+    // Session of the client, NULL if resuming is disabled or while the
+    // session it claimed with `resume_token` is not taken yet, in which
+    // case `resume_count` messages of it were received. `ws_lost` is set
+    // when the web socket fails, so that the session is then detached.
+    resume_session_t* session;
+    char resume_token[RESUME_TOKEN_SIZE + 1];
+    uint64_t resume_count;
+    bool ws_lost;
+
+    client_stats_t stats;
 } client_t;
 
 
 /*
  * Initialize a client using the `sock` socket.
  */
-void client_init(client_t* client, socket_t sock, const char* bridged_host,
-                 int bridged_port);
+void client_init(client_t* client, socket_t sock, bridge_t* bridge);
 
 
 /*
@@ -67,6 +273,37 @@ void client_send_401(client_t* client);
 void client_send_500(client_t* client);
 
 
+/*
+ * Watch the client sockets on `loop`, and wait for its handshake.
+ * Returns `CLIENT_ERROR` on failure, `CLIENT_SUCCESS` otherwise.
+ */
+client_status_t client_setup(client_t* client, loop_t* loop);
+
+
+/*
+ * Write the frames queued on the client, and update the events it waits
+ * for. Run after the events of the client were handled. If something goes
+ * wrong, the client `alive` member becomes false.
+ */
+void client_update(client_t* client);
+
+
+/*
+ * Relay the bridged server data of a client run by a worker, on its turn:
+ * read up to `budget` bytes, for at most `turn_time` microseconds if not
+ * 0. Sets `more` if data may be left, and returns the bytes read. If
+ * something goes wrong, the client `alive` member becomes false.
+ */
+size_t client_serve(client_t* client, size_t budget, int turn_time,
+                    bool* more);
+
+
+/*
+ * Returns the weight of the scheduling class of the client.
+ */
+int client_weight(client_t* client);
+
+
 /*
  * Handle the client life. If something goes wrong, it is written on stderr,
  * and the client's sockets are closed.
@@ -76,6 +313,39 @@ void client_send_500(client_t* client);
 void* client_thread(client_t* client);
 
 
+/*
+ * Send the message `msg` of `size` bytes to the client, in a frame of
+ * `opcode`, compressed if the client negotiated it. Only called from the
+ * callbacks of the in-process handler, by the thread running the client.
+ * Returns `CLIENT_ERROR` if the client is closing or failed, in which case
+ * it is closed, or `CLIENT_SUCCESS` otherwise.
+ */
+client_status_t client_send(client_t* client, ws_opcode_t opcode,
+                            const char* msg, size_t size);
+
+
+/*
+ * Close the client with `status`, after the messages sent so far, if it is
+ * open. Only called by the thread running the client, as from the
+ * callbacks of the in-process handler.
+ */
+void client_shutdown(client_t* client, ws_close_status_t status);
+
+
+/*
+ * Wake the client thread or worker up, after queuing frames from another
+ * thread.
+ */
+void client_wake(client_t* client);
+
+
+/*
+ * Returns the bytes of memory held by the client: its state, buffers,
+ * queued frames and compression streams.
+ */
+size_t client_resident_bytes(client_t* client);
+
+
 /*
  * Close a client sockets. Set its `alive` member at false.
  */
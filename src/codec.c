@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <byteswap.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "codec.h"
+#include "logger.h"
+#include "metrics.h"
+
+
+codec_status_t codec_decode(const config_codec_t* codec,
+                            const char* buf, size_t size, size_t max_size,
+                            codec_message_t* messages, size_t max_count,
+                            size_t* count, size_t* consumed)
+{
+    size_t offset = 0;
+    *count = 0;
+
+    if (codec->type == CONFIG_CODEC_RAW) {
+        if (size > 0 && max_count > 0) {
+            messages[0] = (codec_message_t){ .data = buf, .size = size };
+            *count = 1;
+            offset = size;
+        }
+        *consumed = offset;
+        return CODEC_SUCCESS;
+    }
+
+    while (*count < max_count && offset < size) {
+        const char* msg = buf + offset;
+        size_t left = size - offset;
+
+        // A message is made of a header, its content and a delimiter.
+        size_t head = 0;
+        size_t len = 0;
+        size_t delimiter = 0;
+
+        switch (codec->type) {
+          case CONFIG_CODEC_LINE: {
+            const char* end = memchr(msg, '\n', left);
+            if (!end) {
+                len = left;
+                delimiter = 1;
+                break;
+            }
+            len = end - msg;
+            delimiter = 1;
+            if (len > 0 && end[-1] == '\r') {
+                len--;
+                delimiter++;
+            }
+            break;
+          }
+
+          case CONFIG_CODEC_U16: {
+            uint16_t len_u16;
+            if (left < sizeof(len_u16)) {
+                goto end;
+            }
+            memcpy(&len_u16, msg, sizeof(len_u16));
+            head = sizeof(len_u16);
+            len = __bswap_16(len_u16);
+            break;
+          }
+
+          case CONFIG_CODEC_U32: {
+            uint32_t len_u32;
+            if (left < sizeof(len_u32)) {
+                goto end;
+            }
+            memcpy(&len_u32, msg, sizeof(len_u32));
+            head = sizeof(len_u32);
+            len = __bswap_32(len_u32);
+            break;
+          }
+
+          case CONFIG_CODEC_FIXED:
+            len = codec->record_size;
+            break;
+
+          default:
+            return CODEC_ERROR;
+        }
+
+        if (len > max_size) {
+            LOG_ERROR("server message of %zu bytes exceeds %zu bytes",
+                      len, max_size);
+            return CODEC_ERROR;
+        }
+        if (left < head + len + delimiter) {
+            break;
+        }
+
+        messages[(*count)++] = (codec_message_t){
+            .data = msg + head,
+            .size = len,
+        };
+        offset += head + len + delimiter;
+    }
+
+  end:
+    *consumed = offset;
+    return CODEC_SUCCESS;
+}
+
+
+size_t codec_encode(const config_codec_t* codec, const char* msg,
+                    size_t size, char* head, struct iovec* iov)
+{
+    size_t head_size = 0;
+    const char* tail = NULL;
+    size_t tail_size = 0;
+
+    switch (codec->type) {
+      case CONFIG_CODEC_RAW:
+        break;
+
+      case CONFIG_CODEC_LINE:
+        if (memchr(msg, '\n', size)) {
+            LOG_ERROR("cannot send a message containing a newline");
+            return 0;
+        }
+        tail = "\n";
+        tail_size = 1;
+        break;
+
+      case CONFIG_CODEC_U16: {
+        if (size > UINT16_MAX) {
+            LOG_ERROR("message of %zu bytes is too long", size);
+            return 0;
+        }
+        uint16_t len = __bswap_16((uint16_t)size);
+        memcpy(head, &len, sizeof(len));
+        head_size = sizeof(len);
+        break;
+      }
+
+      case CONFIG_CODEC_U32: {
+        if (size > UINT32_MAX) {
+            LOG_ERROR("message of %zu bytes is too long", size);
+            return 0;
+        }
+        uint32_t len = __bswap_32((uint32_t)size);
+        memcpy(head, &len, sizeof(len));
+        head_size = sizeof(len);
+        break;
+      }
+
+      case CONFIG_CODEC_FIXED:
+        if (size != codec->record_size) {
+            LOG_ERROR("message of %zu bytes is not a %zu bytes "
+                      "record", size, codec->record_size);
+            return 0;
+        }
+        break;
+
+      default:
+        return 0;
+    }
+
+    size_t iov_count = 0;
+    if (head_size) {
+        iov[iov_count++] = (struct iovec){ head, head_size };
+    }
+    iov[iov_count++] = (struct iovec){ (void*)msg, size };
+    if (tail_size) {
+        iov[iov_count++] = (struct iovec){ (void*)tail, tail_size };
+    }
+    return iov_count;
+}
+
+
+codec_status_t codec_send(const config_codec_t* codec, socket_t sock,
+                          const char* msg, size_t size, buffer_t* pending)
+{
+    char head[CODEC_HEAD_MAX];
+    struct iovec iov[CODEC_IOV_MAX];
+    size_t iov_count = codec_encode(codec, msg, size, head, iov);
+    if (iov_count == 0) {
+        return CODEC_ERROR;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < iov_count; i++) {
+        total += iov[i].iov_len;
+    }
+    ssize_t written = 0;
+
+    // Bytes already pending go first.
+    if (!pending || buffer_size(pending) == 0) {
+        struct msghdr hdr = {
+            .msg_iov = iov,
+            .msg_iovlen = iov_count,
+        };
+        written = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+        if (written < 0 && pending
+            && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            written = 0;
+        }
+        if (written < 0 || (!pending && written != total)) {
+            LOG_ERROR("unable to send message to the bridged server");
+            return CODEC_ERROR;
+        }
+        metrics_add(METRICS_UPSTREAM_BYTES_OUT, written);
+    }
+
+    // Keep what the socket didn't take.
+    for (size_t i = 0; i < iov_count; i++) {
+        size_t skip = (size_t)written < iov[i].iov_len
+                    ? (size_t)written
+                    : iov[i].iov_len;
+        size_t left = iov[i].iov_len - skip;
+        written -= skip;
+        if (left == 0) {
+            continue;
+        }
+        if (!buffer_reserve(pending, left)) {
+            LOG_ERROR("cannot allocate the bridged server buffer");
+            return CODEC_ERROR;
+        }
+        memcpy(buffer_tail(pending), (char*)iov[i].iov_base + skip, left);
+        buffer_commit(pending, left);
+    }
+    return CODEC_SUCCESS;
+}
+
+
+codec_status_t codec_flush(socket_t sock, buffer_t* pending) {
+    while (buffer_size(pending) > 0) {
+        ssize_t written = send(sock, buffer_content(pending),
+                               buffer_size(pending), MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return CODEC_SUCCESS;
+            }
+            LOG_ERROR("unable to send message to the bridged server");
+            return CODEC_ERROR;
+        }
+        metrics_add(METRICS_UPSTREAM_BYTES_OUT, written);
+        buffer_consume(pending, written);
+    }
+    buffer_release(pending);
+    return CODEC_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/*
+ * Message delimitation on the bridged server connection.
+ *
+ * Decoding never copies: messages point in the receive buffer, which must
+ * be kept untouched until they are sent.
+ */
+#ifndef _codec_h_
+#define _codec_h_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "buffer.h"
+#include "config.h"
+#include "net.h"
+
+
+// Largest delimiter preceding a message, and buffers of an encoded one.
+#define CODEC_HEAD_MAX  4
+#define CODEC_IOV_MAX   3
+
+
+typedef enum codec_status {
+    CODEC_ERROR = -1,
+    CODEC_SUCCESS = 0,
+} codec_status_t;
+
+
+typedef struct codec_message {
+    const char* data;
+    size_t size;
+} codec_message_t;
+
+
+/*
+ * Split the `size` received bytes of `buf` into at most `max_count`
+ * messages. `*count` is set to the number of decoded messages, and
+ * `*consumed` to the number of bytes they used, delimiters included.
+ * Incomplete messages are left for the next call, except with the raw codec
+ * which uses all the bytes.
+ * Returns `CODEC_ERROR` if a message is larger than `max_size`, or
+ * `CODEC_SUCCESS` otherwise.
+ */
+codec_status_t codec_decode(const config_codec_t* codec,
+                            const char* buf, size_t size, size_t max_size,
+                            codec_message_t* messages, size_t max_count,
+                            size_t* count, size_t* consumed);
+
+
+/*
+ * Delimit the message `msg` following `codec`, filling `iov` with the
+ * buffers to send, up to `CODEC_IOV_MAX`. The delimiter preceding the
+ * message is written in `head`, of `CODEC_HEAD_MAX` bytes.
+ * Returns the number of buffers, or 0 if the message cannot be encoded.
+ */
+size_t codec_encode(const config_codec_t* codec, const char* msg,
+                    size_t size, char* head, struct iovec* iov);
+
+
+/*
+ * Send the message `msg` on `sock`, delimited following `codec`. When
+ * `pending` is not NULL, the bytes that the non-blocking `sock` can't take
+ * now are appended to it, to be written by `codec_flush`: the message is
+ * then entirely pending if nothing was written, as a packet must be.
+ * Returns `CODEC_ERROR` if the message cannot be encoded or sent, or
+ * `CODEC_SUCCESS` otherwise.
+ */
+codec_status_t codec_send(const config_codec_t* codec, socket_t sock,
+                          const char* msg, size_t size, buffer_t* pending);
+
+
+/*
+ * Write the bytes of `pending` that `sock` can take, which must hold a
+ * single message when it is a packet socket.
+ * Returns `CODEC_ERROR` if the socket failed, or `CODEC_SUCCESS` otherwise.
+ */
+codec_status_t codec_flush(socket_t sock, buffer_t* pending);
+
+
+#endif
@@ -0,0 +1,862 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sched.h>
+
+#include "config.h"
+#include "net.h"
+#include "shm.h"
+
+
+void config_init(config_t* config) {
+    *config = (config_t){
+        .listening_port = 0,
+        .bridged_host = NULL,
+        .bridged_port = 0,
+        .listening_unix = NULL,
+        .bridged_unix = NULL,
+        .bridged_shm = NULL,
+        .shm_ring_size = 256 * 1024,
+        .upgrade_socket = NULL,
+        .drain_time = 30000,
+        .resume_time = 0,
+        .resume_buffer = 256 * 1024,
+        .max_message_size = 16 * 1024 * 1024,
+        .max_queue_size = 4 * 1024 * 1024,
+        .broadcast = false,
+        .workers = 0,
+        .cpu_count = 0,
+        .busy_poll = 0,
+        .upstream_opcode = CONFIG_OPCODE_AUTO,
+        .upstream_codec = {
+            .type = CONFIG_CODEC_RAW,
+            .record_size = 0,
+        },
+        .recv_buffer_max = 256 * 1024,
+        .read_budget = 1024 * 1024,
+        .turn_time = 1000,
+        .class_count = 0,
+        .coalesce_reads = false,
+        .coalesce = {
+            .latency_us = 0,
+            .max_batch = 64 * 1024,
+        },
+        .timeouts = {
+            .handshake = 10000,
+            .idle = 0,
+            .ping_interval = 30000,
+            .pong = 10000,
+            .close = 5000,
+        },
+        .admission = {
+            .max_clients = 0,
+            .max_queued = 0,
+            .max_loop_lag = 0,
+            .max_upstream_failures = 0,
+            .pause = false,
+            .rate = 0,
+            .burst = 0,
+        },
+        .deflate = {
+            .enabled = true,
+            .server_no_context_takeover = false,
+            .client_no_context_takeover = false,
+            .server_max_window_bits = 15,
+            .client_max_window_bits = 15,
+            .level = 6,
+            .mem_level = 8,
+            .threshold = 64,
+        },
+        .log = {
+            .level = CONFIG_LOG_INFO,
+            .payload_sample = 1,
+            .payload_rate = 100,
+        },
+        .metrics_port = 0,
+        .capture = {
+            .path = NULL,
+            .size = 64 << 20,
+            .sample = 1,
+        },
+        .tls = {
+            .cert = NULL,
+            .key = NULL,
+            .ktls = true,
+        },
+    };
+}
+
+
+void config_usage(FILE* out, const char* program) {
+    fprintf(out,
+        "usage: %s [options] <listening port> <broadcast hostname> "
+        "<broadcast port>\n"
+        "       %s [options] <listening port> unix:PATH|unixpacket:PATH\n"
+        "       %s [options] <listening port> shm:PATH\n"
+        "\n"
+        "The listening port may be a unix:PATH too. Unix socket paths "
+        "starting with\n"
+        "'@' are in the abstract namespace. A shm:PATH server is reached "
+        "through shared\n"
+        "memory rings, set up over the unix packet socket PATH.\n"
+        "\n"
+        "options:\n"
+        "  --max-message-size=BYTES          largest client message "
+                                             "(default 16777216)\n"
+        "  --max-queue-size=BYTES            output bytes queued before "
+                                             "dropping a client\n"
+        "                                    (default 4194304)\n"
+        "  --broadcast                       share one bridged server "
+                                             "connection between\n"
+        "                                    all clients\n"
+        "  --workers=N                       run connections in N event "
+                                             "loop threads\n"
+        "                                    instead of a thread each "
+                                             "(default 0)\n"
+        "  --cpus=LIST                       pin the workers in turn to the "
+                                             "CPUs of\n"
+        "                                    LIST, as 0-3,8\n"
+        "  --busy-poll=USEC                  poll for data up to USEC "
+                                             "before sleeping\n"
+        "                                    (default 0)\n"
+        "  --upstream-opcode=auto|text|binary\n"
+        "                                    opcode of relayed server "
+                                             "data; auto sends\n"
+        "                                    valid UTF-8 as text "
+                                             "(default auto)\n"
+        "  --upstream-codec=raw|line|u16|u32|fixed:SIZE\n"
+        "                                    message delimitation on the "
+                                             "server\n"
+        "                                    connection (default raw)\n"
+        "  --recv-buffer-max=BYTES           largest read from the server "
+                                             "(default 262144)\n"
+        "  --read-budget=BYTES               bytes read from a server "
+                                             "connection per\n"
+        "                                    wakeup (default 1048576)\n"
+        "  --turn-time=USEC                  time a worker spends on a "
+                                             "connection per\n"
+        "                                    turn, 0 for no limit "
+                                             "(default 1000)\n"
+        "  --class=PREFIX:WEIGHT             read budget multiplier of "
+                                             "the clients whose\n"
+        "                                    request path starts with "
+                                             "PREFIX\n"
+        "  --coalesce-reads                  relay a wakeup's raw reads "
+                                             "as one message\n"
+        "  --coalesce-latency=USEC           hold frames to clients up to "
+                                             "USEC to send\n"
+        "                                    them together (default 0)\n"
+        "  --coalesce-max-batch=BYTES        send held frames past this "
+                                             "size\n"
+        "                                    (default 65536)\n"
+        "  --handshake-timeout=MS            time given to complete the "
+                                             "handshake\n"
+        "                                    (default 10000)\n"
+        "  --idle-timeout=MS                 close clients idle for MS "
+                                             "(default 0, never)\n"
+        "  --ping-interval=MS                time between pings "
+                                             "(default 30000, 0 never)\n"
+        "  --pong-timeout=MS                 time waited for a pong "
+                                             "(default 10000)\n"
+        "  --close-timeout=MS                time waited for the client "
+                                             "close frame\n"
+        "                                    (default 5000)\n"
+        "  --no-deflate                      disable permessage-deflate\n"
+        "  --deflate-window-bits=9..15       server compressor window "
+                                             "(default 15)\n"
+        "  --deflate-client-window-bits=9..15\n"
+        "                                    window asked to clients "
+                                             "(default 15)\n"
+        "  --deflate-no-context-takeover     reset the server compressor "
+                                             "after each message\n"
+        "  --deflate-client-no-context-takeover\n"
+        "                                    ask clients to reset their "
+                                             "compressor\n"
+        "  --deflate-level=0..9              compression level (default 6)\n"
+        "  --deflate-mem-level=1..9          zlib memory level (default 8)\n"
+        "  --deflate-threshold=BYTES         send smaller messages raw "
+                                             "(default 64)\n"
+        "  --log-level=error|warning|info|debug\n"
+        "                                    least important records "
+                                             "written; debug\n"
+        "                                    logs payloads (default info)\n"
+        "  --log-payload-sample=N            log one payload out of N "
+                                             "(default 1)\n"
+        "  --log-payload-rate=N              payloads logged per second "
+                                             "and thread\n"
+        "                                    (default 100, 0 unlimited)\n"
+        "  --metrics-port=PORT               serve Prometheus metrics on "
+                                             "PORT\n"
+        "                                    (default 0, disabled)\n"
+        "  --capture=FILE                    record the relayed messages "
+                                             "in FILE\n"
+        "  --capture-size=BYTES              largest capture file "
+                                             "(default 67108864)\n"
+        "  --capture-sample=N                capture one connection out "
+                                             "of N\n"
+        "                                    (default 1)\n"
+        "  --tls-cert=FILE                   accept TLS connections with "
+                                             "the PEM\n"
+        "                                    certificate chain in FILE\n"
+        "  --tls-key=FILE                    PEM private key (default, "
+                                             "in the\n"
+        "                                    certificate file)\n"
+        "  --no-ktls                         keep TLS records in user "
+                                             "space\n"
+        "  --shm-ring-size=BYTES             bytes of each shared memory "
+                                             "ring, a power\n"
+        "                                    of two (default 262144)\n"
+        "  --upgrade-socket=PATH             hand the listening sockets "
+                                             "over to a new\n"
+        "                                    process connecting PATH, "
+                                             "taking them from\n"
+        "                                    a running one first\n"
+        "  --drain-time=MS                   time over which clients are "
+                                             "closed after\n"
+        "                                    the handover (default "
+                                             "30000)\n"
+        "  --resume-time=MS                  keep the bridged server "
+                                             "connection of a\n"
+        "                                    lost client for MS to "
+                                             "resume (default 0,\n"
+        "                                    disabled)\n"
+        "  --resume-buffer=BYTES             bytes of the last messages "
+                                             "kept to resume\n"
+        "                                    a client (default 262144)\n"
+        "  --max-clients=COUNT               clients run at once before "
+                                             "overload\n"
+        "                                    (default 0, no limit)\n"
+        "  --max-queued=BYTES                bytes queued to all the "
+                                             "clients before\n"
+        "                                    overload (default 0, no "
+                                             "limit)\n"
+        "  --max-loop-lag=MS                 lag of a worker loop before "
+                                             "overload\n"
+        "                                    (default 0, no limit)\n"
+        "  --max-upstream-failures=COUNT     failed bridged server "
+                                             "connections in a\n"
+        "                                    row before overload, a "
+                                             "client per second\n"
+        "                                    still probing it (default 0, "
+                                             "no limit)\n"
+        "  --overload=reject|pause           answer new clients with a 503 "
+                                             "while\n"
+        "                                    overloaded, or stop accepting "
+                                             "them\n"
+        "                                    (default reject)\n"
+        "  --rate-limit=COUNT                clients accepted per second "
+                                             "from each\n"
+        "                                    address, others answered "
+                                             "with a 429\n"
+        "                                    (default 0, no limit)\n"
+        "  --rate-burst=COUNT                clients accepted at once from "
+                                             "each\n"
+        "                                    address (default the rate)\n",
+        program, program, program);
+}
+
+
+static config_status_t _config_parse_int(const char* name, const char* str,
+                                         int min, int max, int* out)
+{
+    char* end;
+    long value = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value < min || value > max) {
+        fprintf(stderr, "%s: '%s' is not in [%d, %d]\n", name, str, min, max);
+        return CONFIG_ERROR;
+    }
+    *out = value;
+    return CONFIG_SUCCESS;
+}
+
+
+static config_status_t _config_parse_size(const char* name, const char* str,
+                                          size_t* out)
+{
+    char* end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (*str == '\0' || *str == '-' || *end != '\0') {
+        fprintf(stderr, "%s: '%s' is not a valid size\n", name, str);
+        return CONFIG_ERROR;
+    }
+    *out = value;
+    return CONFIG_SUCCESS;
+}
+
+
+enum {
+    OPT_MAX_MESSAGE_SIZE = 256,
+    OPT_MAX_QUEUE_SIZE,
+    OPT_BROADCAST,
+    OPT_WORKERS,
+    OPT_CPUS,
+    OPT_BUSY_POLL,
+    OPT_UPSTREAM_OPCODE,
+    OPT_UPSTREAM_CODEC,
+    OPT_RECV_BUFFER_MAX,
+    OPT_READ_BUDGET,
+    OPT_TURN_TIME,
+    OPT_CLASS,
+    OPT_COALESCE_READS,
+    OPT_COALESCE_LATENCY,
+    OPT_COALESCE_MAX_BATCH,
+    OPT_HANDSHAKE_TIMEOUT,
+    OPT_IDLE_TIMEOUT,
+    OPT_PING_INTERVAL,
+    OPT_PONG_TIMEOUT,
+    OPT_CLOSE_TIMEOUT,
+    OPT_NO_DEFLATE,
+    OPT_DEFLATE_WINDOW_BITS,
+    OPT_DEFLATE_CLIENT_WINDOW_BITS,
+    OPT_DEFLATE_NO_CONTEXT_TAKEOVER,
+    OPT_DEFLATE_CLIENT_NO_CONTEXT_TAKEOVER,
+    OPT_DEFLATE_LEVEL,
+    OPT_DEFLATE_MEM_LEVEL,
+    OPT_DEFLATE_THRESHOLD,
+    OPT_LOG_LEVEL,
+    OPT_LOG_PAYLOAD_SAMPLE,
+    OPT_LOG_PAYLOAD_RATE,
+    OPT_METRICS_PORT,
+    OPT_CAPTURE,
+    OPT_CAPTURE_SIZE,
+    OPT_CAPTURE_SAMPLE,
+    OPT_TLS_CERT,
+    OPT_TLS_KEY,
+    OPT_NO_KTLS,
+    OPT_SHM_RING_SIZE,
+    OPT_UPGRADE_SOCKET,
+    OPT_DRAIN_TIME,
+    OPT_RESUME_TIME,
+    OPT_RESUME_BUFFER,
+    OPT_MAX_CLIENTS,
+    OPT_MAX_QUEUED,
+    OPT_MAX_LOOP_LAG,
+    OPT_MAX_UPSTREAM_FAILURES,
+    OPT_OVERLOAD,
+    OPT_RATE_LIMIT,
+    OPT_RATE_BURST,
+};
+
+
+static const struct option options_g[] = {
+    { "max-message-size", required_argument, NULL, OPT_MAX_MESSAGE_SIZE },
+    { "max-queue-size", required_argument, NULL, OPT_MAX_QUEUE_SIZE },
+    { "broadcast", no_argument, NULL, OPT_BROADCAST },
+    { "workers", required_argument, NULL, OPT_WORKERS },
+    { "cpus", required_argument, NULL, OPT_CPUS },
+    { "busy-poll", required_argument, NULL, OPT_BUSY_POLL },
+    { "upstream-opcode", required_argument, NULL, OPT_UPSTREAM_OPCODE },
+    { "upstream-codec", required_argument, NULL, OPT_UPSTREAM_CODEC },
+    { "recv-buffer-max", required_argument, NULL, OPT_RECV_BUFFER_MAX },
+    { "read-budget", required_argument, NULL, OPT_READ_BUDGET },
+    { "turn-time", required_argument, NULL, OPT_TURN_TIME },
+    { "class", required_argument, NULL, OPT_CLASS },
+    { "coalesce-reads", no_argument, NULL, OPT_COALESCE_READS },
+    { "coalesce-latency", required_argument, NULL, OPT_COALESCE_LATENCY },
+    { "coalesce-max-batch", required_argument, NULL,
+      OPT_COALESCE_MAX_BATCH },
+    { "handshake-timeout", required_argument, NULL, OPT_HANDSHAKE_TIMEOUT },
+    { "idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT },
+    { "ping-interval", required_argument, NULL, OPT_PING_INTERVAL },
+    { "pong-timeout", required_argument, NULL, OPT_PONG_TIMEOUT },
+    { "close-timeout", required_argument, NULL, OPT_CLOSE_TIMEOUT },
+    { "no-deflate", no_argument, NULL, OPT_NO_DEFLATE },
+    { "deflate-window-bits", required_argument, NULL,
+      OPT_DEFLATE_WINDOW_BITS },
+    { "deflate-client-window-bits", required_argument, NULL,
+      OPT_DEFLATE_CLIENT_WINDOW_BITS },
+    { "deflate-no-context-takeover", no_argument, NULL,
+      OPT_DEFLATE_NO_CONTEXT_TAKEOVER },
+    { "deflate-client-no-context-takeover", no_argument, NULL,
+      OPT_DEFLATE_CLIENT_NO_CONTEXT_TAKEOVER },
+    { "deflate-level", required_argument, NULL, OPT_DEFLATE_LEVEL },
+    { "deflate-mem-level", required_argument, NULL, OPT_DEFLATE_MEM_LEVEL },
+    { "deflate-threshold", required_argument, NULL, OPT_DEFLATE_THRESHOLD },
+    { "log-level", required_argument, NULL, OPT_LOG_LEVEL },
+    { "log-payload-sample", required_argument, NULL,
+      OPT_LOG_PAYLOAD_SAMPLE },
+    { "log-payload-rate", required_argument, NULL, OPT_LOG_PAYLOAD_RATE },
+    { "metrics-port", required_argument, NULL, OPT_METRICS_PORT },
+    { "capture", required_argument, NULL, OPT_CAPTURE },
+    { "capture-size", required_argument, NULL, OPT_CAPTURE_SIZE },
+    { "capture-sample", required_argument, NULL, OPT_CAPTURE_SAMPLE },
+    { "tls-cert", required_argument, NULL, OPT_TLS_CERT },
+    { "tls-key", required_argument, NULL, OPT_TLS_KEY },
+    { "no-ktls", no_argument, NULL, OPT_NO_KTLS },
+    { "shm-ring-size", required_argument, NULL, OPT_SHM_RING_SIZE },
+    { "upgrade-socket", required_argument, NULL, OPT_UPGRADE_SOCKET },
+    { "drain-time", required_argument, NULL, OPT_DRAIN_TIME },
+    { "resume-time", required_argument, NULL, OPT_RESUME_TIME },
+    { "resume-buffer", required_argument, NULL, OPT_RESUME_BUFFER },
+    { "max-clients", required_argument, NULL, OPT_MAX_CLIENTS },
+    { "max-queued", required_argument, NULL, OPT_MAX_QUEUED },
+    { "max-loop-lag", required_argument, NULL, OPT_MAX_LOOP_LAG },
+    { "max-upstream-failures", required_argument, NULL,
+      OPT_MAX_UPSTREAM_FAILURES },
+    { "overload", required_argument, NULL, OPT_OVERLOAD },
+    { "rate-limit", required_argument, NULL, OPT_RATE_LIMIT },
+    { "rate-burst", required_argument, NULL, OPT_RATE_BURST },
+    { NULL, 0, NULL, 0 }
+};
+
+
+static config_status_t _config_parse_opcode(const char* name, const char* str,
+                                            config_opcode_t* out)
+{
+    if (strcmp(str, "auto") == 0) {
+        *out = CONFIG_OPCODE_AUTO;
+    } else
+    if (strcmp(str, "text") == 0) {
+        *out = CONFIG_OPCODE_TEXT;
+    } else
+    if (strcmp(str, "binary") == 0) {
+        *out = CONFIG_OPCODE_BINARY;
+    } else {
+        fprintf(stderr, "%s: unknown opcode mode '%s'\n", name, str);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+static config_status_t _config_parse_codec(const char* name, const char* str,
+                                           config_codec_t* out)
+{
+    static const char* FIXED = "fixed:";
+
+    if (strcmp(str, "raw") == 0) {
+        out->type = CONFIG_CODEC_RAW;
+    } else
+    if (strcmp(str, "line") == 0) {
+        out->type = CONFIG_CODEC_LINE;
+    } else
+    if (strcmp(str, "u16") == 0) {
+        out->type = CONFIG_CODEC_U16;
+    } else
+    if (strcmp(str, "u32") == 0) {
+        out->type = CONFIG_CODEC_U32;
+    } else
+    if (strncmp(str, FIXED, strlen(FIXED)) == 0) {
+        out->type = CONFIG_CODEC_FIXED;
+        if (_config_parse_size(name, str + strlen(FIXED), &out->record_size)
+            != CONFIG_SUCCESS)
+        {
+            return CONFIG_ERROR;
+        }
+        if (out->record_size == 0) {
+            fprintf(stderr, "%s: records cannot be empty\n", name);
+            return CONFIG_ERROR;
+        }
+    } else {
+        fprintf(stderr, "%s: unknown codec '%s'\n", name, str);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse a scheduling class, "PREFIX:WEIGHT", into the next class of
+ * `config`.
+ */
+static config_status_t _config_parse_class(const char* name, const char* str,
+                                           config_t* config)
+{
+    const char* colon = strrchr(str, ':');
+    if (config->class_count == CONFIG_MAX_CLASSES) {
+        fprintf(stderr, "%s: at most %d classes\n", name, CONFIG_MAX_CLASSES);
+        return CONFIG_ERROR;
+    }
+    // Prefixes are written in the metrics labels as they are.
+    if (!colon || str[0] != '/' || strpbrk(str, "\"\\")) {
+        fprintf(stderr, "%s: '%s' is not a /PREFIX:WEIGHT class\n", name,
+                str);
+        return CONFIG_ERROR;
+    }
+    config_class_t* class = &config->classes[config->class_count];
+    class->prefix = str;
+    class->prefix_size = colon - str;
+    if (_config_parse_int(name, colon + 1, 1, 1000, &class->weight)
+        != CONFIG_SUCCESS)
+    {
+        return CONFIG_ERROR;
+    }
+    config->class_count++;
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse a comma separated list of CPUs and ranges of CPUs, as "0-3,8".
+ */
+static config_status_t _config_parse_cpus(const char* name, const char* str,
+                                          config_t* config)
+{
+    const char* item = str;
+
+    config->cpu_count = 0;
+    while (true) {
+        char* end;
+        long first = strtol(item, &end, 10);
+        long last = first;
+        if (end != item && *end == '-') {
+            const char* next = end + 1;
+            last = strtol(next, &end, 10);
+            if (end == next) {
+                goto error;
+            }
+        }
+        if (end == item || (*end != ',' && *end != '\0') || first < 0
+            || last < first || last >= CPU_SETSIZE)
+        {
+            goto error;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (config->cpu_count == CONFIG_MAX_WORKERS) {
+                fprintf(stderr, "%s: at most %d CPUs\n", name,
+                        CONFIG_MAX_WORKERS);
+                return CONFIG_ERROR;
+            }
+            config->cpus[config->cpu_count++] = cpu;
+        }
+        if (*end == '\0') {
+            return CONFIG_SUCCESS;
+        }
+        item = end + 1;
+    }
+
+  error:
+    fprintf(stderr, "%s: '%s' is not a list of CPUs below %d\n", name, str,
+            CPU_SETSIZE);
+    return CONFIG_ERROR;
+}
+
+
+static config_status_t _config_parse_log_level(const char* name,
+                                               const char* str,
+                                               config_log_level_t* out)
+{
+    if (strcmp(str, "error") == 0) {
+        *out = CONFIG_LOG_ERROR;
+    } else
+    if (strcmp(str, "warning") == 0) {
+        *out = CONFIG_LOG_WARNING;
+    } else
+    if (strcmp(str, "info") == 0) {
+        *out = CONFIG_LOG_INFO;
+    } else
+    if (strcmp(str, "debug") == 0) {
+        *out = CONFIG_LOG_DEBUG;
+    } else {
+        fprintf(stderr, "%s: unknown log level '%s'\n", name, str);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+static config_status_t _config_parse_option(config_t* config, int opt,
+                                            const char* name,
+                                            const char* arg)
+{
+    switch (opt) {
+      case OPT_MAX_MESSAGE_SIZE:
+        return _config_parse_size(name, arg, &config->max_message_size);
+
+      case OPT_MAX_QUEUE_SIZE:
+        return _config_parse_size(name, arg, &config->max_queue_size);
+
+      case OPT_BROADCAST:
+        config->broadcast = true;
+        return CONFIG_SUCCESS;
+
+      case OPT_WORKERS:
+        return _config_parse_int(name, arg, 0, CONFIG_MAX_WORKERS,
+                                 &config->workers);
+
+      case OPT_CPUS:
+        return _config_parse_cpus(name, arg, config);
+
+      case OPT_BUSY_POLL:
+        return _config_parse_int(name, arg, 0, 1000000, &config->busy_poll);
+
+      case OPT_UPSTREAM_OPCODE:
+        return _config_parse_opcode(name, arg, &config->upstream_opcode);
+
+      case OPT_UPSTREAM_CODEC:
+        return _config_parse_codec(name, arg, &config->upstream_codec);
+
+      case OPT_RECV_BUFFER_MAX:
+        return _config_parse_size(name, arg, &config->recv_buffer_max);
+
+      case OPT_READ_BUDGET:
+        return _config_parse_size(name, arg, &config->read_budget);
+
+      case OPT_TURN_TIME:
+        return _config_parse_int(name, arg, 0, INT_MAX, &config->turn_time);
+
+      case OPT_CLASS:
+        return _config_parse_class(name, arg, config);
+
+      case OPT_COALESCE_READS:
+        config->coalesce_reads = true;
+        return CONFIG_SUCCESS;
+
+      case OPT_COALESCE_LATENCY:
+        return _config_parse_int(name, arg, 0, 1000000,
+                                 &config->coalesce.latency_us);
+
+      case OPT_COALESCE_MAX_BATCH:
+        return _config_parse_size(name, arg, &config->coalesce.max_batch);
+
+      case OPT_HANDSHAKE_TIMEOUT:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->timeouts.handshake);
+
+      case OPT_IDLE_TIMEOUT:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->timeouts.idle);
+
+      case OPT_PING_INTERVAL:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->timeouts.ping_interval);
+
+      case OPT_PONG_TIMEOUT:
+        return _config_parse_int(name, arg, 1, INT_MAX,
+                                 &config->timeouts.pong);
+
+      case OPT_CLOSE_TIMEOUT:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->timeouts.close);
+
+      case OPT_NO_DEFLATE:
+        config->deflate.enabled = false;
+        return CONFIG_SUCCESS;
+
+      case OPT_DEFLATE_WINDOW_BITS:
+        // zlib cannot produce raw deflate streams with an 8 bits window.
+        return _config_parse_int(name, arg, 9, 15,
+                                 &config->deflate.server_max_window_bits);
+
+      case OPT_DEFLATE_CLIENT_WINDOW_BITS:
+        return _config_parse_int(name, arg, 9, 15,
+                                 &config->deflate.client_max_window_bits);
+
+      case OPT_DEFLATE_NO_CONTEXT_TAKEOVER:
+        config->deflate.server_no_context_takeover = true;
+        return CONFIG_SUCCESS;
+
+      case OPT_DEFLATE_CLIENT_NO_CONTEXT_TAKEOVER:
+        config->deflate.client_no_context_takeover = true;
+        return CONFIG_SUCCESS;
+
+      case OPT_DEFLATE_LEVEL:
+        return _config_parse_int(name, arg, 0, 9, &config->deflate.level);
+
+      case OPT_DEFLATE_MEM_LEVEL:
+        return _config_parse_int(name, arg, 1, 9, &config->deflate.mem_level);
+
+      case OPT_DEFLATE_THRESHOLD:
+        return _config_parse_size(name, arg, &config->deflate.threshold);
+
+      case OPT_LOG_LEVEL:
+        return _config_parse_log_level(name, arg, &config->log.level);
+
+      case OPT_LOG_PAYLOAD_SAMPLE:
+        return _config_parse_int(name, arg, 1, INT_MAX,
+                                 &config->log.payload_sample);
+
+      case OPT_LOG_PAYLOAD_RATE:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->log.payload_rate);
+
+      case OPT_METRICS_PORT:
+        return _config_parse_int(name, arg, 0, 65535, &config->metrics_port);
+
+      case OPT_CAPTURE:
+        config->capture.path = arg;
+        return CONFIG_SUCCESS;
+
+      case OPT_CAPTURE_SIZE:
+        return _config_parse_size(name, arg, &config->capture.size);
+
+      case OPT_CAPTURE_SAMPLE:
+        return _config_parse_int(name, arg, 1, INT_MAX,
+                                 &config->capture.sample);
+
+      case OPT_TLS_CERT:
+        config->tls.cert = arg;
+        return CONFIG_SUCCESS;
+
+      case OPT_TLS_KEY:
+        config->tls.key = arg;
+        return CONFIG_SUCCESS;
+
+      case OPT_NO_KTLS:
+        config->tls.ktls = false;
+        return CONFIG_SUCCESS;
+
+      case OPT_SHM_RING_SIZE:
+        if (_config_parse_size(name, arg, &config->shm_ring_size)
+            != CONFIG_SUCCESS)
+        {
+            return CONFIG_ERROR;
+        }
+        if (!shmring_size_valid(config->shm_ring_size)) {
+            fprintf(stderr, "%s: rings hold a power of two of bytes, "
+                    "between %d and %d\n", name, SHMRING_SIZE_MIN,
+                    SHMRING_SIZE_MAX);
+            return CONFIG_ERROR;
+        }
+        return CONFIG_SUCCESS;
+
+      case OPT_UPGRADE_SOCKET:
+        config->upgrade_socket = arg;
+        return CONFIG_SUCCESS;
+
+      case OPT_DRAIN_TIME:
+        return _config_parse_int(name, arg, 0, INT_MAX, &config->drain_time);
+
+      case OPT_RESUME_TIME:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->resume_time);
+
+      case OPT_RESUME_BUFFER:
+        return _config_parse_size(name, arg, &config->resume_buffer);
+
+      case OPT_MAX_CLIENTS:
+        return _config_parse_size(name, arg, &config->admission.max_clients);
+
+      case OPT_MAX_QUEUED:
+        return _config_parse_size(name, arg, &config->admission.max_queued);
+
+      case OPT_MAX_LOOP_LAG:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->admission.max_loop_lag);
+
+      case OPT_MAX_UPSTREAM_FAILURES:
+        return _config_parse_int(name, arg, 0, INT_MAX,
+                                 &config->admission.max_upstream_failures);
+
+      case OPT_OVERLOAD:
+        if (strcmp(arg, "reject") == 0) {
+            config->admission.pause = false;
+        } else
+        if (strcmp(arg, "pause") == 0) {
+            config->admission.pause = true;
+        } else {
+            fprintf(stderr, "%s: unknown policy '%s'\n", name, arg);
+            return CONFIG_ERROR;
+        }
+        return CONFIG_SUCCESS;
+
+      case OPT_RATE_LIMIT:
+        return _config_parse_int(name, arg, 0, 1000000,
+                                 &config->admission.rate);
+
+      case OPT_RATE_BURST:
+        return _config_parse_int(name, arg, 0, 1000000,
+                                 &config->admission.burst);
+
+      default:
+        return CONFIG_ERROR;
+    }
+}
+
+
+config_status_t config_parse(config_t* config, int argc, char** argv) {
+    int opt;
+    int opt_index;
+
+    while ((opt = getopt_long(argc, argv, "", options_g, &opt_index)) != -1) {
+        if (opt == '?') {
+            return CONFIG_ERROR;
+        }
+        if (_config_parse_option(config, opt, options_g[opt_index].name,
+                                 optarg)
+            != CONFIG_SUCCESS)
+        {
+            return CONFIG_ERROR;
+        }
+    }
+
+    if (argc - optind < 2) {
+        return CONFIG_ERROR;
+    }
+
+    if (config->tls.key && !config->tls.cert) {
+        fprintf(stderr, "a TLS key needs a certificate\n");
+        return CONFIG_ERROR;
+    }
+
+    // Only workers share a loop whose lag is measured.
+    if (config->admission.max_loop_lag > 0 && config->workers == 0) {
+        fprintf(stderr, "the loop lag limit needs workers\n");
+        return CONFIG_ERROR;
+    }
+    // Clients run in their own threads are spread by the scheduler.
+    if (config->cpu_count > 0 && config->workers == 0) {
+        fprintf(stderr, "pinning to CPUs needs workers\n");
+        return CONFIG_ERROR;
+    }
+    if (config->admission.burst == 0) {
+        config->admission.burst = config->admission.rate;
+    }
+
+    if (config->recv_buffer_max == 0 || config->read_budget == 0) {
+        fprintf(stderr, "reads need a non-zero size and budget\n");
+        return CONFIG_ERROR;
+    }
+
+    // Broadcast frames are compressed once for every subscriber, which is
+    // only possible if no subscriber keeps a compression context.
+    if (config->broadcast) {
+        config->deflate.server_no_context_takeover = true;
+    }
+
+    if (socket_is_unix(argv[optind])) {
+        config->listening_unix = argv[optind];
+    } else
+    if (sscanf(argv[optind], "%d", &config->listening_port) != 1) {
+        fprintf(stderr, "listening port '%s' is not a valid port format.\n",
+                argv[optind]);
+        return CONFIG_ERROR;
+    }
+    if (socket_is_unix(argv[optind + 1])) {
+        config->bridged_unix = argv[optind + 1];
+    } else
+    if (shm_is_address(argv[optind + 1])) {
+        config->bridged_shm = argv[optind + 1];
+    } else
+    if (argc - optind < 3) {
+        return CONFIG_ERROR;
+    } else {
+        config->bridged_host = argv[optind + 1];
+        if (sscanf(argv[optind + 2], "%d", &config->bridged_port) != 1) {
+            fprintf(stderr, "broadcast port '%s' is not a valid port "
+                    "format.\n", argv[optind + 2]);
+            return CONFIG_ERROR;
+        }
+    }
+
+    // The broadcast thread blocks on its server socket.
+    if (config->broadcast && config->bridged_shm) {
+        fprintf(stderr, "broadcast mode needs a socket to the bridged "
+                "server\n");
+        return CONFIG_ERROR;
+    }
+
+    // Only the bridged server socket of a client is kept for it to resume:
+    // not the shared broadcast connection, nor shared memory rings.
+    if (config->resume_time > 0 && (config->broadcast || config->bridged_shm))
+    {
+        fprintf(stderr, "resuming needs a socket to the bridged server of "
+                "each client\n");
+        return CONFIG_ERROR;
+    }
+
+    return CONFIG_SUCCESS;
+}
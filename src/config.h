@@ -0,0 +1,321 @@
+/*
+ * Runtime configuration of the bridge, built from the command line.
+ */
+#ifndef _config_h_
+#define _config_h_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Largest number of worker threads.
+#define CONFIG_MAX_WORKERS  256
+
+// Largest number of scheduling classes, besides the default one.
+#define CONFIG_MAX_CLASSES  8
+
+
+typedef enum config_status {
+    CONFIG_ERROR = -1,
+    CONFIG_SUCCESS = 0,
+} config_status_t;
+
+
+/*
+ * Opcode of the frames relaying bridged server data.
+ */
+typedef enum config_opcode {
+    // Text if the data is valid UTF-8, binary otherwise.
+    CONFIG_OPCODE_AUTO,
+    // Always text, the server is trusted to only send UTF-8.
+    CONFIG_OPCODE_TEXT,
+    CONFIG_OPCODE_BINARY,
+} config_opcode_t;
+
+
+/*
+ * How messages are delimited on the bridged server connection.
+ */
+typedef enum config_codec_type {
+    // No delimitation, each read is relayed as a message.
+    CONFIG_CODEC_RAW,
+    // Messages end with a newline.
+    CONFIG_CODEC_LINE,
+    // Messages start with their size, as a big endian 16 or 32 bits integer.
+    CONFIG_CODEC_U16,
+    CONFIG_CODEC_U32,
+    // Messages all have the same size.
+    CONFIG_CODEC_FIXED,
+} config_codec_type_t;
+
+
+typedef struct config_codec {
+    config_codec_type_t type;
+    size_t record_size;
+} config_codec_t;
+
+
+/*
+ * permessage-deflate (RFC 7692) settings.
+ */
+typedef struct config_deflate {
+    bool enabled;
+
+    // When set, the server resets its compressor after every message. This
+    // costs some compression ratio but lets idle connections give their
+    // deflate state back to the pool.
+    bool server_no_context_takeover;
+
+    // When set, clients are asked to reset their compressor after every
+    // message, so our decompressor can be pooled too.
+    bool client_no_context_takeover;
+
+    int server_max_window_bits;
+    int client_max_window_bits;
+    int level;
+    int mem_level;
+
+    // Messages smaller than this are sent uncompressed.
+    size_t threshold;
+} config_deflate_t;
+
+
+/*
+ * How frames relayed to clients are grouped in TCP segments.
+ */
+typedef struct config_coalesce {
+    // Microseconds written frames may be held waiting for more, or 0 to send
+    // every write right away.
+    int latency_us;
+
+    // Bytes held after which they are sent without waiting.
+    size_t max_batch;
+} config_coalesce_t;
+
+
+/*
+ * Scheduling class of the clients whose request path starts with the
+ * `prefix_size` bytes of `prefix`. Workers let them read `weight` times
+ * the read budget from their bridged server per round.
+ */
+typedef struct config_class {
+    const char* prefix;
+    size_t prefix_size;
+    int weight;
+} config_class_t;
+
+
+/*
+ * Admission of the new clients, checked when they are accepted. 0 disables
+ * a limit.
+ */
+typedef struct config_admission {
+    // Clients run at once.
+    size_t max_clients;
+    // Bytes waiting in the output queues of all the clients.
+    size_t max_queued;
+    // Milliseconds a worker loop may run behind its timers.
+    int max_loop_lag;
+    // Consecutive failed bridged server connections, after which a single
+    // client per second is admitted to probe it.
+    int max_upstream_failures;
+    // Stop accepting while overloaded, leaving the clients in the listen
+    // backlog, instead of answering them with a 503.
+    bool pause;
+    // Clients accepted per second from each source address, and how many
+    // may be accepted at once.
+    int rate;
+    int burst;
+} config_admission_t;
+
+
+/*
+ * Deadlines of client connections, in milliseconds. 0 disables one.
+ */
+typedef struct config_timeouts {
+    // Time given to a client to complete its handshake.
+    int handshake;
+
+    // Time without any message, in either direction, before a client is
+    // closed.
+    int idle;
+
+    // Time between two pings, and time waited for the pong answering one
+    // before the client is considered dead.
+    int ping_interval;
+    int pong;
+
+    // Time given to a client to answer our close frame.
+    int close;
+} config_timeouts_t;
+
+
+/*
+ * Importance of log records, from the most important.
+ */
+typedef enum config_log_level {
+    CONFIG_LOG_ERROR,
+    CONFIG_LOG_WARNING,
+    CONFIG_LOG_INFO,
+    // Also logs the messages relayed in both directions.
+    CONFIG_LOG_DEBUG,
+} config_log_level_t;
+
+
+typedef struct config_log {
+    config_log_level_t level;
+
+    // Only one message payload out of this many is logged.
+    int payload_sample;
+
+    // Largest number of message payloads logged per second by each thread,
+    // or 0 for no limit.
+    int payload_rate;
+} config_log_t;
+
+
+/*
+ * Traffic capture.
+ */
+typedef struct config_capture {
+    // File the captured traffic is appended to, or NULL to capture nothing.
+    const char* path;
+
+    // Largest size of the capture file. Records which do not fit anymore are
+    // dropped.
+    size_t size;
+
+    // Only one connection out of this many is captured.
+    int sample;
+} config_capture_t;
+
+
+/*
+ * TLS termination on the listener.
+ */
+typedef struct config_tls {
+    // PEM certificate chain, or NULL to accept plain connections.
+    const char* cert;
+    // PEM private key, read from `cert` when NULL.
+    const char* key;
+    // Hand the session keys to the kernel once the handshake is done, so
+    // that connections are relayed like plain ones.
+    bool ktls;
+} config_tls_t;
+
+
+typedef struct config {
+    int listening_port;
+    const char* bridged_host;
+    int bridged_port;
+
+    // Unix socket addresses (`unix:PATH`, `unixpacket:PATH`) listened on
+    // or bridged instead of the TCP ones, or NULL.
+    const char* listening_unix;
+    const char* bridged_unix;
+
+    // Shared memory address (`shm:PATH`) of the bridged server, or NULL,
+    // and the bytes of each ring of its connections.
+    const char* bridged_shm;
+    size_t shm_ring_size;
+
+    // Largest message accepted from a client, after decompression, or from
+    // the bridged server.
+    size_t max_message_size;
+
+    // Bytes that may wait in a client output queue before it is considered
+    // too slow and disconnected.
+    size_t max_queue_size;
+
+    // Share a single bridged server connection between all the clients.
+    bool broadcast;
+
+    // Number of threads running the connections in event loops, or 0 to run
+    // each connection in its own thread.
+    int workers;
+
+    // CPUs the workers are pinned to in turn, their memory then being
+    // allocated on their NUMA node, or none.
+    int cpus[CONFIG_MAX_WORKERS];
+    size_t cpu_count;
+
+    // Microseconds spent polling the sockets and the worker loops for data
+    // before sleeping, or 0 to sleep at once.
+    int busy_poll;
+
+    config_opcode_t upstream_opcode;
+    config_codec_t upstream_codec;
+
+    // Largest single read from the bridged server. Reads start small and
+    // grow up to this size while the server keeps them full.
+    size_t recv_buffer_max;
+
+    // Bytes read from the bridged server connection before giving the other
+    // connections a turn.
+    size_t read_budget;
+
+    // Microseconds a worker spends relaying the bridged server data of a
+    // client per turn, or 0 for no limit.
+    int turn_time;
+
+    // Scheduling classes, the first one whose prefix starts the request
+    // path applying. Other clients have the default class, of weight 1.
+    config_class_t classes[CONFIG_MAX_CLASSES];
+    size_t class_count;
+
+    // With the raw codec, relay everything read in one turn as a single
+    // message instead of a message per read.
+    bool coalesce_reads;
+
+    // Coalescing policy of the route to the bridged server.
+    config_coalesce_t coalesce;
+
+    config_timeouts_t timeouts;
+
+    config_admission_t admission;
+
+    config_deflate_t deflate;
+
+    config_log_t log;
+
+    // Port serving the metrics over HTTP, or 0 to not collect them.
+    int metrics_port;
+
+    config_capture_t capture;
+    config_tls_t tls;
+
+    // Unix packet socket on which a new process takes the listening
+    // sockets over, or NULL, and the time over which the clients are then
+    // closed, in milliseconds.
+    const char* upgrade_socket;
+    int drain_time;
+
+    // Milliseconds the bridged server connection of a client which lost
+    // its connection is kept for it to resume, or 0 to close it at once,
+    // and bytes of the last messages relayed kept for each client.
+    int resume_time;
+    size_t resume_buffer;
+} config_t;
+
+
+/*
+ * Fill `config` with default values.
+ */
+void config_init(config_t* config);
+
+
+/*
+ * Parse the command line into `config`. Errors are written on stderr.
+ * Returns `CONFIG_ERROR` on invalid arguments, `CONFIG_SUCCESS` otherwise.
+ */
+config_status_t config_parse(config_t* config, int argc, char** argv);
+
+
+/*
+ * Write the command line usage on `out`.
+ */
+void config_usage(FILE* out, const char* program);
+
+
+#endif
@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "coro.h"
+#include "logger.h"
+
+
+// Free stacks kept by a thread, more are unmapped.
+#define CORO_POOL_MAX   64
+
+
+/*
+ * Free stacks of a thread, all of the same size, linked through the first
+ * bytes above their guard page.
+ */
+typedef struct coro_pool {
+    char* stacks;
+    size_t count;
+    size_t stack_size;
+} coro_pool_t;
+
+
+static pthread_key_t coro_pool_key_g;
+static pthread_once_t coro_pool_once_g = PTHREAD_ONCE_INIT;
+
+static __thread coro_t* coro_current_g = NULL;
+
+
+/*
+ * Switch stacks: save the registers of the running code on its stack and
+ * its stack pointer in `*save`, then restore those saved at `load`.
+ */
+void _coro_switch(void** save, void* load)
+    __attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+// The MXCSR and x87 control words are preserved too, as the ABI wants.
+__asm__(
+    ".pushsection .text\n"
+    ".globl _coro_switch\n"
+    ".type _coro_switch, @function\n"
+    "_coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size _coro_switch, .-_coro_switch\n"
+    ".popsection\n"
+);
+#else
+void _coro_switch(void** save, void* load) {
+    ucontext_t here;
+    *save = &here;
+    swapcontext(&here, load);
+}
+#endif
+
+
+static void _coro_pool_destroy(void* data) {
+    coro_pool_t* pool = data;
+    while (pool->stacks) {
+        char* stack = pool->stacks;
+        pool->stacks = *(char**)(stack + getpagesize());
+        munmap(stack, pool->stack_size);
+    }
+    free(pool);
+}
+
+
+static void _coro_pool_create_key(void) {
+    pthread_key_create(&coro_pool_key_g, &_coro_pool_destroy);
+}
+
+
+/*
+ * Returns the pool of the calling thread, or NULL if it cannot be created.
+ */
+static coro_pool_t* _coro_pool(void) {
+    pthread_once(&coro_pool_once_g, &_coro_pool_create_key);
+    coro_pool_t* pool = pthread_getspecific(coro_pool_key_g);
+    if (!pool) {
+        pool = calloc(1, sizeof(coro_pool_t));
+        if (pool && pthread_setspecific(coro_pool_key_g, pool) != 0) {
+            free(pool);
+            pool = NULL;
+        }
+    }
+    return pool;
+}
+
+
+/*
+ * Returns a stack of `size` bytes, from the pool or mapped with its guard
+ * page, or NULL on failure.
+ */
+static char* _coro_stack_take(size_t size) {
+    coro_pool_t* pool = _coro_pool();
+    if (pool && pool->stacks && pool->stack_size == size) {
+        char* stack = pool->stacks;
+        pool->stacks = *(char**)(stack + getpagesize());
+        pool->count--;
+        return stack;
+    }
+
+    char* stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+                       | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(stack, getpagesize(), PROT_NONE) < 0) {
+        munmap(stack, size);
+        return NULL;
+    }
+    return stack;
+}
+
+
+static void _coro_stack_give(char* stack, size_t size) {
+    coro_pool_t* pool = _coro_pool();
+    if (!pool || pool->count == CORO_POOL_MAX
+        || (pool->stacks && pool->stack_size != size))
+    {
+        munmap(stack, size);
+        return;
+    }
+    *(char**)(stack + getpagesize()) = pool->stacks;
+    pool->stacks = stack;
+    pool->stack_size = size;
+    pool->count++;
+}
+
+
+/*
+ * First function run on the stack of a coroutine, which never returns.
+ */
+static void _coro_start(void) {
+    coro_t* coro = coro_current_g;
+    coro->entry(coro->data);
+    coro->done = true;
+    _coro_switch(&coro->context, coro->caller);
+    abort();
+}
+
+
+/*
+ * Prepare the stack below `top` so that switching to the coroutine starts
+ * it.
+ */
+static void _coro_prepare(coro_t* coro, char* top) {
+#if defined(__x86_64__)
+    // Entered through `ret`, as if called: a null return address, then the
+    // registers popped by the switch, the control words being the default
+    // ones.
+    uint64_t* sp = (uint64_t*)((uintptr_t)top & ~(uintptr_t)15);
+    *--sp = 0;
+    *--sp = (uintptr_t)&_coro_start;
+    for (size_t i = 0; i < 6; i++) {
+        *--sp = 0;
+    }
+    *--sp = UINT64_C(0x037f) << 32 | 0x1f80;
+    coro->context = sp;
+#else
+    top = (char*)(((uintptr_t)top - sizeof(ucontext_t)) & ~(uintptr_t)15);
+    ucontext_t* context = (ucontext_t*)top;
+    getcontext(context);
+    context->uc_stack.ss_sp = coro->stack + getpagesize();
+    context->uc_stack.ss_size = top - (char*)context->uc_stack.ss_sp;
+    context->uc_link = NULL;
+    makecontext(context, &_coro_start, 0);
+    coro->context = context;
+#endif
+}
+
+
+static void _coro_on_event(void* data, uint32_t events);
+static void _coro_on_timeout(wheel_timer_t* timer, void* data);
+
+
+coro_t* coro_create(loop_t* loop, size_t stack_size, coro_entry_t entry,
+                    coro_entry_t wake, void* data)
+{
+    size_t page = getpagesize();
+    size_t size = (stack_size + page - 1) / page * page;
+    if (size < 4 * page) {
+        size = 4 * page;
+    }
+    char* stack = _coro_stack_take(size);
+    if (!stack) {
+        LOG_ERROR("cannot map a coroutine stack of %zu bytes", size);
+        return NULL;
+    }
+
+    coro_t* coro = (coro_t*)(stack + size) - 1;
+    *coro = (coro_t){
+        .loop = loop,
+        .stack = stack,
+        .stack_size = size,
+        .entry = entry,
+        .wake = wake,
+        .data = data,
+        .done = false,
+        .cancelled = false,
+        .waiting = false,
+    };
+    wheel_timer_init(&coro->timer, &_coro_on_timeout, coro);
+    _coro_prepare(coro, (char*)coro);
+    return coro;
+}
+
+
+void coro_destroy(coro_t* coro) {
+    _coro_stack_give(coro->stack, coro->stack_size);
+}
+
+
+void coro_resume(coro_t* coro) {
+    coro_t* previous = coro_current_g;
+    coro_current_g = coro;
+    _coro_switch(&coro->caller, coro->context);
+    coro_current_g = previous;
+}
+
+
+void coro_yield(void) {
+    coro_t* coro = coro_current_g;
+    _coro_switch(&coro->context, coro->caller);
+}
+
+
+coro_t* coro_self(void) {
+    return coro_current_g;
+}
+
+
+/*
+ * Resume the coroutine, or have its owner do it.
+ */
+static void _coro_wake(coro_t* coro) {
+    if (coro->wake) {
+        coro->wake(coro->data);
+    } else {
+        coro_resume(coro);
+    }
+}
+
+
+static void _coro_on_event(void* data, uint32_t events) {
+    coro_t* coro = data;
+    if (coro->waiting) {
+        coro->waiting = false;
+        coro->events = events;
+        _coro_wake(coro);
+    }
+}
+
+
+static void _coro_on_timeout(wheel_timer_t* timer, void* data) {
+    coro_t* coro = data;
+    if (coro->waiting) {
+        coro->waiting = false;
+        coro->events = 0;
+        _coro_wake(coro);
+    }
+}
+
+
+void coro_cancel(coro_t* coro) {
+    coro->cancelled = true;
+    if (coro->waiting) {
+        coro->waiting = false;
+        coro_resume(coro);
+    }
+}
+
+
+/*
+ * Wait for `events` on `fd` with poll, blocking the thread.
+ */
+static int _coro_poll(int fd, uint32_t events, int timeout_ms) {
+    // Poll events have the values of the epoll ones.
+    struct pollfd pollfd = {
+        .fd = fd,
+        .events = events,
+    };
+    int count = poll(&pollfd, 1, timeout_ms);
+    if (count <= 0) {
+        return count;
+    }
+    return pollfd.revents;
+}
+
+
+int coro_wait(int fd, uint32_t events, int timeout_ms) {
+    coro_t* coro = coro_current_g;
+    if (!coro) {
+        return _coro_poll(fd, events, timeout_ms);
+    }
+    if (coro->cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    if (fd >= 0
+        && loop_add(coro->loop, &coro->watch, fd, events, &_coro_on_event,
+                    coro)
+           != LOOP_SUCCESS)
+    {
+        return -1;
+    }
+    if (timeout_ms >= 0) {
+        loop_arm(coro->loop, &coro->timer, timeout_ms);
+    }
+    coro->events = 0;
+    coro->waiting = true;
+    coro_yield();
+
+    if (fd >= 0) {
+        loop_remove(coro->loop, &coro->watch);
+    }
+    loop_disarm(coro->loop, &coro->timer);
+    if (coro->cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return coro->events;
+}
+
+
+coro_status_t coro_sleep(int delay_ms) {
+    if (!coro_current_g) {
+        struct timespec delay = {
+            .tv_sec = delay_ms / 1000,
+            .tv_nsec = delay_ms % 1000 * 1000000L,
+        };
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+            /* nothing */
+        }
+        return CORO_SUCCESS;
+    }
+    return coro_wait(-1, 0, delay_ms) < 0 ? CORO_ERROR : CORO_SUCCESS;
+}
+
+
+ssize_t coro_recv(socket_t sock, void* buf, size_t size) {
+    while (true) {
+        ssize_t received = recv(sock, buf, size, MSG_DONTWAIT);
+        if (received >= 0) {
+            return received;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        if (errno != EINTR && coro_wait(sock, EPOLLIN, -1) < 0) {
+            return -1;
+        }
+    }
+}
+
+
+ssize_t coro_send(socket_t sock, const void* buf, size_t size) {
+    size_t sent = 0;
+
+    while (sent < size) {
+        ssize_t count = send(sock, (const char*)buf + sent, size - sent,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (count >= 0) {
+            sent += count;
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        if (errno != EINTR && coro_wait(sock, EPOLLOUT, -1) < 0) {
+            return -1;
+        }
+    }
+    return size;
+}
+
+
+socket_t coro_connect(const socket_address_t* addr) {
+    socket_t sock = socket_connect(addr);
+    if (sock == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    if (coro_wait(sock, EPOLLOUT, -1) < 0
+        || socket_connect_result(sock) != NET_SUCCESS)
+    {
+        close(sock);
+        return SOCKET_ERROR;
+    }
+    return sock;
+}
@@ -0,0 +1,154 @@
+/*
+ * Stackful coroutines, run by the thread of an event loop.
+ *
+ * A coroutine runs a function on its own stack, and may suspend itself
+ * while it waits for a descriptor or a delay, the loop running the others
+ * meanwhile. The waiting calls read like the blocking ones: `coro_recv`,
+ * `coro_send` or `coro_connect` return once done, without blocking the
+ * thread. Called outside of a coroutine, they block it instead.
+ *
+ * Stacks are mapped with a guard page below them, faulting on overflow
+ * rather than overwriting memory, and only cost the pages they touched.
+ * The coroutine state is kept at their top. Each thread keeps the stacks of
+ * the coroutines it destroyed, to give them to the next ones. Switching
+ * from a coroutine to another only saves the registers a function must
+ * preserve, in user space, on x86-64; other architectures use `ucontext`.
+ */
+#ifndef _coro_h_
+#define _coro_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "loop.h"
+#include "net.h"
+#include "wheel.h"
+
+
+// Default bytes of a coroutine stack, its state and guard page included.
+#define CORO_STACK_SIZE     (64 * 1024)
+
+
+typedef enum coro_status {
+    CORO_ERROR = -1,
+    CORO_SUCCESS = 0,
+} coro_status_t;
+
+
+typedef void (*coro_entry_t)(void* data);
+
+
+typedef struct coro {
+    loop_t* loop;
+
+    // Stack pointer saved by the coroutine when it suspends, and by the
+    // code resuming it meanwhile.
+    void* context;
+    void* caller;
+
+    // Mapping of the stack, its guard page and this state included.
+    char* stack;
+    size_t stack_size;
+
+    // Run on the coroutine with `data`. `wake`, unless NULL, is called with
+    // `data` when what the coroutine waits for happened, instead of
+    // resuming it right away.
+    coro_entry_t entry;
+    coro_entry_t wake;
+    void* data;
+
+    bool done;
+    bool cancelled;
+
+    // Descriptor and delay waited for, while `waiting`, and the events
+    // which happened, 0 if the delay expired first.
+    bool waiting;
+    loop_watch_t watch;
+    wheel_timer_t timer;
+    uint32_t events;
+} coro_t;
+
+
+/*
+ * Create a coroutine running `entry` on `loop` with `data`, on a stack of
+ * `stack_size` bytes, rounded up to pages. It starts when first resumed.
+ * Returns NULL on failure.
+ */
+coro_t* coro_create(loop_t* loop, size_t stack_size, coro_entry_t entry,
+                    coro_entry_t wake, void* data);
+
+
+/*
+ * Drop the coroutine and its stack, which it must not be waiting on.
+ * A coroutine which did not end holds its stack frames: it must not hold
+ * anything else.
+ */
+void coro_destroy(coro_t* coro);
+
+
+/*
+ * Run the coroutine until it suspends or ends.
+ */
+void coro_resume(coro_t* coro);
+
+
+/*
+ * Suspend the running coroutine, returning to the code which resumed it.
+ */
+void coro_yield(void);
+
+
+/*
+ * Returns the running coroutine, or NULL on the stack of a thread.
+ */
+coro_t* coro_self(void);
+
+
+/*
+ * Have the coroutine stop waiting, its current and next waits failing with
+ * ECANCELED without suspending it, and resume it if it was waiting.
+ */
+void coro_cancel(coro_t* coro);
+
+
+/*
+ * Wait for `events` (EPOLLIN, EPOLLOUT...) on `fd` during `timeout_ms`
+ * milliseconds, or forever if negative.
+ * Like poll, the descriptor may not be ready anymore once it returns.
+ * Returns the events which happened, 0 on timeout, or -1 on failure or
+ * cancellation, setting errno.
+ */
+int coro_wait(int fd, uint32_t events, int timeout_ms);
+
+
+/*
+ * Wait for `delay_ms` milliseconds.
+ * Returns `CORO_ERROR` if cancelled, `CORO_SUCCESS` otherwise.
+ */
+coro_status_t coro_sleep(int delay_ms);
+
+
+/*
+ * Receive up to `size` bytes on `sock`, waiting for some.
+ * Returns the bytes received, 0 once the peer closed, or -1 on failure.
+ */
+ssize_t coro_recv(socket_t sock, void* buf, size_t size);
+
+
+/*
+ * Send the `size` bytes of `buf` on `sock`, waiting for room as needed.
+ * Returns `size`, or -1 on failure.
+ */
+ssize_t coro_send(socket_t sock, const void* buf, size_t size);
+
+
+/*
+ * Connect a non-blocking socket to `addr`, waiting for the connection.
+ * Returns the socket, or `SOCKET_ERROR` on failure.
+ */
+socket_t coro_connect(const socket_address_t* addr);
+
+
+#endif
@@ -0,0 +1,367 @@
+#include <byteswap.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+#include "metrics.h"
+
+
+// Number of frames written by a single call.
+#define FRAME_FLUSH_IOV     64
+
+
+/*
+ * Write `iov` on `sock` following the queue flags.
+ */
+static ssize_t _frame_queue_send(frame_queue_t* queue, socket_t sock,
+                                 const struct iovec* iov, size_t count)
+{
+    struct msghdr hdr = {
+        .msg_iov = (struct iovec*)iov,
+        .msg_iovlen = count,
+    };
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL | (queue->more ? MSG_MORE : 0));
+}
+
+
+frame_t* frame_new(uint8_t rsv, ws_opcode_t op, const char* payload,
+                   size_t size)
+{
+    frame_t* frame = malloc(sizeof(frame_t) + WS_FRAME_HEAD_MAX + size);
+    if (!frame) {
+        return NULL;
+    }
+    frame->refs = 1;
+    frame->size = ws_encode_frame_head(frame->data, true, rsv, op, size);
+    memcpy(frame->data + frame->size, payload, size);
+    frame->size += size;
+    return frame;
+}
+
+
+frame_t* frame_new_close(ws_close_status_t status) {
+    uint16_t payload = __bswap_16((uint16_t)status);
+    return frame_new(0, WS_OP_CLOSE, (const char*)&payload, sizeof(payload));
+}
+
+
+frame_t* frame_alloc(size_t size) {
+    frame_t* frame = malloc(sizeof(frame_t) + size);
+    if (!frame) {
+        return NULL;
+    }
+    frame->refs = 1;
+    frame->size = size;
+    return frame;
+}
+
+
+frame_t* frame_ref(frame_t* frame) {
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+
+void frame_unref(frame_t* frame) {
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(frame);
+    }
+}
+
+
+void frame_queue_init(frame_queue_t* queue, size_t max_bytes) {
+    *queue = (frame_queue_t){
+        .max_bytes = max_bytes,
+    };
+    pthread_mutex_init(&queue->lock, NULL);
+}
+
+
+static void _frame_ring_clear(frame_ring_t* ring) {
+    for (size_t i = 0; i < ring->count; i++) {
+        frame_unref(ring->frames[(ring->head + i) % ring->capacity]);
+    }
+    free(ring->frames);
+    *ring = (frame_ring_t){ .frames = NULL };
+}
+
+
+void frame_queue_destroy(frame_queue_t* queue) {
+    if (queue->current) {
+        frame_unref(queue->current);
+    }
+    _frame_ring_clear(&queue->control);
+    _frame_ring_clear(&queue->data);
+    pthread_mutex_destroy(&queue->lock);
+    *queue = (frame_queue_t){ .current = NULL };
+}
+
+
+static frame_status_t _frame_ring_grow(frame_ring_t* ring) {
+    size_t capacity = ring->capacity ? ring->capacity * 2 : 16;
+    frame_t** frames = malloc(capacity * sizeof(frame_t*));
+    if (!frames) {
+        return FRAME_ERROR;
+    }
+    for (size_t i = 0; i < ring->count; i++) {
+        frames[i] = ring->frames[(ring->head + i) % ring->capacity];
+    }
+    free(ring->frames);
+    ring->frames = frames;
+    ring->capacity = capacity;
+    ring->head = 0;
+    return FRAME_SUCCESS;
+}
+
+
+/*
+ * Free the memory of an empty ring.
+ */
+static void _frame_ring_release(frame_ring_t* ring) {
+    if (ring->count == 0 && ring->frames) {
+        free(ring->frames);
+        *ring = (frame_ring_t){ .frames = NULL };
+    }
+}
+
+
+static frame_t* _frame_ring_at(const frame_ring_t* ring, size_t index) {
+    return ring->frames[(ring->head + index) % ring->capacity];
+}
+
+
+static frame_t* _frame_ring_pop(frame_ring_t* ring) {
+    frame_t* frame = ring->frames[ring->head];
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+    return frame;
+}
+
+
+static bool _frame_queue_empty(const frame_queue_t* queue) {
+    return !queue->current
+        && queue->control.count == 0
+        && queue->data.count == 0;
+}
+
+
+static frame_status_t _frame_queue_push(frame_queue_t* queue,
+                                        frame_ring_t* ring, frame_t* frame)
+{
+    if (queue->bytes + frame->size > queue->max_bytes
+        && !_frame_queue_empty(queue))
+    {
+        return FRAME_FULL;
+    }
+    if (ring->count == ring->capacity
+        && _frame_ring_grow(ring) != FRAME_SUCCESS)
+    {
+        return FRAME_ERROR;
+    }
+    ring->frames[(ring->head + ring->count) % ring->capacity]
+        = frame_ref(frame);
+    ring->count++;
+    queue->bytes += frame->size;
+    return FRAME_SUCCESS;
+}
+
+
+frame_status_t frame_queue_push(frame_queue_t* queue, frame_t* frame) {
+    pthread_mutex_lock(&queue->lock);
+    frame_status_t status = _frame_queue_push(queue, &queue->data, frame);
+    pthread_mutex_unlock(&queue->lock);
+    return status;
+}
+
+
+frame_status_t frame_queue_push_control(frame_queue_t* queue,
+                                        frame_t* frame)
+{
+    pthread_mutex_lock(&queue->lock);
+    frame_status_t status = _frame_queue_push(queue, &queue->control, frame);
+    pthread_mutex_unlock(&queue->lock);
+    return status;
+}
+
+
+frame_status_t frame_queue_write(frame_queue_t* queue, socket_t sock,
+                                 const struct iovec* iov, size_t count)
+{
+    frame_status_t status = FRAME_SUCCESS;
+    size_t total = 0;
+    size_t written = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    // Bytes can only be written directly if nothing is waiting before them.
+    if (_frame_queue_empty(queue)) {
+        ssize_t ret = _frame_queue_send(queue, sock, iov, count);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                status = FRAME_ERROR;
+                goto end;
+            }
+            ret = 0;
+        }
+        written = ret;
+        queue->bytes_written += written;
+        queue->writes++;
+        metrics_add(METRICS_WS_BYTES_OUT, written);
+    }
+
+    if (written < total) {
+        // The frame started on the socket must be finished before any
+        // control frame.
+        bool started = written > 0;
+        frame_t* rest = frame_alloc(total - written);
+        if (!rest) {
+            status = FRAME_ERROR;
+            goto end;
+        }
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t len = iov[i].iov_len;
+            const char* base = iov[i].iov_base;
+            if (written >= len) {
+                written -= len;
+                continue;
+            }
+            memcpy(rest->data + offset, base + written, len - written);
+            offset += len - written;
+            written = 0;
+        }
+        if (started) {
+            queue->current = rest;
+            queue->offset = 0;
+            queue->bytes += rest->size;
+        } else {
+            status = _frame_queue_push(queue, &queue->data, rest);
+            frame_unref(rest);
+        }
+    }
+
+  end:
+    pthread_mutex_unlock(&queue->lock);
+    return status;
+}
+
+
+/*
+ * Drop the first `written` bytes of the queue, in the order they were
+ * written: the current frame, the control frames, then the data frames.
+ * A frame written partially becomes the current one.
+ */
+static void _frame_queue_drop(frame_queue_t* queue, size_t written) {
+    queue->bytes -= written;
+    queue->bytes_written += written;
+    queue->writes++;
+    metrics_add(METRICS_WS_BYTES_OUT, written);
+
+    if (queue->current) {
+        size_t left = queue->current->size - queue->offset;
+        if (written < left) {
+            queue->offset += written;
+            return;
+        }
+        written -= left;
+        frame_unref(queue->current);
+        queue->current = NULL;
+        queue->offset = 0;
+    }
+
+    while (written > 0) {
+        frame_ring_t* ring = queue->control.count > 0
+                           ? &queue->control
+                           : &queue->data;
+        frame_t* frame = _frame_ring_pop(ring);
+        if (written < frame->size) {
+            queue->current = frame;
+            queue->offset = written;
+            return;
+        }
+        written -= frame->size;
+        frame_unref(frame);
+    }
+}
+
+
+frame_status_t frame_queue_flush(frame_queue_t* queue, socket_t sock) {
+    frame_status_t status = FRAME_SUCCESS;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!_frame_queue_empty(queue)) {
+        struct iovec iov[FRAME_FLUSH_IOV];
+        size_t iov_count = 0;
+        if (queue->current) {
+            iov[iov_count++] = (struct iovec){
+                .iov_base = queue->current->data + queue->offset,
+                .iov_len = queue->current->size - queue->offset,
+            };
+        }
+        frame_ring_t* rings[] = { &queue->control, &queue->data };
+        for (size_t r = 0; r < 2; r++) {
+            for (size_t i = 0;
+                 i < rings[r]->count && iov_count < FRAME_FLUSH_IOV;
+                 i++)
+            {
+                frame_t* frame = _frame_ring_at(rings[r], i);
+                iov[iov_count++] = (struct iovec){
+                    .iov_base = frame->data,
+                    .iov_len = frame->size,
+                };
+            }
+        }
+
+        ssize_t written = _frame_queue_send(queue, sock, iov, iov_count);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                status = FRAME_ERROR;
+            }
+            break;
+        }
+        _frame_queue_drop(queue, written);
+        if (queue->current) {
+            // The socket is full.
+            break;
+        }
+    }
+    // Idle connections hold no ring.
+    _frame_ring_release(&queue->control);
+    _frame_ring_release(&queue->data);
+    pthread_mutex_unlock(&queue->lock);
+
+    return status;
+}
+
+
+size_t frame_queue_resident_bytes(frame_queue_t* queue) {
+    pthread_mutex_lock(&queue->lock);
+    size_t bytes = queue->bytes
+                 + (queue->control.capacity + queue->data.capacity)
+                 * sizeof(frame_t*);
+    pthread_mutex_unlock(&queue->lock);
+    return bytes;
+}
+
+
+size_t frame_queue_bytes(frame_queue_t* queue) {
+    pthread_mutex_lock(&queue->lock);
+    size_t bytes = queue->bytes;
+    pthread_mutex_unlock(&queue->lock);
+    return bytes;
+}
+
+
+bool frame_queue_empty(frame_queue_t* queue) {
+    pthread_mutex_lock(&queue->lock);
+    bool empty = _frame_queue_empty(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return empty;
+}
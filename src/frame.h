@@ -0,0 +1,176 @@
+/*
+ * Encoded WebSocket frames ready to be written on sockets, and queues of
+ * such frames.
+ *
+ * A frame holds its header and payload in a single block and is reference
+ * counted, so the same bytes can be queued on any number of connections.
+ */
+#ifndef _frame_h_
+#define _frame_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "net.h"
+#include "ws.h"
+
+
+typedef enum frame_status {
+    FRAME_ERROR = -1,
+    FRAME_SUCCESS = 0,
+    FRAME_FULL = 1,
+} frame_status_t;
+
+
+typedef struct frame {
+    int refs;
+    size_t size;
+    char data[];
+} frame_t;
+
+
+/*
+ * Ring of frames.
+ */
+typedef struct frame_ring {
+    frame_t** frames;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} frame_ring_t;
+
+
+/*
+ * Queue of frames waiting to be written on a socket. Frames may be pushed by
+ * any thread, while a single thread flushes the queue.
+ *
+ * Control frames are written before the data frames waiting, so that
+ * heartbeats and close frames are not delayed by a backlog, but never in
+ * the middle of another frame.
+ */
+typedef struct frame_queue {
+    pthread_mutex_t lock;
+
+    // Frame partially written, and its bytes already written.
+    frame_t* current;
+    size_t offset;
+
+    frame_ring_t control;
+    frame_ring_t data;
+
+    // Bytes waiting to be written, and the limit over which pushes fail.
+    size_t bytes;
+    size_t max_bytes;
+
+    // Flag writes with MSG_MORE, leaving the owner to push the socket.
+    bool more;
+
+    // Bytes written on the socket so far, and the number of writes.
+    size_t bytes_written;
+    size_t writes;
+} frame_queue_t;
+
+
+/*
+ * Create a single frame message with a reference count of 1.
+ * Returns NULL on allocation failure.
+ */
+frame_t* frame_new(uint8_t rsv, ws_opcode_t op, const char* payload,
+                   size_t size);
+
+
+/*
+ * Create a close frame carrying `status`, with a reference count of 1.
+ * Returns NULL on allocation failure.
+ */
+frame_t* frame_new_close(ws_close_status_t status);
+
+
+/*
+ * Create a frame of `size` uninitialized bytes, with a reference count of 1.
+ * Returns NULL on allocation failure.
+ */
+frame_t* frame_alloc(size_t size);
+
+
+/*
+ * Take a new reference on `frame`.
+ */
+frame_t* frame_ref(frame_t* frame);
+
+
+/*
+ * Drop a reference on `frame`, freeing it with the last one.
+ */
+void frame_unref(frame_t* frame);
+
+
+/*
+ * Initialize an empty queue holding at most `max_bytes` bytes.
+ */
+void frame_queue_init(frame_queue_t* queue, size_t max_bytes);
+
+
+/*
+ * Drop all the frames of the queue and free it.
+ */
+void frame_queue_destroy(frame_queue_t* queue);
+
+
+/*
+ * Append `frame` to the queue, taking a new reference on it.
+ * Returns `FRAME_FULL` if the queue is over its limit, `FRAME_ERROR` on
+ * allocation failure or `FRAME_SUCCESS` otherwise.
+ */
+frame_status_t frame_queue_push(frame_queue_t* queue, frame_t* frame);
+
+
+/*
+ * Insert the control `frame` before the data frames waiting in the queue,
+ * after the control frames already there.
+ * Returns like `frame_queue_push`.
+ */
+frame_status_t frame_queue_push_control(frame_queue_t* queue,
+                                        frame_t* frame);
+
+
+/*
+ * Write the `count` buffers of `iov` on `sock` after the queued frames.
+ * What cannot be written right away is copied in the queue.
+ * Returns `FRAME_FULL` if the queue is over its limit, `FRAME_ERROR` if the
+ * socket failed, or `FRAME_SUCCESS` otherwise.
+ */
+frame_status_t frame_queue_write(frame_queue_t* queue, socket_t sock,
+                                 const struct iovec* iov, size_t count);
+
+
+/*
+ * Write as many queued bytes as `sock` accepts without blocking.
+ * Returns `FRAME_ERROR` if the socket failed, `FRAME_SUCCESS` otherwise.
+ */
+frame_status_t frame_queue_flush(frame_queue_t* queue, socket_t sock);
+
+
+/*
+ * Returns the bytes of memory held by the queue: its rings and the frames
+ * waiting, even those shared with other queues.
+ */
+size_t frame_queue_resident_bytes(frame_queue_t* queue);
+
+
+/*
+ * Returns the bytes waiting in the queue.
+ */
+size_t frame_queue_bytes(frame_queue_t* queue);
+
+
+/*
+ * Returns true if nothing is waiting in the queue.
+ */
+bool frame_queue_empty(frame_queue_t* queue);
+
+
+#endif
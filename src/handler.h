@@ -0,0 +1,60 @@
+/*
+ * In-process handlers of the web socket clients.
+ *
+ * An application embedding the bridge (see `server.h`) may handle the
+ * clients itself instead of relaying them to a bridged server. Its
+ * callbacks are run by the thread running the client, a worker or the
+ * client own thread, which they must not block. They answer with
+ * `client_send`, and may close the client with `client_shutdown`.
+ *
+ * A handler with a stack size has the callbacks of each client run on a
+ * coroutine of the thread (see `coro.h`), where they may wait with the
+ * `coro_*` calls: the thread runs the other clients meanwhile, and the
+ * messages of the client are not read until the callback returns. Its
+ * waits are cancelled once the client is closed, `on_close` only running
+ * once the callback returned.
+ */
+#ifndef _handler_h_
+#define _handler_h_
+
+#include <stddef.h>
+
+#include "ws.h"
+
+
+struct client;
+
+
+typedef enum handler_status {
+    HANDLER_ERROR = -1,
+    HANDLER_SUCCESS = 0,
+} handler_status_t;
+
+
+typedef struct handler {
+    // A client completed its handshake. Returning `HANDLER_ERROR` closes it
+    // with an internal error, without calling `on_close`.
+    handler_status_t (*on_open)(struct client* client, void* data);
+
+    // A client sent a message, text or binary, decompressed and validated.
+    // `msg` points in the client buffers, and is only valid during the call,
+    // waits included.
+    // Returning `HANDLER_ERROR` closes the client with an internal error.
+    handler_status_t (*on_message)(struct client* client, ws_opcode_t opcode,
+                                   const char* msg, size_t size, void* data);
+
+    // A client opened by `on_open` is closed, with `status`. Nothing can be
+    // sent to it anymore.
+    void (*on_close)(struct client* client, ws_close_status_t status,
+                     void* data);
+
+    // Given to all the callbacks.
+    void* data;
+
+    // Bytes of the coroutine stacks running the callbacks, as
+    // `CORO_STACK_SIZE`, or 0 to run them on the thread stack.
+    size_t stack_size;
+} handler_t;
+
+
+#endif
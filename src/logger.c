@@ -0,0 +1,528 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+
+
+// Bytes of the ring of each thread.
+#define LOGGER_RING_SIZE        16384
+
+// Longest text of a record, including its terminating NUL. Longer texts are
+// truncated.
+#define LOGGER_TEXT_MAX         512
+
+// Payload bytes kept by a record, the others are only counted.
+#define LOGGER_PAYLOAD_MAX      128
+
+// Milliseconds slept by the background thread when all the rings are empty.
+#define LOGGER_DRAIN_INTERVAL   10
+
+
+typedef enum logger_kind {
+    LOGGER_KIND_TEXT,
+    LOGGER_KIND_PAYLOAD,
+    // Fills the end of a ring too short for the next record.
+    LOGGER_KIND_PADDING,
+} logger_kind_t;
+
+
+/*
+ * Header of a record in a ring, followed by its text and its payload.
+ * Records are aligned on the header size, so that the end of a ring always
+ * has room for a padding header.
+ */
+typedef struct logger_record {
+    // CLOCK_REALTIME, in nanoseconds.
+    uint64_t time_ns;
+    // Size of the logged payload, of which `payload_size` bytes are kept.
+    uint64_t payload_total;
+    // Bytes of the whole record, header included.
+    uint32_t size;
+    uint16_t text_size;
+    uint16_t payload_size;
+    uint8_t level;
+    uint8_t kind;
+} logger_record_t;
+
+
+/*
+ * Single producer, single consumer ring of the records of a thread.
+ */
+typedef struct logger_ring {
+    // Written by the thread owning the ring.
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    bool closed;
+
+    // Written by the background thread.
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t reported_dropped;
+    struct logger_ring* next;
+    // Records being drained, from the cursor to the end, and whether the
+    // ring was closed when the draining started.
+    uint64_t cursor;
+    uint64_t end;
+    bool drained;
+
+    char data[LOGGER_RING_SIZE] __attribute__((aligned(64)));
+} logger_ring_t;
+
+
+/*
+ * Formatted date and time of the last second a record was written in.
+ */
+typedef struct logger_clock {
+    time_t second;
+    char text[32];
+} logger_clock_t;
+
+
+typedef struct logger {
+    bool running;
+    pthread_t thread;
+    // Closes the ring of a thread when it exits.
+    pthread_key_t key;
+
+    // Protects the list of rings.
+    pthread_mutex_t lock;
+    logger_ring_t* rings;
+
+    int payload_sample;
+    int payload_rate;
+} logger_t;
+
+
+/*
+ * Payload sampling and rate limiting state of a thread.
+ */
+typedef struct logger_payloads {
+    uint64_t seen;
+    time_t second;
+    int count;
+    uint64_t suppressed;
+} logger_payloads_t;
+
+
+config_log_level_t logger_level_g = CONFIG_LOG_INFO;
+
+static logger_t logger_g = {
+    .running = false,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .rings = NULL,
+    .payload_sample = 1,
+    .payload_rate = 0,
+};
+
+static __thread logger_ring_t* thread_ring_g = NULL;
+static __thread logger_payloads_t thread_payloads_g;
+
+static const char* LEVEL_NAMES[] = {
+    [CONFIG_LOG_ERROR] = "ERROR",
+    [CONFIG_LOG_WARNING] = "WARN",
+    [CONFIG_LOG_INFO] = "INFO",
+    [CONFIG_LOG_DEBUG] = "DEBUG",
+};
+
+
+static size_t _logger_align(size_t size) {
+    size_t align = sizeof(logger_record_t);
+    return (size + align - 1) / align * align;
+}
+
+
+static uint64_t _logger_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * UINT64_C(1000000000) + now.tv_nsec;
+}
+
+
+/*
+ * Write the record of `level` made of `text` and of `payload_size` bytes of
+ * a `payload_total` bytes payload, at `time_ns`.
+ */
+static void _logger_print(logger_clock_t* clock, uint64_t time_ns,
+                          config_log_level_t level, logger_kind_t kind,
+                          const char* text, size_t text_size,
+                          const unsigned char* payload, size_t payload_size,
+                          uint64_t payload_total)
+{
+    FILE* out = level <= CONFIG_LOG_WARNING ? stderr : stdout;
+
+    time_t second = time_ns / 1000000000;
+    if (second != clock->second || clock->text[0] == '\0') {
+        struct tm tm;
+        gmtime_r(&second, &tm);
+        strftime(clock->text, sizeof(clock->text), "%Y-%m-%dT%H:%M:%S",
+                 &tm);
+        clock->second = second;
+    }
+    fprintf(out, "%s.%06uZ %-5s %.*s", clock->text,
+            (unsigned)(time_ns % 1000000000 / 1000), LEVEL_NAMES[level],
+            (int)text_size, text);
+
+    if (kind == LOGGER_KIND_PAYLOAD) {
+        // Binary payloads must not reach the terminal as is.
+        char escaped[LOGGER_PAYLOAD_MAX * 4 + 1];
+        size_t len = 0;
+        for (size_t i = 0; i < payload_size; i++) {
+            unsigned char c = payload[i];
+            if (c >= 0x20 && c < 0x7f && c != '\\') {
+                escaped[len++] = c;
+            } else {
+                len += sprintf(escaped + len, "\\x%02x", c);
+            }
+        }
+        fprintf(out, " %.*s", (int)len, escaped);
+        if (payload_total > payload_size) {
+            fprintf(out, "... (%llu bytes)",
+                    (unsigned long long)payload_total);
+        }
+    }
+    fputc('\n', out);
+}
+
+
+/*
+ * Write a record right away, when no background thread runs.
+ */
+static void _logger_write_now(config_log_level_t level, logger_kind_t kind,
+                              const void* payload, size_t payload_total,
+                              const char* format, va_list args)
+{
+    logger_clock_t clock = { .text = "" };
+    char text[LOGGER_TEXT_MAX];
+    int len = vsnprintf(text, sizeof(text), format, args);
+    if (len < 0) {
+        len = 0;
+    } else
+    if (len >= LOGGER_TEXT_MAX) {
+        len = LOGGER_TEXT_MAX - 1;
+    }
+    size_t payload_size = payload_total < LOGGER_PAYLOAD_MAX
+                        ? payload_total
+                        : LOGGER_PAYLOAD_MAX;
+    _logger_print(&clock, _logger_clock_ns(), level, kind, text, len,
+                  payload, payload_size, payload_total);
+}
+
+
+static void _logger_ring_close(void* data) {
+    logger_ring_t* ring = data;
+    thread_ring_g = NULL;
+    __atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Returns the ring of the calling thread, created on its first record, or
+ * NULL on allocation failure.
+ */
+static logger_ring_t* _logger_ring(void) {
+    logger_ring_t* ring = thread_ring_g;
+    if (ring) {
+        return ring;
+    }
+
+    if (posix_memalign((void**)&ring, 64, sizeof(logger_ring_t)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, offsetof(logger_ring_t, data));
+
+    pthread_mutex_lock(&logger_g.lock);
+    ring->next = logger_g.rings;
+    logger_g.rings = ring;
+    pthread_mutex_unlock(&logger_g.lock);
+
+    pthread_setspecific(logger_g.key, ring);
+    thread_ring_g = ring;
+    return ring;
+}
+
+
+/*
+ * Returns room for a record of at most `size` bytes in `ring`, or NULL if
+ * it is full.
+ */
+static logger_record_t* _logger_reserve(logger_ring_t* ring, size_t size) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = head % LOGGER_RING_SIZE;
+    size_t contiguous = LOGGER_RING_SIZE - offset;
+    size_t padding = contiguous < size ? contiguous : 0;
+
+    if (LOGGER_RING_SIZE - (head - tail) < padding + size) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (padding) {
+        logger_record_t* record = (logger_record_t*)(ring->data + offset);
+        record->kind = LOGGER_KIND_PADDING;
+        record->size = padding;
+        head += padding;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return (logger_record_t*)(ring->data + head % LOGGER_RING_SIZE);
+}
+
+
+static void _logger_vwrite(config_log_level_t level, logger_kind_t kind,
+                           const void* payload, size_t payload_total,
+                           const char* format, va_list args)
+{
+    logger_ring_t* ring = NULL;
+    if (__atomic_load_n(&logger_g.running, __ATOMIC_ACQUIRE)) {
+        ring = _logger_ring();
+    }
+    if (!ring) {
+        _logger_write_now(level, kind, payload, payload_total, format, args);
+        return;
+    }
+
+    size_t payload_size = payload_total < LOGGER_PAYLOAD_MAX
+                        ? payload_total
+                        : LOGGER_PAYLOAD_MAX;
+    logger_record_t* record = _logger_reserve(
+        ring,
+        _logger_align(sizeof(logger_record_t) + LOGGER_TEXT_MAX
+                      + payload_size)
+    );
+    if (!record) {
+        return;
+    }
+
+    char* text = (char*)(record + 1);
+    int len = vsnprintf(text, LOGGER_TEXT_MAX, format, args);
+    if (len < 0) {
+        len = 0;
+    } else
+    if (len >= LOGGER_TEXT_MAX) {
+        len = LOGGER_TEXT_MAX - 1;
+    }
+    if (payload_size > 0) {
+        memcpy(text + len, payload, payload_size);
+    }
+
+    record->time_ns = _logger_clock_ns();
+    record->payload_total = payload_total;
+    record->size = _logger_align(sizeof(logger_record_t) + len
+                                 + payload_size);
+    record->text_size = len;
+    record->payload_size = payload_size;
+    record->level = level;
+    record->kind = kind;
+    __atomic_store_n(&ring->head, ring->head + record->size,
+                     __ATOMIC_RELEASE);
+}
+
+
+void logger_write(config_log_level_t level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    _logger_vwrite(level, LOGGER_KIND_TEXT, NULL, 0, format, args);
+    va_end(args);
+}
+
+
+/*
+ * Returns true if the next payload of the calling thread is logged.
+ */
+static bool _logger_sample_payload(void) {
+    logger_payloads_t* payloads = &thread_payloads_g;
+
+    if (payloads->seen++ % logger_g.payload_sample != 0) {
+        return false;
+    }
+    if (logger_g.payload_rate == 0) {
+        return true;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec != payloads->second) {
+        if (payloads->suppressed > 0) {
+            logger_write(CONFIG_LOG_DEBUG, "logger: %llu payloads not "
+                         "logged over the rate limit",
+                         (unsigned long long)payloads->suppressed);
+        }
+        payloads->second = now.tv_sec;
+        payloads->count = 0;
+        payloads->suppressed = 0;
+    }
+    if (payloads->count >= logger_g.payload_rate) {
+        payloads->suppressed++;
+        return false;
+    }
+    payloads->count++;
+    return true;
+}
+
+
+void logger_write_payload(const void* payload, size_t size,
+                          const char* format, ...)
+{
+    if (!_logger_sample_payload()) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    _logger_vwrite(CONFIG_LOG_DEBUG, LOGGER_KIND_PAYLOAD, payload, size,
+                   format, args);
+    va_end(args);
+}
+
+
+/*
+ * Returns the next record of `ring` to write, or NULL if it has none left.
+ */
+static logger_record_t* _logger_next_record(logger_ring_t* ring) {
+    while (ring->cursor != ring->end) {
+        logger_record_t* record = (logger_record_t*)(ring->data + ring->cursor
+                                                     % LOGGER_RING_SIZE);
+        if (record->kind != LOGGER_KIND_PADDING) {
+            return record;
+        }
+        ring->cursor += record->size;
+    }
+    return NULL;
+}
+
+
+/*
+ * Write the records of all the rings in time order, freeing the rings of
+ * exited threads.
+ * Returns the number of records written.
+ */
+static size_t _logger_drain(logger_clock_t* clock) {
+    size_t count = 0;
+
+    // Rings are only added at the head of the list, and only removed here.
+    pthread_mutex_lock(&logger_g.lock);
+    logger_ring_t* rings = logger_g.rings;
+    pthread_mutex_unlock(&logger_g.lock);
+
+    for (logger_ring_t* ring = rings; ring; ring = ring->next) {
+        // Once closed, the ring gets no more records.
+        ring->drained = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        ring->end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        ring->cursor = ring->tail;
+    }
+
+    // Merge the rings, whose records are each in time order.
+    for (;;) {
+        logger_ring_t* oldest = NULL;
+        logger_record_t* oldest_record = NULL;
+        for (logger_ring_t* ring = rings; ring; ring = ring->next) {
+            logger_record_t* record = _logger_next_record(ring);
+            if (record && (!oldest_record
+                           || record->time_ns < oldest_record->time_ns))
+            {
+                oldest = ring;
+                oldest_record = record;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+
+        const char* text = (const char*)(oldest_record + 1);
+        _logger_print(clock, oldest_record->time_ns, oldest_record->level,
+                      oldest_record->kind, text, oldest_record->text_size,
+                      (const unsigned char*)text + oldest_record->text_size,
+                      oldest_record->payload_size,
+                      oldest_record->payload_total);
+        oldest->cursor += oldest_record->size;
+        count++;
+    }
+
+    logger_ring_t** link = &logger_g.rings;
+    logger_ring_t* ring = rings;
+    while (ring) {
+        __atomic_store_n(&ring->tail, ring->cursor, __ATOMIC_RELEASE);
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported_dropped) {
+            char text[64];
+            int len = snprintf(text, sizeof(text), "logger: %llu records "
+                               "dropped by a full ring",
+                               (unsigned long long)(dropped
+                                                    - ring->reported_dropped));
+            _logger_print(clock, _logger_clock_ns(), CONFIG_LOG_WARNING,
+                          LOGGER_KIND_TEXT, text, len, NULL, 0, 0);
+            ring->reported_dropped = dropped;
+        }
+
+        logger_ring_t* next = ring->next;
+        if (ring->drained) {
+            // Rings may have been added before it since the list was read.
+            pthread_mutex_lock(&logger_g.lock);
+            while (*link != ring) {
+                link = &(*link)->next;
+            }
+            *link = next;
+            pthread_mutex_unlock(&logger_g.lock);
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+        ring = next;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    return count;
+}
+
+
+static void* _logger_thread(void* data) {
+    logger_clock_t clock = { .text = "" };
+    bool running;
+    size_t count;
+
+    do {
+        running = __atomic_load_n(&logger_g.running, __ATOMIC_ACQUIRE);
+        count = _logger_drain(&clock);
+        if (count == 0 && running) {
+            struct timespec interval = {
+                .tv_sec = 0,
+                .tv_nsec = LOGGER_DRAIN_INTERVAL * 1000000,
+            };
+            nanosleep(&interval, NULL);
+        }
+    } while (running || count > 0);
+
+    return NULL;
+}
+
+
+logger_status_t logger_start(const config_log_t* config) {
+    logger_g.payload_sample = config->payload_sample;
+    logger_g.payload_rate = config->payload_rate;
+    logger_level_g = config->level;
+
+    if (pthread_key_create(&logger_g.key, &_logger_ring_close) != 0) {
+        fprintf(stderr, "logger: unable to create thread key\n");
+        return LOGGER_ERROR;
+    }
+    __atomic_store_n(&logger_g.running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&logger_g.thread, NULL, &_logger_thread, NULL) != 0) {
+        fprintf(stderr, "logger: unable to start thread\n");
+        __atomic_store_n(&logger_g.running, false, __ATOMIC_RELEASE);
+        pthread_key_delete(logger_g.key);
+        return LOGGER_ERROR;
+    }
+    return LOGGER_SUCCESS;
+}
+
+
+void logger_stop(void) {
+    if (__atomic_exchange_n(&logger_g.running, false, __ATOMIC_ACQ_REL)) {
+        pthread_join(logger_g.thread, NULL);
+    }
+}
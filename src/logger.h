@@ -0,0 +1,91 @@
+/*
+ * Asynchronous logger.
+ *
+ * Each thread writes its records in its own ring buffer, without locks nor
+ * system calls, and a background thread drains the rings to the standard
+ * output (info and debug) or error (errors and warnings). Records hold the
+ * raw time, formatted by the background thread only.
+ *
+ * The `LOG_*` macros only compare the level when it is disabled, so that
+ * their arguments are not even evaluated. Payloads are logged at the debug
+ * level, escaped, truncated, sampled and rate limited.
+ *
+ * Before `logger_start` and after `logger_stop`, records are written
+ * synchronously.
+ */
+#ifndef _logger_h_
+#define _logger_h_
+
+#include <stddef.h>
+
+#include "config.h"
+
+
+typedef enum logger_status {
+    LOGGER_ERROR = -1,
+    LOGGER_SUCCESS = 0,
+} logger_status_t;
+
+
+// Records of this level or more important are written.
+extern config_log_level_t logger_level_g;
+
+
+#define LOG_ENABLED(level)  ((level) <= logger_level_g)
+
+#define LOG(level, ...) \
+    do { \
+        if (LOG_ENABLED(level)) { \
+            logger_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(...)      LOG(CONFIG_LOG_ERROR, __VA_ARGS__)
+#define LOG_WARNING(...)    LOG(CONFIG_LOG_WARNING, __VA_ARGS__)
+#define LOG_INFO(...)       LOG(CONFIG_LOG_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)      LOG(CONFIG_LOG_DEBUG, __VA_ARGS__)
+
+/*
+ * Log the `size` bytes of `payload` after the text formatted by the other
+ * arguments.
+ */
+#define LOG_PAYLOAD(payload, size, ...) \
+    do { \
+        if (LOG_ENABLED(CONFIG_LOG_DEBUG)) { \
+            logger_write_payload(payload, size, __VA_ARGS__); \
+        } \
+    } while (0)
+
+
+/*
+ * Start the background thread draining the records, following `config`.
+ * Returns `LOGGER_ERROR` on failure, `LOGGER_SUCCESS` otherwise.
+ */
+logger_status_t logger_start(const config_log_t* config);
+
+
+/*
+ * Write the pending records and stop the background thread.
+ */
+void logger_stop(void);
+
+
+/*
+ * Record a line formatted by `format` at `level`. A newline is appended.
+ * Use the `LOG_*` macros instead, which skip disabled levels.
+ */
+void logger_write(config_log_level_t level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+
+/*
+ * Record the `size` bytes of `payload` after the text formatted by
+ * `format`, unless the payload is not sampled or exceeds the rate limit.
+ * Use `LOG_PAYLOAD` instead, which skips it when debug is disabled.
+ */
+void logger_write_payload(const void* payload, size_t size,
+                          const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+
+#endif
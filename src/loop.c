@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "logger.h"
+#include "loop.h"
+
+
+// Events collected by a single wait.
+#define LOOP_EVENTS     64
+
+// Packets the kernel polls from a device queue at once while busy polling.
+#define LOOP_BUSY_POLL_BUDGET   8
+
+// Older C libraries miss the epoll busy poll parameters of Linux 6.9.
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS    _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+
+static uint64_t _loop_clock_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000) + now.tv_nsec / 1000000;
+}
+
+
+static uint64_t _loop_clock_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000000) + now.tv_nsec / 1000;
+}
+
+
+loop_status_t loop_init(loop_t* loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        return LOOP_ERROR;
+    }
+    wheel_init(&loop->timers, _loop_clock_ms());
+    loop->busy_poll_us = 0;
+    return LOOP_SUCCESS;
+}
+
+
+void loop_set_busy_poll(loop_t* loop, int busy_poll_us) {
+    struct epoll_params params = {
+        .busy_poll_usecs = busy_poll_us,
+        .busy_poll_budget = LOOP_BUSY_POLL_BUDGET,
+        .prefer_busy_poll = busy_poll_us > 0,
+    };
+    // Older kernels only spin on the descriptors, from user space.
+    if (ioctl(loop->epoll_fd, EPIOCSPARAMS, &params) < 0
+        && busy_poll_us > 0)
+    {
+        LOG_DEBUG("loop %p: no kernel busy polling", loop);
+    }
+    loop->busy_poll_us = busy_poll_us;
+}
+
+
+void loop_destroy(loop_t* loop) {
+    close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+}
+
+
+loop_status_t loop_add(loop_t* loop, loop_watch_t* watch, int fd,
+                       uint32_t events, loop_callback_t callback, void* data)
+{
+    *watch = (loop_watch_t){
+        .fd = fd,
+        .events = events,
+        .callback = callback,
+        .data = data,
+    };
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = watch,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return LOOP_ERROR;
+    }
+    return LOOP_SUCCESS;
+}
+
+
+loop_status_t loop_modify(loop_t* loop, loop_watch_t* watch, uint32_t events)
+{
+    if (watch->events == events) {
+        return LOOP_SUCCESS;
+    }
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = watch,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &event) < 0) {
+        return LOOP_ERROR;
+    }
+    watch->events = events;
+    return LOOP_SUCCESS;
+}
+
+
+void loop_remove(loop_t* loop, loop_watch_t* watch) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+
+/*
+ * Wait for events during `wait_us` microseconds, or forever if negative.
+ */
+static int _loop_wait(loop_t* loop, struct epoll_event* events,
+                      int64_t wait_us)
+{
+    struct timespec timeout = {
+        .tv_sec = wait_us / 1000000,
+        .tv_nsec = (wait_us % 1000000) * 1000,
+    };
+    int count = epoll_pwait2(loop->epoll_fd, events, LOOP_EVENTS,
+                             wait_us < 0 ? NULL : &timeout, NULL);
+    if (count < 0 && errno == ENOSYS) {
+        // Kernels older than 5.11 only wait for milliseconds.
+        count = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS,
+                           wait_us < 0 ? -1 : (wait_us + 999) / 1000);
+    }
+    return count;
+}
+
+
+/*
+ * Poll for events without sleeping during the busy poll time, or `wait_us`
+ * if sooner, then wait for what is left of `wait_us`.
+ */
+static int _loop_spin(loop_t* loop, struct epoll_event* events,
+                      int64_t wait_us)
+{
+    uint64_t start = _loop_clock_us();
+    int64_t spin_us = loop->busy_poll_us;
+    int64_t spent_us;
+
+    if (wait_us >= 0 && wait_us < spin_us) {
+        spin_us = wait_us;
+    }
+    do {
+        int count = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS, 0);
+        if (count != 0) {
+            return count;
+        }
+        spent_us = _loop_clock_us() - start;
+    } while (spent_us < spin_us);
+
+    if (wait_us < 0) {
+        return _loop_wait(loop, events, -1);
+    }
+    return _loop_wait(loop, events,
+                      wait_us > spent_us ? wait_us - spent_us : 0);
+}
+
+
+loop_status_t loop_run_once(loop_t* loop, int64_t max_wait_us) {
+    struct epoll_event events[LOOP_EVENTS];
+
+    int64_t wait_us = max_wait_us;
+    uint64_t next_tick = wheel_next_tick(&loop->timers);
+    if (next_tick != UINT64_MAX) {
+        uint64_t now = _loop_clock_ms();
+        uint64_t due = loop->timers.now + next_tick;
+        int64_t timer_wait_us = due > now ? (due - now) * 1000 : 0;
+        if (wait_us < 0 || timer_wait_us < wait_us) {
+            wait_us = timer_wait_us;
+        }
+    }
+
+    int count = loop->busy_poll_us > 0 && wait_us != 0
+              ? _loop_spin(loop, events, wait_us)
+              : _loop_wait(loop, events, wait_us);
+    if (count < 0) {
+        if (errno != EINTR) {
+            LOG_ERROR("loop %p: cannot wait for events", loop);
+            return LOOP_ERROR;
+        }
+        count = 0;
+    }
+
+    // Timers armed by the callbacks count from the end of the wait.
+    wheel_advance(&loop->timers, _loop_clock_ms());
+
+    for (int i = 0; i < count; i++) {
+        loop_watch_t* watch = events[i].data.ptr;
+        watch->callback(watch->data, events[i].events);
+    }
+
+    return LOOP_SUCCESS;
+}
@@ -0,0 +1,124 @@
+/*
+ * Event loop: waits for events on file descriptors with epoll, and runs a
+ * timer wheel with a millisecond resolution.
+ *
+ * A loop is driven by a single thread. Descriptors are registered through
+ * watches, which must stay at the same address while they are registered.
+ *
+ * A busy polling loop spins on its descriptors for a while before sleeping,
+ * trading a core for the latency of a wake up. Kernels from 6.9 also poll
+ * the device queues of its sockets meanwhile.
+ */
+#ifndef _loop_h_
+#define _loop_h_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "wheel.h"
+
+
+typedef enum loop_status {
+    LOOP_ERROR = -1,
+    LOOP_SUCCESS = 0,
+} loop_status_t;
+
+
+/*
+ * Called with the epoll events of a watched descriptor.
+ */
+typedef void (*loop_callback_t)(void* data, uint32_t events);
+
+
+typedef struct loop_watch {
+    int fd;
+    uint32_t events;
+    loop_callback_t callback;
+    void* data;
+} loop_watch_t;
+
+
+typedef struct loop {
+    int epoll_fd;
+    wheel_t timers;
+    // Microseconds spun before sleeping, or 0.
+    int busy_poll_us;
+} loop_t;
+
+
+/*
+ * Create the loop epoll instance.
+ * Returns `LOOP_ERROR` on failure, `LOOP_SUCCESS` otherwise.
+ */
+loop_status_t loop_init(loop_t* loop);
+
+
+/*
+ * Close the loop epoll instance. Armed timers are left untouched.
+ */
+void loop_destroy(loop_t* loop);
+
+
+/*
+ * Have the loop poll for events during `busy_poll_us` microseconds before
+ * sleeping, or sleep at once if 0.
+ */
+void loop_set_busy_poll(loop_t* loop, int busy_poll_us);
+
+
+/*
+ * Returns the current time of the loop, in milliseconds.
+ */
+static inline uint64_t loop_now(const loop_t* loop) {
+    return loop->timers.now;
+}
+
+
+/*
+ * Watch `events` (EPOLLIN, EPOLLOUT...) on `fd`, calling `callback` with
+ * `data` when some happen.
+ * Returns `LOOP_ERROR` on failure, `LOOP_SUCCESS` otherwise.
+ */
+loop_status_t loop_add(loop_t* loop, loop_watch_t* watch, int fd,
+                       uint32_t events, loop_callback_t callback, void* data);
+
+
+/*
+ * Change the events watched by `watch`, if they differ.
+ * Returns `LOOP_ERROR` on failure, `LOOP_SUCCESS` otherwise.
+ */
+loop_status_t loop_modify(loop_t* loop, loop_watch_t* watch, uint32_t events);
+
+
+/*
+ * Stop watching the descriptor of `watch`.
+ */
+void loop_remove(loop_t* loop, loop_watch_t* watch);
+
+
+/*
+ * Arm `timer` to expire in `delay_ms` milliseconds.
+ */
+static inline void loop_arm(loop_t* loop, wheel_timer_t* timer,
+                            uint64_t delay_ms)
+{
+    wheel_arm(&loop->timers, timer, delay_ms);
+}
+
+
+static inline void loop_disarm(loop_t* loop, wheel_timer_t* timer) {
+    wheel_disarm(&loop->timers, timer);
+}
+
+
+/*
+ * Wait for events during at most `max_wait_us` microseconds, or until the
+ * next timer expiry if it is sooner, then run the callbacks of the expired
+ * timers and of the events. A negative `max_wait_us` only waits for the
+ * next timer.
+ * Returns `LOOP_ERROR` if waiting failed, `LOOP_SUCCESS` otherwise.
+ */
+loop_status_t loop_run_once(loop_t* loop, int64_t max_wait_us);
+
+
+#endif
@@ -0,0 +1,485 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "net.h"
+
+
+// Largest HTTP request read by the listener.
+#define METRICS_REQUEST_MAX     2048
+
+// Seconds given to a scraper to send its request.
+#define METRICS_REQUEST_TIMEOUT 5
+
+// Milliseconds waited before accepting again when out of descriptors.
+#define METRICS_ACCEPT_BACKOFF  100
+
+
+typedef struct metrics_counter_info {
+    const char* name;
+    // Labels of the sample, or NULL.
+    const char* labels;
+    const char* help;
+} metrics_counter_info_t;
+
+
+typedef struct metrics_histogram_info {
+    const char* name;
+    const char* help;
+    // Factor converting the recorded values to the exported unit.
+    double scale;
+} metrics_histogram_info_t;
+
+
+bool metrics_enabled_g = false;
+__thread metrics_shard_t* metrics_shard_g = NULL;
+
+// Protects the list of shards, and the shard of the exited threads.
+static pthread_mutex_t metrics_lock_g = PTHREAD_MUTEX_INITIALIZER;
+static metrics_shard_t* metrics_shards_g = NULL;
+static metrics_shard_t metrics_retired_g;
+
+// Folds the shard of a thread in the retired one when it exits.
+static pthread_key_t metrics_key_g;
+
+// Names the scheduling classes.
+static const config_t* metrics_config_g = NULL;
+
+
+static const metrics_counter_info_t COUNTERS[] = {
+    [METRICS_CONNECTIONS_OPENED] = {
+        "wsbridge_connections_total", NULL,
+        "Client connections accepted."
+    },
+    [METRICS_CONNECTIONS_CLOSED] = {
+        "wsbridge_connections_closed_total", NULL,
+        "Client connections closed."
+    },
+    [METRICS_HANDSHAKES] = {
+        "wsbridge_handshakes_total", NULL,
+        "WebSocket handshakes completed."
+    },
+    [METRICS_HANDSHAKE_FAILURES] = {
+        "wsbridge_handshake_failures_total", NULL,
+        "Client connections closed before completing their handshake."
+    },
+    [METRICS_UPSTREAM_CONNECTS] = {
+        "wsbridge_upstream_connects_total", NULL,
+        "Connections to the bridged server established."
+    },
+    [METRICS_UPSTREAM_CONNECT_FAILURES] = {
+        "wsbridge_upstream_connect_failures_total", NULL,
+        "Connections to the bridged server which failed."
+    },
+    [METRICS_WS_BYTES_IN] = {
+        "wsbridge_websocket_bytes_total", "direction=\"in\"",
+        "Bytes read from and written to clients."
+    },
+    [METRICS_WS_BYTES_OUT] = {
+        "wsbridge_websocket_bytes_total", "direction=\"out\"",
+        "Bytes read from and written to clients."
+    },
+    [METRICS_WS_FRAMES_IN] = {
+        "wsbridge_websocket_frames_total", "direction=\"in\"",
+        "Frames received from and queued to clients."
+    },
+    [METRICS_WS_FRAMES_OUT] = {
+        "wsbridge_websocket_frames_total", "direction=\"out\"",
+        "Frames received from and queued to clients."
+    },
+    [METRICS_UPSTREAM_BYTES_IN] = {
+        "wsbridge_upstream_bytes_total", "direction=\"in\"",
+        "Bytes read from and written to the bridged server."
+    },
+    [METRICS_UPSTREAM_BYTES_OUT] = {
+        "wsbridge_upstream_bytes_total", "direction=\"out\"",
+        "Bytes read from and written to the bridged server."
+    },
+    [METRICS_SLOW_CLIENTS] = {
+        "wsbridge_slow_clients_total", NULL,
+        "Clients dropped because their queue was full."
+    },
+    [METRICS_SESSIONS_DETACHED] = {
+        "wsbridge_sessions_detached_total", NULL,
+        "Bridged server connections kept for a client which was lost."
+    },
+    [METRICS_SESSIONS_RESUMED] = {
+        "wsbridge_sessions_resumed_total", NULL,
+        "Clients reattached to their bridged server connection."
+    },
+    [METRICS_CONNECTIONS_REJECTED] = {
+        "wsbridge_connections_rejected_total", NULL,
+        "Clients answered with a 503 while the bridge was overloaded."
+    },
+    [METRICS_CONNECTIONS_LIMITED] = {
+        "wsbridge_connections_rate_limited_total", NULL,
+        "Clients answered with a 429 over the rate of their address."
+    },
+};
+
+
+static const metrics_histogram_info_t HISTOGRAMS[] = {
+    [METRICS_RELAY_LATENCY] = {
+        "wsbridge_relay_latency_seconds",
+        "Time from a bridged server read to the web socket write.",
+        1e-6,
+    },
+    [METRICS_UPSTREAM_CONNECT_TIME] = {
+        "wsbridge_upstream_connect_seconds",
+        "Time to connect the bridged server.",
+        1e-6,
+    },
+    [METRICS_QUEUE_DEPTH] = {
+        "wsbridge_queue_depth_bytes",
+        "Bytes waiting in a client queue after it was flushed.",
+        1,
+    },
+    [METRICS_CLASS_LATENCY] = {
+        "wsbridge_class_relay_latency_seconds",
+        "Time from bridged server data being ready to the web socket "
+        "write, by scheduling class.",
+        1e-6,
+    },
+};
+
+
+/*
+ * Add the values of `from` to `to`. `from` may be updated meanwhile.
+ */
+static void _metrics_fold(metrics_shard_t* to, metrics_shard_t* from) {
+    for (size_t i = 0; i < METRICS_COUNTERS; i++) {
+        to->counters[i] += __atomic_load_n(&from->counters[i],
+                                           __ATOMIC_RELAXED);
+    }
+    for (size_t i = 0; i < METRICS_HISTOGRAMS; i++) {
+        for (size_t j = 0; j < METRICS_BUCKETS; j++) {
+            to->buckets[i][j] += __atomic_load_n(&from->buckets[i][j],
+                                                 __ATOMIC_RELAXED);
+        }
+        to->sums[i] += __atomic_load_n(&from->sums[i], __ATOMIC_RELAXED);
+    }
+}
+
+
+static void _metrics_shard_retire(void* data) {
+    metrics_shard_t* shard = data;
+
+    pthread_mutex_lock(&metrics_lock_g);
+    _metrics_fold(&metrics_retired_g, shard);
+    metrics_shard_t** link = &metrics_shards_g;
+    while (*link != shard) {
+        link = &(*link)->next;
+    }
+    *link = shard->next;
+    pthread_mutex_unlock(&metrics_lock_g);
+
+    metrics_shard_g = NULL;
+    free(shard);
+}
+
+
+metrics_shard_t* metrics_shard(void) {
+    metrics_shard_t* shard;
+    if (posix_memalign((void**)&shard, 64, sizeof(metrics_shard_t)) != 0) {
+        return NULL;
+    }
+    memset(shard, 0, sizeof(metrics_shard_t));
+
+    pthread_mutex_lock(&metrics_lock_g);
+    shard->next = metrics_shards_g;
+    metrics_shards_g = shard;
+    pthread_mutex_unlock(&metrics_lock_g);
+
+    pthread_setspecific(metrics_key_g, shard);
+    metrics_shard_g = shard;
+    return shard;
+}
+
+
+/*
+ * Fill `total` with the sum of all the shards.
+ */
+static void _metrics_sum(metrics_shard_t* total) {
+    memset(total, 0, sizeof(metrics_shard_t));
+
+    pthread_mutex_lock(&metrics_lock_g);
+    _metrics_fold(total, &metrics_retired_g);
+    for (metrics_shard_t* shard = metrics_shards_g; shard;
+         shard = shard->next)
+    {
+        _metrics_fold(total, shard);
+    }
+    pthread_mutex_unlock(&metrics_lock_g);
+}
+
+
+/*
+ * Returns the largest value of the bucket `index`.
+ */
+static uint64_t _metrics_bucket_max(unsigned index) {
+    if (index < METRICS_SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = index / METRICS_SUB_BUCKETS - 1;
+    uint64_t sub = index % METRICS_SUB_BUCKETS;
+    return ((METRICS_SUB_BUCKETS + sub) << shift) + ((UINT64_C(1) << shift)
+                                                    - 1);
+}
+
+
+/*
+ * Append the text formatted by `format` to `out`.
+ */
+__attribute__((format(printf, 2, 3)))
+static bool _metrics_append(buffer_t* out, const char* format, ...) {
+    va_list args;
+    for (;;) {
+        va_start(args, format);
+        int len = vsnprintf(buffer_tail(out), buffer_room(out), format,
+                            args);
+        va_end(args);
+        if (len < 0) {
+            return false;
+        }
+        if ((size_t)len < buffer_room(out)) {
+            buffer_commit(out, len);
+            return true;
+        }
+        if (!buffer_reserve(out, len + 1)) {
+            return false;
+        }
+    }
+}
+
+
+/*
+ * Write the samples of `histogram`, of the family `info`, with the
+ * `labels` ending with a comma, or "".
+ */
+static void _metrics_render_histogram(buffer_t* out, metrics_shard_t* total,
+                                      size_t histogram,
+                                      const metrics_histogram_info_t* info,
+                                      const char* labels)
+{
+    const uint64_t* buckets = total->buckets[histogram];
+
+    int last = -1;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        if (buckets[i] > 0) {
+            last = i;
+        }
+    }
+
+    // The labels of the sum and count samples lose their last comma.
+    int labels_size = strlen(labels) > 0 ? (int)strlen(labels) - 1 : 0;
+    uint64_t count = 0;
+    for (int i = 0; i <= last; i++) {
+        count += buckets[i];
+        _metrics_append(out, "%s_bucket{%sle=\"%.9g\"} %llu\n", info->name,
+                        labels, _metrics_bucket_max(i) * info->scale,
+                        (unsigned long long)count);
+    }
+    _metrics_append(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", info->name,
+                    labels, (unsigned long long)count);
+    _metrics_append(out, "%s_sum%s%.*s%s %.9g\n", info->name,
+                    labels_size ? "{" : "", labels_size, labels,
+                    labels_size ? "}" : "",
+                    total->sums[histogram] * info->scale);
+    _metrics_append(out, "%s_count%s%.*s%s %llu\n", info->name,
+                    labels_size ? "{" : "", labels_size, labels,
+                    labels_size ? "}" : "", (unsigned long long)count);
+}
+
+
+static void _metrics_render_header(buffer_t* out,
+                                   const metrics_histogram_info_t* info)
+{
+    _metrics_append(out, "# HELP %s %s\n# TYPE %s histogram\n", info->name,
+                    info->help, info->name);
+}
+
+
+/*
+ * Write all the metrics in `out`, in the Prometheus text format.
+ */
+static void _metrics_render(buffer_t* out) {
+    metrics_shard_t* total = malloc(sizeof(metrics_shard_t));
+    if (!total) {
+        return;
+    }
+    _metrics_sum(total);
+
+    uint64_t opened = total->counters[METRICS_CONNECTIONS_OPENED];
+    uint64_t closed = total->counters[METRICS_CONNECTIONS_CLOSED];
+    _metrics_append(out, "# HELP wsbridge_connections_active Client "
+                    "connections open.\n"
+                    "# TYPE wsbridge_connections_active gauge\n"
+                    "wsbridge_connections_active %llu\n",
+                    (unsigned long long)(opened > closed
+                                         ? opened - closed
+                                         : 0));
+
+    for (size_t i = 0; i < METRICS_COUNTERS; i++) {
+        const metrics_counter_info_t* info = &COUNTERS[i];
+        // Samples of a metric follow each other, with a single header.
+        if (i == 0 || strcmp(info->name, COUNTERS[i - 1].name) != 0) {
+            _metrics_append(out, "# HELP %s %s\n# TYPE %s counter\n",
+                            info->name, info->help, info->name);
+        }
+        _metrics_append(out, "%s%s%s%s %llu\n", info->name,
+                        info->labels ? "{" : "",
+                        info->labels ? info->labels : "",
+                        info->labels ? "}" : "",
+                        (unsigned long long)total->counters[i]);
+    }
+
+    for (size_t i = 0; i < METRICS_CLASS_LATENCY; i++) {
+        _metrics_render_header(out, &HISTOGRAMS[i]);
+        _metrics_render_histogram(out, total, i, &HISTOGRAMS[i], "");
+    }
+
+    const metrics_histogram_info_t* info = &HISTOGRAMS[METRICS_CLASS_LATENCY];
+    _metrics_render_header(out, info);
+    _metrics_render_histogram(out, total, METRICS_CLASS_LATENCY, info,
+                              "class=\"default\",");
+    for (size_t i = 0; i < metrics_config_g->class_count; i++) {
+        const config_class_t* class = &metrics_config_g->classes[i];
+        char labels[256];
+        snprintf(labels, sizeof(labels), "class=\"%.*s\",",
+                 (int)class->prefix_size, class->prefix);
+        _metrics_render_histogram(out, total, METRICS_CLASS_LATENCY + 1 + i,
+                                  info, labels);
+    }
+    free(total);
+}
+
+
+/*
+ * Answer the HTTP request waiting on `sock`.
+ */
+static void _metrics_serve(socket_t sock) {
+    char request[METRICS_REQUEST_MAX];
+    size_t size = 0;
+    struct timeval timeout = { .tv_sec = METRICS_REQUEST_TIMEOUT };
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (size < sizeof(request) - 1) {
+        ssize_t len = recv(sock, request + size, sizeof(request) - 1 - size,
+                           0);
+        if (len <= 0) {
+            return;
+        }
+        size += len;
+        request[size] = '\0';
+        if (strstr(request, "\r\n\r\n")) {
+            break;
+        }
+    }
+
+    buffer_t body;
+    buffer_init(&body);
+    const char* status = "200 OK";
+    if (strncmp(request, "GET /metrics ", strlen("GET /metrics ")) == 0
+        || strncmp(request, "GET / ", strlen("GET / ")) == 0)
+    {
+        _metrics_render(&body);
+    } else {
+        status = "404 Not Found";
+    }
+
+    char head[256];
+    int head_size = snprintf(head, sizeof(head),
+                             "HTTP/1.1 %s\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Connection: close\r\n"
+                             "\r\n", status, buffer_size(&body));
+    struct iovec iov[2] = {
+        { head, head_size },
+        { buffer_content(&body), buffer_size(&body) },
+    };
+    struct msghdr hdr = {
+        .msg_iov = iov,
+        .msg_iovlen = buffer_size(&body) > 0 ? 2 : 1,
+    };
+    if (sendmsg(sock, &hdr, MSG_NOSIGNAL) < 0) {
+        LOG_ERROR("metrics: unable to answer a request");
+    }
+    buffer_free(&body);
+}
+
+
+/*
+ * Wait before accepting again when out of descriptors: the pending
+ * connection stays in the backlog, so accepting at once would fail again.
+ */
+static void _metrics_backoff(void) {
+    struct timespec interval = {
+        .tv_sec = METRICS_ACCEPT_BACKOFF / 1000,
+        .tv_nsec = (METRICS_ACCEPT_BACKOFF % 1000) * 1000000,
+    };
+    nanosleep(&interval, NULL);
+}
+
+
+static void* _metrics_thread(void* data) {
+    socket_t listener = (socket_t)(intptr_t)data;
+    // Whether the last accept failed, to only log the first failure.
+    bool failing = false;
+
+    for (;;) {
+        socket_t sock = accept(listener, NULL, NULL);
+        if (sock < 0) {
+            int error = errno;
+            if (error == EINTR || error == ECONNABORTED) {
+                continue;
+            }
+            if (!failing) {
+                LOG_ERROR("metrics: connection failure: %s", strerror(error));
+                failing = true;
+            }
+            if (error == EMFILE || error == ENFILE
+                || error == ENOBUFS || error == ENOMEM)
+            {
+                _metrics_backoff();
+            }
+            continue;
+        }
+        failing = false;
+        _metrics_serve(sock);
+        socket_close(sock);
+    }
+    return NULL;
+}
+
+
+metrics_status_t metrics_start(socket_t listener, const config_t* config) {
+    pthread_t thread;
+
+    metrics_config_g = config;
+    if (pthread_key_create(&metrics_key_g, &_metrics_shard_retire) != 0) {
+        LOG_ERROR("metrics: unable to create thread key");
+        return METRICS_ERROR;
+    }
+    if (pthread_create(&thread, NULL, &_metrics_thread,
+                       (void*)(intptr_t)listener) != 0)
+    {
+        LOG_ERROR("metrics: unable to start thread");
+        socket_close(listener);
+        return METRICS_ERROR;
+    }
+    pthread_detach(thread);
+
+    metrics_enabled_g = true;
+    return METRICS_SUCCESS;
+}
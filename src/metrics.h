@@ -0,0 +1,155 @@
+/*
+ * Counters and histograms of the bridge, served in the Prometheus text
+ * format by a small HTTP listener.
+ *
+ * Each thread updates its own shard, allocated on its first update and
+ * aligned on cache lines, so that no two cores write the same line. The
+ * listener sums the shards when it is scraped, without stopping the
+ * writers. Shards of exited threads are folded in a shared one.
+ *
+ * Histograms are log-bucketed: each power of two is split in
+ * `METRICS_SUB_BUCKETS` buckets, so values are kept with a relative error
+ * under 25% whatever their magnitude.
+ *
+ * Updates cost nothing but a test while the listener is not started.
+ */
+#ifndef _metrics_h_
+#define _metrics_h_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "net.h"
+
+
+// Buckets splitting each power of two, and the resulting bucket count.
+#define METRICS_SUB_BUCKETS_BITS    2
+#define METRICS_SUB_BUCKETS         (1 << METRICS_SUB_BUCKETS_BITS)
+#define METRICS_BUCKETS             ((64 - METRICS_SUB_BUCKETS_BITS + 1) \
+                                     * METRICS_SUB_BUCKETS)
+
+
+typedef enum metrics_status {
+    METRICS_ERROR = -1,
+    METRICS_SUCCESS = 0,
+} metrics_status_t;
+
+
+typedef enum metrics_counter {
+    METRICS_CONNECTIONS_OPENED,
+    METRICS_CONNECTIONS_CLOSED,
+    METRICS_HANDSHAKES,
+    METRICS_HANDSHAKE_FAILURES,
+    METRICS_UPSTREAM_CONNECTS,
+    METRICS_UPSTREAM_CONNECT_FAILURES,
+    METRICS_WS_BYTES_IN,
+    METRICS_WS_BYTES_OUT,
+    METRICS_WS_FRAMES_IN,
+    METRICS_WS_FRAMES_OUT,
+    METRICS_UPSTREAM_BYTES_IN,
+    METRICS_UPSTREAM_BYTES_OUT,
+    METRICS_SLOW_CLIENTS,
+    METRICS_SESSIONS_DETACHED,
+    METRICS_SESSIONS_RESUMED,
+    METRICS_CONNECTIONS_REJECTED,
+    METRICS_CONNECTIONS_LIMITED,
+    METRICS_COUNTERS,
+} metrics_counter_t;
+
+
+typedef enum metrics_histogram {
+    // Microseconds from the server read to the web socket write.
+    METRICS_RELAY_LATENCY,
+    // Microseconds to connect the bridged server.
+    METRICS_UPSTREAM_CONNECT_TIME,
+    // Bytes waiting in a client queue after it was flushed.
+    METRICS_QUEUE_DEPTH,
+    // Microseconds from bridged server data being ready to the web socket
+    // write, for each scheduling class, the default one first.
+    METRICS_CLASS_LATENCY,
+    METRICS_HISTOGRAMS = METRICS_CLASS_LATENCY + CONFIG_MAX_CLASSES + 1,
+} metrics_histogram_t;
+
+
+typedef struct metrics_shard {
+    uint64_t counters[METRICS_COUNTERS];
+    uint64_t buckets[METRICS_HISTOGRAMS][METRICS_BUCKETS];
+    uint64_t sums[METRICS_HISTOGRAMS];
+    struct metrics_shard* next;
+} __attribute__((aligned(64))) metrics_shard_t;
+
+
+extern bool metrics_enabled_g;
+extern __thread metrics_shard_t* metrics_shard_g;
+
+
+/*
+ * Returns the shard of the calling thread, allocating it on its first call,
+ * or NULL on allocation failure.
+ */
+metrics_shard_t* metrics_shard(void);
+
+
+/*
+ * Returns the bucket of `value` in histograms.
+ */
+static inline unsigned metrics_bucket(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned exponent = 63 - __builtin_clzll(value);
+    unsigned shift = exponent - METRICS_SUB_BUCKETS_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS
+         + ((value >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+
+/*
+ * Add `count` to `counter`.
+ */
+static inline void metrics_add(metrics_counter_t counter, uint64_t count) {
+    if (!metrics_enabled_g) {
+        return;
+    }
+    metrics_shard_t* shard = metrics_shard_g ? metrics_shard_g
+                                             : metrics_shard();
+    if (shard) {
+        // Only this thread writes its shard, the scraper only reads it.
+        __atomic_store_n(&shard->counters[counter],
+                         shard->counters[counter] + count,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * Record `value` in `histogram`.
+ */
+static inline void metrics_record(metrics_histogram_t histogram,
+                                  uint64_t value)
+{
+    if (!metrics_enabled_g) {
+        return;
+    }
+    metrics_shard_t* shard = metrics_shard_g ? metrics_shard_g
+                                             : metrics_shard();
+    if (shard) {
+        uint64_t* bucket = &shard->buckets[histogram][metrics_bucket(value)];
+        __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&shard->sums[histogram],
+                         shard->sums[histogram] + value, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * Serve the metrics over HTTP on the clients accepted on `listener`, from
+ * a new thread, and start collecting them. The scheduling classes of
+ * `config` label the latency of their clients.
+ * Returns `METRICS_ERROR` on failure, `METRICS_SUCCESS` otherwise.
+ */
+metrics_status_t metrics_start(socket_t listener, const config_t* config);
+
+
+#endif
@@ -1,13 +1,31 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include "logger.h"
 #include "net.h"
 
 
+// Prefixes of the Unix socket addresses, with their socket type.
+static const struct {
+    const char* prefix;
+    int type;
+} unix_schemes_g[] = {
+    { "unix:", SOCK_STREAM },
+    { "unixpacket:", SOCK_SEQPACKET },
+};
+
+
 net_status_t socket_set_non_blocking(socket_t sock) {
     int flags = fcntl(sock, F_GETFL, 0);
     if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
@@ -17,31 +35,141 @@ net_status_t socket_set_non_blocking(socket_t sock) {
 }
 
 
-socket_t socket_create_server_tcp(int port, size_t max_connections) {
-    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
-                   &(int){ 1 }, sizeof(int)) < 0)
+net_status_t socket_set_no_delay(socket_t sock) {
+    // Sockets which are not TCP ones, like Unix sockets or the user space
+    // TLS relays, have no delay to disable.
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                   &(int){ 1 }, sizeof(int)) < 0
+        && errno != EOPNOTSUPP)
     {
-        fprintf(stderr, "server socket will not be reusable\n");
+        return NET_ERROR;
     }
-    struct sockaddr_in addr = {
-        .sin_addr.s_addr = htonl(INADDR_ANY),
-        .sin_family = AF_INET,
-        .sin_port = htons(port)
-    };
+    return NET_SUCCESS;
+}
+
+
+net_status_t socket_set_busy_poll(socket_t sock, int usec) {
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+        return NET_ERROR;
+    }
+    return NET_SUCCESS;
+}
+
 
-    if (bind(sock,
-             (const struct sockaddr*)&addr,
-             sizeof(struct sockaddr_in))
-        < 0)
+net_status_t socket_push(socket_t sock) {
+    // Linux pushes the pending segments whenever TCP_NODELAY is set, even
+    // if it already was.
+    return socket_set_no_delay(sock);
+}
+
+
+/*
+ * Returns the socket type of the Unix socket address `str` and set `*path`
+ * to its path, or returns -1 if it is not one.
+ */
+static int _socket_unix_type(const char* str, const char** path) {
+    for (size_t i = 0; i < sizeof(unix_schemes_g) / sizeof(*unix_schemes_g);
+         i++)
     {
-        fprintf(stderr, "unable to bind listening socket on %d\n", port);
+        size_t size = strlen(unix_schemes_g[i].prefix);
+        if (strncmp(str, unix_schemes_g[i].prefix, size) == 0) {
+            *path = str + size;
+            return unix_schemes_g[i].type;
+        }
+    }
+    return -1;
+}
+
+
+bool socket_is_unix(const char* str) {
+    const char* path;
+    return _socket_unix_type(str, &path) >= 0;
+}
+
+
+net_status_t socket_parse_unix(const char* str, socket_address_t* addr) {
+    const char* path;
+    int type = _socket_unix_type(str, &path);
+    size_t size = type >= 0 ? strlen(path) : 0;
+    if (size == 0 || size >= sizeof(addr->un.sun_path)) {
+        return NET_ERROR;
+    }
+
+    *addr = (socket_address_t){
+        .type = type,
+        .un = { .sun_family = AF_UNIX },
+    };
+    memcpy(addr->un.sun_path, path, size);
+    if (path[0] == '@') {
+        // Abstract names start with a null byte and are sized, not
+        // terminated.
+        addr->un.sun_path[0] = '\0';
+        addr->size = offsetof(struct sockaddr_un, sun_path) + size;
+    } else {
+        addr->size = offsetof(struct sockaddr_un, sun_path) + size + 1;
+    }
+    return NET_SUCCESS;
+}
+
+
+/*
+ * Write a printable form of `addr` in `buf`, for the logs.
+ */
+static const char* _socket_address_name(const socket_address_t* addr,
+                                        char* buf, size_t size)
+{
+    if (addr->any.sa_family == AF_INET) {
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->in.sin_addr, host, sizeof(host));
+        snprintf(buf, size, "%s:%d", host, ntohs(addr->in.sin_port));
+    } else
+    if (addr->un.sun_path[0] == '\0') {
+        snprintf(buf, size, "@%.*s",
+                 (int)(addr->size - offsetof(struct sockaddr_un, sun_path)
+                       - 1),
+                 addr->un.sun_path + 1);
+    } else {
+        snprintf(buf, size, "%s", addr->un.sun_path);
+    }
+    return buf;
+}
+
+
+socket_t socket_create_server(const socket_address_t* addr,
+                              size_t max_connections)
+{
+    char name[128];
+    socket_t sock = socket(addr->any.sa_family, addr->type | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        LOG_ERROR("unable to create listening socket");
+        return SOCKET_ERROR;
+    }
+
+    if (addr->any.sa_family == AF_INET) {
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                       &(int){ 1 }, sizeof(int)) < 0)
+        {
+            LOG_WARNING("server socket will not be reusable");
+        }
+    } else
+    if (addr->un.sun_path[0] != '\0') {
+        // A socket file outlives its server, remove the previous one.
+        struct stat st;
+        if (stat(addr->un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(addr->un.sun_path);
+        }
+    }
+
+    if (bind(sock, &addr->any, addr->size) < 0) {
+        LOG_ERROR("unable to bind listening socket on %s",
+                  _socket_address_name(addr, name, sizeof(name)));
+        close(sock);
         return SOCKET_ERROR;
     }
 
     if (listen(sock, max_connections) < 0) {
-        fprintf(stderr, "unable to listen for %zu connections\n",
-                max_connections);
+        LOG_ERROR("unable to listen for %zu connections", max_connections);
+        close(sock);
         return SOCKET_ERROR;
     }
 
@@ -49,31 +177,85 @@ socket_t socket_create_server_tcp(int port, size_t max_connections) {
 }
 
 
-socket_t socket_create_client_tcp(const char* hostname, int port) {
-    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct hostent* hostinfo;
-    struct sockaddr_in sin;
+socket_t socket_create_server_tcp(int port, size_t max_connections) {
+    socket_address_t addr = {
+        .type = SOCK_STREAM,
+        .size = sizeof(struct sockaddr_in),
+        .in = {
+            .sin_addr.s_addr = htonl(INADDR_ANY),
+            .sin_family = AF_INET,
+            .sin_port = htons(port)
+        },
+    };
+    return socket_create_server(&addr, max_connections);
+}
 
-    hostinfo = gethostbyname(hostname);
-    if (!hostinfo) {
-        fprintf(stderr, "unknown host %s\n", hostname);
+
+socket_t socket_create_client(const socket_address_t* addr) {
+    char name[128];
+    socket_t sock = socket(addr->any.sa_family, addr->type | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return SOCKET_ERROR;
+    }
+    if (connect(sock, &addr->any, addr->size) < 0) {
+        LOG_ERROR("cannot connect to %s",
+                  _socket_address_name(addr, name, sizeof(name)));
+        close(sock);
         return SOCKET_ERROR;
     }
+    return sock;
+}
+
 
-    sin = (struct sockaddr_in){
-        .sin_addr = *(struct in_addr*)hostinfo->h_addr,
-        .sin_port = htons(port),
-        .sin_family = AF_INET
+net_status_t socket_resolve(const char* hostname, int port,
+                            socket_address_t* addr)
+{
+    struct hostent* hostinfo = gethostbyname(hostname);
+    if (!hostinfo) {
+        LOG_ERROR("unknown host %s", hostname);
+        return NET_ERROR;
+    }
+    *addr = (socket_address_t){
+        .type = SOCK_STREAM,
+        .size = sizeof(struct sockaddr_in),
+        .in = {
+            .sin_addr = *(struct in_addr*)hostinfo->h_addr,
+            .sin_port = htons(port),
+            .sin_family = AF_INET
+        },
     };
-    if (connect(sock, (struct sockaddr*)&sin, sizeof(struct sockaddr)) < 0) {
-        fprintf(stderr, "cannot connect to %s:%d\n", hostname, port);
+    return NET_SUCCESS;
+}
+
+
+socket_t socket_connect(const socket_address_t* addr) {
+    socket_t sock = socket(addr->any.sa_family,
+                           addr->type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return SOCKET_ERROR;
+    }
+    // Unix sockets connect at once, or fail with EAGAIN when the backlog
+    // of the server is full.
+    if (connect(sock, &addr->any, addr->size) < 0 && errno != EINPROGRESS) {
+        close(sock);
         return SOCKET_ERROR;
     }
-
     return sock;
 }
 
 
+net_status_t socket_connect_result(socket_t sock) {
+    int error = 0;
+    socklen_t size = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &size) < 0
+        || error != 0)
+    {
+        return NET_ERROR;
+    }
+    return NET_SUCCESS;
+}
+
+
 void socket_flush(socket_t sock) {
     char buf[4096];
     while (recv(sock, buf, sizeof(buf), 0) > 0) {
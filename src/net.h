@@ -4,6 +4,11 @@
 #ifndef _net_h_
 #define _net_h_
 
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
 
 typedef int socket_t;
 
@@ -17,6 +22,23 @@ typedef enum net_status {
 #define SOCKET_ERROR    (-1)
 
 
+/*
+ * Address of a TCP socket, or of a Unix domain socket, in the file system
+ * or in the abstract namespace.
+ */
+typedef struct socket_address {
+    // SOCK_STREAM, or SOCK_SEQPACKET for Unix sockets keeping the message
+    // boundaries.
+    int type;
+    socklen_t size;
+    union {
+        struct sockaddr any;
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    };
+} socket_address_t;
+
+
 /*
  * Set the given socket `sock` in non-blocking mode.
  * Returns `NET_SUCESS` in case of success or `NET_ERROR` on failure.
@@ -24,6 +46,56 @@ typedef enum net_status {
 net_status_t socket_set_non_blocking(socket_t sock);
 
 
+/*
+ * Disable Nagle's algorithm on the TCP socket `sock`, so that small writes
+ * are sent right away.
+ * Returns `NET_SUCESS` in case of success or `NET_ERROR` on failure.
+ */
+net_status_t socket_set_no_delay(socket_t sock);
+
+
+/*
+ * Have reads on `sock` poll its device queue during `usec` microseconds
+ * when it has no data, instead of waiting for an interrupt. Raising the
+ * time over the system default needs CAP_NET_ADMIN.
+ * Returns `NET_SUCESS` in case of success or `NET_ERROR` on failure.
+ */
+net_status_t socket_set_busy_poll(socket_t sock, int usec);
+
+
+/*
+ * Send the data held back by writes flagged with MSG_MORE on `sock` now.
+ * Returns `NET_SUCESS` in case of success or `NET_ERROR` on failure.
+ */
+net_status_t socket_push(socket_t sock);
+
+
+/*
+ * Returns true if `str` is a Unix socket address, as parsed by
+ * `socket_parse_unix`.
+ */
+bool socket_is_unix(const char* str);
+
+
+/*
+ * Parse the Unix socket address `str`: `unix:PATH` for a stream socket or
+ * `unixpacket:PATH` for a sequenced packet one, `PATH` being in the
+ * abstract namespace when it starts with '@'.
+ * Returns `NET_SUCESS` in case of success or `NET_ERROR` on failure.
+ */
+net_status_t socket_parse_unix(const char* str, socket_address_t* addr);
+
+
+/*
+ * Create a new server socket listening on `addr` accepting
+ * `max_connections` connections. A stale socket file is replaced.
+ * Returns the socket descriptor on success, or `SOCKET_ERROR` in case of
+ * failure.
+ */
+socket_t socket_create_server(const socket_address_t* addr,
+                              size_t max_connections);
+
+
 /*
  * Create a new TCP server socket listening on port `port` accepting
  * `max_connections` connections.
@@ -34,10 +106,36 @@ socket_t socket_create_server_tcp(int port, size_t max_connections);
 
 
 /*
- * Create a new TCP client to the given `hostname` and `port`.
+ * Create a new blocking client socket connected to `addr`.
+ * Returns the socket descriptor on success, or `SOCKET_ERROR` in case of
+ * failure.
+ */
+socket_t socket_create_client(const socket_address_t* addr);
+
+
+/*
+ * Resolve `hostname` and write its TCP address with `port` in `addr`.
  * Returns `NET_SUCESS` in case of success or `NET_ERROR` on failure.
  */
-socket_t socket_create_client_tcp(const char* hostname, int port);
+net_status_t socket_resolve(const char* hostname, int port,
+                            socket_address_t* addr);
+
+
+/*
+ * Start connecting a new non-blocking socket to `addr`. The socket becomes
+ * writable once the connection is done, and its outcome is then given by
+ * `socket_connect_result`.
+ * Returns the socket descriptor on success, or `SOCKET_ERROR` in case of
+ * failure.
+ */
+socket_t socket_connect(const socket_address_t* addr);
+
+
+/*
+ * Returns `NET_SUCESS` if the connection started by `socket_connect`
+ * succeeded, or `NET_ERROR` otherwise.
+ */
+net_status_t socket_connect_result(socket_t sock);
 
 
 /*
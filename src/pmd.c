@@ -0,0 +1,591 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "pmd.h"
+
+
+// Number of idle streams of each kind kept by a thread.
+#define PMD_POOL_MAX_IDLE   64
+
+// Approximate size of the internal zlib states, besides their windows.
+#define PMD_DEFLATE_STATE_SIZE  6000
+#define PMD_INFLATE_STATE_SIZE  7200
+
+
+// Trailer removed from compressed messages (RFC 7692 section 7.2.1).
+static const unsigned char PMD_TRAILER[4] = { 0x00, 0x00, 0xff, 0xff };
+
+
+/*
+ * Free streams of a thread, sorted by window size since a stream cannot
+ * change its window once created.
+ */
+typedef struct pmd_cache {
+    pmd_stream_t* deflaters[16];
+    pmd_stream_t* inflaters[16];
+    size_t idle_deflaters;
+    size_t idle_inflaters;
+} pmd_cache_t;
+
+
+static pthread_key_t pmd_cache_key_g;
+static pthread_once_t pmd_cache_once_g = PTHREAD_ONCE_INIT;
+
+
+void pmd_pool_init(pmd_pool_t* pool, const config_deflate_t* config) {
+    *pool = (pmd_pool_t){
+        .config = config,
+    };
+}
+
+
+static void _pmd_free_list(pmd_stream_t* stream, bool deflater) {
+    while (stream) {
+        pmd_stream_t* next = stream->next;
+        if (deflater) {
+            deflateEnd(&stream->z);
+        } else {
+            inflateEnd(&stream->z);
+        }
+        free(stream);
+        stream = next;
+    }
+}
+
+
+static void _pmd_cache_destroy(void* data) {
+    pmd_cache_t* cache = data;
+    for (size_t i = 0; i < 16; i++) {
+        _pmd_free_list(cache->deflaters[i], true);
+        _pmd_free_list(cache->inflaters[i], false);
+    }
+    free(cache);
+}
+
+
+static void _pmd_cache_create_key(void) {
+    pthread_key_create(&pmd_cache_key_g, &_pmd_cache_destroy);
+}
+
+
+/*
+ * Returns the free streams of the calling thread, or NULL if they cannot be
+ * allocated.
+ */
+static pmd_cache_t* _pmd_cache(void) {
+    pthread_once(&pmd_cache_once_g, &_pmd_cache_create_key);
+    pmd_cache_t* cache = pthread_getspecific(pmd_cache_key_g);
+    if (!cache) {
+        cache = calloc(1, sizeof(pmd_cache_t));
+        if (cache && pthread_setspecific(pmd_cache_key_g, cache) != 0) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+
+void pmd_pool_destroy(pmd_pool_t* pool) {
+    // The streams of the other threads are freed when they exit.
+    pthread_once(&pmd_cache_once_g, &_pmd_cache_create_key);
+    pmd_cache_t* cache = pthread_getspecific(pmd_cache_key_g);
+    if (cache) {
+        pthread_setspecific(pmd_cache_key_g, NULL);
+        _pmd_cache_destroy(cache);
+    }
+}
+
+
+static pmd_stream_t* _pmd_pool_take(pmd_pool_t* pool, bool deflater,
+                                    int window_bits)
+{
+    const config_deflate_t* config = pool->config;
+    pmd_cache_t* cache = _pmd_cache();
+    pmd_stream_t* stream = NULL;
+
+    if (cache) {
+        pmd_stream_t** list = deflater ? &cache->deflaters[window_bits]
+                                       : &cache->inflaters[window_bits];
+        stream = *list;
+        if (stream) {
+            *list = stream->next;
+            if (deflater) {
+                cache->idle_deflaters--;
+            } else {
+                cache->idle_inflaters--;
+            }
+        }
+    }
+    // A thread may run bridges compressing with other settings.
+    if (stream && deflater
+        && (stream->level != config->level
+            || stream->mem_level != config->mem_level))
+    {
+        stream->next = NULL;
+        _pmd_free_list(stream, true);
+        stream = NULL;
+    }
+    if (stream) {
+        return stream;
+    }
+
+    stream = calloc(1, sizeof(pmd_stream_t));
+    if (!stream) {
+        return NULL;
+    }
+    stream->window_bits = window_bits;
+    stream->level = config->level;
+    stream->mem_level = config->mem_level;
+
+    // Negative window bits select raw deflate streams, without zlib header.
+    int ret = deflater
+            ? deflateInit2(&stream->z, config->level, Z_DEFLATED,
+                           -window_bits, config->mem_level,
+                           Z_DEFAULT_STRATEGY)
+            : inflateInit2(&stream->z, -window_bits);
+    if (ret != Z_OK) {
+        LOG_ERROR("unable to initialize zlib stream (%d)", ret);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+
+static void _pmd_pool_give(pmd_pool_t* pool, bool deflater,
+                           pmd_stream_t* stream)
+{
+    pmd_cache_t* cache = _pmd_cache();
+    size_t* idle = NULL;
+    if (cache) {
+        idle = deflater ? &cache->idle_deflaters : &cache->idle_inflaters;
+    }
+    if (!idle || *idle == PMD_POOL_MAX_IDLE) {
+        stream->next = NULL;
+        _pmd_free_list(stream, deflater);
+        return;
+    }
+
+    if (deflater) {
+        deflateReset(&stream->z);
+    } else {
+        inflateReset(&stream->z);
+    }
+    pmd_stream_t** list = deflater ? &cache->deflaters[stream->window_bits]
+                                   : &cache->inflaters[stream->window_bits];
+    stream->next = *list;
+    *list = stream;
+    (*idle)++;
+}
+
+
+/*
+ * Parse a window bits parameter value, which may be quoted.
+ * Returns -1 if the value is invalid.
+ */
+static int _pmd_parse_window_bits(const char* value) {
+    char buf[8];
+    size_t len = strlen(value);
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+        if (len - 2 >= sizeof(buf)) {
+            return -1;
+        }
+        memcpy(buf, value + 1, len - 2);
+        buf[len - 2] = '\0';
+        value = buf;
+    }
+
+    if (strlen(value) == 0 || strlen(value) > 2) {
+        return -1;
+    }
+    for (const char* c = value; *c; c++) {
+        if (!isdigit((unsigned char)*c)) {
+            return -1;
+        }
+    }
+    int bits = atoi(value);
+    return (bits >= 8 && bits <= 15) ? bits : -1;
+}
+
+
+static char* _pmd_trim(char* str) {
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    char* end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+
+/*
+ * Try to accept a single offer, e.g.
+ * "permessage-deflate; client_max_window_bits; server_max_window_bits=10".
+ */
+static bool _pmd_accept_offer(const config_deflate_t* config, char* offer,
+                              pmd_params_t* params)
+{
+    char* save;
+    char* token = strtok_r(offer, ";", &save);
+    if (!token || strcmp(_pmd_trim(token), "permessage-deflate") != 0) {
+        return false;
+    }
+
+    bool seen_snct = false, seen_cnct = false;
+    int server_bits = 0;   // 0 when the parameter is absent
+    int client_bits = 0;   // -1 when present without value
+
+    while ((token = strtok_r(NULL, ";", &save))) {
+        char* value = strchr(token, '=');
+        if (value) {
+            *value++ = '\0';
+            value = _pmd_trim(value);
+        }
+        char* name = _pmd_trim(token);
+
+        if (strcmp(name, "server_no_context_takeover") == 0) {
+            if (seen_snct || value) {
+                return false;
+            }
+            seen_snct = true;
+        } else
+        if (strcmp(name, "client_no_context_takeover") == 0) {
+            if (seen_cnct || value) {
+                return false;
+            }
+            seen_cnct = true;
+        } else
+        if (strcmp(name, "server_max_window_bits") == 0) {
+            if (server_bits != 0 || !value) {
+                return false;
+            }
+            server_bits = _pmd_parse_window_bits(value);
+            if (server_bits < 0) {
+                return false;
+            }
+        } else
+        if (strcmp(name, "client_max_window_bits") == 0) {
+            if (client_bits != 0) {
+                return false;
+            }
+            client_bits = value ? _pmd_parse_window_bits(value) : -1;
+            if (value && client_bits < 0) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+
+    int server_window = config->server_max_window_bits;
+    if (server_bits > 0 && server_bits < server_window) {
+        server_window = server_bits;
+    }
+    if (server_window < 9) {
+        // zlib silently uses a 9 bits window when asked for 8.
+        return false;
+    }
+
+    // We can only limit the client window if it announced it supports it.
+    int client_window = 15;
+    if (client_bits != 0) {
+        client_window = config->client_max_window_bits;
+        if (client_bits > 0 && client_bits < client_window) {
+            client_window = client_bits;
+        }
+    }
+
+    *params = (pmd_params_t){
+        .enabled = true,
+        .server_no_context_takeover = seen_snct
+                                   || config->server_no_context_takeover,
+        .client_no_context_takeover = seen_cnct
+                                   || config->client_no_context_takeover,
+        .server_max_window_bits = server_window,
+        .client_max_window_bits = client_window,
+    };
+    return true;
+}
+
+
+void pmd_negotiate(const config_deflate_t* config, const char* offers,
+                   pmd_params_t* params)
+{
+    *params = (pmd_params_t){ .enabled = false };
+    if (!config->enabled || !offers) {
+        return;
+    }
+
+    char* copy = strdup(offers);
+    if (!copy) {
+        return;
+    }
+
+    // Offers are listed by preference order, separated by commas.
+    char* save;
+    for (char* offer = strtok_r(copy, ",", &save);
+         offer;
+         offer = strtok_r(NULL, ",", &save))
+    {
+        if (_pmd_accept_offer(config, offer, params)) {
+            break;
+        }
+    }
+
+    free(copy);
+}
+
+
+void pmd_format_response(const pmd_params_t* params, char* buf, size_t size) {
+    int len = snprintf(buf, size, "permessage-deflate");
+
+#define APPEND(...) \
+    if (len >= 0 && len < size) { \
+        len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    }
+
+    if (params->server_no_context_takeover) {
+        APPEND("; server_no_context_takeover");
+    }
+    if (params->client_no_context_takeover) {
+        APPEND("; client_no_context_takeover");
+    }
+    if (params->server_max_window_bits < 15) {
+        APPEND("; server_max_window_bits=%d", params->server_max_window_bits);
+    }
+    if (params->client_max_window_bits < 15) {
+        APPEND("; client_max_window_bits=%d", params->client_max_window_bits);
+    }
+
+#undef APPEND
+}
+
+
+void pmd_init(pmd_context_t* ctx, pmd_pool_t* pool,
+              const pmd_params_t* params)
+{
+    *ctx = (pmd_context_t){
+        .params = *params,
+        .pool = pool,
+    };
+}
+
+
+void pmd_release(pmd_context_t* ctx) {
+    if (ctx->deflater) {
+        _pmd_pool_give(ctx->pool, true, ctx->deflater);
+        ctx->deflater = NULL;
+    }
+    if (ctx->inflater) {
+        _pmd_pool_give(ctx->pool, false, ctx->inflater);
+        ctx->inflater = NULL;
+    }
+    pmd_release_buffer(ctx);
+}
+
+
+void pmd_release_buffer(pmd_context_t* ctx) {
+    free(ctx->buf);
+    ctx->buf = NULL;
+    ctx->buf_capacity = 0;
+}
+
+
+size_t pmd_resident_bytes(const pmd_context_t* ctx) {
+    // zlib memory needs, as documented in zconf.h, plus the stream states.
+    size_t bytes = ctx->buf_capacity;
+    if (ctx->deflater) {
+        bytes += sizeof(pmd_stream_t) + PMD_DEFLATE_STATE_SIZE
+               + (1 << (ctx->deflater->window_bits + 2))
+               + (1 << (ctx->pool->config->mem_level + 9));
+    }
+    if (ctx->inflater) {
+        bytes += sizeof(pmd_stream_t) + PMD_INFLATE_STATE_SIZE
+               + (1 << ctx->inflater->window_bits);
+    }
+    return bytes;
+}
+
+
+static bool _pmd_reserve(char** buf, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity ? *capacity : 256;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    char* new_buf = realloc(*buf, new_capacity);
+    if (!new_buf) {
+        return false;
+    }
+    *buf = new_buf;
+    *capacity = new_capacity;
+    return true;
+}
+
+
+pmd_status_t pmd_compress(pmd_context_t* ctx, const char* msg, size_t size,
+                          const char** out, size_t* out_size)
+{
+    if (!ctx->params.enabled || size < ctx->pool->config->threshold) {
+        return PMD_SKIPPED;
+    }
+
+    if (!ctx->deflater) {
+        ctx->deflater = _pmd_pool_take(ctx->pool, true,
+                                       ctx->params.server_max_window_bits);
+        if (!ctx->deflater) {
+            return PMD_ERROR;
+        }
+    }
+
+    z_stream* z = &ctx->deflater->z;
+    size_t len = 0;
+    z->next_in = (Bytef*)msg;
+    z->avail_in = size;
+    do {
+        if (!_pmd_reserve(&ctx->buf, &ctx->buf_capacity,
+                          len + deflateBound(z, z->avail_in) + 16))
+        {
+            return PMD_ERROR;
+        }
+        z->next_out = (Bytef*)ctx->buf + len;
+        z->avail_out = ctx->buf_capacity - len;
+        int ret = deflate(z, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOG_ERROR("deflate failed (%d)", ret);
+            return PMD_ERROR;
+        }
+        len = ctx->buf_capacity - z->avail_out;
+    } while (z->avail_out == 0 || z->avail_in > 0);
+
+    if (len < sizeof(PMD_TRAILER)
+        || memcmp(ctx->buf + len - sizeof(PMD_TRAILER), PMD_TRAILER,
+                  sizeof(PMD_TRAILER)) != 0)
+    {
+        LOG_ERROR("deflate produced an unexpected block ending");
+        return PMD_ERROR;
+    }
+    len -= sizeof(PMD_TRAILER);
+
+    if (ctx->params.server_no_context_takeover) {
+        _pmd_pool_give(ctx->pool, true, ctx->deflater);
+        ctx->deflater = NULL;
+
+        // Without shared history, a message that doesn't shrink can be sent
+        // as is. With context takeover the client must see every byte we
+        // fed to the compressor.
+        if (len >= size) {
+            return PMD_SKIPPED;
+        }
+    }
+
+    *out = ctx->buf;
+    *out_size = len;
+    return PMD_SUCCESS;
+}
+
+
+static pmd_status_t _pmd_inflate(z_stream* z, const char* in, size_t size,
+                                 size_t max_size, char** out, size_t* len,
+                                 size_t* capacity)
+{
+    z->next_in = (Bytef*)in;
+    z->avail_in = size;
+    for (;;) {
+        if (*len == *capacity) {
+            if (*capacity > max_size) {
+                LOG_ERROR("inflated message exceeds %zu bytes", max_size);
+                return PMD_ERROR;
+            }
+            if (!_pmd_reserve(out, capacity, *capacity * 2)) {
+                return PMD_ERROR;
+            }
+        }
+        z->next_out = (Bytef*)*out + *len;
+        z->avail_out = *capacity - *len;
+        int ret = inflate(z, Z_SYNC_FLUSH);
+        *len = *capacity - z->avail_out;
+
+        if (ret == Z_STREAM_END) {
+            // The client closed its deflate stream, the next message starts
+            // a new one.
+            inflateReset(z);
+        } else
+        if (ret == Z_BUF_ERROR && z->avail_out > 0 && z->avail_in == 0) {
+            // Nothing left to produce.
+            break;
+        } else
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOG_ERROR("inflate failed (%d)", ret);
+            return PMD_ERROR;
+        }
+
+        if (z->avail_in == 0 && z->avail_out > 0) {
+            break;
+        }
+    }
+    return PMD_SUCCESS;
+}
+
+
+pmd_status_t pmd_decompress(pmd_context_t* ctx, const char* msg, size_t size,
+                            size_t max_size, char** out, size_t* out_size)
+{
+    if (!ctx->inflater) {
+        ctx->inflater = _pmd_pool_take(ctx->pool, false,
+                                       ctx->params.client_max_window_bits);
+        if (!ctx->inflater) {
+            return PMD_ERROR;
+        }
+    }
+
+    size_t len = 0;
+    size_t capacity = size * 2 + 64;
+    *out = malloc(capacity);
+    if (!*out) {
+        return PMD_ERROR;
+    }
+
+    z_stream* z = &ctx->inflater->z;
+    pmd_status_t status = _pmd_inflate(z, msg, size, max_size, out, &len,
+                                       &capacity);
+    if (status == PMD_SUCCESS) {
+        status = _pmd_inflate(z, (const char*)PMD_TRAILER,
+                              sizeof(PMD_TRAILER), max_size, out, &len,
+                              &capacity);
+    }
+    if (status == PMD_SUCCESS && len > max_size) {
+        LOG_ERROR("inflated message exceeds %zu bytes", max_size);
+        status = PMD_ERROR;
+    }
+
+    if (ctx->params.client_no_context_takeover || status != PMD_SUCCESS) {
+        _pmd_pool_give(ctx->pool, false, ctx->inflater);
+        ctx->inflater = NULL;
+    }
+
+    if (status != PMD_SUCCESS) {
+        free(*out);
+        *out = NULL;
+        return status;
+    }
+
+    // Ensure there is room for the NUL terminator expected by callers.
+    if (len == capacity && !_pmd_reserve(out, &capacity, len + 1)) {
+        free(*out);
+        *out = NULL;
+        return PMD_ERROR;
+    }
+    (*out)[len] = '\0';
+    *out_size = len;
+    return PMD_SUCCESS;
+}
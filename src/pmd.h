@@ -0,0 +1,149 @@
+/*
+ * permessage-deflate WebSocket extension (RFC 7692).
+ *
+ * A deflate stream costs around 300 KB with default settings, so streams are
+ * not owned by connections: they are taken from the free streams of the
+ * running thread when a message must be (de)compressed, without any lock.
+ * When context takeover is disabled for a direction, the stream goes back
+ * to the thread right after the message; otherwise the connection keeps it
+ * from its first compressed message until it closes.
+ */
+#ifndef _pmd_h_
+#define _pmd_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <zlib.h>
+
+#include "config.h"
+
+
+typedef enum pmd_status {
+    PMD_ERROR = -1,
+    PMD_SUCCESS = 0,
+    PMD_SKIPPED = 1,
+} pmd_status_t;
+
+
+/*
+ * Parameters agreed with a client during the handshake.
+ */
+typedef struct pmd_params {
+    bool enabled;
+    bool server_no_context_takeover;
+    bool client_no_context_takeover;
+    int server_max_window_bits;
+    int client_max_window_bits;
+} pmd_params_t;
+
+
+typedef struct pmd_stream {
+    struct pmd_stream* next;
+    int window_bits;
+    int level;
+    int mem_level;
+    z_stream z;
+} pmd_stream_t;
+
+
+/*
+ * Settings of the zlib streams of a bridge. The free streams are kept by
+ * each thread, so that taking one needs no lock.
+ */
+typedef struct pmd_pool {
+    const config_deflate_t* config;
+} pmd_pool_t;
+
+
+/*
+ * Compression state of a single connection.
+ */
+typedef struct pmd_context {
+    pmd_params_t params;
+    pmd_pool_t* pool;
+    pmd_stream_t* deflater;
+    pmd_stream_t* inflater;
+
+    // Output of the last `pmd_compress` call.
+    char* buf;
+    size_t buf_capacity;
+} pmd_context_t;
+
+
+/*
+ * Initialize an empty pool creating streams with the `config` settings.
+ */
+void pmd_pool_init(pmd_pool_t* pool, const config_deflate_t* config);
+
+
+/*
+ * Free the idle streams of the calling thread. Those of the other threads
+ * are freed when they exit.
+ */
+void pmd_pool_destroy(pmd_pool_t* pool);
+
+
+/*
+ * Pick the first acceptable offer of the `Sec-WebSocket-Extensions` header
+ * value `offers`. `params->enabled` is false if none can be accepted.
+ */
+void pmd_negotiate(const config_deflate_t* config, const char* offers,
+                   pmd_params_t* params);
+
+
+/*
+ * Write the `Sec-WebSocket-Extensions` header value answering `params` in
+ * `buf`.
+ */
+void pmd_format_response(const pmd_params_t* params, char* buf, size_t size);
+
+
+/*
+ * Initialize a connection context. No zlib state is allocated until the
+ * first message.
+ */
+void pmd_init(pmd_context_t* ctx, pmd_pool_t* pool,
+              const pmd_params_t* params);
+
+
+/*
+ * Give back the context streams and buffers.
+ */
+void pmd_release(pmd_context_t* ctx);
+
+
+/*
+ * Free the output of the last `pmd_compress` call, once it is not used.
+ */
+void pmd_release_buffer(pmd_context_t* ctx);
+
+
+/*
+ * Returns an estimate of the memory held by the context: its output buffer
+ * and the zlib state of the streams it keeps.
+ */
+size_t pmd_resident_bytes(const pmd_context_t* ctx);
+
+
+/*
+ * Compress the message `msg`. On success, `*out` points to the compressed
+ * payload, valid until the next call.
+ * Returns `PMD_SKIPPED` if the message must be sent uncompressed,
+ * `PMD_ERROR` on failure or `PMD_SUCCESS` otherwise.
+ */
+pmd_status_t pmd_compress(pmd_context_t* ctx, const char* msg, size_t size,
+                          const char** out, size_t* out_size);
+
+
+/*
+ * Decompress the payload `msg` of a message having RSV1 set. Allocates *out
+ * with the decompressed message, refusing to produce more than `max_size`
+ * bytes.
+ * Returns `PMD_ERROR` on failure or `PMD_SUCCESS` otherwise.
+ */
+pmd_status_t pmd_decompress(pmd_context_t* ctx, const char* msg, size_t size,
+                            size_t max_size, char** out, size_t* out_size);
+
+
+#endif
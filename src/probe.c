@@ -0,0 +1,12 @@
+#include "probe.h"
+
+
+#ifdef PROBE_SDT
+
+// Semaphores live in the `.probes` section, where tracers look for them.
+#define _PROBE_DEFINE(name) \
+    volatile unsigned short wsbridge_##name##_semaphore \
+        __attribute__((section(".probes")));
+PROBE_LIST(_PROBE_DEFINE)
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Static tracing probes.
+ *
+ * The bridge defines USDT probes of the `wsbridge` provider, so that
+ * bpftrace, perf or SystemTap can attach to a running bridge. A probe is a
+ * single nop until a tracer attaches to it, but its arguments are always
+ * evaluated. Each probe has a semaphore, raised by the tracer while it is
+ * attached: arguments which cost something, like timestamps or locked
+ * counters, are only computed when `PROBE_ENABLED` tells it is.
+ *
+ * Probes are compiled out when <sys/sdt.h> is not available.
+ *
+ * Probes and arguments, `conn` being the client address as logged,
+ * 0 for the broadcast connection, and `ns` the CLOCK_MONOTONIC time:
+ *
+ *     handshake_start(conn, ns)            client accepted
+ *     handshake_end(conn, ok, ns)          handshake answered or rejected
+ *     upstream_connect(conn, ok, ns)       bridged server connected
+ *     ws_message(conn, opcode, size, ns)   client message decoded
+ *     server_message(conn, opcode, size, ns)
+ *                                          server message decoded
+ *     frame_sent(conn, frames, bytes, queued, ns)
+ *                                          frames relayed (0 when the
+ *                                          queue is flushed), `bytes`
+ *                                          written, `queued` bytes left
+ *     queue_full(conn, queued, ns)         client dropped for being slow
+ *     close(conn, status, ns)              client closed
+ */
+#ifndef _probe_h_
+#define _probe_h_
+
+#include <stdint.h>
+#include <time.h>
+
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBE_SDT
+#endif
+#endif
+
+
+#define PROBE_LIST(X) \
+    X(handshake_start) \
+    X(handshake_end) \
+    X(upstream_connect) \
+    X(ws_message) \
+    X(server_message) \
+    X(frame_sent) \
+    X(queue_full) \
+    X(close)
+
+
+#ifdef PROBE_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define _PROBE_DECLARE(name) \
+    extern volatile unsigned short wsbridge_##name##_semaphore;
+PROBE_LIST(_PROBE_DECLARE)
+
+#define PROBE(name, ...) STAP_PROBEV(wsbridge, name, ##__VA_ARGS__)
+#define PROBE_ENABLED(name) \
+    __builtin_expect(wsbridge_##name##_semaphore != 0, 0)
+
+#else
+
+// The arguments are still compiled, never evaluated, so that the values
+// only traced don't become unused.
+#define PROBE(name, ...) \
+    do { if (0) _probe_discard(0, ##__VA_ARGS__); } while (0)
+#define PROBE_ENABLED(name) 0
+
+static inline void _probe_discard(int unused, ...) {
+}
+
+#endif
+
+
+/*
+ * Timestamp of the `name` probe: the monotonic time in nanoseconds while a
+ * tracer is attached to it, 0 otherwise.
+ */
+#define PROBE_NOW(name) (PROBE_ENABLED(name) ? probe_now_ns() : 0)
+
+
+static inline uint64_t probe_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+#endif
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "resume.h"
+
+
+// Bytes of a message record before its payload: its size and opcode.
+#define RESUME_RECORD_HEAD  5
+
+
+static uint64_t _resume_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ull + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * Returns the bucket of `token`, whose characters are random.
+ */
+static resume_session_t** _resume_bucket(resume_t* resume,
+                                         const char* token)
+{
+    size_t hash = 0;
+    for (size_t i = 0; i < 8; i++) {
+        hash = hash * 16 + (token[i] <= '9' ? token[i] - '0'
+                                            : token[i] - 'a' + 10);
+    }
+    return &resume->buckets[hash & (RESUME_BUCKETS - 1)];
+}
+
+
+/*
+ * Returns the link to the session of `token` in its bucket, which points
+ * to NULL if there is none. Called with the lock held.
+ */
+static resume_session_t** _resume_find(resume_t* resume, const char* token) {
+    resume_session_t** link = _resume_bucket(resume, token);
+    while (*link && strcmp((*link)->token, token) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+
+/*
+ * Close the bridged server connection of a detached session, and free it.
+ */
+static void _resume_free(resume_session_t* session) {
+    if (session->server_sock != SOCKET_ERROR) {
+        socket_gently_close(session->server_sock);
+    }
+    buffer_free(&session->server_in);
+    buffer_free(&session->server_out);
+    buffer_free(&session->replay);
+    free(session);
+}
+
+
+void resume_init(resume_t* resume, int time, size_t buffer_size) {
+    pthread_mutex_init(&resume->lock, NULL);
+    for (size_t i = 0; i < RESUME_BUCKETS; i++) {
+        resume->buckets[i] = NULL;
+    }
+    resume->detached = 0;
+    resume->time = time;
+    resume->buffer_size = buffer_size;
+}
+
+
+void resume_destroy(resume_t* resume) {
+    // Sessions still run are freed by their clients.
+    for (size_t i = 0; i < RESUME_BUCKETS; i++) {
+        resume_session_t** link = &resume->buckets[i];
+        while (*link) {
+            resume_session_t* session = *link;
+            if (session->ws_sock == SOCKET_ERROR) {
+                *link = session->next;
+                _resume_free(session);
+            } else {
+                link = &session->next;
+            }
+        }
+    }
+    resume->detached = 0;
+    pthread_mutex_destroy(&resume->lock);
+}
+
+
+resume_session_t* resume_open(resume_t* resume, socket_t ws_sock) {
+    resume_session_t* session = calloc(1, sizeof(resume_session_t));
+    if (!session) {
+        return NULL;
+    }
+    uint8_t random[RESUME_TOKEN_SIZE / 2];
+    if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+        LOG_ERROR("cannot generate a resume token");
+        free(session);
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(random); i++) {
+        snprintf(session->token + i * 2, 3, "%02x", random[i]);
+    }
+    session->ws_sock = ws_sock;
+    session->server_sock = SOCKET_ERROR;
+    buffer_init(&session->server_in);
+    buffer_init(&session->server_out);
+    buffer_init(&session->replay);
+
+    pthread_mutex_lock(&resume->lock);
+    resume_session_t** bucket = _resume_bucket(resume, session->token);
+    session->next = *bucket;
+    *bucket = session;
+    pthread_mutex_unlock(&resume->lock);
+    return session;
+}
+
+
+void resume_close(resume_t* resume, resume_session_t* session) {
+    pthread_mutex_lock(&resume->lock);
+    resume_session_t** link = _resume_find(resume, session->token);
+    *link = session->next;
+    pthread_mutex_unlock(&resume->lock);
+    _resume_free(session);
+}
+
+
+void resume_detach(resume_t* resume, resume_session_t* session,
+                   socket_t server_sock, buffer_t* server_in,
+                   buffer_t* server_out)
+{
+    pthread_mutex_lock(&resume->lock);
+    session->ws_sock = SOCKET_ERROR;
+    session->server_sock = server_sock;
+    session->server_in = *server_in;
+    session->server_out = *server_out;
+    session->expires = _resume_now() + resume->time;
+    resume->detached++;
+    pthread_mutex_unlock(&resume->lock);
+    buffer_init(server_in);
+    buffer_init(server_out);
+}
+
+
+resume_status_t resume_claim(resume_t* resume, const char* token,
+                             uint64_t count, const void* owner)
+{
+    resume_status_t status = RESUME_ERROR;
+
+    pthread_mutex_lock(&resume->lock);
+    resume_session_t* session = *_resume_find(resume, token);
+    if (!session) {
+        goto end;
+    }
+    if (session->ws_sock == SOCKET_ERROR) {
+        // The messages of a running session may still be dropped, they are
+        // checked again once it is taken.
+        if (count < session->first || count > session->sent) {
+            goto end;
+        }
+    } else
+    if (session->claim != owner) {
+        // The client running the session sees its connection lost, and
+        // detaches it. The socket is only closed once detached.
+        shutdown(session->ws_sock, SHUT_RDWR);
+    }
+    session->claim = owner;
+    status = RESUME_SUCCESS;
+
+  end:
+    pthread_mutex_unlock(&resume->lock);
+    return status;
+}
+
+
+resume_status_t resume_take(resume_t* resume, const char* token,
+                            const void* owner, socket_t ws_sock,
+                            resume_session_t** session,
+                            socket_t* server_sock, buffer_t* server_in,
+                            buffer_t* server_out)
+{
+    resume_status_t status = RESUME_ERROR;
+
+    pthread_mutex_lock(&resume->lock);
+    resume_session_t* found = *_resume_find(resume, token);
+    if (!found || found->claim != owner) {
+        goto end;
+    }
+    if (found->ws_sock != SOCKET_ERROR) {
+        status = RESUME_BUSY;
+        goto end;
+    }
+    found->ws_sock = ws_sock;
+    found->claim = NULL;
+    *session = found;
+    *server_sock = found->server_sock;
+    *server_in = found->server_in;
+    *server_out = found->server_out;
+    found->server_sock = SOCKET_ERROR;
+    buffer_init(&found->server_in);
+    buffer_init(&found->server_out);
+    resume->detached--;
+    status = RESUME_SUCCESS;
+
+  end:
+    pthread_mutex_unlock(&resume->lock);
+    return status;
+}
+
+
+void resume_expire(resume_t* resume) {
+    resume_session_t* expired = NULL;
+    uint64_t now = _resume_now();
+
+    pthread_mutex_lock(&resume->lock);
+    for (size_t i = 0; i < RESUME_BUCKETS && resume->detached > 0; i++) {
+        resume_session_t** link = &resume->buckets[i];
+        while (*link) {
+            resume_session_t* session = *link;
+            if (session->ws_sock == SOCKET_ERROR && session->expires <= now) {
+                *link = session->next;
+                session->next = expired;
+                expired = session;
+                resume->detached--;
+            } else {
+                link = &session->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&resume->lock);
+
+    // Closing waits for what the servers still send, out of the lock.
+    while (expired) {
+        resume_session_t* session = expired;
+        expired = session->next;
+        LOG_INFO("session %.8s expired", session->token);
+        _resume_free(session);
+    }
+}
+
+
+/*
+ * Returns the size of the message record at `record`.
+ */
+static uint32_t _resume_record_size(const char* record) {
+    uint32_t size;
+    memcpy(&size, record, sizeof(size));
+    return size;
+}
+
+
+bool resume_record(resume_t* resume, resume_session_t* session,
+                   ws_opcode_t opcode, const char* msg, size_t size)
+{
+    buffer_t* replay = &session->replay;
+    size_t record_size = RESUME_RECORD_HEAD + size;
+
+    session->sent++;
+    if (record_size > resume->buffer_size) {
+        // Too large to be kept: none of the messages before it may be
+        // resumed either.
+        buffer_consume(replay, buffer_size(replay));
+        buffer_release(replay);
+        session->first = session->sent;
+        return true;
+    }
+    while (buffer_size(replay) + record_size > resume->buffer_size) {
+        buffer_consume(replay, RESUME_RECORD_HEAD
+                               + _resume_record_size(buffer_content(replay)));
+        session->first++;
+    }
+    if (!buffer_reserve(replay, record_size)) {
+        return false;
+    }
+    uint32_t size32 = size;
+    char* record = buffer_tail(replay);
+    memcpy(record, &size32, sizeof(size32));
+    record[4] = opcode;
+    memcpy(record + RESUME_RECORD_HEAD, msg, size);
+    buffer_commit(replay, record_size);
+    return true;
+}
+
+
+bool resume_replay(resume_session_t* session, uint64_t count,
+                   bool (*send)(void* data, ws_opcode_t opcode,
+                                const char* msg, size_t size),
+                   void* data)
+{
+    const char* record = buffer_content(&session->replay);
+    for (uint64_t number = session->first; number < session->sent;
+         number++)
+    {
+        uint32_t size = _resume_record_size(record);
+        if (number >= count
+            && !send(data, (ws_opcode_t)record[4],
+                     record + RESUME_RECORD_HEAD, size))
+        {
+            return false;
+        }
+        record += RESUME_RECORD_HEAD + size;
+    }
+    return true;
+}
+
+
+bool resume_parse(const char* value, char token[RESUME_TOKEN_SIZE + 1],
+                  uint64_t* count)
+{
+    int end = 0;
+    if (sscanf(value, "%32[0-9a-f] %" SCNu64 "%n", token, count, &end) != 2
+        || strlen(token) != RESUME_TOKEN_SIZE || value[end] != '\0')
+    {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,195 @@
+/*
+ * Resumption of the clients which briefly lost their connection.
+ *
+ * Each client relayed to a bridged server socket is given a session, whose
+ * token is sent in the `Wsbridge-Resume` header of the handshake answer.
+ * The session keeps the last messages relayed to the client, up to the
+ * resume buffer. When the connection of an open client is lost, its
+ * bridged server connection is detached in the session rather than
+ * closed, for the resume time.
+ *
+ * A client reconnecting with `Wsbridge-Resume: TOKEN COUNT`, where COUNT
+ * is the number of messages it received, claims the session: it is
+ * answered with the same token, then reattached to the bridged server
+ * connection, and sent the messages it missed. If the previous connection
+ * is still running the session, its web socket is shut down first. A
+ * client whose session expired, or which missed messages that are not
+ * kept anymore, is given a new session instead.
+ *
+ * Sessions are looked up by token in a table shared by the threads. A
+ * session only changes hands under the table lock: its messages are
+ * otherwise only touched by the thread running its client.
+ */
+#ifndef _resume_h_
+#define _resume_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "net.h"
+#include "ws.h"
+
+
+#define RESUME_HEADER       "Wsbridge-Resume"
+
+// Hexadecimal characters of a token.
+#define RESUME_TOKEN_SIZE   32
+
+// Buckets of the session table, a power of two.
+#define RESUME_BUCKETS      1024
+
+
+typedef enum resume_status {
+    RESUME_ERROR = -1,
+    RESUME_SUCCESS = 0,
+    // The session is still run by the previous connection of the client.
+    RESUME_BUSY = 1,
+} resume_status_t;
+
+
+typedef struct resume_session {
+    char token[RESUME_TOKEN_SIZE + 1];
+    struct resume_session* next;
+
+    // Web socket of the client running the session, or `SOCKET_ERROR`
+    // while it is detached, and the last client which claimed it.
+    socket_t ws_sock;
+    const void* claim;
+
+    // Bridged server connection and its buffers, while detached, and when
+    // it is closed if not resumed (monotonic milliseconds).
+    socket_t server_sock;
+    buffer_t server_in;
+    buffer_t server_out;
+    uint64_t expires;
+
+    // Messages relayed to the client, as records of their size on 4 bytes,
+    // their opcode on 1 byte and their payload. The oldest are dropped
+    // beyond the resume buffer.
+    buffer_t replay;
+
+    // Number of the oldest message in `replay`, and of messages relayed.
+    uint64_t first;
+    uint64_t sent;
+} resume_session_t;
+
+
+typedef struct resume {
+    pthread_mutex_t lock;
+    resume_session_t* buckets[RESUME_BUCKETS];
+
+    // Detached sessions, which are checked for their expiry.
+    size_t detached;
+
+    // Milliseconds a detached session is kept, and bytes of the messages
+    // kept for each session.
+    int time;
+    size_t buffer_size;
+} resume_t;
+
+
+/*
+ * Initialize an empty session table, keeping detached sessions for `time`
+ * milliseconds and up to `buffer_size` bytes of their messages.
+ */
+void resume_init(resume_t* resume, int time, size_t buffer_size);
+
+
+/*
+ * Close the bridged server connections of the detached sessions, and free
+ * the table.
+ */
+void resume_destroy(resume_t* resume);
+
+
+/*
+ * Create a session with a new token, run by the client of `ws_sock`.
+ * Returns NULL on failure.
+ */
+resume_session_t* resume_open(resume_t* resume, socket_t ws_sock);
+
+
+/*
+ * Drop the session of a client which closed its bridged server connection
+ * itself.
+ */
+void resume_close(resume_t* resume, resume_session_t* session);
+
+
+/*
+ * Keep the bridged server connection `server_sock`, with the `server_in`
+ * and `server_out` buffers, in the session of a client which lost its
+ * connection, until it is resumed or expires. The buffers are left empty.
+ */
+void resume_detach(resume_t* resume, resume_session_t* session,
+                   socket_t server_sock, buffer_t* server_in,
+                   buffer_t* server_out);
+
+
+/*
+ * Claim the session of `token` for the client `owner`, which received
+ * `count` of its messages, shutting down the web socket of the client
+ * still running it.
+ * Returns `RESUME_ERROR` if there is no such session or it cannot be
+ * resumed from `count`, `RESUME_SUCCESS` otherwise.
+ */
+resume_status_t resume_claim(resume_t* resume, const char* token,
+                             uint64_t count, const void* owner);
+
+
+/*
+ * Take the session of `token` claimed by `owner` over, with the web socket
+ * `ws_sock`: the bridged server connection and its buffers are moved to
+ * `server_sock`, `server_in` and `server_out`.
+ * Returns `RESUME_BUSY` while the previous client still runs it,
+ * `RESUME_ERROR` if it was closed, expired or claimed by another client,
+ * `RESUME_SUCCESS` otherwise.
+ */
+resume_status_t resume_take(resume_t* resume, const char* token,
+                            const void* owner, socket_t ws_sock,
+                            resume_session_t** session,
+                            socket_t* server_sock, buffer_t* server_in,
+                            buffer_t* server_out);
+
+
+/*
+ * Close the bridged server connections of the sessions detached for
+ * longer than the resume time.
+ */
+void resume_expire(resume_t* resume);
+
+
+/*
+ * Keep the message `msg` of `size` bytes relayed to the client of the
+ * session in `opcode` frames, dropping the oldest ones beyond the resume
+ * buffer. Only called by the thread running the session.
+ * Returns false on allocation failure.
+ */
+bool resume_record(resume_t* resume, resume_session_t* session,
+                   ws_opcode_t opcode, const char* msg, size_t size);
+
+
+/*
+ * Call `send` for each message of the session from the message number
+ * `count` on, stopping at the first one it fails.
+ * Returns false if it failed.
+ */
+bool resume_replay(resume_session_t* session, uint64_t count,
+                   bool (*send)(void* data, ws_opcode_t opcode,
+                                const char* msg, size_t size),
+                   void* data);
+
+
+/*
+ * Parse the resume header value `value`, "TOKEN COUNT", into `token` and
+ * `count`.
+ * Returns false if it is invalid.
+ */
+bool resume_parse(const char* value, char token[RESUME_TOKEN_SIZE + 1],
+                  uint64_t* count);
+
+
+#endif
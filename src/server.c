@@ -0,0 +1,579 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "capture.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pmd.h"
+#include "server.h"
+#include "shm.h"
+
+
+// Milliseconds between two counts of the clients left while draining.
+#define SERVER_DRAIN_POLL   100
+
+// Milliseconds between two checks of the detached sessions expiry.
+#define SERVER_RESUME_POLL  1000
+
+// Milliseconds between two checks of the load while not accepting.
+#define SERVER_PAUSE_POLL   100
+
+
+/*
+ * Returns the first non-alive client slot of `server`, or NULL if there is
+ * none.
+ */
+static client_t* _server_free_slot(server_t* server) {
+    for (size_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (!server->clients[i].alive) {
+            return server->clients + i;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Create the socket accepting the web socket clients.
+ * Returns `SOCKET_ERROR` on failure.
+ */
+static socket_t _server_listen(const config_t* config) {
+    size_t backlog = config->workers > 0 ? SOMAXCONN : SERVER_MAX_CLIENTS;
+    if (!config->listening_unix) {
+        return socket_create_server_tcp(config->listening_port, backlog);
+    }
+
+    socket_address_t addr;
+    if (socket_parse_unix(config->listening_unix, &addr) != NET_SUCCESS) {
+        LOG_ERROR("invalid listening address %s", config->listening_unix);
+        return SOCKET_ERROR;
+    }
+    // Web socket frames are read as a byte stream.
+    if (addr.type != SOCK_STREAM) {
+        LOG_ERROR("web socket clients need a stream socket");
+        return SOCKET_ERROR;
+    }
+    return socket_create_server(&addr, backlog);
+}
+
+
+/*
+ * Take the listening sockets of the running bridge over, if any, or create
+ * them, then listen for a successor on the upgrade socket.
+ */
+static server_status_t _server_listen_all(server_t* server) {
+    const config_t* config = server->config;
+    socket_t sockets[UPGRADE_SOCKETS] = { SOCKET_ERROR, SOCKET_ERROR };
+
+    if (config->upgrade_socket) {
+        if (upgrade_init(&server->upgrade, config->upgrade_socket)
+            != UPGRADE_SUCCESS)
+        {
+            return SERVER_ERROR;
+        }
+        upgrade_status_t status = upgrade_take(&server->upgrade, sockets);
+        if (status == UPGRADE_ERROR) {
+            return SERVER_ERROR;
+        }
+        if (status == UPGRADE_SUCCESS) {
+            LOG_INFO("took the listening sockets of the running bridge over");
+        }
+    }
+
+    server->sock = sockets[UPGRADE_LISTENER];
+    if (server->sock == SOCKET_ERROR) {
+        server->sock = _server_listen(config);
+        if (server->sock == SOCKET_ERROR) {
+            return SERVER_ERROR;
+        }
+    }
+    if (config->metrics_port > 0) {
+        server->metrics_sock = sockets[UPGRADE_METRICS];
+        if (server->metrics_sock == SOCKET_ERROR) {
+            server->metrics_sock = socket_create_server_tcp(
+                config->metrics_port, SOMAXCONN);
+        }
+        if (server->metrics_sock == SOCKET_ERROR
+            || metrics_start(server->metrics_sock, server->config)
+               != METRICS_SUCCESS)
+        {
+            return SERVER_ERROR;
+        }
+    } else
+    if (sockets[UPGRADE_METRICS] != SOCKET_ERROR) {
+        close(sockets[UPGRADE_METRICS]);
+    }
+
+    if (config->upgrade_socket
+        && upgrade_listen(&server->upgrade) != UPGRADE_SUCCESS)
+    {
+        LOG_ERROR("unable to listen on the upgrade socket %s",
+                  config->upgrade_socket);
+        return SERVER_ERROR;
+    }
+    return SERVER_SUCCESS;
+}
+
+
+/*
+ * Raise the limit of open descriptors to its maximum, since workers run
+ * many connections.
+ */
+static void _server_raise_files_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0
+        || limit.rlim_cur == limit.rlim_max)
+    {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        LOG_ERROR("unable to raise the open files limit");
+    }
+}
+
+
+/*
+ * Resolve the address of the bridged server, once for all the clients.
+ */
+static server_status_t _server_resolve(server_t* server) {
+    const config_t* config = server->config;
+    bridge_t* bridge = &server->bridge;
+
+    if (config->bridged_shm) {
+        if (shm_parse(config->bridged_shm, &bridge->server_addr)
+            != SHM_SUCCESS)
+        {
+            LOG_ERROR("invalid bridged server address %s",
+                      config->bridged_shm);
+            return SERVER_ERROR;
+        }
+        bridge->shm = true;
+    } else
+    if (config->bridged_unix) {
+        if (socket_parse_unix(config->bridged_unix, &bridge->server_addr)
+            != NET_SUCCESS)
+        {
+            LOG_ERROR("invalid bridged server address %s",
+                      config->bridged_unix);
+            return SERVER_ERROR;
+        }
+    } else
+    if (socket_resolve(config->bridged_host, config->bridged_port,
+                       &bridge->server_addr) != NET_SUCCESS)
+    {
+        return SERVER_ERROR;
+    }
+    return SERVER_SUCCESS;
+}
+
+
+/*
+ * Returns the worker to run the client of `sock`: the next one pinned to
+ * the CPU which received its packets, so that they are relayed where they
+ * are warm in cache, or else the next one in turn.
+ */
+static worker_t* _server_pick_worker(server_t* server, socket_t sock) {
+    const config_t* config = server->config;
+    int cpu = -1;
+    socklen_t size = sizeof(cpu);
+
+    if (config->cpu_count > 0) {
+        getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size);
+    }
+    for (int i = 0; cpu >= 0 && i < config->workers; i++) {
+        worker_t* worker = &server->workers[(server->next_worker + i)
+                                            % config->workers];
+        if (worker->cpu == cpu) {
+            server->next_worker += i + 1;
+            return worker;
+        }
+    }
+    return &server->workers[server->next_worker++ % config->workers];
+}
+
+
+/*
+ * Run a client on `sock`, in a worker or in its own thread. Called by the
+ * listening thread, or by the TLS thread once a TLS handshake is done.
+ */
+static void _server_run_client(socket_t sock, void* data) {
+    server_t* server = data;
+    const config_t* config = server->config;
+
+    if (config->workers > 0) {
+        worker_t* worker = _server_pick_worker(server, sock);
+        if (worker_add(worker, sock) != WORKER_SUCCESS) {
+            LOG_ERROR("cannot give the client to a worker, rejecting");
+            close(sock);
+        }
+        return;
+    }
+
+    client_t* client_slot = _server_free_slot(server);
+    if (!client_slot) {
+        LOG_WARNING("no available client slot, rejecting");
+        close(sock);
+        return;
+    }
+
+    // The thread which ran the slot may still be closing it, and holds its
+    // stack until it is joined.
+    if (client_slot->thread) {
+        pthread_join(client_slot->thread, NULL);
+    }
+    client_init(client_slot, sock, &server->bridge);
+    client_start(client_slot);
+}
+
+
+server_status_t server_start(server_t* server, const config_t* config,
+                             const handler_t* handler)
+{
+    *server = (server_t){
+        .config = config,
+        .bridge = {
+            .config = config,
+            .shm = false,
+            .broadcast = NULL,
+            .handler = handler,
+            .resume = NULL,
+        },
+        .running = true,
+        .sock = SOCKET_ERROR,
+        .metrics_sock = SOCKET_ERROR,
+        .upgrade = { .sock = SOCKET_ERROR },
+        .workers = NULL,
+    };
+    if (handler && config->broadcast) {
+        LOG_ERROR("broadcast mode relays to the bridged server, not to "
+                  "a handler");
+        return SERVER_ERROR;
+    }
+    if (handler && !handler->on_message) {
+        LOG_ERROR("the handler must handle the client messages");
+        return SERVER_ERROR;
+    }
+    if (handler && config->resume_time > 0) {
+        LOG_ERROR("resuming keeps bridged server connections, not "
+                  "handler ones");
+        return SERVER_ERROR;
+    }
+    pmd_pool_init(&server->bridge.pmd_pool, &config->deflate);
+    if (!handler && _server_resolve(server) != SERVER_SUCCESS) {
+        return SERVER_ERROR;
+    }
+
+    if (config->workers > 0) {
+        _server_raise_files_limit();
+        server->workers = calloc(config->workers, sizeof(worker_t));
+        if (!server->workers) {
+            LOG_ERROR("cannot allocate the workers");
+            return SERVER_ERROR;
+        }
+    }
+    if (config->capture.path) {
+        if (capture_start(config) != CAPTURE_SUCCESS) {
+            return SERVER_ERROR;
+        }
+        atexit(&capture_stop);
+    }
+    // Clients beyond the slots are rejected as overloading the server.
+    if (admission_init(&server->admission, &config->admission,
+                       config->workers > 0 ? 0 : SERVER_MAX_CLIENTS)
+        != ADMISSION_SUCCESS)
+    {
+        return SERVER_ERROR;
+    }
+    if (config->resume_time > 0) {
+        resume_init(&server->resume, config->resume_time,
+                    config->resume_buffer);
+        server->bridge.resume = &server->resume;
+    }
+    if (config->broadcast) {
+        if (broadcast_start(&server->broadcast, &server->bridge)
+            != BROADCAST_SUCCESS)
+        {
+            return SERVER_ERROR;
+        }
+        server->bridge.broadcast = &server->broadcast;
+    }
+    for (int i = 0; i < config->workers; i++) {
+        int cpu = config->cpu_count > 0
+                ? config->cpus[i % config->cpu_count]
+                : -1;
+        if (worker_start(&server->workers[i], &server->bridge, cpu)
+            != WORKER_SUCCESS)
+        {
+            return SERVER_ERROR;
+        }
+    }
+    if (config->tls.cert
+        && tls_start(&server->tls, config, &_server_run_client, server)
+           != TLS_SUCCESS)
+    {
+        return SERVER_ERROR;
+    }
+    // Last, since a running bridge stops accepting once it gave its
+    // sockets.
+    return _server_listen_all(server);
+}
+
+
+/*
+ * Returns the count of clients the server still runs.
+ */
+static size_t _server_client_count(server_t* server) {
+    size_t count = 0;
+    if (server->config->workers > 0) {
+        for (int i = 0; i < server->config->workers; i++) {
+            count += worker_client_count(&server->workers[i]);
+        }
+        return count;
+    }
+    for (size_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (server->clients[i].alive) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+/*
+ * Gather the load signals of the clients run by the server in `load`.
+ */
+static void _server_load(server_t* server, admission_load_t* load) {
+    *load = (admission_load_t){
+        .clients = 0,
+        .queued = 0,
+        .lag = 0,
+        .upstream_failures = __atomic_load_n(
+            &server->bridge.upstream_failures, __ATOMIC_RELAXED),
+    };
+    if (server->config->workers > 0) {
+        for (int i = 0; i < server->config->workers; i++) {
+            worker_t* worker = &server->workers[i];
+            uint64_t lag = worker_lag(worker);
+            load->clients += worker_client_count(worker);
+            load->queued += worker_queued(worker);
+            load->lag = lag > load->lag ? lag : load->lag;
+        }
+        return;
+    }
+    for (size_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        client_t* client = &server->clients[i];
+        if (client->alive) {
+            load->clients++;
+            load->queued += __atomic_load_n(&client->queued,
+                                            __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/*
+ * Run the client accepted on `sock` from `addr` if it is admitted, or
+ * reject it.
+ */
+static void _server_admit(server_t* server, socket_t sock,
+                          const struct sockaddr* addr)
+{
+    admission_load_t load;
+    _server_load(server, &load);
+
+    admission_verdict_t verdict = admission_check(&server->admission, &load,
+                                                  addr);
+    if (verdict != ADMISSION_ADMIT) {
+        metrics_add(verdict == ADMISSION_LIMITED
+                    ? METRICS_CONNECTIONS_LIMITED
+                    : METRICS_CONNECTIONS_REJECTED, 1);
+        admission_reject(sock, verdict, server->config->tls.cert != NULL);
+        return;
+    }
+
+    LOG_INFO("new client connected");
+    if (!server->config->tls.cert) {
+        _server_run_client(sock, server);
+    } else
+    if (tls_add(&server->tls, sock) != TLS_SUCCESS) {
+        LOG_ERROR("cannot give the client to the TLS thread, rejecting");
+        close(sock);
+    }
+}
+
+
+/*
+ * Returns whether the server stops accepting clients for now.
+ */
+static bool _server_paused(server_t* server) {
+    admission_load_t load;
+    if (!server->config->admission.pause) {
+        return false;
+    }
+    _server_load(server, &load);
+    return admission_paused(&server->admission, &load);
+}
+
+
+static void _server_sleep(uint64_t ms) {
+    struct timespec interval = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000,
+    };
+    nanosleep(&interval, NULL);
+}
+
+
+/*
+ * Close the clients with a going away status, spread over the drain time
+ * so that they don't reconnect to the new process all at once, then wait
+ * for them to be closed, up to the close timeout.
+ */
+static void _server_drain(server_t* server) {
+    const config_t* config = server->config;
+    size_t count = _server_client_count(server);
+
+    LOG_INFO("draining %zu clients over %d ms", count, config->drain_time);
+    if (count == 0) {
+        return;
+    }
+    if (config->workers > 0) {
+        for (int i = 0; i < config->workers; i++) {
+            worker_drain(&server->workers[i], config->drain_time);
+        }
+        _server_sleep(config->drain_time);
+    } else {
+        // Each client thread sees its flag within a poll timeout. The TLS
+        // thread may still start clients meanwhile: the count is read again.
+        for (size_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            client_t* client = &server->clients[i];
+            if (client->alive) {
+                __atomic_store_n(&client->going_away, true,
+                                 __ATOMIC_RELEASE);
+                count = _server_client_count(server);
+                if (count > 0) {
+                    _server_sleep(config->drain_time / count);
+                }
+            }
+        }
+    }
+
+    uint64_t waited = 0;
+    while (_server_client_count(server) > 0
+           && waited < (uint64_t)config->timeouts.close)
+    {
+        _server_sleep(SERVER_DRAIN_POLL);
+        waited += SERVER_DRAIN_POLL;
+    }
+}
+
+
+/*
+ * Give the listening sockets to the new process connecting the upgrade
+ * socket, then drain the clients.
+ * Returns `SERVER_ERROR` if the sockets were not given.
+ */
+static server_status_t _server_hand_over(server_t* server) {
+    socket_t sockets[UPGRADE_SOCKETS] = {
+        [UPGRADE_LISTENER] = server->sock,
+        [UPGRADE_METRICS] = server->metrics_sock,
+    };
+    if (upgrade_give(&server->upgrade, sockets) != UPGRADE_SUCCESS) {
+        return SERVER_ERROR;
+    }
+    LOG_INFO("listening sockets handed over to the new bridge");
+
+    // The new process accepts on the same socket: it is closed, not shut
+    // down. The metrics keep being served until the process exits.
+    close(server->sock);
+    server->sock = SOCKET_ERROR;
+    _server_drain(server);
+    return SERVER_SUCCESS;
+}
+
+
+void server_run(server_t* server) {
+    while (server->running) {
+        // While paused, the clients wait in the listen backlog.
+        bool paused = _server_paused(server);
+        int timeout = paused ? SERVER_PAUSE_POLL
+                    : server->bridge.resume ? SERVER_RESUME_POLL
+                    : -1;
+        struct pollfd fds[2] = {
+            { .fd = paused ? -1 : server->sock, .events = POLLIN },
+            { .fd = server->upgrade.sock, .events = POLLIN },
+        };
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno != EINTR) {
+                LOG_ERROR("unable to wait for clients");
+                return;
+            }
+            continue;
+        }
+        if (server->bridge.resume) {
+            resume_expire(server->bridge.resume);
+        }
+        if (fds[1].revents && _server_hand_over(server) == SERVER_SUCCESS) {
+            return;
+        }
+        if (!fds[0].revents) {
+            continue;
+        }
+
+        struct sockaddr client_addr;
+        socklen_t addr_size = sizeof(struct sockaddr);
+        int client_sock = accept(server->sock, &client_addr, &addr_size);
+        if (client_sock < 0) {
+            // The listener is shut down by `server_stop`.
+            if (server->running) {
+                LOG_ERROR("client connection failure");
+            }
+        } else {
+            _server_admit(server, client_sock, &client_addr);
+        }
+    }
+}
+
+
+void server_stop(server_t* server) {
+    const config_t* config = server->config;
+
+    server->running = false;
+    if (server->sock != SOCKET_ERROR) {
+        LOG_INFO("closing server socket");
+        socket_gently_close(server->sock);
+        server->sock = SOCKET_ERROR;
+    }
+    upgrade_close(&server->upgrade);
+    if (config->tls.cert) {
+        tls_stop(&server->tls);
+    }
+    for (int i = 0; i < config->workers; i++) {
+        worker_stop(&server->workers[i]);
+    }
+    for (size_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (server->clients[i].alive) {
+            server->clients[i].alive = false;
+            pthread_join(server->clients[i].thread, NULL);
+        }
+    }
+    if (server->bridge.broadcast) {
+        broadcast_stop(server->bridge.broadcast);
+        server->bridge.broadcast = NULL;
+    }
+    if (server->bridge.resume) {
+        resume_destroy(server->bridge.resume);
+        server->bridge.resume = NULL;
+    }
+    admission_destroy(&server->admission);
+    free(server->workers);
+    server->workers = NULL;
+    pmd_pool_destroy(&server->bridge.pmd_pool);
+}
@@ -0,0 +1,108 @@
+/*
+ * The bridge server: listens for the web socket clients and runs them, in
+ * their own threads or in workers, behind the TLS thread if enabled.
+ *
+ * Clients are relayed to the bridged server of the configuration, or
+ * handled in-process by an application linking `libwsbridge.a`:
+ *
+ *     static handler_status_t on_message(client_t* client,
+ *                                        ws_opcode_t opcode,
+ *                                        const char* msg, size_t size,
+ *                                        void* data)
+ *     {
+ *         client_send(client, opcode, msg, size);
+ *         return HANDLER_SUCCESS;
+ *     }
+ *
+ *     static const handler_t echo = { .on_message = &on_message };
+ *     static server_t server;
+ *
+ *     server_start(&server, &config, &echo);
+ *     server_run(&server);
+ *
+ * See `handler.h` for the callbacks, and `examples/echo.c`.
+ */
+#ifndef _server_h_
+#define _server_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "admission.h"
+#include "bridge.h"
+#include "broadcast.h"
+#include "client.h"
+#include "config.h"
+#include "handler.h"
+#include "net.h"
+#include "resume.h"
+#include "tls.h"
+#include "upgrade.h"
+#include "worker.h"
+
+
+// Clients run in their own threads, without workers.
+#define SERVER_MAX_CLIENTS  32
+
+
+typedef enum server_status {
+    SERVER_ERROR = -1,
+    SERVER_SUCCESS = 0,
+} server_status_t;
+
+
+typedef struct server {
+    const config_t* config;
+    bridge_t bridge;
+    volatile bool running;
+
+    // Sockets accepting the web socket clients and the metrics scrapes,
+    // which are handed over to a new process through `upgrade`.
+    socket_t sock;
+    socket_t metrics_sock;
+    upgrade_t upgrade;
+
+    // Slots of the clients run in their own threads.
+    client_t clients[SERVER_MAX_CLIENTS];
+
+    // The configured workers, and the next one given a client.
+    worker_t* workers;
+    size_t next_worker;
+
+    broadcast_t broadcast;
+    tls_t tls;
+
+    // Sessions of the clients, if they may resume.
+    resume_t resume;
+
+    // Admission of the accepted clients.
+    admission_t admission;
+} server_t;
+
+
+/*
+ * Start the server of `config`, handling its clients with `handler`, or
+ * relaying them to the bridged server if NULL: the listener, then the
+ * threads of the workers, of the broadcast and of TLS.
+ * The logger must be started. The server must not move once started.
+ */
+server_status_t server_start(server_t* server, const config_t* config,
+                             const handler_t* handler);
+
+
+/*
+ * Accept the clients until `server_stop` is called, or until the listening
+ * sockets are handed over to a new process. The clients are then closed
+ * over the drain time, and waited for.
+ */
+void server_run(server_t* server);
+
+
+/*
+ * Stop accepting clients, then close the running ones and stop the
+ * threads of the server.
+ */
+void server_stop(server_t* server);
+
+
+#endif
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "shm.h"
+
+
+bool shm_is_address(const char* str) {
+    return strncmp(str, SHM_PREFIX, strlen(SHM_PREFIX)) == 0;
+}
+
+
+shm_status_t shm_parse(const char* str, socket_address_t* addr) {
+    char unix_addr[sizeof(addr->un.sun_path) + 16];
+
+    if (!shm_is_address(str)) {
+        return SHM_ERROR;
+    }
+    snprintf(unix_addr, sizeof(unix_addr), "unixpacket:%s",
+             str + strlen(SHM_PREFIX));
+    if (socket_parse_unix(unix_addr, addr) != NET_SUCCESS) {
+        return SHM_ERROR;
+    }
+    return SHM_SUCCESS;
+}
+
+
+void shm_init(shm_t* shm) {
+    *shm = (shm_t){
+        .base = NULL,
+        .wake_fd = -1,
+        .peer_fd = -1,
+    };
+}
+
+
+/*
+ * Send the descriptors of the mapping `map_fd` and of the eventfds of `shm`
+ * on `sock`, along with a copy of the mapping header.
+ */
+static shm_status_t _shm_send_fds(shm_t* shm, socket_t sock, int map_fd) {
+    int fds[3] = { map_fd, shm->peer_fd, shm->wake_fd };
+    char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+    struct iovec iov = { shm->base, sizeof(shmring_header_t) };
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &hdr, MSG_NOSIGNAL) < 0) {
+        return SHM_ERROR;
+    }
+    return SHM_SUCCESS;
+}
+
+
+socket_t shm_connect(shm_t* shm, const socket_address_t* addr, size_t size) {
+    size_t map_size = shmring_map_size(size);
+    int map_fd = -1;
+
+    shm_init(shm);
+    socket_t sock = socket_connect(addr);
+    if (sock == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+
+    map_fd = memfd_create("wsbridge-shm", MFD_CLOEXEC);
+    if (map_fd < 0 || ftruncate(map_fd, map_size) < 0) {
+        LOG_ERROR("unable to create a shared memory of %zu bytes", map_size);
+        goto error;
+    }
+    void* base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      map_fd, 0);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("unable to map the shared memory");
+        goto error;
+    }
+    *(shmring_header_t*)base = (shmring_header_t){
+        .magic = SHMRING_MAGIC,
+        .version = SHMRING_VERSION,
+        .size = size,
+    };
+    shm->base = base;
+    shm->size = size;
+    shm->out = shmring_get(base, size, SHMRING_BRIDGE);
+    shm->in = shmring_get(base, size, SHMRING_SERVER);
+    // Neither side read its ring yet, so both wait for the first message.
+    shm->out->reader_waiting = 1;
+    shm->in->reader_waiting = 1;
+
+    shm->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shm->wake_fd < 0 || shm->peer_fd < 0) {
+        LOG_ERROR("unable to create the shared memory events");
+        goto error;
+    }
+
+    if (_shm_send_fds(shm, sock, map_fd) != SHM_SUCCESS) {
+        LOG_ERROR("unable to send the shared memory to the server");
+        goto error;
+    }
+    close(map_fd);
+    return sock;
+
+  error:
+    if (map_fd >= 0) {
+        close(map_fd);
+    }
+    shm_close(shm);
+    close(sock);
+    return SOCKET_ERROR;
+}
+
+
+ssize_t shm_next(shm_t* shm) {
+    return shmring_next(shm->in, shm->size);
+}
+
+
+void shm_read(shm_t* shm, void* buf, size_t len) {
+    shmring_read(shm->in, shm->size, buf, len, shm->peer_fd);
+}
+
+
+shm_status_t shm_send(shm_t* shm, const struct iovec* iov, size_t count,
+                      buffer_t* pending)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total > shmring_max_message(shm->size)) {
+        LOG_ERROR("message of %zu bytes exceeds the shared memory ring",
+                  total);
+        return SHM_ERROR;
+    }
+
+    // Messages already pending go first.
+    if (buffer_size(pending) == 0
+        && shmring_write(shm->out, shm->size, iov, count, total,
+                         shm->peer_fd))
+    {
+        metrics_add(METRICS_UPSTREAM_BYTES_OUT, total);
+        return SHM_SUCCESS;
+    }
+
+    if (!buffer_reserve(pending, total)) {
+        LOG_ERROR("cannot allocate the bridged server buffer");
+        return SHM_ERROR;
+    }
+    for (size_t i = 0; i < count; i++) {
+        memcpy(buffer_tail(pending), iov[i].iov_base, iov[i].iov_len);
+        buffer_commit(pending, iov[i].iov_len);
+    }
+    return SHM_SUCCESS;
+}
+
+
+void shm_flush(shm_t* shm, buffer_t* pending) {
+    size_t size = buffer_size(pending);
+    struct iovec iov = { buffer_content(pending), size };
+
+    if (size > 0
+        && shmring_write(shm->out, shm->size, &iov, 1, size, shm->peer_fd))
+    {
+        metrics_add(METRICS_UPSTREAM_BYTES_OUT, size);
+        buffer_consume(pending, size);
+        buffer_release(pending);
+    }
+}
+
+
+void shm_clear(shm_t* shm) {
+    eventfd_t count;
+    eventfd_read(shm->wake_fd, &count);
+}
+
+
+void shm_rearm(shm_t* shm) {
+    eventfd_write(shm->wake_fd, 1);
+}
+
+
+void shm_close(shm_t* shm) {
+    if (shm->base) {
+        munmap(shm->base, shmring_map_size(shm->size));
+    }
+    if (shm->wake_fd >= 0) {
+        close(shm->wake_fd);
+    }
+    if (shm->peer_fd >= 0) {
+        close(shm->peer_fd);
+    }
+    shm_init(shm);
+}
@@ -0,0 +1,131 @@
+/*
+ * Shared memory connections to the bridged server.
+ *
+ * A bridged server on the same host may be reached through shared memory
+ * rings instead of a socket, given as `shm:PATH`: it then listens on the
+ * Unix packet socket PATH. For each client, the bridge connects it and
+ * sends, in a single packet, the descriptors of the mapping holding the
+ * rings of the connection (see `shmring.h`), of the server eventfd and of
+ * the bridge eventfd. The socket is then only kept to learn when either
+ * side closes the connection.
+ *
+ * `lib/wsbshm.h` implements the server side.
+ */
+#ifndef _shm_h_
+#define _shm_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "buffer.h"
+#include "net.h"
+#include "shmring.h"
+
+
+#define SHM_PREFIX  "shm:"
+
+
+typedef enum shm_status {
+    SHM_ERROR = -1,
+    SHM_SUCCESS = 0,
+} shm_status_t;
+
+
+typedef struct shm {
+    // Mapping of the connection, NULL if not connected, and the bytes of
+    // data of each of its rings.
+    void* base;
+    size_t size;
+
+    // Rings written by the bridge, and by the server.
+    shmring_t* out;
+    shmring_t* in;
+
+    // eventfd waking the bridge up, watched by its loop, and the one waking
+    // the server up.
+    int wake_fd;
+    int peer_fd;
+} shm_t;
+
+
+/*
+ * Returns whether `str` is a shared memory address.
+ */
+bool shm_is_address(const char* str);
+
+
+/*
+ * Parse the shared memory address `str` into the address of the socket of
+ * the server.
+ * Returns `SHM_ERROR` if it is invalid, `SHM_SUCCESS` otherwise.
+ */
+shm_status_t shm_parse(const char* str, socket_address_t* addr);
+
+
+/*
+ * Initialize an unconnected `shm`.
+ */
+void shm_init(shm_t* shm);
+
+
+/*
+ * Connect `shm` to the server listening on `addr`, with rings of `size`
+ * bytes.
+ * Returns the socket of the connection, or `SOCKET_ERROR` on failure.
+ */
+socket_t shm_connect(shm_t* shm, const socket_address_t* addr, size_t size);
+
+
+/*
+ * Returns the size of the next message of the server, or `SHMRING_EMPTY`
+ * or `SHMRING_INVALID` as `shmring_next`.
+ */
+ssize_t shm_next(shm_t* shm);
+
+
+/*
+ * Read the next message of the server, of `len` bytes, into `buf`.
+ */
+void shm_read(shm_t* shm, void* buf, size_t len);
+
+
+/*
+ * Send the message made of the `count` buffers of `iov` to the server. If
+ * `pending` is not empty, or if the ring has no room for the message, it is
+ * appended to `pending` to be written by `shm_flush`: the bridge eventfd is
+ * written once the server made room.
+ * Returns `SHM_ERROR` if the message is too large or cannot be kept,
+ * `SHM_SUCCESS` otherwise.
+ */
+shm_status_t shm_send(shm_t* shm, const struct iovec* iov, size_t count,
+                      buffer_t* pending);
+
+
+/*
+ * Write the message of `pending` if the ring has room for it.
+ */
+void shm_flush(shm_t* shm, buffer_t* pending);
+
+
+/*
+ * Reset the bridge eventfd, before the rings are checked.
+ */
+void shm_clear(shm_t* shm);
+
+
+/*
+ * Write the bridge eventfd, so that messages left in the ring are read by a
+ * later turn of the loop.
+ */
+void shm_rearm(shm_t* shm);
+
+
+/*
+ * Unmap the rings and close the eventfds.
+ */
+void shm_close(shm_t* shm);
+
+
+#endif
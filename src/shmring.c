@@ -0,0 +1,155 @@
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "shmring.h"
+
+
+// Bytes of the size preceding each message.
+#define SHMRING_LEN_SIZE    sizeof(uint32_t)
+
+
+/*
+ * Returns the bytes of the record of a message of `len` bytes.
+ */
+static size_t _shmring_record(size_t len) {
+    return (SHMRING_LEN_SIZE + len + 7) & ~(size_t)7;
+}
+
+
+/*
+ * Wake the peer up through `fd` if `*waiting` says it waits. The barrier
+ * orders the ring update before the flag read, and pairs with the one of
+ * `_shmring_wait`.
+ */
+static void _shmring_wake(uint32_t* waiting, int fd) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST))
+    {
+        // Failing means the counter is saturated, so the peer is awake.
+        eventfd_write(fd, 1);
+    }
+}
+
+
+/*
+ * Mark the calling side as waiting in `*waiting`, before checking the ring
+ * again.
+ */
+static void _shmring_wait(uint32_t* waiting) {
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+bool shmring_size_valid(size_t size) {
+    return size >= SHMRING_SIZE_MIN && size <= SHMRING_SIZE_MAX
+        && (size & (size - 1)) == 0;
+}
+
+
+size_t shmring_map_size(size_t size) {
+    return sizeof(shmring_header_t) + 2 * (sizeof(shmring_t) + size);
+}
+
+
+shmring_t* shmring_get(void* base, size_t size, int index) {
+    char* rings = (char*)base + sizeof(shmring_header_t);
+    return (shmring_t*)(rings + index * (sizeof(shmring_t) + size));
+}
+
+
+size_t shmring_max_message(size_t size) {
+    return size - SHMRING_LEN_SIZE;
+}
+
+
+/*
+ * Copy `len` bytes of `src` to the ring data at `pos`, wrapping around.
+ */
+static void _shmring_copy_in(shmring_t* ring, size_t size, uint64_t pos,
+                             const void* src, size_t len)
+{
+    size_t offset = pos & (size - 1);
+    size_t first = size - offset < len ? size - offset : len;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char*)src + first, len - first);
+}
+
+
+/*
+ * Copy `len` bytes of the ring data at `pos` to `dst`, wrapping around.
+ */
+static void _shmring_copy_out(const shmring_t* ring, size_t size,
+                              uint64_t pos, void* dst, size_t len)
+{
+    size_t offset = pos & (size - 1);
+    size_t first = size - offset < len ? size - offset : len;
+    memcpy(dst, ring->data + offset, first);
+    memcpy((char*)dst + first, ring->data, len - first);
+}
+
+
+bool shmring_write(shmring_t* ring, size_t size, const struct iovec* iov,
+                   size_t count, size_t total, int reader_fd)
+{
+    size_t record = _shmring_record(total);
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (size - (head - tail) < record) {
+        _shmring_wait(&ring->writer_waiting);
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (size - (head - tail) < record) {
+            return false;
+        }
+        __atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    // Records are aligned on 8 bytes, so their size never wraps around.
+    uint32_t len = total;
+    memcpy(ring->data + (head & (size - 1)), &len, sizeof(len));
+    uint64_t pos = head + SHMRING_LEN_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        _shmring_copy_in(ring, size, pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+
+    __atomic_store_n(&ring->head, head + record, __ATOMIC_RELEASE);
+    _shmring_wake(&ring->reader_waiting, reader_fd);
+    return true;
+}
+
+
+ssize_t shmring_next(shmring_t* ring, size_t size) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        _shmring_wait(&ring->reader_waiting);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return SHMRING_EMPTY;
+        }
+        __atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    // The peer is not trusted to write valid sizes.
+    uint32_t len;
+    memcpy(&len, ring->data + (tail & (size - 1)), sizeof(len));
+    if (head - tail > size || _shmring_record(len) > head - tail) {
+        return SHMRING_INVALID;
+    }
+    return len;
+}
+
+
+void shmring_read(shmring_t* ring, size_t size, void* buf, size_t len,
+                  int writer_fd)
+{
+    uint64_t tail = ring->tail;
+    _shmring_copy_out(ring, size, tail + SHMRING_LEN_SIZE, buf, len);
+    __atomic_store_n(&ring->tail, tail + _shmring_record(len),
+                     __ATOMIC_RELEASE);
+    _shmring_wake(&ring->writer_waiting, writer_fd);
+}
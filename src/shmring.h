@@ -0,0 +1,122 @@
+/*
+ * Shared memory message rings.
+ *
+ * A shared memory connection to a bridged server is a mapping holding a
+ * `shmring_header_t` followed by two single producer, single consumer
+ * rings: the one written by the bridge, then the one written by the server.
+ * Each side owns an eventfd, which its peer writes when it must wake up:
+ * when a message was written in the ring it reads, or when room was made in
+ * the ring it writes. The peer is only woken up if it said it was waiting,
+ * so that busy connections relay messages without any system call.
+ *
+ * Messages keep their boundaries. Each is written as its size, on 32 bits,
+ * followed by its bytes, the record being aligned on 8 bytes.
+ *
+ * This module is shared by the bridge and the library of the bridged
+ * servers, `lib/wsbshm.h`.
+ */
+#ifndef _shmring_h_
+#define _shmring_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+#define SHMRING_MAGIC       0x57534252
+#define SHMRING_VERSION     1
+
+// Bounds of the ring sizes, which are powers of two.
+#define SHMRING_SIZE_MIN    4096
+#define SHMRING_SIZE_MAX    (1 << 30)
+
+// Index of the rings in the mapping, named after their writer.
+#define SHMRING_BRIDGE      0
+#define SHMRING_SERVER      1
+
+// Returned by `shmring_next` when a ring is empty, or when its peer wrote
+// an invalid record.
+#define SHMRING_EMPTY       (-1)
+#define SHMRING_INVALID     (-2)
+
+
+// Padded to the alignment of the rings which follow it.
+typedef struct shmring_header {
+    _Alignas(64) uint32_t magic;
+    uint32_t version;
+    // Bytes of data of each ring.
+    uint64_t size;
+} shmring_header_t;
+
+
+typedef struct shmring {
+    // Written by the producer: bytes ever written, and whether it waits for
+    // room.
+    _Alignas(64) uint64_t head;
+    uint32_t writer_waiting;
+
+    // Written by the consumer: bytes ever read, and whether it waits for
+    // messages.
+    _Alignas(64) uint64_t tail;
+    uint32_t reader_waiting;
+
+    _Alignas(64) char data[];
+} shmring_t;
+
+
+/*
+ * Returns whether `size` is a valid ring size.
+ */
+bool shmring_size_valid(size_t size);
+
+
+/*
+ * Returns the bytes of a mapping holding two rings of `size` bytes.
+ */
+size_t shmring_map_size(size_t size);
+
+
+/*
+ * Returns the ring `index` of the mapping `base`, whose rings hold `size`
+ * bytes.
+ */
+shmring_t* shmring_get(void* base, size_t size, int index);
+
+
+/*
+ * Returns the largest message a ring of `size` bytes holds.
+ */
+size_t shmring_max_message(size_t size);
+
+
+/*
+ * Write the message made of the `count` buffers of `iov`, of `total` bytes,
+ * in `ring` and wake its reader up through `reader_fd` if it waits.
+ * When the ring hasn't room for the whole message, nothing is written and
+ * the writer is marked as waiting, unless room was made meanwhile.
+ * Returns whether the message was written.
+ */
+bool shmring_write(shmring_t* ring, size_t size, const struct iovec* iov,
+                   size_t count, size_t total, int reader_fd);
+
+
+/*
+ * Returns the size of the next message of `ring`, or `SHMRING_INVALID` if
+ * it is corrupted. When it is empty, the reader is marked as waiting, and
+ * `SHMRING_EMPTY` is returned unless a message was written meanwhile.
+ */
+ssize_t shmring_next(shmring_t* ring, size_t size);
+
+
+/*
+ * Copy the next message of `ring`, of `len` bytes as told by
+ * `shmring_next`, to `buf`, then wake its writer up through `writer_fd` if
+ * it waits for room.
+ */
+void shmring_read(shmring_t* ring, size_t size, void* buf, size_t len,
+                  int writer_fd);
+
+
+#endif
@@ -0,0 +1,617 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+
+#include "logger.h"
+#include "tls.h"
+
+
+// Bytes relayed at once in user space, the largest TLS record payload.
+#define TLS_RELAY_SIZE      16384
+
+
+/*
+ * A connection handshaking, or relayed in user space once its handshake is
+ * done. `in` holds the bytes decrypted for the bridge, `out` those read from
+ * the bridge, waiting to be encrypted.
+ */
+typedef struct tls_conn {
+    tls_t* tls;
+    struct tls_conn* prev;
+    struct tls_conn* next;
+    SSL* ssl;
+    socket_t sock;
+    loop_watch_t sock_watch;
+    wheel_timer_t deadline;
+
+    socket_t pair;
+    loop_watch_t pair_watch;
+    char* in;
+    size_t in_start;
+    size_t in_end;
+    char* out;
+    size_t out_start;
+    size_t out_end;
+    // Events of the client socket waited for by the pending SSL_read and
+    // SSL_write, which may need to write and read respectively.
+    uint32_t read_events;
+    uint32_t write_events;
+    // The client sent its close_notify, or the bridge closed its end.
+    bool sock_closed;
+    bool pair_closed;
+    // Removed, freed once the events of the current wait are handled.
+    bool dead;
+} tls_conn_t;
+
+
+static void* _tls_reserve(void* items, size_t* capacity, size_t count,
+                          size_t size)
+{
+    if (count < *capacity) {
+        return items;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    void* new_items = realloc(items, new_capacity * size);
+    if (new_items) {
+        *capacity = new_capacity;
+    }
+    return new_items;
+}
+
+
+/*
+ * Log the errors queued by OpenSSL for this thread, after `what`.
+ */
+static void _tls_log_errors(const char* what) {
+    unsigned long error = ERR_get_error();
+    if (error == 0) {
+        LOG_ERROR("tls: %s", what);
+    }
+    for (; error != 0; error = ERR_get_error()) {
+        char reason[256];
+        ERR_error_string_n(error, reason, sizeof(reason));
+        LOG_ERROR("tls: %s: %s", what, reason);
+    }
+}
+
+
+/*
+ * Forget `conn`, closing its sockets unless `keep_sock`. It is freed once
+ * the events of the current wait are handled, since some may refer to it.
+ */
+static void _tls_remove(tls_conn_t* conn, bool keep_sock) {
+    tls_t* tls = conn->tls;
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        tls->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    loop_disarm(&tls->loop, &conn->deadline);
+    loop_remove(&tls->loop, &conn->sock_watch);
+    if (conn->pair != SOCKET_ERROR) {
+        loop_remove(&tls->loop, &conn->pair_watch);
+        close(conn->pair);
+    }
+    SSL_free(conn->ssl);
+    if (!keep_sock) {
+        close(conn->sock);
+    }
+    free(conn->in);
+    free(conn->out);
+    conn->in = conn->out = NULL;
+    conn->dead = true;
+    conn->next = tls->dead;
+    tls->dead = conn;
+}
+
+
+static void _tls_free_dead(tls_t* tls) {
+    while (tls->dead) {
+        tls_conn_t* conn = tls->dead;
+        tls->dead = conn->next;
+        free(conn);
+    }
+}
+
+
+static void _tls_on_deadline(wheel_timer_t* timer, void* data) {
+    tls_conn_t* conn = data;
+    LOG_INFO("tls: connection %p did not complete its handshake", conn);
+    _tls_remove(conn, false);
+}
+
+
+/*
+ * Watch the events the relay of `conn` waits for on both sockets.
+ */
+static void _tls_watch(tls_conn_t* conn) {
+    uint32_t sock_events = 0;
+    uint32_t pair_events = 0;
+    if (conn->in_start < conn->in_end) {
+        pair_events |= EPOLLOUT;
+    } else
+    if (!conn->sock_closed) {
+        sock_events |= conn->read_events;
+    }
+    if (conn->out_start < conn->out_end) {
+        sock_events |= conn->write_events;
+    } else
+    if (!conn->pair_closed) {
+        pair_events |= EPOLLIN;
+    }
+    if (loop_modify(&conn->tls->loop, &conn->sock_watch, sock_events)
+        != LOOP_SUCCESS
+        || loop_modify(&conn->tls->loop, &conn->pair_watch, pair_events)
+           != LOOP_SUCCESS)
+    {
+        LOG_ERROR("tls: cannot watch connection %p", conn);
+        _tls_remove(conn, false);
+    }
+}
+
+
+/*
+ * Move the bytes of `conn` between the TLS session and the bridge, as far
+ * as the sockets allow.
+ */
+static void _tls_relay(tls_conn_t* conn) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        // From the client to the bridge.
+        if (conn->in_start == conn->in_end && !conn->sock_closed) {
+            int len = SSL_read(conn->ssl, conn->in, TLS_RELAY_SIZE);
+            if (len > 0) {
+                conn->in_start = 0;
+                conn->in_end = len;
+                conn->read_events = EPOLLIN;
+            } else {
+                switch (SSL_get_error(conn->ssl, len)) {
+                  case SSL_ERROR_WANT_READ:
+                    conn->read_events = EPOLLIN;
+                    break;
+
+                  case SSL_ERROR_WANT_WRITE:
+                    conn->read_events = EPOLLOUT;
+                    break;
+
+                  case SSL_ERROR_ZERO_RETURN:
+                    // The bridge sees the end of the stream.
+                    conn->sock_closed = true;
+                    shutdown(conn->pair, SHUT_WR);
+                    break;
+
+                  default:
+                    goto close;
+                }
+            }
+        }
+        if (conn->in_start < conn->in_end) {
+            ssize_t len = send(conn->pair, conn->in + conn->in_start,
+                               conn->in_end - conn->in_start, MSG_NOSIGNAL);
+            if (len > 0) {
+                conn->in_start += len;
+                progress = true;
+            } else
+            if (errno != EAGAIN && errno != EINTR) {
+                goto close;
+            }
+        }
+
+        // From the bridge to the client.
+        if (conn->out_start == conn->out_end && !conn->pair_closed) {
+            ssize_t len = recv(conn->pair, conn->out, TLS_RELAY_SIZE, 0);
+            if (len > 0) {
+                conn->out_start = 0;
+                conn->out_end = len;
+            } else
+            if (len == 0) {
+                conn->pair_closed = true;
+            } else
+            if (errno != EAGAIN && errno != EINTR) {
+                goto close;
+            }
+        }
+        if (conn->out_start < conn->out_end) {
+            int len = SSL_write(conn->ssl, conn->out + conn->out_start,
+                                conn->out_end - conn->out_start);
+            if (len > 0) {
+                conn->out_start += len;
+                conn->write_events = EPOLLOUT;
+                progress = true;
+            } else {
+                switch (SSL_get_error(conn->ssl, len)) {
+                  case SSL_ERROR_WANT_READ:
+                    conn->write_events = EPOLLIN;
+                    break;
+
+                  case SSL_ERROR_WANT_WRITE:
+                    conn->write_events = EPOLLOUT;
+                    break;
+
+                  default:
+                    goto close;
+                }
+            }
+        }
+    }
+
+    // The bridge closed the connection and everything it sent is written.
+    if (conn->pair_closed && conn->out_start == conn->out_end) {
+        SSL_shutdown(conn->ssl);
+        goto close;
+    }
+    _tls_watch(conn);
+    return;
+
+  close:
+    _tls_remove(conn, false);
+}
+
+
+static void _tls_on_pair(void* data, uint32_t events) {
+    tls_conn_t* conn = data;
+    if (!conn->dead) {
+        _tls_relay(conn);
+    }
+}
+
+
+/*
+ * Relay `conn` in user space, through a socket pair whose other end is
+ * given to the bridge.
+ */
+static void _tls_relay_start(tls_conn_t* conn) {
+    tls_t* tls = conn->tls;
+    socket_t pair[2];
+
+    conn->in = malloc(TLS_RELAY_SIZE);
+    conn->out = malloc(TLS_RELAY_SIZE);
+    if (!conn->in || !conn->out
+        || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                      pair) < 0)
+    {
+        LOG_ERROR("tls: cannot relay connection %p", conn);
+        _tls_remove(conn, false);
+        return;
+    }
+    conn->pair = pair[0];
+    conn->read_events = EPOLLIN;
+    conn->write_events = EPOLLOUT;
+    if (loop_add(&tls->loop, &conn->pair_watch, conn->pair, EPOLLIN,
+                 &_tls_on_pair, conn)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("tls: cannot watch connection %p", conn);
+        conn->pair = SOCKET_ERROR;
+        close(pair[0]);
+        close(pair[1]);
+        _tls_remove(conn, false);
+        return;
+    }
+    tls->ready(pair[1], tls->ready_data);
+    _tls_relay(conn);
+}
+
+
+/*
+ * Give the socket of `conn` to the bridge, its records being handled by
+ * the kernel in both directions.
+ * Returns false if the kernel does not handle them.
+ */
+static bool _tls_offload(tls_conn_t* conn) {
+    tls_t* tls = conn->tls;
+    if (!tls->config->tls.ktls) {
+        return false;
+    }
+    // Data read ahead by OpenSSL would be lost to the bridge.
+    if (!BIO_get_ktls_send(SSL_get_wbio(conn->ssl))
+        || !BIO_get_ktls_recv(SSL_get_rbio(conn->ssl))
+        || SSL_has_pending(conn->ssl))
+    {
+        if (!tls->ktls_warned) {
+            LOG_WARNING("tls: kernel TLS unavailable for %s, relaying in "
+                        "user space", SSL_get_cipher_name(conn->ssl));
+            tls->ktls_warned = true;
+        }
+        return false;
+    }
+
+    // Freeing a session not shut down would drop it from the cache.
+    SSL_set_shutdown(conn->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    socket_t sock = conn->sock;
+    _tls_remove(conn, true);
+    tls->ready(sock, tls->ready_data);
+    return true;
+}
+
+
+static void _tls_handshake(tls_conn_t* conn) {
+    tls_t* tls = conn->tls;
+    uint32_t events;
+
+    int ret = SSL_accept(conn->ssl);
+    if (ret != 1) {
+        switch (SSL_get_error(conn->ssl, ret)) {
+          case SSL_ERROR_WANT_READ:
+            events = EPOLLIN;
+            break;
+
+          case SSL_ERROR_WANT_WRITE:
+            events = EPOLLOUT;
+            break;
+
+          default:
+            _tls_log_errors("handshake failed");
+            _tls_remove(conn, false);
+            return;
+        }
+        if (loop_modify(&tls->loop, &conn->sock_watch, events)
+            != LOOP_SUCCESS)
+        {
+            LOG_ERROR("tls: cannot watch connection %p", conn);
+            _tls_remove(conn, false);
+        }
+        return;
+    }
+
+    LOG_DEBUG("tls: connection %p: %s, %s%s", conn, SSL_get_version(conn->ssl),
+              SSL_get_cipher_name(conn->ssl),
+              SSL_session_reused(conn->ssl) ? ", resumed" : "");
+    loop_disarm(&tls->loop, &conn->deadline);
+    if (!_tls_offload(conn)) {
+        _tls_relay_start(conn);
+    }
+}
+
+
+static void _tls_on_sock(void* data, uint32_t events) {
+    tls_conn_t* conn = data;
+    if (conn->dead) {
+        return;
+    }
+    if (conn->pair == SOCKET_ERROR) {
+        _tls_handshake(conn);
+    } else {
+        _tls_relay(conn);
+    }
+}
+
+
+/*
+ * Start the handshake of the accepted socket `sock`.
+ */
+static void _tls_run(tls_t* tls, socket_t sock) {
+    tls_conn_t* conn = calloc(1, sizeof(tls_conn_t));
+    if (!conn) {
+        LOG_ERROR("tls: cannot allocate connection");
+        close(sock);
+        return;
+    }
+    conn->tls = tls;
+    conn->sock = sock;
+    conn->pair = SOCKET_ERROR;
+    wheel_timer_init(&conn->deadline, &_tls_on_deadline, conn);
+
+    conn->ssl = SSL_new(tls->ctx);
+    if (!conn->ssl || SSL_set_fd(conn->ssl, sock) != 1
+        || socket_set_non_blocking(sock) != NET_SUCCESS)
+    {
+        _tls_log_errors("cannot create session");
+        SSL_free(conn->ssl);
+        close(sock);
+        free(conn);
+        return;
+    }
+    // Handshake flights and relayed records are sent as soon as written.
+    if (socket_set_no_delay(sock) == NET_ERROR) {
+        LOG_ERROR("tls: unable to disable Nagle on connection %p", conn);
+    }
+    if (loop_add(&tls->loop, &conn->sock_watch, sock, EPOLLIN,
+                 &_tls_on_sock, conn)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("tls: cannot watch connection %p", conn);
+        SSL_free(conn->ssl);
+        close(sock);
+        free(conn);
+        return;
+    }
+
+    conn->next = tls->conns;
+    if (tls->conns) {
+        tls->conns->prev = conn;
+    }
+    tls->conns = conn;
+    if (tls->config->timeouts.handshake > 0) {
+        loop_arm(&tls->loop, &conn->deadline, tls->config->timeouts.handshake);
+    }
+}
+
+
+static void _tls_on_wake(void* data, uint32_t events) {
+    tls_t* tls = data;
+    eventfd_t count;
+    eventfd_read(tls->wake_fd, &count);
+
+    pthread_mutex_lock(&tls->lock);
+    socket_t* accepted = tls->accepted;
+    size_t accepted_count = tls->accepted_count;
+    tls->accepted = NULL;
+    tls->accepted_count = 0;
+    tls->accepted_capacity = 0;
+    pthread_mutex_unlock(&tls->lock);
+
+    for (size_t i = 0; i < accepted_count; i++) {
+        _tls_run(tls, accepted[i]);
+    }
+    free(accepted);
+}
+
+
+static void* _tls_thread(tls_t* tls) {
+    // OpenSSL writes without MSG_NOSIGNAL: a write to a connection reset by
+    // the client fails with EPIPE instead of killing the bridge.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    while (__atomic_load_n(&tls->running, __ATOMIC_ACQUIRE)) {
+        if (loop_run_once(&tls->loop, -1) != LOOP_SUCCESS) {
+            break;
+        }
+        _tls_free_dead(tls);
+    }
+    while (tls->conns) {
+        _tls_remove(tls->conns, false);
+    }
+    _tls_free_dead(tls);
+    return NULL;
+}
+
+
+static SSL_CTX* _tls_context(const config_tls_t* config) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        _tls_log_errors("cannot create context");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, config->cert) != 1) {
+        _tls_log_errors(config->cert);
+        goto error;
+    }
+    const char* key = config->key ? config->key : config->cert;
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        _tls_log_errors(key);
+        goto error;
+    }
+
+    // Returning clients skip the key exchange, through the session cache
+    // with TLS 1.2 and through tickets, which OpenSSL sends by default.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"wsbridge",
+                                   8);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION
+                             | (config->ktls ? SSL_OP_ENABLE_KTLS : 0));
+    // Idle connections relayed in user space don't hold record buffers.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                          | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                          | SSL_MODE_RELEASE_BUFFERS);
+    return ctx;
+
+  error:
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+
+/*
+ * Free the TLS resources, once its thread is stopped.
+ */
+static void _tls_destroy(tls_t* tls) {
+    for (size_t i = 0; i < tls->accepted_count; i++) {
+        close(tls->accepted[i]);
+    }
+    free(tls->accepted);
+    if (tls->wake_fd != SOCKET_ERROR) {
+        close(tls->wake_fd);
+    }
+    loop_destroy(&tls->loop);
+    pthread_mutex_destroy(&tls->lock);
+    SSL_CTX_free(tls->ctx);
+}
+
+
+tls_status_t tls_start(tls_t* tls, const config_t* config, tls_ready_t ready,
+                       void* data)
+{
+    *tls = (tls_t){
+        .config = config,
+        .ready = ready,
+        .ready_data = data,
+        .running = true,
+        .wake_fd = SOCKET_ERROR,
+    };
+    pthread_mutex_init(&tls->lock, NULL);
+
+    if (loop_init(&tls->loop) != LOOP_SUCCESS) {
+        LOG_ERROR("tls: unable to create loop");
+        pthread_mutex_destroy(&tls->lock);
+        return TLS_ERROR;
+    }
+    tls->ctx = _tls_context(&config->tls);
+    if (!tls->ctx) {
+        goto error;
+    }
+    tls->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (tls->wake_fd < 0) {
+        LOG_ERROR("tls: unable to create wake up event");
+        tls->wake_fd = SOCKET_ERROR;
+        goto error;
+    }
+    if (loop_add(&tls->loop, &tls->wake_watch, tls->wake_fd, EPOLLIN,
+                 &_tls_on_wake, tls)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("tls: unable to watch wake up event");
+        goto error;
+    }
+
+    if (pthread_create(&tls->thread, NULL, (void* (*)(void*))&_tls_thread,
+                       tls) != 0)
+    {
+        LOG_ERROR("tls: unable to start thread");
+        goto error;
+    }
+    LOG_INFO("tls: accepting TLS connections%s",
+             config->tls.ktls ? ", with kernel TLS" : "");
+    return TLS_SUCCESS;
+
+  error:
+    _tls_destroy(tls);
+    return TLS_ERROR;
+}
+
+
+void tls_stop(tls_t* tls) {
+    __atomic_store_n(&tls->running, false, __ATOMIC_RELEASE);
+    eventfd_write(tls->wake_fd, 1);
+    pthread_join(tls->thread, NULL);
+    _tls_destroy(tls);
+}
+
+
+tls_status_t tls_add(tls_t* tls, socket_t sock) {
+    tls_status_t status = TLS_SUCCESS;
+
+    pthread_mutex_lock(&tls->lock);
+    socket_t* accepted = _tls_reserve(tls->accepted, &tls->accepted_capacity,
+                                      tls->accepted_count, sizeof(socket_t));
+    if (!accepted) {
+        status = TLS_ERROR;
+        goto end;
+    }
+    tls->accepted = accepted;
+    tls->accepted[tls->accepted_count++] = sock;
+
+  end:
+    pthread_mutex_unlock(&tls->lock);
+    if (status == TLS_SUCCESS) {
+        eventfd_write(tls->wake_fd, 1);
+    }
+    return status;
+}
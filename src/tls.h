@@ -0,0 +1,96 @@
+/*
+ * TLS termination.
+ *
+ * Accepted sockets are handed to a TLS thread, which runs their handshakes
+ * in its event loop, with session resumption through the server session
+ * cache and tickets. With kernel TLS, OpenSSL then hands the session keys
+ * to the kernel (TLS_TX and TLS_RX), and the socket is given to the bridge
+ * like a plain one: records are encrypted and decrypted by `send`, `writev`
+ * and `recv`.
+ *
+ * When the kernel can't take both directions, or kernel TLS is disabled,
+ * the TLS thread keeps the session and relays the connection in user space,
+ * through a socket pair whose other end is given to the bridge.
+ */
+#ifndef _tls_h_
+#define _tls_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+#include "config.h"
+#include "loop.h"
+#include "net.h"
+
+
+typedef enum tls_status {
+    TLS_ERROR = -1,
+    TLS_SUCCESS = 0,
+} tls_status_t;
+
+
+/*
+ * Called by the TLS thread with the socket of a connection whose handshake
+ * is done, plain to the bridge.
+ */
+typedef void (*tls_ready_t)(socket_t sock, void* data);
+
+
+struct tls_conn;
+
+
+typedef struct tls {
+    const config_t* config;
+    SSL_CTX* ctx;
+    tls_ready_t ready;
+    void* ready_data;
+
+    pthread_t thread;
+    loop_t loop;
+    bool running;
+
+    // Wakes the thread up when sockets were accepted.
+    int wake_fd;
+    loop_watch_t wake_watch;
+
+    // Protects the sockets accepted for the thread.
+    pthread_mutex_t lock;
+    socket_t* accepted;
+    size_t accepted_count;
+    size_t accepted_capacity;
+
+    // Connections handshaking or relayed in user space, and those removed
+    // during the current wait.
+    struct tls_conn* conns;
+    struct tls_conn* dead;
+
+    // Only warn once about kernel TLS being unavailable.
+    bool ktls_warned;
+} tls_t;
+
+
+/*
+ * Load the certificate and key of `config` and start the TLS thread,
+ * calling `ready` with `data` for each connection ready to be bridged.
+ * Returns `TLS_ERROR` on failure, `TLS_SUCCESS` otherwise.
+ */
+tls_status_t tls_start(tls_t* tls, const config_t* config, tls_ready_t ready,
+                       void* data);
+
+
+/*
+ * Stop the TLS thread, closing the connections it runs.
+ */
+void tls_stop(tls_t* tls);
+
+
+/*
+ * Give the accepted socket `sock` to the TLS thread.
+ * Returns `TLS_ERROR` on failure, `TLS_SUCCESS` otherwise.
+ */
+tls_status_t tls_add(tls_t* tls, socket_t sock);
+
+
+#endif
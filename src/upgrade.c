@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "upgrade.h"
+
+
+// Time given to the running bridge to answer, and to the new process to
+// send its request once connected, which it does at once.
+#define UPGRADE_TIMEOUT             5000
+#define UPGRADE_REQUEST_TIMEOUT     200
+
+
+upgrade_status_t upgrade_init(upgrade_t* upgrade, const char* path) {
+    char unix_addr[sizeof(upgrade->addr.un.sun_path) + 16];
+
+    upgrade->sock = SOCKET_ERROR;
+    // Every local user may connect an abstract socket, or bind its name
+    // first.
+    if (path[0] == '@') {
+        LOG_ERROR("the upgrade socket %s must be a path, abstract sockets "
+                  "are open to every user", path);
+        return UPGRADE_ERROR;
+    }
+    snprintf(unix_addr, sizeof(unix_addr), "unixpacket:%s", path);
+    if (socket_parse_unix(unix_addr, &upgrade->addr) != NET_SUCCESS) {
+        LOG_ERROR("invalid upgrade socket %s", path);
+        return UPGRADE_ERROR;
+    }
+    return UPGRADE_SUCCESS;
+}
+
+
+/*
+ * Returns true if the peer of `sock` runs as our effective user, logging
+ * why otherwise.
+ */
+static bool _upgrade_peer_trusted(socket_t sock) {
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0) {
+        LOG_ERROR("cannot get the credentials of the upgrade peer");
+        return false;
+    }
+    if (cred.uid != geteuid()) {
+        LOG_WARNING("ignoring the upgrade peer of pid %d running as uid %d",
+                    (int)cred.pid, (int)cred.uid);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Wait up to `timeout_ms` for a packet of the peer on `sock`, then receive
+ * it in `msg`, with up to `UPGRADE_SOCKETS` descriptors in `fds`.
+ * Returns the count of descriptors received, or -1 on failure.
+ */
+static ssize_t _upgrade_recv(socket_t sock, upgrade_message_t* msg,
+                             int fds[UPGRADE_SOCKETS], int timeout_ms)
+{
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_SOCKETS)];
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+    ssize_t len = recvmsg(sock, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        return -1;
+    }
+
+    size_t count = 0;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+    if (len != sizeof(*msg) || (hdr.msg_flags & MSG_CTRUNC)
+        || msg->magic != UPGRADE_MAGIC || msg->version != UPGRADE_VERSION)
+    {
+        for (size_t i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return count;
+}
+
+
+upgrade_status_t upgrade_take(upgrade_t* upgrade,
+                              socket_t sockets[UPGRADE_SOCKETS])
+{
+    upgrade_message_t msg = {
+        .magic = UPGRADE_MAGIC,
+        .version = UPGRADE_VERSION,
+    };
+    int fds[UPGRADE_SOCKETS];
+
+    for (size_t i = 0; i < UPGRADE_SOCKETS; i++) {
+        sockets[i] = SOCKET_ERROR;
+        msg.sockets[i] = -1;
+    }
+    socket_t sock = socket_connect(&upgrade->addr);
+    if (sock == SOCKET_ERROR) {
+        return UPGRADE_NONE;
+    }
+    if (!_upgrade_peer_trusted(sock)) {
+        goto error;
+    }
+    if (send(sock, &msg, sizeof(msg), MSG_NOSIGNAL) < 0) {
+        LOG_ERROR("cannot ask the running bridge for its sockets");
+        goto error;
+    }
+    ssize_t count = _upgrade_recv(sock, &msg, fds, UPGRADE_TIMEOUT);
+    if (count < 0) {
+        LOG_ERROR("the running bridge didn't give its sockets");
+        goto error;
+    }
+    for (size_t i = 0; i < UPGRADE_SOCKETS; i++) {
+        if (msg.sockets[i] >= 0 && msg.sockets[i] < count) {
+            sockets[i] = fds[msg.sockets[i]];
+        }
+    }
+    close(sock);
+    return UPGRADE_SUCCESS;
+
+  error:
+    close(sock);
+    return UPGRADE_ERROR;
+}
+
+
+upgrade_status_t upgrade_listen(upgrade_t* upgrade) {
+    upgrade->sock = socket_create_server(&upgrade->addr, 1);
+    if (upgrade->sock == SOCKET_ERROR) {
+        return UPGRADE_ERROR;
+    }
+    // Only our user may connect it, and take the sockets.
+    if (chmod(upgrade->addr.un.sun_path, S_IRUSR | S_IWUSR) < 0) {
+        LOG_WARNING("cannot restrict the access to the upgrade socket");
+    }
+    return UPGRADE_SUCCESS;
+}
+
+
+/*
+ * Send the valid `sockets` on `sock`.
+ */
+static upgrade_status_t _upgrade_send(socket_t sock,
+                                      const socket_t sockets[UPGRADE_SOCKETS])
+{
+    upgrade_message_t msg = {
+        .magic = UPGRADE_MAGIC,
+        .version = UPGRADE_VERSION,
+    };
+    int fds[UPGRADE_SOCKETS];
+    size_t count = 0;
+    for (size_t i = 0; i < UPGRADE_SOCKETS; i++) {
+        msg.sockets[i] = -1;
+        if (sockets[i] != SOCKET_ERROR) {
+            msg.sockets[i] = count;
+            fds[count++] = sockets[i];
+        }
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+    struct iovec iov = { &msg, sizeof(msg) };
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    if (sendmsg(sock, &hdr, MSG_NOSIGNAL) < 0) {
+        return UPGRADE_ERROR;
+    }
+    return UPGRADE_SUCCESS;
+}
+
+
+upgrade_status_t upgrade_give(upgrade_t* upgrade,
+                              const socket_t sockets[UPGRADE_SOCKETS])
+{
+    upgrade_message_t msg;
+    int fds[UPGRADE_SOCKETS];
+
+    socket_t sock = accept4(upgrade->sock, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+        return UPGRADE_ERROR;
+    }
+    if (!_upgrade_peer_trusted(sock)) {
+        close(sock);
+        return UPGRADE_ERROR;
+    }
+    ssize_t count = _upgrade_recv(sock, &msg, fds, UPGRADE_REQUEST_TIMEOUT);
+    if (count != 0) {
+        for (ssize_t i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        LOG_WARNING("ignoring an invalid upgrade request");
+        close(sock);
+        return UPGRADE_ERROR;
+    }
+
+    // The successor listens on the upgrade socket once it has the sockets.
+    upgrade_close(upgrade);
+    if (_upgrade_send(sock, sockets) != UPGRADE_SUCCESS) {
+        LOG_ERROR("cannot give the sockets to the new bridge");
+        close(sock);
+        upgrade_listen(upgrade);
+        return UPGRADE_ERROR;
+    }
+    close(sock);
+    return UPGRADE_SUCCESS;
+}
+
+
+void upgrade_close(upgrade_t* upgrade) {
+    if (upgrade->sock != SOCKET_ERROR) {
+        close(upgrade->sock);
+        upgrade->sock = SOCKET_ERROR;
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * Handover of the listening sockets to a new bridge process.
+ *
+ * A bridge started with an upgrade socket listens on it for its successor.
+ * A new process with the same upgrade socket connects it first: the
+ * running one then closes its upgrade socket, and sends its listening
+ * sockets, the clients one and the metrics one, with SCM_RIGHTS. The new
+ * process accepts the next clients on them, and listens on the upgrade
+ * socket in turn, while the old one drains its clients. The accept queue
+ * is shared, so no connection is refused during the upgrade.
+ *
+ * Both processes only talk to a peer running as their own user, and the
+ * upgrade socket is only writable by it.
+ */
+#ifndef _upgrade_h_
+#define _upgrade_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+
+#define UPGRADE_MAGIC       0x57534255
+#define UPGRADE_VERSION     1
+
+// Sockets handed over, in this order.
+#define UPGRADE_LISTENER    0
+#define UPGRADE_METRICS     1
+#define UPGRADE_SOCKETS     2
+
+
+typedef enum upgrade_status {
+    UPGRADE_ERROR = -1,
+    UPGRADE_SUCCESS = 0,
+    // No bridge listens on the upgrade socket.
+    UPGRADE_NONE = 1,
+} upgrade_status_t;
+
+
+/*
+ * Packet of the new process asking for the sockets, and of the answer
+ * carrying them: the index of each socket in the descriptors, or -1 for
+ * the ones not sent.
+ */
+typedef struct upgrade_message {
+    uint32_t magic;
+    uint32_t version;
+    int32_t sockets[UPGRADE_SOCKETS];
+} upgrade_message_t;
+
+
+typedef struct upgrade {
+    socket_address_t addr;
+
+    // Socket listening for the successor, or `SOCKET_ERROR`.
+    socket_t sock;
+} upgrade_t;
+
+
+/*
+ * Parse the upgrade socket `path` into `upgrade`, a Unix packet socket.
+ * Abstract names, starting with '@', are rejected.
+ */
+upgrade_status_t upgrade_init(upgrade_t* upgrade, const char* path);
+
+
+/*
+ * Take the sockets of the bridge listening on the upgrade socket over, in
+ * `sockets`, which are left to `SOCKET_ERROR` if not sent.
+ * Returns `UPGRADE_NONE` if no bridge is running.
+ */
+upgrade_status_t upgrade_take(upgrade_t* upgrade,
+                              socket_t sockets[UPGRADE_SOCKETS]);
+
+
+/*
+ * Listen for the successor on the upgrade socket.
+ */
+upgrade_status_t upgrade_listen(upgrade_t* upgrade);
+
+
+/*
+ * Accept the successor connecting the upgrade socket, and give it
+ * `sockets`. The upgrade socket is closed first, so that the successor
+ * may listen on it once it got them.
+ * Returns `UPGRADE_ERROR` if the peer is not a bridge or the sockets
+ * couldn't be sent, the upgrade socket listening again then.
+ */
+upgrade_status_t upgrade_give(upgrade_t* upgrade,
+                              const socket_t sockets[UPGRADE_SOCKETS]);
+
+
+/*
+ * Close the upgrade socket.
+ */
+void upgrade_close(upgrade_t* upgrade);
+
+
+#endif
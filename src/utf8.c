@@ -0,0 +1,371 @@
+#include <string.h>
+
+#include "utf8.h"
+
+
+/*
+ * Returns the length of the sequence starting with `lead`, or 0 if `lead`
+ * cannot start a sequence.
+ */
+static size_t _utf8_sequence_length(uint8_t lead) {
+    if (lead < 0x80) {
+        return 1;
+    } else
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        return 2;
+    } else
+    if (lead >= 0xe0 && lead <= 0xef) {
+        return 3;
+    } else
+    if (lead >= 0xf0 && lead <= 0xf4) {
+        return 4;
+    }
+    return 0;
+}
+
+
+static bool _utf8_validate_scalar(const uint8_t* s, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        // Skip ASCII words.
+        if (i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, s + i, sizeof(word));
+            if (!(word & 0x8080808080808080ULL)) {
+                i += 8;
+                continue;
+            }
+        }
+
+        uint8_t lead = s[i];
+        size_t n = _utf8_sequence_length(lead);
+        if (n == 0 || i + n > len) {
+            return false;
+        }
+
+        // The second byte range excludes overlong forms, surrogates and
+        // code points over U+10FFFF.
+        uint8_t lo = 0x80, hi = 0xbf;
+        switch (lead) {
+          case 0xe0: lo = 0xa0; break;
+          case 0xed: hi = 0x9f; break;
+          case 0xf0: lo = 0x90; break;
+          case 0xf4: hi = 0x8f; break;
+          default: break;
+        }
+        if (n > 1 && (s[i + 1] < lo || s[i + 1] > hi)) {
+            return false;
+        }
+        for (size_t k = 2; k < n; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) {
+                return false;
+            }
+        }
+        i += n;
+    }
+    return true;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+
+/*
+ * Error classes of a two bytes window, see Keiser and Lemire, section 6.
+ */
+#define TOO_SHORT       (1 << 0)    // 11______ 0_______ / 11______ 11______
+#define TOO_LONG        (1 << 1)    // 0_______ 10______
+#define OVERLONG_3      (1 << 2)    // 11100000 100_____
+#define TOO_LARGE       (1 << 3)    // 11110100 1001____ and above
+#define SURROGATE       (1 << 4)    // 11101101 101_____
+#define OVERLONG_2      (1 << 5)    // 1100000_ 10______
+#define TOO_LARGE_1000  (1 << 6)    // 11110101 1000____ and above
+#define OVERLONG_4      (1 << 6)    // 11110000 1000____
+#define TWO_CONTS       (1 << 7)    // 10______ 10______
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+
+// Indexed by the high nibble of the first byte.
+static const uint8_t BYTE_1_HIGH[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+// Indexed by the low nibble of the first byte.
+static const uint8_t BYTE_1_LOW[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+// Indexed by the high nibble of the second byte.
+static const uint8_t BYTE_2_HIGH[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000
+        | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// A block ending with bytes over these values ends with an incomplete
+// sequence.
+static const uint8_t INCOMPLETE_MAX[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf,
+};
+
+
+__attribute__((target("ssse3")))
+static bool _utf8_validate_ssse3(const uint8_t* s, size_t len) {
+    const __m128i byte_1_high = _mm_loadu_si128((const __m128i*)BYTE_1_HIGH);
+    const __m128i byte_1_low = _mm_loadu_si128((const __m128i*)BYTE_1_LOW);
+    const __m128i byte_2_high = _mm_loadu_si128((const __m128i*)BYTE_2_HIGH);
+    const __m128i incomplete_max
+        = _mm_loadu_si128((const __m128i*)(INCOMPLETE_MAX + 16));
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+
+    for (size_t i = 0; i < len; i += 16) {
+        __m128i input;
+        if (i + 16 <= len) {
+            input = _mm_loadu_si128((const __m128i*)(s + i));
+        } else {
+            // Pad the last block with ASCII.
+            uint8_t tail[16] = { 0 };
+            memcpy(tail, s + i, len - i);
+            input = _mm_loadu_si128((const __m128i*)tail);
+        }
+
+        if (_mm_movemask_epi8(input) == 0) {
+            // ASCII only, but the previous block may need continuations.
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_input = input;
+            continue;
+        }
+
+        __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+        __m128i special_cases = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(byte_1_high,
+                    _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(byte_2_high,
+                _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+        // Third and fourth bytes of a sequence must be continuations.
+        __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+        __m128i must_be_continuation = _mm_and_si128(
+            _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+                         _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80))),
+            _mm_set1_epi8((char)0x80));
+        error = _mm_or_si128(error,
+                             _mm_xor_si128(must_be_continuation,
+                                           special_cases));
+
+        prev_incomplete = _mm_subs_epu8(input, incomplete_max);
+        prev_input = input;
+    }
+
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128()))
+        == 0xffff;
+}
+
+
+__attribute__((target("avx2")))
+static bool _utf8_validate_avx2(const uint8_t* s, size_t len) {
+    const __m256i byte_1_high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)BYTE_1_HIGH));
+    const __m256i byte_1_low = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)BYTE_1_LOW));
+    const __m256i byte_2_high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)BYTE_2_HIGH));
+    const __m256i incomplete_max
+        = _mm256_loadu_si256((const __m256i*)INCOMPLETE_MAX);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < len; i += 32) {
+        __m256i input;
+        if (i + 32 <= len) {
+            input = _mm256_loadu_si256((const __m256i*)(s + i));
+        } else {
+            uint8_t tail[32] = { 0 };
+            memcpy(tail, s + i, len - i);
+            input = _mm256_loadu_si256((const __m256i*)tail);
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_input = input;
+            continue;
+        }
+
+        // alignr works on 128 bits lanes: shift in the previous lane first.
+        __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+        __m256i special_cases = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_shuffle_epi8(byte_1_high,
+                    _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                _mm256_shuffle_epi8(byte_1_low,
+                    _mm256_and_si256(prev1, nibble))),
+            _mm256_shuffle_epi8(byte_2_high,
+                _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+        __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+        __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+        __m256i must_be_continuation = _mm256_and_si256(
+            _mm256_or_si256(
+                _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+                _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80))),
+            _mm256_set1_epi8((char)0x80));
+        error = _mm256_or_si256(error,
+                                _mm256_xor_si256(must_be_continuation,
+                                                 special_cases));
+
+        prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+        prev_input = input;
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+
+typedef bool (*_utf8_validator_t)(const uint8_t*, size_t);
+
+
+static _utf8_validator_t _utf8_select_validator(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &_utf8_validate_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return &_utf8_validate_ssse3;
+    }
+    return &_utf8_validate_scalar;
+}
+
+#else
+
+typedef bool (*_utf8_validator_t)(const uint8_t*, size_t);
+
+
+static _utf8_validator_t _utf8_select_validator(void) {
+    return &_utf8_validate_scalar;
+}
+
+#endif
+
+
+// Below this size, setting up the vector registers costs more than it saves.
+#define UTF8_SIMD_MIN_LEN   32
+
+
+bool utf8_validate(const char* buf, size_t len) {
+    static _utf8_validator_t validator = NULL;
+    if (len < UTF8_SIMD_MIN_LEN) {
+        return _utf8_validate_scalar((const uint8_t*)buf, len);
+    }
+    if (!validator) {
+        validator = _utf8_select_validator();
+    }
+    return validator((const uint8_t*)buf, len);
+}
+
+
+size_t utf8_complete_length(const char* buf, size_t len) {
+    const uint8_t* s = (const uint8_t*)buf;
+
+    // Look for the last lead byte among the last three bytes.
+    for (size_t back = 1; back <= 3 && back <= len; back++) {
+        uint8_t c = s[len - back];
+        if ((c & 0xc0) == 0x80) {
+            continue;
+        }
+        size_t n = _utf8_sequence_length(c);
+        return (n > back) ? len - back : len;
+    }
+    return len;
+}
+
+
+void utf8_init(utf8_state_t* state) {
+    state->pending_len = 0;
+}
+
+
+bool utf8_update(utf8_state_t* state, const char* buf, size_t len) {
+    // First complete the character split by the previous chunk.
+    if (state->pending_len > 0) {
+        size_t needed = _utf8_sequence_length(state->pending[0]);
+        size_t taken = needed - state->pending_len;
+        if (taken > len) {
+            taken = len;
+        }
+        memcpy(state->pending + state->pending_len, buf, taken);
+        state->pending_len += taken;
+        buf += taken;
+        len -= taken;
+
+        if (state->pending_len < needed) {
+            // Still incomplete, at least check the continuations.
+            for (size_t i = 1; i < state->pending_len; i++) {
+                if ((state->pending[i] & 0xc0) != 0x80) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        if (!_utf8_validate_scalar(state->pending, needed)) {
+            return false;
+        }
+        state->pending_len = 0;
+    }
+
+    size_t complete = utf8_complete_length(buf, len);
+    if (!utf8_validate(buf, complete)) {
+        return false;
+    }
+    state->pending_len = len - complete;
+    memcpy(state->pending, buf + complete, state->pending_len);
+    return true;
+}
+
+
+bool utf8_finish(const utf8_state_t* state) {
+    return state->pending_len == 0;
+}
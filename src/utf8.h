@@ -0,0 +1,60 @@
+/*
+ * UTF-8 validation.
+ *
+ * Validation runs on 32 bytes (AVX2) or 16 bytes (SSSE3) at a time when the
+ * CPU supports it, using the lookup algorithm of Keiser and Lemire
+ * ("Validating UTF-8 In Less Than One Instruction Per Byte", 2021), and
+ * falls back on a scalar validator otherwise.
+ */
+#ifndef _utf8_h_
+#define _utf8_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * State of a validation running over several chunks. A character may be
+ * split between two chunks: its first bytes are kept until the next one.
+ */
+typedef struct utf8_state {
+    uint8_t pending[4];
+    size_t pending_len;
+} utf8_state_t;
+
+
+/*
+ * Returns true if `buf` is a valid UTF-8 string.
+ */
+bool utf8_validate(const char* buf, size_t len);
+
+
+/*
+ * Returns the length of the longest prefix of `buf` which doesn't end in
+ * the middle of a character. Invalid bytes are considered complete.
+ */
+size_t utf8_complete_length(const char* buf, size_t len);
+
+
+/*
+ * Start a new chunked validation.
+ */
+void utf8_init(utf8_state_t* state);
+
+
+/*
+ * Validate the next chunk of a stream.
+ * Returns false as soon as an invalid sequence is found.
+ */
+bool utf8_update(utf8_state_t* state, const char* buf, size_t len);
+
+
+/*
+ * Returns true if the stream validated by `state` doesn't end in the middle
+ * of a character.
+ */
+bool utf8_finish(const utf8_state_t* state);
+
+
+#endif
@@ -0,0 +1,178 @@
+#include "wheel.h"
+
+
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+
+
+void wheel_init(wheel_t* wheel, uint64_t now) {
+    *wheel = (wheel_t){
+        .now = now,
+        .count = 0,
+    };
+}
+
+
+void wheel_timer_init(wheel_timer_t* timer, wheel_callback_t callback,
+                      void* data)
+{
+    *timer = (wheel_timer_t){
+        .next = NULL,
+        .prev = NULL,
+        .callback = callback,
+        .data = data,
+    };
+}
+
+
+static void _wheel_insert(wheel_t* wheel, wheel_timer_t* timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1
+           && delta >> (WHEEL_BITS * (level + 1)) != 0)
+    {
+        level++;
+    }
+    size_t slot = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    wheel_timer_t** head = &wheel->slots[level][slot];
+    timer->next = *head;
+    timer->prev = head;
+    if (*head) {
+        (*head)->prev = &timer->next;
+    }
+    *head = timer;
+    wheel->occupied[level] |= UINT64_C(1) << slot;
+    wheel->count++;
+}
+
+
+static void _wheel_unlink(wheel_t* wheel, wheel_timer_t* timer) {
+    // The slot becomes empty if the timer was alone in it.
+    uintptr_t prev = (uintptr_t)timer->prev;
+    uintptr_t slots = (uintptr_t)wheel->slots;
+    if (!timer->next && prev >= slots && prev < slots + sizeof(wheel->slots)) {
+        size_t index = (wheel_timer_t**)prev - &wheel->slots[0][0];
+        wheel->occupied[index / WHEEL_SLOTS]
+            &= ~(UINT64_C(1) << (index % WHEEL_SLOTS));
+    }
+
+    *timer->prev = timer->next;
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->count--;
+}
+
+
+void wheel_arm(wheel_t* wheel, wheel_timer_t* timer, uint64_t delay) {
+    if (wheel_timer_armed(timer)) {
+        _wheel_unlink(wheel, timer);
+    }
+    // The slot of the current tick was already processed.
+    if (delay == 0) {
+        delay = 1;
+    } else
+    if (delay > WHEEL_MAX_DELAY) {
+        delay = WHEEL_MAX_DELAY;
+    }
+    timer->expires = wheel->now + delay;
+    _wheel_insert(wheel, timer);
+}
+
+
+void wheel_disarm(wheel_t* wheel, wheel_timer_t* timer) {
+    if (wheel_timer_armed(timer)) {
+        _wheel_unlink(wheel, timer);
+    }
+}
+
+
+/*
+ * Move the timers of `slot` out of the wheel, in a list starting at `*list`.
+ */
+static void _wheel_take_slot(wheel_t* wheel, int level, size_t slot,
+                             wheel_timer_t** list)
+{
+    *list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+    if (*list) {
+        (*list)->prev = list;
+    }
+}
+
+
+/*
+ * Process the tick `wheel->now`: move the timers of the higher level slots
+ * starting at this tick down, then expire the timers of level 0.
+ */
+static void _wheel_process(wheel_t* wheel) {
+    uint64_t now = wheel->now;
+    wheel_timer_t* list;
+
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        if (now & ((UINT64_C(1) << (WHEEL_BITS * level)) - 1)) {
+            continue;
+        }
+        size_t slot = (now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        if (!(wheel->occupied[level] & (UINT64_C(1) << slot))) {
+            continue;
+        }
+        _wheel_take_slot(wheel, level, slot, &list);
+        while (list) {
+            wheel_timer_t* timer = list;
+            _wheel_unlink(wheel, timer);
+            _wheel_insert(wheel, timer);
+        }
+    }
+
+    // Callbacks may disarm the timers of the list, which stays linked.
+    _wheel_take_slot(wheel, 0, now & WHEEL_MASK, &list);
+    while (list) {
+        wheel_timer_t* timer = list;
+        _wheel_unlink(wheel, timer);
+        timer->callback(timer, timer->data);
+    }
+}
+
+
+uint64_t wheel_next_tick(const wheel_t* wheel) {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (!occupied) {
+            continue;
+        }
+
+        // Rotate the slots following the current one down to bit 0.
+        uint64_t position = wheel->now >> (WHEEL_BITS * level);
+        unsigned shift = (position + 1) & WHEEL_MASK;
+        if (shift) {
+            occupied = (occupied >> shift)
+                     | (occupied << (WHEEL_SLOTS - shift));
+        }
+        uint64_t start = (position + 1 + __builtin_ctzll(occupied))
+                       << (WHEEL_BITS * level);
+        if (start - wheel->now < next) {
+            next = start - wheel->now;
+        }
+    }
+
+    return next;
+}
+
+
+void wheel_advance(wheel_t* wheel, uint64_t now) {
+    while (wheel->now < now) {
+        uint64_t next = wheel_next_tick(wheel);
+        if (next > now - wheel->now) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now += next;
+        _wheel_process(wheel);
+    }
+}
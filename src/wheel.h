@@ -0,0 +1,105 @@
+/*
+ * Hierarchical timer wheel.
+ *
+ * Time is counted in ticks of one millisecond. The wheel has
+ * `WHEEL_LEVELS` levels of `WHEEL_SLOTS` slots: level 0 holds the timers
+ * expiring within the next 64 ticks, one slot per tick, and each next level
+ * covers 64 times the span of the previous one. A timer due later than the
+ * span of level 0 is moved down a level each time the wheel reaches the
+ * slot holding it.
+ *
+ * Timers are intrusive list nodes, so arming and disarming them is constant
+ * time, and advancing the wheel only visits the slots which are due.
+ */
+#ifndef _wheel_h_
+#define _wheel_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    5
+
+// Longest delay of a timer, about 12 days. Longer ones are clamped.
+#define WHEEL_MAX_DELAY ((UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+
+typedef struct wheel_timer wheel_timer_t;
+
+typedef void (*wheel_callback_t)(wheel_timer_t* timer, void* data);
+
+
+struct wheel_timer {
+    wheel_timer_t* next;
+    // Pointer on the pointer to this timer, NULL if the timer is disarmed.
+    wheel_timer_t** prev;
+
+    uint64_t expires;
+    wheel_callback_t callback;
+    void* data;
+};
+
+
+typedef struct wheel {
+    // Last tick processed.
+    uint64_t now;
+    size_t count;
+
+    wheel_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    // Bit `i` of `occupied[level]` is set if slot `i` of `level` has timers.
+    uint64_t occupied[WHEEL_LEVELS];
+} wheel_t;
+
+
+/*
+ * Initialize an empty wheel whose current tick is `now`.
+ */
+void wheel_init(wheel_t* wheel, uint64_t now);
+
+
+/*
+ * Initialize a disarmed timer calling `callback` with `data` on expiry.
+ */
+void wheel_timer_init(wheel_timer_t* timer, wheel_callback_t callback,
+                      void* data);
+
+
+/*
+ * Returns true if `timer` is waiting in a wheel.
+ */
+static inline bool wheel_timer_armed(const wheel_timer_t* timer) {
+    return timer->prev != NULL;
+}
+
+
+/*
+ * (Re)arm `timer` to expire `delay` ticks after the current one.
+ */
+void wheel_arm(wheel_t* wheel, wheel_timer_t* timer, uint64_t delay);
+
+
+/*
+ * Disarm `timer`, if it is armed.
+ */
+void wheel_disarm(wheel_t* wheel, wheel_timer_t* timer);
+
+
+/*
+ * Process the ticks until `now` included, running the callbacks of the
+ * timers expiring during them. Callbacks may arm and disarm timers.
+ */
+void wheel_advance(wheel_t* wheel, uint64_t now);
+
+
+/*
+ * Returns the number of ticks after which `wheel_advance` must be called
+ * again, or UINT64_MAX if no timer is armed. This may be earlier than the
+ * next expiry, when a timer has to be moved down a level.
+ */
+uint64_t wheel_next_tick(const wheel_t* wheel);
+
+
+#endif
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "logger.h"
+#include "worker.h"
+
+
+// Milliseconds between two reports of the memory held by the clients.
+#define WORKER_REPORT_INTERVAL  10000
+
+// Milliseconds between two measures of the loop lag.
+#define WORKER_LAG_INTERVAL     100
+
+
+/*
+ * Make room for one more item of `size` bytes after the `count` ones of
+ * `items`.
+ * Returns the possibly moved items, or NULL on allocation failure.
+ */
+static void* _worker_reserve(void* items, size_t* capacity, size_t count,
+                             size_t size)
+{
+    if (count < *capacity) {
+        return items;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    void* new_items = realloc(items, new_capacity * size);
+    if (new_items) {
+        *capacity = new_capacity;
+    }
+    return new_items;
+}
+
+
+void worker_touch(worker_t* worker, client_t* client) {
+    if (!client->dirty) {
+        client->dirty = true;
+        client->next_dirty = worker->dirty;
+        worker->dirty = client;
+    }
+}
+
+
+/*
+ * Append `client` to the ready list, behind the clients with data left.
+ */
+static void _worker_append(worker_t* worker, client_t* client) {
+    client->ready = true;
+    client->next_ready = NULL;
+    client->prev_ready = worker->ready_tail;
+    if (worker->ready_tail) {
+        worker->ready_tail->next_ready = client;
+    } else {
+        worker->ready = client;
+    }
+    worker->ready_tail = client;
+}
+
+
+void worker_schedule(worker_t* worker, client_t* client) {
+    if (client->ready) {
+        return;
+    }
+    // A client which had no data left is served first, sparse clients
+    // being answered before the backlog of the bulk ones.
+    client->ready = true;
+    client->prev_ready = NULL;
+    client->next_ready = worker->ready;
+    if (worker->ready) {
+        worker->ready->prev_ready = client;
+    } else {
+        worker->ready_tail = client;
+    }
+    worker->ready = client;
+}
+
+
+/*
+ * Take `client` out of the ready list.
+ */
+static void _worker_unschedule(worker_t* worker, client_t* client) {
+    if (client->prev_ready) {
+        client->prev_ready->next_ready = client->next_ready;
+    } else {
+        worker->ready = client->next_ready;
+    }
+    if (client->next_ready) {
+        client->next_ready->prev_ready = client->prev_ready;
+    } else {
+        worker->ready_tail = client->prev_ready;
+    }
+    client->ready = false;
+}
+
+
+/*
+ * Give each ready client a turn, the ones scheduled meanwhile waiting for
+ * the next round. Its deficit grows by its quantum, and it reads its
+ * bridged server up to it. A client left with data keeps what it didn't
+ * use, up to a quantum, for the next round.
+ */
+static void _worker_serve(worker_t* worker) {
+    const config_t* config = worker->bridge->config;
+    client_t* last = worker->ready_tail;
+    bool done = last == NULL;
+
+    while (!done) {
+        client_t* client = worker->ready;
+        done = client == last;
+        _worker_unschedule(worker, client);
+
+        int64_t quantum = (int64_t)config->read_budget
+                        * client_weight(client);
+        client->deficit += quantum;
+        bool more = true;
+        if (client->deficit > 0) {
+            client->deficit -= client_serve(client, client->deficit,
+                                            config->turn_time, &more);
+            worker_touch(worker, client);
+        }
+        if (more && client->alive) {
+            if (client->deficit > quantum) {
+                client->deficit = quantum;
+            }
+            _worker_append(worker, client);
+        } else {
+            client->deficit = 0;
+        }
+    }
+}
+
+
+/*
+ * Run a new client on the accepted socket `sock`.
+ */
+static void _worker_run(worker_t* worker, socket_t sock) {
+    client_t* client = malloc(sizeof(client_t));
+    if (!client) {
+        LOG_ERROR("worker %p: cannot allocate client", worker);
+        close(sock);
+        return;
+    }
+    client_init(client, sock, worker->bridge);
+    client->worker = worker;
+    client->alive = true;
+
+    client->next = worker->clients;
+    if (worker->clients) {
+        worker->clients->prev = client;
+    }
+    worker->clients = client;
+    __atomic_store_n(&worker->clients_count, worker->clients_count + 1,
+                     __ATOMIC_RELAXED);
+
+    if (client_setup(client, &worker->loop) != CLIENT_SUCCESS) {
+        client_send_500(client);
+        client->alive = false;
+    }
+    worker_touch(worker, client);
+}
+
+
+/*
+ * Close `client` and free it.
+ */
+static void _worker_remove(worker_t* worker, client_t* client) {
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        worker->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    __atomic_store_n(&worker->clients_count, worker->clients_count - 1,
+                     __ATOMIC_RELAXED);
+    if (client->ready) {
+        _worker_unschedule(worker, client);
+    }
+
+    // No other thread wakes the client up once it is closed.
+    client_close(client);
+    if (__atomic_load_n(&client->wake_pending, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&worker->lock);
+        for (size_t i = 0; i < worker->woken_count; i++) {
+            if (worker->woken[i] == client) {
+                worker->woken[i] = worker->woken[--worker->woken_count];
+                break;
+            }
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+    free(client);
+}
+
+
+/*
+ * Update the clients whose events were handled, freeing the dead ones.
+ */
+static void _worker_update(worker_t* worker) {
+    while (worker->dirty) {
+        client_t* client = worker->dirty;
+        worker->dirty = client->next_dirty;
+        client->dirty = false;
+
+        client->stats.wakeups++;
+        client_update(client);
+        if (!client->alive) {
+            _worker_remove(worker, client);
+        }
+    }
+}
+
+
+/*
+ * Close the next open client, then wait for the time left divided among
+ * the clients left, so that they are spread until the end of the drain.
+ * All the open clients are closed once it is over.
+ */
+static void _worker_on_drain(wheel_timer_t* timer, void* data) {
+    worker_t* worker = data;
+    uint64_t now = loop_now(&worker->loop);
+    bool over = now >= worker->drain_end;
+    size_t left = 0;
+    bool closed = false;
+
+    for (client_t* client = worker->clients; client; client = client->next) {
+        if (client->state == CLIENT_CLOSING || !client->alive) {
+            continue;
+        }
+        if (client->state == CLIENT_OPEN && (over || !closed)) {
+            client_shutdown(client, WS_CLOSE_GOING_AWAY);
+            worker_touch(worker, client);
+            closed = true;
+        } else {
+            left++;
+        }
+    }
+    // Clients still opening are closed by the next expiries.
+    if (left > 0) {
+        uint64_t delay = over ? 0 : (worker->drain_end - now) / (left + 1);
+        loop_arm(&worker->loop, &worker->drain_timer, delay > 0 ? delay : 1);
+    }
+}
+
+
+static void _worker_on_wake(void* data, uint32_t events) {
+    worker_t* worker = data;
+    eventfd_t count;
+    eventfd_read(worker->wake_fd, &count);
+
+    pthread_mutex_lock(&worker->lock);
+    int drain_time = worker->drain_time;
+    worker->drain_time = 0;
+    socket_t* accepted = worker->accepted;
+    size_t accepted_count = worker->accepted_count;
+    worker->accepted = NULL;
+    worker->accepted_count = 0;
+    worker->accepted_capacity = 0;
+    for (size_t i = 0; i < worker->woken_count; i++) {
+        client_t* client = worker->woken[i];
+        __atomic_store_n(&client->wake_pending, false, __ATOMIC_RELEASE);
+        worker_touch(worker, client);
+    }
+    worker->woken_count = 0;
+    pthread_mutex_unlock(&worker->lock);
+
+    for (size_t i = 0; i < accepted_count; i++) {
+        _worker_run(worker, accepted[i]);
+    }
+    free(accepted);
+
+    if (drain_time > 0) {
+        worker->drain_end = loop_now(&worker->loop) + drain_time;
+        _worker_on_drain(&worker->drain_timer, worker);
+    }
+}
+
+
+static void _worker_on_report(wheel_timer_t* timer, void* data) {
+    worker_t* worker = data;
+    size_t bytes = 0;
+    for (client_t* client = worker->clients; client; client = client->next) {
+        bytes += client_resident_bytes(client);
+    }
+
+    if (worker->clients_count != worker->reported_count
+        || bytes != worker->reported_bytes)
+    {
+        LOG_INFO("worker %p: %zu clients, %zu bytes resident, %zu per "
+                 "client", worker, worker->clients_count, bytes,
+                 worker->clients_count ? bytes / worker->clients_count : 0);
+        worker->reported_count = worker->clients_count;
+        worker->reported_bytes = bytes;
+    }
+    loop_arm(&worker->loop, timer, WORKER_REPORT_INTERVAL);
+}
+
+
+/*
+ * Measure how late the timer expires, its loop being busy with events.
+ */
+static void _worker_on_lag(wheel_timer_t* timer, void* data) {
+    worker_t* worker = data;
+    uint64_t now = loop_now(&worker->loop);
+    __atomic_store_n(&worker->lag, now - worker->lag_expires,
+                     __ATOMIC_RELAXED);
+    worker->lag_expires = now + WORKER_LAG_INTERVAL;
+    loop_arm(&worker->loop, timer, WORKER_LAG_INTERVAL);
+}
+
+
+static void* _worker_thread(worker_t* worker) {
+    while (__atomic_load_n(&worker->running, __ATOMIC_ACQUIRE)) {
+        // Ready clients are served again as soon as the new events are.
+        if (loop_run_once(&worker->loop, worker->ready ? 0 : -1)
+            != LOOP_SUCCESS)
+        {
+            break;
+        }
+        _worker_serve(worker);
+        _worker_update(worker);
+    }
+
+    while (worker->clients) {
+        client_t* client = worker->clients;
+        client->alive = false;
+        _worker_remove(worker, client);
+    }
+    return NULL;
+}
+
+
+/*
+ * Free the worker resources, once its thread is stopped.
+ */
+static void _worker_destroy(worker_t* worker) {
+    for (size_t i = 0; i < worker->accepted_count; i++) {
+        close(worker->accepted[i]);
+    }
+    free(worker->accepted);
+    free(worker->woken);
+    if (worker->wake_fd != SOCKET_ERROR) {
+        close(worker->wake_fd);
+    }
+    loop_destroy(&worker->loop);
+    pthread_mutex_destroy(&worker->lock);
+}
+
+
+/*
+ * Create the worker thread, pinned to its CPU if it has one.
+ * Returns `WORKER_ERROR` on failure, `WORKER_SUCCESS` otherwise.
+ */
+static worker_status_t _worker_create_thread(worker_t* worker) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    int ret = pthread_create(&worker->thread, &attr,
+                             (void* (*)(void*))&_worker_thread, worker);
+    pthread_attr_destroy(&attr);
+    if (ret != 0 && worker->cpu >= 0) {
+        LOG_ERROR("worker %p: CPU %d may not be available", worker,
+                  worker->cpu);
+    }
+    return ret == 0 ? WORKER_SUCCESS : WORKER_ERROR;
+}
+
+
+worker_status_t worker_start(worker_t* worker, bridge_t* bridge, int cpu) {
+    *worker = (worker_t){
+        .bridge = bridge,
+        .running = true,
+        .cpu = cpu,
+        .wake_fd = SOCKET_ERROR,
+    };
+    pthread_mutex_init(&worker->lock, NULL);
+
+    if (loop_init(&worker->loop) != LOOP_SUCCESS) {
+        LOG_ERROR("worker %p: unable to create its loop", worker);
+        pthread_mutex_destroy(&worker->lock);
+        return WORKER_ERROR;
+    }
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wake_fd < 0) {
+        LOG_ERROR("worker %p: unable to create wake up event", worker);
+        worker->wake_fd = SOCKET_ERROR;
+        goto error;
+    }
+    if (loop_add(&worker->loop, &worker->wake_watch, worker->wake_fd,
+                 EPOLLIN, &_worker_on_wake, worker)
+        != LOOP_SUCCESS)
+    {
+        LOG_ERROR("worker %p: unable to watch wake up event", worker);
+        goto error;
+    }
+    wheel_timer_init(&worker->report_timer, &_worker_on_report, worker);
+    wheel_timer_init(&worker->drain_timer, &_worker_on_drain, worker);
+    loop_arm(&worker->loop, &worker->report_timer, WORKER_REPORT_INTERVAL);
+    wheel_timer_init(&worker->lag_timer, &_worker_on_lag, worker);
+    if (bridge->config->admission.max_loop_lag > 0) {
+        worker->lag_expires = loop_now(&worker->loop) + WORKER_LAG_INTERVAL;
+        loop_arm(&worker->loop, &worker->lag_timer, WORKER_LAG_INTERVAL);
+    }
+
+    loop_set_busy_poll(&worker->loop, bridge->config->busy_poll);
+
+    if (_worker_create_thread(worker) != WORKER_SUCCESS) {
+        LOG_ERROR("worker %p: unable to start thread", worker);
+        goto error;
+    }
+    return WORKER_SUCCESS;
+
+  error:
+    _worker_destroy(worker);
+    return WORKER_ERROR;
+}
+
+
+void worker_stop(worker_t* worker) {
+    __atomic_store_n(&worker->running, false, __ATOMIC_RELEASE);
+    eventfd_write(worker->wake_fd, 1);
+    pthread_join(worker->thread, NULL);
+    _worker_destroy(worker);
+}
+
+
+void worker_drain(worker_t* worker, int drain_time) {
+    pthread_mutex_lock(&worker->lock);
+    // Without time to spread them, the clients are closed at once.
+    worker->drain_time = drain_time > 0 ? drain_time : 1;
+    pthread_mutex_unlock(&worker->lock);
+    eventfd_write(worker->wake_fd, 1);
+}
+
+
+size_t worker_client_count(worker_t* worker) {
+    return __atomic_load_n(&worker->clients_count, __ATOMIC_RELAXED);
+}
+
+
+size_t worker_queued(worker_t* worker) {
+    return __atomic_load_n(&worker->queued, __ATOMIC_RELAXED);
+}
+
+
+uint64_t worker_lag(worker_t* worker) {
+    return __atomic_load_n(&worker->lag, __ATOMIC_RELAXED);
+}
+
+
+void worker_count_queued(worker_t* worker, size_t delta) {
+    __atomic_store_n(&worker->queued, worker->queued + delta,
+                     __ATOMIC_RELAXED);
+}
+
+
+worker_status_t worker_add(worker_t* worker, socket_t sock) {
+    worker_status_t status = WORKER_SUCCESS;
+
+    pthread_mutex_lock(&worker->lock);
+    socket_t* accepted = _worker_reserve(worker->accepted,
+                                         &worker->accepted_capacity,
+                                         worker->accepted_count,
+                                         sizeof(socket_t));
+    if (!accepted) {
+        status = WORKER_ERROR;
+        goto end;
+    }
+    worker->accepted = accepted;
+    worker->accepted[worker->accepted_count++] = sock;
+
+  end:
+    pthread_mutex_unlock(&worker->lock);
+    if (status == WORKER_SUCCESS) {
+        eventfd_write(worker->wake_fd, 1);
+    }
+    return status;
+}
+
+
+void worker_wake(worker_t* worker, client_t* client) {
+    // Already waiting for the worker, which will see the new frames.
+    if (__atomic_load_n(&client->wake_pending, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    bool wake = false;
+    pthread_mutex_lock(&worker->lock);
+    if (!client->wake_pending) {
+        client_t** woken = _worker_reserve(worker->woken,
+                                           &worker->woken_capacity,
+                                           worker->woken_count,
+                                           sizeof(client_t*));
+        if (woken) {
+            worker->woken = woken;
+            worker->woken[worker->woken_count++] = client;
+            __atomic_store_n(&client->wake_pending, true, __ATOMIC_RELEASE);
+            wake = true;
+        } else {
+            LOG_ERROR("worker %p: cannot wake client %p up", worker, client);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    if (wake) {
+        eventfd_write(worker->wake_fd, 1);
+    }
+}
@@ -0,0 +1,175 @@
+/*
+ * Workers run many clients in a single event loop thread, so that an idle
+ * connection only costs its compact client state and its sockets, instead
+ * of a thread stack and loop.
+ *
+ * Accepted sockets are handed to a worker by the listening thread. Clients
+ * mark themselves dirty while their events are handled, and the worker
+ * updates the dirty ones once all the events of a wait are handled: clients
+ * are only closed and freed then, when no event may refer to them anymore.
+ *
+ * Clients whose bridged server has data are not read right away, but put
+ * in a ready list served in deficit round robin after the events: on each
+ * round, a client may read the read budget times the weight of its class,
+ * plus what it didn't use of it on the previous round, during at most the
+ * turn time. Clients which had no data left are queued first. A client
+ * streaming large payloads thus takes its share of the worker, while the
+ * others keep being relayed in between.
+ *
+ * A worker may be pinned to a CPU from its start. Its clients, their
+ * buffers and its loop are allocated by its thread, and so on the memory
+ * node of that CPU.
+ */
+#ifndef _worker_h_
+#define _worker_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "bridge.h"
+#include "client.h"
+#include "loop.h"
+#include "net.h"
+#include "wheel.h"
+
+
+typedef enum worker_status {
+    WORKER_ERROR = -1,
+    WORKER_SUCCESS = 0,
+} worker_status_t;
+
+
+typedef struct worker {
+    bridge_t* bridge;
+    pthread_t thread;
+    loop_t loop;
+    bool running;
+
+    // CPU the thread is pinned to, or -1.
+    int cpu;
+
+    // Wakes the worker up when another thread gave it sockets or clients.
+    int wake_fd;
+    loop_watch_t wake_watch;
+
+    // Protects the sockets accepted for the worker and the clients woken by
+    // other threads.
+    pthread_mutex_t lock;
+    socket_t* accepted;
+    size_t accepted_count;
+    size_t accepted_capacity;
+    client_t** woken;
+    size_t woken_count;
+    size_t woken_capacity;
+
+    // Clients run by the worker, and those to update after the events.
+    // The count is read by other threads.
+    client_t* clients;
+    size_t clients_count;
+    client_t* dirty;
+
+    // Clients whose bridged server data waits for their turn, in round
+    // robin order.
+    client_t* ready;
+    client_t* ready_tail;
+
+    // Time over which the clients are closed, asked by another thread, or
+    // 0, then the loop time the last one is closed at.
+    int drain_time;
+    uint64_t drain_end;
+    wheel_timer_t drain_timer;
+
+    // Periodically writes the memory held by the clients.
+    wheel_timer_t report_timer;
+    size_t reported_count;
+    size_t reported_bytes;
+
+    // Bytes waiting in the output queues of the clients, and milliseconds
+    // the lag timer last expired late, read by other threads.
+    size_t queued;
+    uint64_t lag;
+    wheel_timer_t lag_timer;
+    uint64_t lag_expires;
+} worker_t;
+
+
+/*
+ * Start a worker thread running the clients of `bridge`, pinned to `cpu`
+ * unless it is -1.
+ * Returns `WORKER_ERROR` on failure, `WORKER_SUCCESS` otherwise.
+ */
+worker_status_t worker_start(worker_t* worker, bridge_t* bridge, int cpu);
+
+
+/*
+ * Stop the worker thread, closing its clients.
+ */
+void worker_stop(worker_t* worker);
+
+
+/*
+ * Give the accepted socket `sock` to the worker, which runs a client on it.
+ * Returns `WORKER_ERROR` on failure, `WORKER_SUCCESS` otherwise.
+ */
+worker_status_t worker_add(worker_t* worker, socket_t sock);
+
+
+/*
+ * Have the worker close its clients with a going away status, one at a
+ * time over `drain_time` milliseconds, once the server stopped accepting
+ * new ones.
+ */
+void worker_drain(worker_t* worker, int drain_time);
+
+
+/*
+ * Returns the count of clients run by the worker, from any thread.
+ */
+size_t worker_client_count(worker_t* worker);
+
+
+/*
+ * Returns the bytes waiting in the output queues of the clients run by the
+ * worker, from any thread.
+ */
+size_t worker_queued(worker_t* worker);
+
+
+/*
+ * Returns how late the worker loop ran its last timer, in milliseconds,
+ * from any thread. Only measured with a loop lag limit.
+ */
+uint64_t worker_lag(worker_t* worker);
+
+
+/*
+ * Add `delta` bytes, which may wrap to remove them, to the bytes waiting in
+ * the client queues of the worker. Only called from the worker thread.
+ */
+void worker_count_queued(worker_t* worker, size_t delta);
+
+
+/*
+ * Have the worker update `client`, after queuing frames from another
+ * thread.
+ */
+void worker_wake(worker_t* worker, client_t* client);
+
+
+/*
+ * Have the worker update `client` once the current events are handled.
+ * Only called from the worker thread.
+ */
+void worker_touch(worker_t* worker, client_t* client);
+
+
+/*
+ * Have the worker relay the bridged server data of `client` on its next
+ * turn. Only called from the worker thread.
+ */
+void worker_schedule(worker_t* worker, client_t* client);
+
+
+#endif
@@ -1,43 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <byteswap.h>
 
 #include <sha1/sha1.h>
 #include <b64/b64.h>
 
+#include "logger.h"
+#include "utf8.h"
 #include "ws.h"
 
 
-ws_status_t ws_client_handshake_get_key(const char* msg, char* out_key) {
-    static const char* WEB_KEY_STR = "Sec-WebSocket-Key: ";
-    for (size_t i = 0; msg[i] != '\0'; i++) {
-        if (strncmp(msg + i, WEB_KEY_STR, strlen(WEB_KEY_STR)) == 0) {
-            i += strlen(WEB_KEY_STR);
-            size_t key_idx = 0;
-            while (msg[i] != '\r') {
-                out_key[key_idx++] = msg[i++];
-            }
-            out_key[key_idx] = '\0';
-            return WS_SUCCESS;
-        }
-    }
-
-    return WS_ERROR;
-}
-
-
 void ws_compute_accept_key(const char* secret_key, char* key) {
     const char* MAGIC_STRING = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    char buffer[1024];
-    sprintf(buffer, "%s%s", secret_key, MAGIC_STRING);
 
-    // Get SHA-1 of the buffer
+    // Get SHA-1 of the key followed by the magic string
     unsigned char digest[20];
     SHA1_CTX sha;
     SHA1Init(&sha);
-    SHA1Update(&sha, (uint8_t*)buffer, strlen(buffer));
+    SHA1Update(&sha, (const uint8_t*)secret_key, strlen(secret_key));
+    SHA1Update(&sha, (const uint8_t*)MAGIC_STRING, strlen(MAGIC_STRING));
     SHA1Final(digest, &sha);
 
     // Convert to base64:
@@ -45,40 +30,154 @@ void ws_compute_accept_key(const char* secret_key, char* key) {
 }
 
 
-ws_status_t ws_do_handshake(socket_t ws_sock) {
-    int recv_size;
-    char recv_buf[4096];
-    int write_size;
-    char write_buf[4096];
+ws_status_t ws_client_handshake_get_header(const char* msg, const char* name,
+                                           char* out, size_t out_size)
+{
+    size_t name_len = strlen(name);
+    size_t out_len = 0;
+    bool found = false;
 
-    // Waits for the client handshake message
-    recv_size = recv(ws_sock, recv_buf, sizeof(recv_buf) - 1, 0);
-    if (recv_size < 0) {
-        fprintf(stderr, "unable to receive handshake message\n");
+    if (out_size == 0) {
         return WS_ERROR;
     }
-    recv_buf[recv_size] = '\0';
+    out[0] = '\0';
+
+    // Headers start after the request line, one per line.
+    for (const char* line = strstr(msg, "\r\n");
+         line && line[2] != '\0' && line[2] != '\r';
+         line = strstr(line + 2, "\r\n"))
+    {
+        const char* header = line + 2;
+        if (strncasecmp(header, name, name_len) != 0
+            || header[name_len] != ':')
+        {
+            continue;
+        }
+
+        const char* value = header + name_len + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        const char* value_end = strstr(value, "\r\n");
+        size_t value_len = value_end ? value_end - value : strlen(value);
+
+        if (found && out_len + 2 < out_size) {
+            memcpy(out + out_len, ", ", 2);
+            out_len += 2;
+        }
+        if (out_len + value_len >= out_size) {
+            value_len = out_size - out_len - 1;
+        }
+        memcpy(out + out_len, value, value_len);
+        out_len += value_len;
+        out[out_len] = '\0';
+        found = true;
+    }
+
+    return found ? WS_SUCCESS : WS_ERROR;
+}
+
+
+/*
+ * Returns whether `key` is the base64 encoding of 16 bytes, as a client
+ * handshake key must be.
+ */
+static bool _ws_key_is_valid(const char* key) {
+    static const char* ALPHABET =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    if (strlen(key) != WS_KEY_LENGTH || strcmp(key + 22, "==") != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < 22; i++) {
+        if (!strchr(ALPHABET, key[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
 
+ws_status_t ws_handshake_response(const char* request,
+                                  const config_deflate_t* deflate,
+                                  pmd_params_t* pmd_params,
+                                  const char* headers,
+                                  char* out, size_t out_size,
+                                  size_t* out_len)
+{
     // Generate key
-    char key_buf[512];
-    if (ws_client_handshake_get_key(recv_buf, key_buf) == WS_ERROR)
+    // A longer key is cut to one byte more than a valid one.
+    char key_buf[WS_KEY_LENGTH + 2];
+    if (ws_client_handshake_get_header(request, "Sec-WebSocket-Key", key_buf,
+                                       sizeof(key_buf))
+        == WS_ERROR)
     {
-        fprintf(stderr, "unable to find the client handshake key\n");
+        LOG_ERROR("unable to find the client handshake key");
+        return WS_ERROR;
+    }
+    if (!_ws_key_is_valid(key_buf)) {
+        LOG_ERROR("invalid client handshake key");
         return WS_ERROR;
     }
     char access_key[64];
     ws_compute_accept_key(key_buf, access_key);
 
+    // Negotiate extensions
+    char extensions_buf[1024];
+    char extensions_answer[256] = "";
+    const char* offers = NULL;
+    if (ws_client_handshake_get_header(request, "Sec-WebSocket-Extensions",
+                                       extensions_buf, sizeof(extensions_buf))
+        == WS_SUCCESS)
+    {
+        offers = extensions_buf;
+    }
+    pmd_negotiate(deflate, offers, pmd_params);
+    if (pmd_params->enabled) {
+        char pmd_answer[192];
+        pmd_format_response(pmd_params, pmd_answer, sizeof(pmd_answer));
+        snprintf(extensions_answer, sizeof(extensions_answer),
+                 "Sec-WebSocket-Extensions: %s\r\n", pmd_answer);
+    }
+
+    int len = snprintf(out, out_size,
+                       "HTTP/1.1 101 Switching Protocols\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "%s"
+                       "%s"
+                       "Sec-WebSocket-Accept: %s\r\n\r\n",
+                       extensions_answer,
+                       headers ? headers : "",
+                       access_key);
+    if (len < 0 || (size_t)len >= out_size) {
+        LOG_ERROR("server handshake message too large");
+        return WS_ERROR;
+    }
+    *out_len = len;
+
+    return WS_SUCCESS;
+}
+
+
+ws_status_t ws_do_handshake(socket_t ws_sock, const char* request,
+                            const config_deflate_t* deflate,
+                            pmd_params_t* pmd_params,
+                            const char* headers)
+{
+    char write_buf[4096];
+    size_t write_size;
+
+    if (ws_handshake_response(request, deflate, pmd_params, headers,
+                              write_buf, sizeof(write_buf), &write_size)
+        != WS_SUCCESS)
+    {
+        return WS_ERROR;
+    }
+
     // Send handshake answer
-    sprintf(write_buf,
-            "HTTP/1.1 101 Switching Protocols\r\n"
-            "Upgrade: websocket\r\n"
-            "Connection: Upgrade\r\n"
-            "Sec-WebSocket-Accept: %s\r\n\r\n",
-            access_key);
-    write_size = send(ws_sock, write_buf, strlen(write_buf), 0);
-    if (write_size < 0) {
-        fprintf(stderr, "unable to send server handshake message\n");
+    if (send(ws_sock, write_buf, write_size, 0) < 0) {
+        LOG_ERROR("unable to send server handshake message");
         return WS_ERROR;
     }
 
@@ -122,153 +221,227 @@ typedef struct __ws_frame_head {
 } __ws_frame_head_t;
 
 
-#define RECV(what) \
-    recv_size = recv(ws_sock, &what, sizeof(what), 0); \
-    if (recv_size != sizeof(what)) { \
-        fprintf(stderr, "expecting %zu bytes, read %d\n", \
-                sizeof(what), recv_size); \
-        return WS_ERROR; \
+void ws_unmask(char* payload, size_t size, uint32_t mask) {
+    uint64_t mask64 = ((uint64_t)mask << 32) | mask;
+    size_t i = 0;
+    for (; i + sizeof(mask64) <= size; i += sizeof(mask64)) {
+        uint64_t chunk;
+        memcpy(&chunk, payload + i, sizeof(chunk));
+        chunk ^= mask64;
+        memcpy(payload + i, &chunk, sizeof(chunk));
+    }
+    for (; i < size; i++) {
+        payload[i] ^= (char)(mask >> ((i % 4) * 8));
     }
+}
 
 
-ws_status_t __ws_read_message_content(socket_t ws_sock,
-                                      __ws_frame_head_t frame_head,
-                                      char** output,
-                                      size_t* output_size)
+ws_status_t ws_parse_frame(char* buf, size_t size, size_t max_size,
+                           ws_frame_t* frame, size_t* frame_size)
 {
-    int recv_size;
+    __ws_frame_head_t frame_head;
+    size_t offset = sizeof(frame_head);
+
+    if (size < offset) {
+        return WS_NOTHING;
+    }
+    memcpy(&frame_head, buf, sizeof(frame_head));
 
     // Get the payload len
     uint64_t payload_len = frame_head.payload;
     if (payload_len == 126) {
         uint16_t payload_next;
-        RECV(payload_next);
+        if (size < offset + sizeof(payload_next)) {
+            return WS_NOTHING;
+        }
+        memcpy(&payload_next, buf + offset, sizeof(payload_next));
+        offset += sizeof(payload_next);
         payload_len = __bswap_16(payload_next);
     } else
     if (payload_len == 127) {
-        RECV(payload_len);
+        if (size < offset + sizeof(payload_len)) {
+            return WS_NOTHING;
+        }
+        memcpy(&payload_len, buf + offset, sizeof(payload_len));
+        offset += sizeof(payload_len);
         payload_len = __bswap_64(payload_len);
         if (payload_len & ((uint64_t)1) << 63) {
             return WS_ERROR;
         }
     }
 
-    // Get the mask key if any.
-    uint32_t mask_key;
-    if (frame_head.mask) {
-        RECV(mask_key);
-    }
-
-    // Read the data
-    *output_size = payload_len;
-    *output = malloc(payload_len + 1);
-    recv_size = recv(ws_sock, *output, payload_len, 0);
-    if (recv_size != payload_len) {
-        fprintf(stderr, "expecting %zu bytes, read %d\n",
-                payload_len, recv_size);
-        free(*output);
+    // Control frames are never fragmented and carry at most 125 bytes.
+    if (frame_head.opcode >= WS_OP_CLOSE
+        && (!frame_head.fin || payload_len > 125))
+    {
+        LOG_ERROR("invalid control frame");
         return WS_ERROR;
     }
-
-    // Decode the data.
-    if (frame_head.mask) {
-        for (size_t i = 0; i < payload_len; i++) {
-            (*output)[i] ^= (char)(mask_key >> ((i % 4) * 8));
-        }
+    if (payload_len > max_size) {
+        LOG_ERROR("frame of %zu bytes exceeds %zu bytes",
+                  (size_t)payload_len, max_size);
+        return WS_TOO_LARGE;
     }
 
-    (*output)[payload_len] = '\0';
-
-    return WS_SUCCESS;
-}
-
-
-ws_status_t ws_read_message(socket_t ws_sock,
-                            ws_opcode_t* opcode,
-                            char** output,
-                            size_t* output_size)
-{
-    int recv_size;
-    __ws_frame_head_t frame_head;
-
-    // First, try to read the first part of the message:
-    recv_size = recv(ws_sock, &frame_head, sizeof(frame_head), 0);
-    if (recv_size < 0) {
-        return WS_NOTHING;
-    } else
-    if (recv_size != sizeof(frame_head)) {
-        fprintf(stderr, "cannot read frame header (receives %d)\n", recv_size);
+    // Client frames must be masked.
+    uint32_t mask_key;
+    if (!frame_head.mask) {
+        LOG_ERROR("unmasked client frame");
         return WS_ERROR;
     }
-
-    if (!frame_head.fin) {
-        fprintf(stderr, "unsupported multi-frame messages\n");
-        return WS_ERROR;
+    if (size < offset + sizeof(mask_key)) {
+        return WS_NOTHING;
     }
+    memcpy(&mask_key, buf + offset, sizeof(mask_key));
+    offset += sizeof(mask_key);
 
-    *opcode = frame_head.opcode;
-    switch (frame_head.opcode) {
-        case WS_OP_TEXT_FRAME:
-        case WS_OP_BINARY_FRAME:
-          return __ws_read_message_content(ws_sock, frame_head, output,
-                                           output_size);
-
-        case WS_OP_PING:
-        case WS_OP_PONG:
-        case WS_OP_CLOSE:
-          socket_flush(ws_sock);
-          return WS_SUCCESS;
-
-        case WS_OP_CONTINUATION_FRAME:
-        default:
-          fprintf(stderr, "unsupported opcode %x\n", *opcode);
-          return WS_ERROR;
+    if (size - offset < payload_len) {
+        return WS_NOTHING;
     }
+    ws_unmask(buf + offset, payload_len, mask_key);
+
+    *frame = (ws_frame_t){
+        .fin = frame_head.fin,
+        .rsv = frame_head.rsv,
+        .opcode = frame_head.opcode,
+        .payload = buf + offset,
+        .size = payload_len,
+    };
+    *frame_size = offset + payload_len;
+    return WS_SUCCESS;
+}
 
 
-    return WS_SUCCESS;
+bool ws_close_status_valid(unsigned status) {
+    // 1004, 1005, 1006 and 1015 are reserved for local use.
+    return (status >= 1000 && status <= 1003)
+        || (status >= 1007 && status <= 1011)
+        || (status >= 3000 && status <= 4999);
 }
 
 
-ws_status_t ws_send_message(socket_t ws_sock, ws_opcode_t op,
-                            const char* msg, size_t msg_size)
+size_t ws_encode_frame_head(char* buf, bool fin, uint8_t rsv, ws_opcode_t op,
+                            size_t payload_size)
 {
     __ws_frame_head_t frame_head = {
-        .fin = 1,
-        .rsv = 0,
+        .fin = fin,
+        .rsv = rsv,
         .opcode = op,
         .mask = 0,
-        .payload = (msg_size < 126) ? msg_size
-                 : (msg_size < UINT16_MAX) ? 126
+        .payload = (payload_size < 126) ? payload_size
+                 : (payload_size <= UINT16_MAX) ? 126
                  : 127
     };
-
-    char out_buf[4096] = "";
-    size_t out_buf_size = 0;
+    size_t size = 0;
 
 #define WRITE(what) \
-    memcpy(out_buf + out_buf_size, &what, sizeof(what)); \
-    out_buf_size += sizeof(what);
+    memcpy(buf + size, &what, sizeof(what)); \
+    size += sizeof(what);
 
     WRITE(frame_head);
 
-    if (msg_size && msg) {
-        if (msg_size > 125 && msg_size < UINT16_MAX) {
-            uint16_t msg_size_u16 = __bswap_16((uint16_t)msg_size);
-            WRITE(msg_size_u16);
-        } else if (msg_size > 125) {
-            uint64_t msg_size_u64 = __bswap_64((uint64_t)msg_size);
-            WRITE(msg_size_u64);
+    if (payload_size > 125 && payload_size <= UINT16_MAX) {
+        uint16_t payload_size_u16 = __bswap_16((uint16_t)payload_size);
+        WRITE(payload_size_u16);
+    } else if (payload_size > 125) {
+        uint64_t payload_size_u64 = __bswap_64((uint64_t)payload_size);
+        WRITE(payload_size_u64);
+    }
+
+    return size;
+#undef WRITE
+}
+
+
+ws_status_t ws_encode_message(pmd_context_t* pmd, ws_opcode_t op,
+                              const char* msg, size_t msg_size,
+                              char* head, size_t* head_size,
+                              const char** payload, size_t* payload_size)
+{
+    uint8_t rsv = 0;
+    if (pmd && msg && op < WS_OP_CLOSE) {
+        const char* compressed;
+        size_t compressed_size;
+        switch (pmd_compress(pmd, msg, msg_size, &compressed,
+                             &compressed_size))
+        {
+          case PMD_SUCCESS:
+            msg = compressed;
+            msg_size = compressed_size;
+            rsv = WS_RSV1;
+            break;
+
+          case PMD_SKIPPED:
+            break;
+
+          case PMD_ERROR:
+          default:
+            LOG_ERROR("unable to compress message");
+            return WS_ERROR;
         }
-        memcpy(out_buf + out_buf_size, msg, msg_size);
-        out_buf_size += msg_size;
     }
 
-    if (send(ws_sock, out_buf, out_buf_size, 0) != out_buf_size) {
-        fprintf(stderr, "unable to send message content to client\n");
+    if (!msg) {
+        msg_size = 0;
+    }
+
+    *head_size = ws_encode_frame_head(head, true, rsv, op, msg_size);
+    *payload = msg;
+    *payload_size = msg_size;
+    return WS_SUCCESS;
+}
+
+
+ws_status_t ws_send_message(socket_t ws_sock, pmd_context_t* pmd,
+                            ws_opcode_t op,
+                            const char* msg, size_t msg_size)
+{
+    char head_buf[WS_FRAME_HEAD_MAX];
+    size_t head_buf_size;
+
+    if (ws_encode_message(pmd, op, msg, msg_size, head_buf, &head_buf_size,
+                          &msg, &msg_size) != WS_SUCCESS)
+    {
+        return WS_ERROR;
+    }
+
+    // The payload is sent from where it lies, without copying it behind the
+    // header.
+    struct iovec iov[2] = {
+        { .iov_base = head_buf, .iov_len = head_buf_size },
+        { .iov_base = (void*)msg, .iov_len = msg_size },
+    };
+    if (writev(ws_sock, iov, msg_size ? 2 : 1) != head_buf_size + msg_size) {
+        LOG_ERROR("unable to send message content to client");
         return WS_ERROR;
     }
 
     return WS_SUCCESS;
-#undef WRITE
+}
+
+
+ws_opcode_t ws_relay_opcode(config_opcode_t mode, const char* msg, size_t size,
+                            bool stream, size_t* send_size)
+{
+    *send_size = size;
+    switch (mode) {
+      case CONFIG_OPCODE_BINARY:
+        return WS_OP_BINARY_FRAME;
+
+      case CONFIG_OPCODE_TEXT:
+        if (stream) {
+            *send_size = utf8_complete_length(msg, size);
+        }
+        return WS_OP_TEXT_FRAME;
+
+      case CONFIG_OPCODE_AUTO:
+      default: {
+        size_t complete = stream ? utf8_complete_length(msg, size) : size;
+        if (utf8_validate(msg, complete)) {
+            *send_size = complete;
+            return WS_OP_TEXT_FRAME;
+        }
+        return WS_OP_BINARY_FRAME;
+      }
+    }
 }
@@ -1,13 +1,18 @@
 #ifndef _ws_h_
 #define _ws_h_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "net.h"
+#include "pmd.h"
 
 
 typedef enum ws_status {
     WS_ERROR = -1,
     WS_SUCCESS = 0,
     WS_NOTHING = 1,
+    WS_TOO_LARGE = 2,
 } ws_status_t;
 
 
@@ -22,11 +27,36 @@ typedef enum ws_opcode {
 
 
 /*
- * Fill `out_key` with the "Sec-WebSocket-Key" section of the request content
- * string `msg`.
- * Returns `WS_ERROR` if the key cannot be found or `WS_SUCCESS` otherwise.
+ * Status codes carried by close frames.
+ */
+typedef enum ws_close_status {
+    WS_CLOSE_NORMAL         = 1000,
+    WS_CLOSE_GOING_AWAY     = 1001,
+    WS_CLOSE_PROTOCOL_ERROR = 1002,
+    WS_CLOSE_UNSUPPORTED    = 1003,
+    WS_CLOSE_INVALID_DATA   = 1007,
+    WS_CLOSE_POLICY         = 1008,
+    WS_CLOSE_TOO_BIG        = 1009,
+    WS_CLOSE_INTERNAL_ERROR = 1011,
+} ws_close_status_t;
+
+
+/*
+ * Values of the frame header `rsv` field.
+ */
+#define WS_RSV1     0x4     // message is compressed (permessage-deflate)
+
+
+/*
+ * Largest size of a server frame header.
+ */
+#define WS_FRAME_HEAD_MAX   10
+
+
+/*
+ * Length of a client handshake key, 16 bytes encoded in base64.
  */
-ws_status_t ws_client_handshake_get_key(const char* msg, char* out_key);
+#define WS_KEY_LENGTH       24
 
 
 /*
@@ -36,35 +66,125 @@ void ws_compute_accept_key(const char* secret_key, char* key);
 
 
 /*
- * Wait for the handshake message from client, check its content and answer
- * a valid server handshake message.
+ * Fill `out` with the value of the `name` header of the request content
+ * string `msg`. Header names are case insensitive, and values of repeated
+ * headers are joined with commas.
+ * Returns `WS_ERROR` if the header cannot be found or `WS_SUCCESS` otherwise.
+ */
+ws_status_t ws_client_handshake_get_header(const char* msg, const char* name,
+                                           char* out, size_t out_size);
+
+
+/*
+ * Check the client handshake message `request`, a NUL terminated string,
+ * and write the server handshake answer in the `out_size` bytes of `out`,
+ * setting `*out_len` to its length.
+ * permessage-deflate is negotiated following `deflate`, and the agreed
+ * parameters are written in `pmd_params`. `headers`, header lines ending
+ * with "\r\n", are added to the answer unless NULL.
+ * If something goes wrong, returns `WS_ERROR`, otherwise returns `WS_SUCCESS`.
+ */
+ws_status_t ws_handshake_response(const char* request,
+                                  const config_deflate_t* deflate,
+                                  pmd_params_t* pmd_params,
+                                  const char* headers,
+                                  char* out, size_t out_size,
+                                  size_t* out_len);
+
+
+/*
+ * Check the client handshake message `request`, a NUL terminated string,
+ * and answer a valid server handshake message on `ws_sock`.
+ * permessage-deflate is negotiated following `deflate`, and the agreed
+ * parameters are written in `pmd_params`. `headers` are added to the
+ * answer unless NULL, as by `ws_handshake_response`.
  * If something goes wrong, returns `WS_ERROR`, otherwise returns `WS_SUCCESS`.
  */
-ws_status_t ws_do_handshake(socket_t ws_sock);
+ws_status_t ws_do_handshake(socket_t ws_sock, const char* request,
+                            const config_deflate_t* deflate,
+                            pmd_params_t* pmd_params,
+                            const char* headers);
 
 
 /*
- * Read the next message pending on `ws_sock`. Allocates *output with the
- * decoded message content, and set *output_len to the length of the output.
- * `opcode` will be set to the received frame opcode.
- * Returns `WS_ERROR` if an error occured, `WS_NOTHING` if there was noting to
- * read or `WS_SUCCESS` if a message has been read.
- *
- * XXX This function doesn't support messages sent in multiple frames for now.
+ * A frame received from a client. The payload is unmasked in place.
  */
-ws_status_t ws_read_message(socket_t ws_sock,
-                            ws_opcode_t* opcode,
-                            char** output,
-                            size_t* output_len);
+typedef struct ws_frame {
+    bool fin;
+    uint8_t rsv;
+    ws_opcode_t opcode;
+    char* payload;
+    size_t size;
+} ws_frame_t;
 
 
 /*
- * Send the given message content through `ws_sock`.
+ * Apply the masking key `mask` to the `size` bytes of `payload`.
+ */
+void ws_unmask(char* payload, size_t size, uint32_t mask);
+
+
+/*
+ * Parse the client frame at the beginning of the `size` bytes of `buf`.
+ * On success, `frame` describes it and `*frame_size` is set to the number of
+ * bytes it takes in `buf`.
+ * Returns `WS_NOTHING` if the frame is not complete yet, `WS_TOO_LARGE` if
+ * its payload exceeds `max_size` bytes, `WS_ERROR` if it is invalid, or
+ * `WS_SUCCESS` otherwise.
+ */
+ws_status_t ws_parse_frame(char* buf, size_t size, size_t max_size,
+                           ws_frame_t* frame, size_t* frame_size);
+
+
+/*
+ * Returns true if `status` may be carried by a close frame.
+ */
+bool ws_close_status_valid(unsigned status);
+
+
+/*
+ * Write in `buf` the header of an unmasked frame carrying `payload_size`
+ * bytes. `buf` must hold at least `WS_FRAME_HEAD_MAX` bytes.
+ * Returns the header size.
+ */
+size_t ws_encode_frame_head(char* buf, bool fin, uint8_t rsv, ws_opcode_t op,
+                            size_t payload_size);
+
+
+/*
+ * Encode a message of the `msg_size` bytes of `msg`, without sending it: its
+ * header is written in `head`, which must hold `WS_FRAME_HEAD_MAX` bytes,
+ * and `*payload` points to the bytes following it, either `msg` or its
+ * compressed form held by `pmd`. Data messages are compressed with `pmd` when
+ * it is not NULL and the message is large enough.
  * Returns `WS_ERROR` on failure, or `WS_SUCCESS` otherwise.
  */
-ws_status_t ws_send_message(socket_t ws_sock, ws_opcode_t op,
+ws_status_t ws_encode_message(pmd_context_t* pmd, ws_opcode_t op,
+                              const char* msg, size_t msg_size,
+                              char* head, size_t* head_size,
+                              const char** payload, size_t* payload_size);
+
+
+/*
+ * Send the given message content through `ws_sock`. Data messages are
+ * compressed with `pmd` when it is not NULL and the message is large enough.
+ * Returns `WS_ERROR` on failure, or `WS_SUCCESS` otherwise.
+ */
+ws_status_t ws_send_message(socket_t ws_sock, pmd_context_t* pmd,
+                            ws_opcode_t op,
                             const char* msg,
                             size_t msg_size);
 
 
+/*
+ * Choose the opcode relaying the `size` bytes of `msg` received from the
+ * bridged server, following `mode`. `*send_size` is set to the number of
+ * bytes to send now: when `msg` is a part of a `stream`, a text message never
+ * ends in the middle of a character, whose first bytes must be kept for the
+ * next message.
+ */
+ws_opcode_t ws_relay_opcode(config_opcode_t mode, const char* msg, size_t size,
+                            bool stream, size_t* send_size);
+
+
 #endif
@@ -0,0 +1,192 @@
+/*
+ * Test vectors of the UTF-8 validators.
+ *
+ * Checks the scalar validator against known valid and invalid sequences,
+ * truncated and overlong ones included, then checks that the vector
+ * validators the CPU supports and the chunked validation agree with it,
+ * with the sequences at every offset of the vector blocks and split at
+ * every byte, and over random buffers.
+ *
+ * Prints the failed cases and exits with 1 if there are any.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+// The validators to compare are static.
+#include "../src/utf8.c"
+
+
+// Longest vector, and bytes of ASCII it is moved by in the blocks.
+#define TEST_VECTOR_MAX     8
+#define TEST_SHIFT_MAX      70
+
+#define TEST_RANDOM_RUNS    50000
+#define TEST_RANDOM_MAX     100
+
+
+typedef struct test_vector {
+    const char* name;
+    const char* bytes;
+    bool valid;
+} test_vector_t;
+
+
+static const test_vector_t TEST_VECTORS[] = {
+    { "ascii", "a", true },
+    { "2 bytes", "\xc2\x80", true },
+    { "2 bytes max", "\xdf\xbf", true },
+    { "3 bytes", "\xe0\xa0\x80", true },
+    { "3 bytes before surrogates", "\xed\x9f\xbf", true },
+    { "3 bytes after surrogates", "\xee\x80\x80", true },
+    { "3 bytes max", "\xef\xbf\xbf", true },
+    { "4 bytes", "\xf0\x90\x80\x80", true },
+    { "4 bytes max", "\xf4\x8f\xbf\xbf", true },
+    { "mixed", "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80", true },
+
+    { "truncated 2 bytes", "\xc3", false },
+    { "truncated 2 bytes before ascii", "\xc3" "a", false },
+    { "truncated 3 bytes", "\xe2\x82", false },
+    { "truncated 3 bytes after lead", "\xe2", false },
+    { "truncated 3 bytes before ascii", "\xe2\x82" "a", false },
+    { "truncated 4 bytes", "\xf0\x9f\x98", false },
+    { "truncated 4 bytes after 2", "\xf0\x9f", false },
+    { "truncated 4 bytes after lead", "\xf0", false },
+    { "truncated 4 bytes before ascii", "\xf0\x9f\x98" "a", false },
+
+    { "overlong 2 bytes", "\xc0\x80", false },
+    { "overlong 2 bytes max", "\xc1\xbf", false },
+    { "overlong 3 bytes", "\xe0\x80\x80", false },
+    { "overlong 3 bytes max", "\xe0\x9f\xbf", false },
+    { "overlong 4 bytes", "\xf0\x80\x80\x80", false },
+    { "overlong 4 bytes max", "\xf0\x8f\xbf\xbf", false },
+
+    { "surrogate", "\xed\xa0\x80", false },
+    { "surrogate max", "\xed\xbf\xbf", false },
+    { "too large", "\xf4\x90\x80\x80", false },
+    { "too large lead", "\xf5\x80\x80\x80", false },
+    { "invalid byte", "\xff", false },
+    { "lone continuation", "\x80", false },
+    { "continuation after 2 bytes", "\xc3\xa9\x80", false },
+    { "too long 4 bytes", "\xf0\x9f\x98\x80\x80", false },
+};
+
+
+static int failures_g = 0;
+
+
+/*
+ * Report that `validator` wrongly found case `index` of `vector` `valid`.
+ */
+static void _test_fail(const char* validator, const test_vector_t* vector,
+                       size_t index, bool valid)
+{
+    printf("FAIL %s: %s #%zu %s\n", validator, vector->name, index,
+           valid ? "accepted" : "rejected");
+    failures_g++;
+}
+
+
+/*
+ * Returns whether `len` bytes of `buf` are valid, validated in chunks split
+ * at `split`.
+ */
+static bool _test_chunked(const char* buf, size_t len, size_t split) {
+    utf8_state_t state;
+    utf8_init(&state);
+    return utf8_update(&state, buf, split)
+        && utf8_update(&state, buf + split, len - split)
+        && utf8_finish(&state);
+}
+
+
+/*
+ * Check every validator on the `len` bytes of `buf`, case `index` of
+ * `vector`, which should be `valid`.
+ */
+static void _test_buffer(const test_vector_t* vector, size_t index,
+                         const char* buf, size_t len, bool valid)
+{
+    const uint8_t* s = (const uint8_t*)buf;
+
+    if (_utf8_validate_scalar(s, len) != valid) {
+        _test_fail("scalar", vector, index, !valid);
+    }
+    if (utf8_validate(buf, len) != valid) {
+        _test_fail("utf8_validate", vector, index, !valid);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3")
+        && _utf8_validate_ssse3(s, len) != valid)
+    {
+        _test_fail("ssse3", vector, index, !valid);
+    }
+    if (__builtin_cpu_supports("avx2")
+        && _utf8_validate_avx2(s, len) != valid)
+    {
+        _test_fail("avx2", vector, index, !valid);
+    }
+#endif
+    for (size_t split = 0; split <= len; split++) {
+        if (_test_chunked(buf, len, split) != valid) {
+            _test_fail("chunked", vector, index, !valid);
+            break;
+        }
+    }
+}
+
+
+static void _test_vectors(void) {
+    char buf[TEST_SHIFT_MAX + TEST_VECTOR_MAX + TEST_SHIFT_MAX];
+    size_t count = sizeof(TEST_VECTORS) / sizeof(TEST_VECTORS[0]);
+
+    for (size_t i = 0; i < count; i++) {
+        const test_vector_t* vector = &TEST_VECTORS[i];
+        size_t len = strlen(vector->bytes);
+
+        // Alone, then after and between ASCII, across the block boundaries.
+        for (size_t shift = 0; shift < TEST_SHIFT_MAX; shift++) {
+            memset(buf, 'x', shift);
+            memcpy(buf + shift, vector->bytes, len);
+            _test_buffer(vector, shift, buf, shift + len, vector->valid);
+            memset(buf + shift + len, 'y', TEST_SHIFT_MAX);
+            _test_buffer(vector, shift, buf, shift + len + TEST_SHIFT_MAX,
+                         vector->valid);
+        }
+    }
+}
+
+
+/*
+ * Compare the validators with the scalar one over random buffers, made of
+ * bytes likely to form sequences.
+ */
+static void _test_random(void) {
+    static const uint8_t BYTES[] = {
+        'a', 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf, 0xc0, 0xc2, 0xdf,
+        0xe0, 0xed, 0xef, 0xf0, 0xf4, 0xf5, 0xff,
+    };
+    char buf[TEST_RANDOM_MAX];
+    test_vector_t vector = { .name = "random" };
+
+    srand(42);
+    for (size_t run = 0; run < TEST_RANDOM_RUNS; run++) {
+        size_t len = rand() % TEST_RANDOM_MAX;
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = rand() % 4 ? 'a' : BYTES[rand() % sizeof(BYTES)];
+        }
+        bool valid = _utf8_validate_scalar((const uint8_t*)buf, len);
+        _test_buffer(&vector, run, buf, len, valid);
+    }
+}
+
+
+int main(int argc, char** argv) {
+    _test_vectors();
+    _test_random();
+    if (failures_g > 0) {
+        printf("%d failures\n", failures_g);
+        return 1;
+    }
+    printf("utf8: all tests passed\n");
+    return 0;
+}